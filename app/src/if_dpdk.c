@@ -37,6 +37,7 @@ ifnet_setup(npf_router_t *router, const unsigned port_id, const unsigned nqueues
 	uint16_t nb_rxd = RX_RING_SIZE, nb_txd = TX_RING_SIZE;
 	struct rte_eth_dev_info dev_info;
 	struct rte_eth_txconf txconf;
+	unsigned cksum_offload = 0;
 
 	/*
 	 * Obtain and setup some information about the Ethernet port.
@@ -48,6 +49,32 @@ ifnet_setup(npf_router_t *router, const unsigned port_id, const unsigned nqueues
 	if (dev_info.tx_offload_capa & DEV_TX_OFFLOAD_MBUF_FAST_FREE) {
 		pconf.txmode.offloads |= DEV_TX_OFFLOAD_MBUF_FAST_FREE;
 	}
+
+	/*
+	 * Multi-segment TX: the datagrams reassembled by NPF are chained.
+	 * Otherwise, they are linearized on output.
+	 */
+	if (dev_info.tx_offload_capa & DEV_TX_OFFLOAD_MULTI_SEGS) {
+		pconf.txmode.offloads |= DEV_TX_OFFLOAD_MULTI_SEGS;
+		router->ifnet_multiseg |= (1U << port_id);
+	}
+
+	/*
+	 * Checksum offload: NPF relies on it only if all ports support it.
+	 */
+	if (dev_info.tx_offload_capa & DEV_TX_OFFLOAD_IPV4_CKSUM) {
+		pconf.txmode.offloads |= DEV_TX_OFFLOAD_IPV4_CKSUM;
+		cksum_offload |= NPF_CKSUM_IPV4;
+	}
+	if (dev_info.tx_offload_capa & DEV_TX_OFFLOAD_TCP_CKSUM) {
+		pconf.txmode.offloads |= DEV_TX_OFFLOAD_TCP_CKSUM;
+		cksum_offload |= NPF_CKSUM_TCP;
+	}
+	if (dev_info.tx_offload_capa & DEV_TX_OFFLOAD_UDP_CKSUM) {
+		pconf.txmode.offloads |= DEV_TX_OFFLOAD_UDP_CKSUM;
+		cksum_offload |= NPF_CKSUM_UDP;
+	}
+	router->cksum_offload &= cksum_offload;
 	txconf = dev_info.default_txconf;
 	txconf.offloads = pconf.txmode.offloads;
 
@@ -120,6 +147,7 @@ ifnet_ifattach(npf_router_t *router, const unsigned port_id)
 	struct rte_eth_dev_info dev_info;
 	char name[IF_NAMESIZE];
 	in_addr_t addr;
+	uint16_t mtu;
 	ifnet_t *ifp;
 
 	rte_eth_dev_info_get(port_id, &dev_info);
@@ -138,6 +166,10 @@ ifnet_ifattach(npf_router_t *router, const unsigned port_id)
 	ifp->port_id = port_id;
 	strncpy(ifp->name, name, sizeof(ifp->name));
 	rte_eth_macaddr_get(port_id, &ifp->hwaddr);
+	if (rte_eth_dev_get_mtu(port_id, &mtu) != 0) {
+		mtu = RTE_ETHER_MTU;
+	}
+	ifp->mtu = mtu;
 	if (!router->ifnet_addrs[port_id]) {
 		free(ifp);
 		return -1;
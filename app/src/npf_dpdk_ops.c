@@ -8,10 +8,14 @@
 #include <sys/queue.h>
 #include <net/if.h>
 #include <string.h>
+#include <errno.h>
 
 #include <rte_common.h>
 #include <rte_mempool.h>
 #include <rte_mbuf.h>
+#include <rte_ip.h>
+#include <rte_tcp.h>
+#include <rte_udp.h>
 
 #include <net/npf.h>
 #include <net/npfkern.h>
@@ -68,15 +72,41 @@ dpdk_ifop_setmeta(npf_t *npf __unused, ifnet_t *ifp, void *arg)
 	ifp->arg = arg;
 }
 
+static int
+dpdk_ifop_output(npf_t *npf, struct mbuf *m0, const ifnet_t *ifp __unused)
+{
+	npf_router_t *router = npfk_getarg(npf);
+	struct rte_mbuf *m = (void *)m0;
+	worker_t *worker;
+
+	/*
+	 * Generated in the packet handler, therefore on the worker.
+	 */
+	if ((worker = get_worker_ctx(router)) == NULL) {
+		rte_pktmbuf_free(m);
+		return ENXIO;
+	}
+	return ip_inject(worker, m) == -1 ? EHOSTUNREACH : 0;
+}
+
 /*
  * DPDK mbuf wrappers.
  */
 
 static struct mbuf *
-dpdk_mbuf_alloc(npf_t *npf, unsigned flags __unused, size_t size __unused)
+dpdk_mbuf_alloc(npf_t *npf, unsigned flags __unused, size_t size)
 {
 	npf_router_t *router = npfk_getarg(npf);
-	return (void *)rte_pktmbuf_alloc(router->mbuf_pool);
+	struct rte_mbuf *m;
+
+	if ((m = rte_pktmbuf_alloc(router->mbuf_pool)) == NULL) {
+		return NULL;
+	}
+	if (size && rte_pktmbuf_append(m, size) == NULL) {
+		rte_pktmbuf_free(m);
+		return NULL;
+	}
+	return (void *)m;
 }
 
 static void
@@ -125,6 +155,125 @@ dpdk_mbuf_ensure_config(struct mbuf **mp, size_t len)
 	return len <= rte_pktmbuf_data_len(m);
 }
 
+/*
+ * Trimming and chaining the segments, used by the IP reassembly.
+ */
+
+static bool
+dpdk_mbuf_adj(struct mbuf *m0, int len)
+{
+	struct rte_mbuf *m = (void *)m0;
+
+	if (len >= 0) {
+		return rte_pktmbuf_adj(m, len) != NULL;
+	}
+	return rte_pktmbuf_trim(m, -len) == 0;
+}
+
+static bool
+dpdk_mbuf_cat(struct mbuf *m0, struct mbuf *n0)
+{
+	struct rte_mbuf *m = (void *)m0, *n = (void *)n0;
+	return rte_pktmbuf_chain(m, n) == 0;
+}
+
+/*
+ * Checksum offload: the checksums are computed by the NIC on TX.
+ */
+
+static unsigned
+dpdk_mbuf_get_cksum_offload(npf_t *npf, const struct mbuf *m0)
+{
+	const npf_router_t *router = npfk_getarg(npf);
+	const struct rte_mbuf *m = (const void *)m0;
+	unsigned offload = router->cksum_offload;
+	uint8_t proto;
+
+	/*
+	 * The chained packet, e.g. the datagram reassembled by NPF, may
+	 * be fragmented on output: the L4 checksum must be computed now.
+	 */
+	if (m->nb_segs > 1) {
+		offload &= NPF_CKSUM_IPV4;
+	}
+	if (RTE_ETH_IS_IPV4_HDR(m->packet_type)) {
+		const struct rte_ipv4_hdr *ip4;
+
+		ip4 = rte_pktmbuf_mtod(m, const struct rte_ipv4_hdr *);
+		proto = ip4->next_proto_id;
+	} else if (RTE_ETH_IS_IPV6_HDR(m->packet_type)) {
+		const struct rte_ipv6_hdr *ip6;
+
+		/*
+		 * The NIC needs the L4 header offset: no offload if
+		 * there are extension headers.
+		 */
+		ip6 = rte_pktmbuf_mtod(m, const struct rte_ipv6_hdr *);
+		proto = ip6->proto;
+		offload &= ~NPF_CKSUM_IPV4;
+	} else {
+		return 0;
+	}
+	switch (proto) {
+	case IPPROTO_TCP:
+		return offload & (NPF_CKSUM_IPV4 | NPF_CKSUM_TCP);
+	case IPPROTO_UDP:
+		return offload & (NPF_CKSUM_IPV4 | NPF_CKSUM_UDP);
+	default:
+		return offload & NPF_CKSUM_IPV4;
+	}
+}
+
+static void
+dpdk_mbuf_set_cksum_offload(npf_t *npf __unused, struct mbuf *m0,
+    unsigned flags)
+{
+	struct rte_mbuf *m = (void *)m0;
+	uint16_t *l4sum, phsum;
+
+	if (RTE_ETH_IS_IPV4_HDR(m->packet_type)) {
+		struct rte_ipv4_hdr *ip4;
+
+		ip4 = rte_pktmbuf_mtod(m, struct rte_ipv4_hdr *);
+		m->l3_len = (ip4->version_ihl & RTE_IPV4_HDR_IHL_MASK) *
+		    RTE_IPV4_IHL_MULTIPLIER;
+		m->ol_flags |= PKT_TX_IPV4;
+		if (flags & NPF_CKSUM_IPV4) {
+			ip4->hdr_checksum = 0;
+			m->ol_flags |= PKT_TX_IP_CKSUM;
+		}
+		phsum = rte_ipv4_phdr_cksum(ip4, m->ol_flags);
+	} else {
+		struct rte_ipv6_hdr *ip6;
+
+		ip6 = rte_pktmbuf_mtod(m, struct rte_ipv6_hdr *);
+		m->l3_len = sizeof(struct rte_ipv6_hdr);
+		m->ol_flags |= PKT_TX_IPV6;
+		phsum = rte_ipv6_phdr_cksum(ip6, m->ol_flags);
+	}
+
+	/*
+	 * The NIC expects the pseudo-header checksum in the TCP/UDP
+	 * checksum field.
+	 */
+	l4sum = NULL;
+	if (flags & NPF_CKSUM_TCP) {
+		struct rte_tcp_hdr *th = rte_pktmbuf_mtod_offset(m,
+		    struct rte_tcp_hdr *, m->l3_len);
+		l4sum = &th->cksum;
+		m->ol_flags |= PKT_TX_TCP_CKSUM;
+	}
+	if (flags & NPF_CKSUM_UDP) {
+		struct rte_udp_hdr *uh = rte_pktmbuf_mtod_offset(m,
+		    struct rte_udp_hdr *, m->l3_len);
+		l4sum = &uh->dgram_cksum;
+		m->ol_flags |= PKT_TX_UDP_CKSUM;
+	}
+	if (l4sum) {
+		*l4sum = phsum;
+	}
+}
+
 /*
  * NPF ops vectors.
  */
@@ -138,6 +287,10 @@ static const npf_mbufops_t npf_mbufops = {
 	.getchainlen		= dpdk_mbuf_getchainlen,
 	.ensure_contig		= dpdk_mbuf_ensure_config,
 	.ensure_writable	= NULL,
+	.get_cksum_offload	= dpdk_mbuf_get_cksum_offload,
+	.set_cksum_offload	= dpdk_mbuf_set_cksum_offload,
+	.adj			= dpdk_mbuf_adj,
+	.cat			= dpdk_mbuf_cat,
 };
 
 static const npf_ifops_t npf_ifops = {
@@ -146,6 +299,7 @@ static const npf_ifops_t npf_ifops = {
 	.flush			= dpdk_ifop_flush,
 	.getmeta		= dpdk_ifop_getmeta,
 	.setmeta		= dpdk_ifop_setmeta,
+	.output			= dpdk_ifop_output,
 };
 
 npf_t *
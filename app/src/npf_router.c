@@ -52,7 +52,7 @@ setup_signals(void)
 	sigaction(SIGINT, &sa, NULL);
 }
 
-static worker_t *
+worker_t *
 get_worker_ctx(npf_router_t *router)
 {
 	const unsigned locore_id = rte_lcore_id();
@@ -193,6 +193,10 @@ npf_ext_init(npf_t *npf)
 		warnx("npf_ext_normalize_init");
 		return -1;
 	}
+	if (npf_ext_pktlog_init(npf) != 0) {
+		warnx("npf_ext_pktlog_init");
+		return -1;
+	}
 	if (npf_ext_ratelimit_init(npf) != 0) {
 		warnx("npf_ext_ratelimit_init");
 		return -1;
@@ -225,6 +229,7 @@ router_create(void)
 	}
 	router->worker_count = nworkers;
 	router->pktqueue_size = BURST_SIZE;
+	router->cksum_offload = NPF_CKSUM_IPV4 | NPF_CKSUM_TCP | NPF_CKSUM_UDP;
 	LIST_INIT(&router->ifnet_list);
 
 	/*
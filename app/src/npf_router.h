@@ -50,6 +50,7 @@ typedef struct ifnet {
 
 	npf_addr_t		ipaddr;
 	struct rte_ether_addr	hwaddr;
+	unsigned		mtu;
 
 	void *			arg;
 	LIST_ENTRY(ifnet)	entry;
@@ -65,6 +66,16 @@ typedef struct npf_router {
 	unsigned		pktqueue_size;
 	route_table_t *		rtable;
 
+	/*
+	 * Checksums (NPF_CKSUM_*) which all the ports compute on TX.
+	 */
+	unsigned		cksum_offload;
+
+	/*
+	 * Bitmap of the ports which transmit the multi-segment packets.
+	 */
+	uint32_t		ifnet_multiseg;
+
 	/*
 	 * Interface list, map, count as well as bitmap.
 	 */
@@ -129,7 +140,9 @@ int		arp_input(worker_t *, struct rte_mbuf *, const unsigned);
  * Worker / processing.
  */
 
+worker_t *	get_worker_ctx(npf_router_t *);
 int		pktq_enqueue(worker_t *, unsigned, struct rte_mbuf *);
+int		ip_inject(worker_t *, struct rte_mbuf *);
 void		if_input(worker_t *, const unsigned);
 
 #endif
@@ -24,9 +24,15 @@
 #include "npf_router.h"
 #include "utils.h"
 
+#define	IP_MAX_FRAGS	128
+
 static int
 firewall_process(npf_t *npf, struct rte_mbuf **mp, ifnet_t *ifp, const int di)
 {
+	const struct rte_mbuf *m0 = *mp;
+	const npf_mbuf_priv_t minfo = *(npf_mbuf_priv_t *)rte_mbuf_to_priv(*mp);
+	const uint32_t packet_type = m0->packet_type;
+	const uint16_t l2_len = m0->l2_len, l3_len = m0->l3_len;
 	int error;
 
 	error = npfk_packet_handler(npf, (struct mbuf **)mp, ifp, di);
@@ -38,6 +44,19 @@ firewall_process(npf_t *npf, struct rte_mbuf **mp, ifnet_t *ifp, const int di)
 		}
 		return -1;
 	}
+
+	/*
+	 * NPF may also replace the packet (e.g. the SYN proxy), in which
+	 * case carry over the metadata.
+	 */
+	if (__predict_false(*mp != m0)) {
+		struct rte_mbuf *m = *mp;
+
+		*(npf_mbuf_priv_t *)rte_mbuf_to_priv(m) = minfo;
+		m->packet_type = packet_type;
+		m->l2_len = l2_len;
+		m->l3_len = l3_len;
+	}
 	return 0;
 }
 
@@ -244,9 +263,59 @@ ip_route(npf_router_t *router, struct rte_mbuf *m)
 	return rt->if_idx;
 }
 
+/*
+ * ip_fragment: fragment the packet, which exceeds the MTU of the
+ * destination interface, e.g. the datagram reassembled by NPF, and
+ * enqueue the fragments.
+ *
+ * => The packet is always consumed.
+ */
+static int
+ip_fragment(worker_t *worker, struct rte_mbuf *m, const unsigned if_idx,
+    const unsigned mtu)
+{
+	const npf_mbuf_priv_t minfo = *(npf_mbuf_priv_t *)rte_mbuf_to_priv(m);
+	const uint32_t packet_type = m->packet_type;
+	const uint64_t ol_flags = m->ol_flags & (PKT_TX_IPV4 | PKT_TX_IPV6);
+	const uint16_t l2_len = m->l2_len;
+	struct rte_mbuf *frags[IP_MAX_FRAGS];
+	unsigned nfrags = IP_MAX_FRAGS;
+	pktqueue_t *pq = worker->queue[if_idx];
+
+	if (npfk_packet_fragment(worker->npf, (struct mbuf **)&m, mtu,
+	    (struct mbuf **)frags, &nfrags) != 0) {
+		/* ICMP_UNREACH_NEEDFRAG, if the "don't fragment" flag. */
+		rte_pktmbuf_free(m);
+		return -1;
+	}
+	for (unsigned i = 0; i < nfrags; i++) {
+		struct rte_mbuf *f = frags[i];
+
+		/* Note: the IPv4 header checksum is already computed. */
+		*(npf_mbuf_priv_t *)rte_mbuf_to_priv(f) = minfo;
+		f->packet_type = packet_type;
+		f->ol_flags |= ol_flags;
+		f->l2_len = l2_len;
+
+		/* Transmit the queue, if it is full. */
+		if (pq->count >= worker->router->pktqueue_size) {
+			pktq_tx(worker, if_idx);
+		}
+		if (pktq_enqueue(worker, if_idx, f) == -1) {
+			while (i < nfrags) {
+				rte_pktmbuf_free(frags[i++]);
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
 static int
 ip_output(worker_t *worker, struct rte_mbuf *m, const unsigned if_idx)
 {
+	const uint32_t multiseg = worker->router->ifnet_multiseg;
+	unsigned mtu;
 	ifnet_t *ifp;
 	int ret;
 
@@ -258,12 +327,27 @@ ip_output(worker_t *worker, struct rte_mbuf *m, const unsigned if_idx)
 		return -1;
 	}
 	ret = firewall_process(worker->npf, &m, ifp, PFIL_OUT);
+	mtu = ifp->mtu;
 	ifnet_put(ifp);
 	if (ret) {
 		/* Consumed or dropped. */
 		return 0;
 	}
 
+	/*
+	 * The packet may exceed the MTU, e.g. the datagram reassembled
+	 * by NPF: fragment it.  Otherwise, the chained packet must be
+	 * linearized, unless the port transmits such packets.
+	 */
+	if (__predict_false(rte_pktmbuf_pkt_len(m) > mtu)) {
+		return ip_fragment(worker, m, if_idx, mtu);
+	}
+	if (__predict_false(m->nb_segs > 1) &&
+	    (multiseg & (1U << if_idx)) == 0 && rte_pktmbuf_linearize(m)) {
+		rte_pktmbuf_free(m);
+		return -1;
+	}
+
 	/*
 	 * Enqueue for the destination interface.
 	 */
@@ -274,6 +358,49 @@ ip_output(worker_t *worker, struct rte_mbuf *m, const unsigned if_idx)
 	return 0;
 }
 
+/*
+ * ip_inject: route and enqueue the locally generated IPv4/IPv6 packet,
+ * e.g. TCP RST or ICMP error constructed by NPF.  The packet is sent
+ * together with the current burst.
+ *
+ * => The packet is always consumed.
+ */
+int
+ip_inject(worker_t *worker, struct rte_mbuf *m)
+{
+	npf_mbuf_priv_t *minfo = rte_mbuf_to_priv(m);
+	const uint8_t *ver = rte_pktmbuf_mtod(m, const uint8_t *);
+	int if_idx;
+
+	switch (*ver >> 4) {
+	case 4:
+		m->packet_type = RTE_PTYPE_L3_IPV4;
+		m->l3_len = sizeof(struct rte_ipv4_hdr);
+		minfo->ether_type = htons(RTE_ETHER_TYPE_IPV4);
+		break;
+	case 6:
+		m->packet_type = RTE_PTYPE_L3_IPV6;
+		m->l3_len = sizeof(struct rte_ipv6_hdr);
+		minfo->ether_type = htons(RTE_ETHER_TYPE_IPV6);
+		break;
+	default:
+		rte_pktmbuf_free(m);
+		return -1;
+	}
+	minfo->flags = MBUF_NPF_NEED_L2;
+	m->l2_len = RTE_ETHER_HDR_LEN;
+
+	/*
+	 * Note: the packet bypasses the outbound firewall.
+	 */
+	if ((if_idx = ip_route(worker->router, m)) == -1 ||
+	    pktq_enqueue(worker, if_idx, m) == -1) {
+		rte_pktmbuf_free(m);
+		return -1;
+	}
+	return 0;
+}
+
 void
 if_input(worker_t *worker, const unsigned rx_if_idx)
 {
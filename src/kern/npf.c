@@ -62,9 +62,22 @@ npfk_create(int flags, const npf_mbufops_t *mbufops,
 	npf_state_sysinit(npf);
 	npf_ifmap_init(npf, ifops);
 	npf_conn_init(npf);
+	npf_srctrack_init(npf);
 	npf_portmap_init(npf);
 	npf_alg_init(npf);
 	npf_ext_init(npf);
+	npf_synproxy_init(npf);
+#ifdef _NPF_STANDALONE
+	npf_reass_init(npf);
+	npf_sendpkt_init(npf);
+#endif
+
+	if (flags & NPF_EVLOG) {
+		npf_evlog_init(npf);
+	}
+	if (flags & NPF_SYNC) {
+		npf_sync_init(npf);
+	}
 
 	/* Load an empty configuration. */
 	npf_config_init(npf);
@@ -87,10 +100,17 @@ npfk_destroy(npf_t *npf)
 	npf_config_fini(npf);
 
 	/* Finally, safe to destroy the subsystems. */
+#ifdef _NPF_STANDALONE
+	npf_sendpkt_fini(npf);
+	npf_reass_fini(npf);
+#endif
 	npf_ext_fini(npf);
 	npf_alg_fini(npf);
 	npf_portmap_fini(npf);
 	npf_conn_fini(npf);
+	npf_srctrack_fini(npf);
+	npf_evlog_fini(npf);
+	npf_sync_fini(npf);
 	npf_ifmap_fini(npf);
 	npf_state_sysfini(npf);
 	npf_param_fini(npf);
@@ -130,6 +150,12 @@ __dso_public void
 npfk_thread_register(npf_t *npf)
 {
 	npf_ebr_register(npf->ebr);
+
+	/*
+	 * In the standalone case, the PRNG state is per-thread and it
+	 * is seeded on the first use: do it now, outside the packet path.
+	 */
+	(void)cprng_fast32();
 }
 
 __dso_public void
@@ -215,3 +241,33 @@ npfk_stats_clear(npf_t *npf)
 	percpu_foreach_xcall(npf->stats_percpu, XC_HIGHPRI_IPL(IPL_SOFTNET),
 	    npf_stats_clear_cb, NULL);
 }
+
+/*
+ * npfk_evlog_drain: move up to the given number of event log records
+ * into the buffer; returns the number of records.
+ */
+__dso_public size_t
+npfk_evlog_drain(npf_t *npf, npf_event_t *buf, size_t count)
+{
+	return npf_evlog_drain(npf, buf, count);
+}
+
+/*
+ * npfk_sync_drain: move up to the given number of connection state
+ * replication records into the buffer; returns the number of records.
+ */
+__dso_public size_t
+npfk_sync_drain(npf_t *npf, npf_syncrec_t *buf, size_t count)
+{
+	return npf_sync_drain(npf, buf, count);
+}
+
+/*
+ * npfk_sync_apply: apply the connection state replication records;
+ * returns the number of applied records.
+ */
+__dso_public size_t
+npfk_sync_apply(npf_t *npf, const npf_syncrec_t *buf, size_t count)
+{
+	return npf_sync_apply(npf, buf, count);
+}
@@ -87,6 +87,7 @@ typedef struct nbuf nbuf_t;
 void		nbuf_init(npf_t *, nbuf_t *, struct mbuf *, const ifnet_t *);
 void		nbuf_reset(nbuf_t *);
 struct mbuf *	nbuf_head_mbuf(nbuf_t *);
+size_t		nbuf_copydata(const nbuf_t *, void *, size_t);
 
 bool		nbuf_flag_p(const nbuf_t *, int);
 void		nbuf_unset_flag(nbuf_t *, int);
@@ -100,6 +101,8 @@ void *		nbuf_ensure_contig(nbuf_t *, size_t);
 void *		nbuf_ensure_writable(nbuf_t *, size_t);
 
 bool		nbuf_cksum_barrier(nbuf_t *, int);
+unsigned	nbuf_cksum_offload(npf_t *, const nbuf_t *);
+void		nbuf_cksum_offload_set(npf_t *, nbuf_t *, unsigned);
 int		nbuf_add_tag(nbuf_t *, uint32_t);
 int		npf_mbuf_add_tag(nbuf_t *, struct mbuf *, uint32_t);
 int		nbuf_find_tag(nbuf_t *, uint32_t *);
@@ -122,6 +125,8 @@ int		nbuf_find_tag(nbuf_t *, uint32_t *);
 
 #define	NPC_FMTERR	0x200	/* Format error. */
 
+#define	NPC_SYNPROXY	0x400	/* SYN proxy: handshake with the responder. */
+
 #define	NPC_IP46	(NPC_IP4|NPC_IP6)
 
 struct npf_connkey;
@@ -193,6 +198,7 @@ bool		npf_autounload_p(void);
 #define	NPF_RULE_RETICMP		0x00000020
 #define	NPF_RULE_DYNAMIC		0x00000040
 #define	NPF_RULE_GSTATEFUL		0x00000080
+#define	NPF_RULE_SYNPROXY		0x00000100
 
 #define	NPF_DYNAMIC_GROUP		(NPF_RULE_GROUP | NPF_RULE_DYNAMIC)
 
@@ -221,14 +227,26 @@ bool		npf_autounload_p(void);
 #define	NPF_NAT_PORTS			0x01
 #define	NPF_NAT_PORTMAP			0x02
 #define	NPF_NAT_STATIC			0x04
+#define	NPF_NAT_PBA			0x08
+#define	NPF_NAT_EIM			0x10
 
 #define	NPF_NAT_PRIVMASK		0x0f000000
 
+/* Port block allocation: block size range and the default limit. */
+#define	NPF_NAT_PBA_MINSIZE		16
+#define	NPF_NAT_PBA_MAXSIZE		4096
+#define	NPF_NAT_PBA_MAXBLOCKS		8
+
 #define	NPF_ALGO_NONE			0
 #define	NPF_ALGO_NETMAP			1
 #define	NPF_ALGO_IPHASH			2
 #define	NPF_ALGO_RR			3
 #define	NPF_ALGO_NPT66			4
+#define	NPF_ALGO_DETERMINISTIC		5
+
+/* Deterministic NAT: the default port range. */
+#define	NPF_NAT_DET_MINPORT		1024
+#define	NPF_NAT_DET_MAXPORT		65535
 
 /* Table types. */
 #define	NPF_TABLE_IPSET			1
@@ -301,6 +319,7 @@ typedef struct npf_ioctl_table {
 #define	IOC_NPF_RULE		_IOWR('N', 107, nvlist_ref_t)
 #define	IOC_NPF_CONN_LOOKUP	_IOWR('N', 108, nvlist_ref_t)
 #define	IOC_NPF_TABLE_REPLACE	_IOWR('N', 109, nvlist_ref_t)
+#define	IOC_NPF_CONN_LIST	_IOWR('N', 110, nvlist_ref_t)
 
 /*
  * NPF error report.
@@ -325,11 +344,17 @@ typedef enum {
 	/* Packets blocked. */
 	NPF_STAT_BLOCK_DEFAULT,
 	NPF_STAT_BLOCK_RULESET,
+	NPF_STAT_BLOCK_SRC_CONN,
+	NPF_STAT_BLOCK_SRC_RATE,
+	NPF_STAT_BLOCK_SRC_FULL,
 	/* Connection and NAT entries. */
 	NPF_STAT_CONN_CREATE,
 	NPF_STAT_CONN_DESTROY,
 	NPF_STAT_NAT_CREATE,
 	NPF_STAT_NAT_DESTROY,
+	NPF_STAT_CONN_LIMIT,
+	NPF_STAT_CONN_EARLYDROP,
+	NPF_STAT_SRC_OVERLOAD,
 	/* Invalid state cases. */
 	NPF_STAT_INVALID_STATE,
 	NPF_STAT_INVALID_STATE_TCP1,
@@ -342,11 +367,25 @@ typedef enum {
 	NPF_STAT_FRAGMENTS,
 	NPF_STAT_REASSEMBLY,
 	NPF_STAT_REASSFAIL,
+	NPF_STAT_REASSTIMEOUT,
+	/* SYN proxy. */
+	NPF_STAT_SYNPROXY_COOKIE,
+	NPF_STAT_SYNPROXY_HANDSHAKE,
 	/* Other errors. */
 	NPF_STAT_ERROR,
 	/* nbuf non-contiguous cases. */
 	NPF_STAT_NBUF_NONCONTIG,
 	NPF_STAT_NBUF_CONTIG_FAIL,
+	/* Logging. */
+	NPF_STAT_EVLOG_DROP,
+	NPF_STAT_PKTLOG_DROP,
+	NPF_STAT_LOG_UNSAMPLED,
+	NPF_STAT_LOG_CAPPED,
+	/* Connection state replication. */
+	NPF_STAT_SYNC_DROP,
+	NPF_STAT_SYNC_RATELIMIT,
+	/* ICMP errors not sent (standalone). */
+	NPF_STAT_ICMP_SUPPRESSED,
 	/* Count (last). */
 	NPF_STATS_COUNT
 } npf_stats_t;
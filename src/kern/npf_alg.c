@@ -7,6 +7,17 @@
 
 /*
  * NPF interface for the Application Level Gateways (ALGs).
+ *
+ * Dispatch
+ *
+ *	The inspect and translate functions are called for the packets
+ *	of the connections and NAT entries respectively, i.e. nearly all
+ *	traffic, while most ALGs are concerned with a few protocols.
+ *	Therefore, the ALGs may specify the L4 protocols and the port;
+ *	the ALG set keeps a table of the ALG slots for each protocol, so
+ *	the packets of other protocols do not enter the ALG layer at all.
+ *	The match function is called only on the NAT entry creation and
+ *	all ALGs are queried.
  */
 
 #ifdef _KERNEL
@@ -33,6 +44,8 @@ struct npf_alg {
 	unsigned	na_slot;
 };
 
+#define	NPF_ALG_NPROTOS	256
+
 struct npf_algset {
 	/* List of ALGs and the count. */
 	npf_alg_t	alg_list[NPF_MAX_ALGS];
@@ -40,8 +53,17 @@ struct npf_algset {
 
 	/* Matching, inspection and translation functions. */
 	npfa_funcs_t	alg_funcs[NPF_MAX_ALGS];
+
+	/*
+	 * Dispatch tables: the masks of the ALG slots which have the
+	 * inspect and translate functions for the given L4 protocol.
+	 */
+	uint8_t		alg_inspect[NPF_ALG_NPROTOS];
+	uint8_t		alg_translate[NPF_ALG_NPROTOS];
 };
 
+CTASSERT(NPF_MAX_ALGS <= 8);
+
 #define	NPF_ALG_PREF	"npf_alg_"
 #define	NPF_ALG_PREFLEN	(sizeof(NPF_ALG_PREF) - 1)
 
@@ -101,6 +123,81 @@ npf_alg_construct(npf_t *npf, const char *name)
 	return alg;
 }
 
+static bool
+npf_alg_proto_p(const npfa_funcs_t *funcs, unsigned proto)
+{
+	if (funcs->protos[0] == 0) {
+		return true;
+	}
+	for (unsigned i = 0; i < NPFA_MAX_PROTOS; i++) {
+		if (funcs->protos[i] == proto) {
+			return true;
+		}
+		if (funcs->protos[i] == 0) {
+			break;
+		}
+	}
+	return false;
+}
+
+/*
+ * npf_alg_setmask: set or clear the ALG slot in the dispatch tables.
+ */
+static void
+npf_alg_setmask(npf_algset_t *aset, unsigned i, const npfa_funcs_t *funcs)
+{
+	const uint8_t bit = 1U << i;
+
+	for (unsigned p = 0; p < NPF_ALG_NPROTOS; p++) {
+		uint8_t imask = aset->alg_inspect[p] & ~bit;
+		uint8_t tmask = aset->alg_translate[p] & ~bit;
+
+		if (funcs && npf_alg_proto_p(funcs, p)) {
+			imask |= funcs->inspect ? bit : 0;
+			tmask |= funcs->translate ? bit : 0;
+		}
+		atomic_store_relaxed(&aset->alg_inspect[p], imask);
+		atomic_store_relaxed(&aset->alg_translate[p], tmask);
+	}
+}
+
+/*
+ * npf_alg_getmask: get the mask of the ALG slots for the packet, given
+ * the dispatch table.
+ */
+static inline unsigned
+npf_alg_getmask(const npf_cache_t *npc, const uint8_t *table)
+{
+	const unsigned proto = npc->npc_proto;
+
+	if (__predict_false(proto >= NPF_ALG_NPROTOS)) {
+		return 0;
+	}
+	return atomic_load_relaxed(&table[proto]);
+}
+
+/*
+ * npf_alg_port_p: check whether the packet matches the port of the ALG.
+ */
+static inline bool
+npf_alg_port_p(const npf_cache_t *npc, const npfa_funcs_t *f)
+{
+	const in_port_t port = htons(f->port);
+
+	if (port == 0) {
+		return true;
+	}
+	if (npf_iscached(npc, NPC_TCP)) {
+		const struct tcphdr *th = npc->npc_l4.tcp;
+		return th->th_sport == port || th->th_dport == port;
+	}
+	if (npf_iscached(npc, NPC_UDP)) {
+		const struct udphdr *uh = npc->npc_l4.udp;
+		return uh->uh_sport == port || uh->uh_dport == port;
+	}
+	return false;
+}
+
 /*
  * npf_alg_register: register application-level gateway.
  */
@@ -143,8 +240,13 @@ npf_alg_register(npf_t *npf, const char *name, const npfa_funcs_t *funcs)
 	atomic_store_relaxed(&afuncs->translate, funcs->translate);
 	atomic_store_relaxed(&afuncs->inspect, funcs->inspect);
 	atomic_store_relaxed(&afuncs->match, funcs->match);
+	memcpy(afuncs->protos, funcs->protos, sizeof(afuncs->protos));
+	afuncs->port = funcs->port;
 	membar_producer();
 
+	/* Make the functions visible to the packet dispatch. */
+	npf_alg_setmask(aset, i, funcs);
+
 	atomic_store_relaxed(&aset->alg_count, MAX(aset->alg_count, i + 1));
 	npf_config_exit(npf);
 
@@ -163,6 +265,7 @@ npf_alg_unregister(npf_t *npf, npf_alg_t *alg)
 
 	/* Deactivate the functions first. */
 	npf_config_enter(npf);
+	npf_alg_setmask(aset, i, NULL);
 	afuncs = &aset->alg_funcs[i];
 	atomic_store_relaxed(&afuncs->match, NULL);
 	atomic_store_relaxed(&afuncs->translate, NULL);
@@ -227,22 +330,31 @@ npf_alg_match(npf_cache_t *npc, npf_nat_t *nt, int di)
  *	or manipulation here.
  *
  *	=> This is called when the packet is being translated according
- *	   to the dynamic NAT logic [NAT-TRANSLATE].
+ *	   to the dynamic NAT logic [NAT-TRANSLATE], only for the ALGs
+ *	   concerned with the protocol and the port of the packet.
  */
 void
 npf_alg_exec(npf_cache_t *npc, npf_nat_t *nt, const npf_flow_t flow)
 {
 	npf_t *npf = npc->npc_ctx;
 	npf_algset_t *aset = npf->algset;
-	unsigned count;
+	unsigned mask;
 	int s;
 
+	/* Fast path: no ALG is concerned with this protocol. */
+	if (npf_alg_getmask(npc, aset->alg_translate) == 0) {
+		return;
+	}
+
 	s = npf_config_read_enter(npf);
-	count = atomic_load_relaxed(&aset->alg_count);
-	for (unsigned i = 0; i < count; i++) {
+	mask = npf_alg_getmask(npc, aset->alg_translate);
+	for (unsigned i = 0; mask; i++, mask >>= 1) {
 		const npfa_funcs_t *f = &aset->alg_funcs[i];
 		bool (*translate_func)(npf_cache_t *, npf_nat_t *, npf_flow_t);
 
+		if ((mask & 1) == 0 || !npf_alg_port_p(npc, f)) {
+			continue;
+		}
 		translate_func = atomic_load_relaxed(&f->translate);
 		if (translate_func) {
 			translate_func(npc, nt, flow);
@@ -260,7 +372,8 @@ npf_alg_exec(npf_cache_t *npc, npf_nat_t *nt, const npf_flow_t flow)
  *	extract and use a different n-tuple to perform a lookup.
  *
  *	=> This is called at the beginning of the connection state lookup
- *	   function [CONN-LOOKUP].
+ *	   function [CONN-LOOKUP], only for the ALGs concerned with the
+ *	   protocol and the port of the packet.
  *
  *	=> Must use the npf_conn_lookup() function to perform the custom
  *	   connection state lookup and return the result.
@@ -274,15 +387,23 @@ npf_alg_conn(npf_cache_t *npc, int di)
 	npf_t *npf = npc->npc_ctx;
 	npf_algset_t *aset = npf->algset;
 	npf_conn_t *con = NULL;
-	unsigned count;
+	unsigned mask;
 	int s;
 
+	/* Fast path: no ALG is concerned with this protocol. */
+	if (npf_alg_getmask(npc, aset->alg_inspect) == 0) {
+		return NULL;
+	}
+
 	s = npf_config_read_enter(npf);
-	count = atomic_load_relaxed(&aset->alg_count);
-	for (unsigned i = 0; i < count; i++) {
+	mask = npf_alg_getmask(npc, aset->alg_inspect);
+	for (unsigned i = 0; mask; i++, mask >>= 1) {
 		const npfa_funcs_t *f = &aset->alg_funcs[i];
 		npf_conn_t *(*inspect_func)(npf_cache_t *, int);
 
+		if ((mask & 1) == 0 || !npf_alg_port_p(npc, f)) {
+			continue;
+		}
 		inspect_func = atomic_load_relaxed(&f->inspect);
 		if (inspect_func && (con = inspect_func(npc, di)) != NULL) {
 			break;
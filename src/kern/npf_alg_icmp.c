@@ -383,10 +383,12 @@ npfa_icmp_nat(npf_cache_t *npc, npf_nat_t *nt, npf_flow_t flow)
 	 *	2) Rewrite the TCP/UDP checksum (if not ICMP).
 	 *	3) Rewrite the IPv4 checksum for (1) and (2).
 	 *
+	 * The checksums of the embedded packet are never offloaded.
+	 *
 	 * XXX: Assumes NPF_NATOUT (source address/port).  Currently,
 	 * npfa_icmp_match() matches only for the PFIL_OUT traffic.
 	 */
-	if (npf_napt_rwr(&enpc, which, addr, port)) {
+	if (npf_napt_rwr(&enpc, which, addr, port, 0)) {
 		goto err;
 	}
 
@@ -439,6 +441,7 @@ npf_alg_icmp_init(npf_t *npf)
 		.translate	= npfa_icmp_nat,
 		.inspect	= npfa_icmp_conn,
 		.destroy	= NULL,
+		.protos		= { IPPROTO_ICMP, IPPROTO_ICMPV6 },
 	};
 	alg_icmp = npf_alg_register(npf, "icmp", &icmp);
 	return alg_icmp ? 0 : ENOMEM;
@@ -55,7 +55,8 @@ typedef struct {
 
 static npf_pptp_alg_t		pptp_alg	__cacheline_aligned;
 
-#define	PPTP_SERVER_PORT		htons(1723)
+#define	PPTP_PORT			1723
+#define	PPTP_SERVER_PORT		htons(PPTP_PORT)
 
 #define	PPTP_OUTGOING_CALL_MIN_LEN	32
 
@@ -771,12 +772,15 @@ npf_alg_pptp_init(npf_t *npf)
 		.translate	= pptp_tcp_translate,
 		.inspect	= NULL,
 		.destroy	= pptp_tcp_destroy,
+		.protos		= { IPPROTO_TCP },
+		.port		= PPTP_PORT,
 	};
 	static const npfa_funcs_t pptp_gre = {
 		.match		= NULL,
 		.translate	= pptp_gre_translate,
 		.inspect	= pptp_gre_inspect,
 		.destroy	= pptp_gre_destroy,
+		.protos		= { IPPROTO_GRE },
 	};
 
 	/* Portmap for the PPTP call ID range. */
@@ -114,10 +114,13 @@ CTASSERT(PFIL_ALL == (0x001 | 0x002));
 #define	CONN_PASS	0x008	/* perform implicit passing */
 #define	CONN_EXPIRE	0x010	/* explicitly expire */
 #define	CONN_REMOVED	0x020	/* "forw/back" entries removed */
+#define	CONN_NOLOG	0x040	/* not recorded in the event log */
+#define	CONN_SYNCED	0x080	/* created from the record */
 
 enum { CONN_TRACKING_OFF, CONN_TRACKING_ON };
 
 static int	npf_conn_export(npf_t *, npf_conn_t *, nvlist_t *);
+static void	npf_conncursor_flush(npf_t *);
 
 /*
  * npf_conn_sys{init,fini}: initialize/destroy connection tracking.
@@ -141,6 +144,24 @@ npf_conn_init(npf_t *npf)
 			.default_val = 1, // true
 			.min = 0, .max = 1
 		},
+		{
+			"conn.max",
+			&params->conn_max,
+			.default_val = 0, // unlimited
+			.min = 0, .max = INT_MAX
+		},
+		{
+			"conn.adaptive.start",
+			&params->adaptive_start,
+			.default_val = 60, // % of conn.max
+			.min = 0, .max = 1000
+		},
+		{
+			"conn.adaptive.end",
+			&params->adaptive_end,
+			.default_val = 120, // % of conn.max
+			.min = 0, .max = 1000
+		},
 	};
 	npf_param_register(npf, param_map, __arraycount(param_map));
 
@@ -153,6 +174,7 @@ npf_conn_init(npf_t *npf)
 
 	mutex_init(&npf->conn_lock, MUTEX_DEFAULT, IPL_NONE);
 	atomic_store_relaxed(&npf->conn_tracking, CONN_TRACKING_OFF);
+	LIST_INIT(&npf->conn_cursors);
 	npf->conn_db = npf_conndb_create();
 	npf_conndb_sysinit(npf);
 
@@ -167,6 +189,7 @@ npf_conn_fini(npf_t *npf)
 	/* Note: the caller should have flushed the connections. */
 	KASSERT(atomic_load_relaxed(&npf->conn_tracking) == CONN_TRACKING_OFF);
 
+	npf_conncursor_flush(npf);
 	npf_conndb_destroy(npf->conn_db);
 	pool_cache_destroy(npf->conn_cache[0]);
 	pool_cache_destroy(npf->conn_cache[1]);
@@ -340,6 +363,7 @@ npf_conn_inspect(npf_cache_t *npc, const unsigned di, int *error)
 	nbuf_t *nbuf = npc->npc_nbuf;
 	npf_flow_t flow;
 	npf_conn_t *con;
+	unsigned state;
 	bool ok;
 
 	KASSERT(!nbuf_flag_p(nbuf, NBUF_DATAREF_RESET));
@@ -363,9 +387,21 @@ npf_conn_inspect(npf_cache_t *npc, const unsigned di, int *error)
 		return NULL;
 	}
 
+	/*
+	 * SYN proxy rewrites the SEQ/ACK numbers, therefore the deferred
+	 * checksum must be computed first.  Note: the flag is set before
+	 * the connection is activated and it never changes afterwards.
+	 */
+	if (__predict_false(con->c_state.nst_flags & NPF_STATE_SYNPROXY) &&
+	    nbuf_cksum_barrier(nbuf, di)) {
+		npf_recache(npc);
+	}
+
 	/* Inspect the protocol data and handle state changes. */
 	mutex_enter(&con->c_lock);
+	state = con->c_state.nst_state;
 	ok = npf_state_inspect(npc, &con->c_state, flow);
+	state ^= con->c_state.nst_state;
 	mutex_exit(&con->c_lock);
 
 	/* If invalid state: let the rules deal with it. */
@@ -374,6 +410,13 @@ npf_conn_inspect(npf_cache_t *npc, const unsigned di, int *error)
 		npf_stats_inc(npc->npc_ctx, NPF_STAT_INVALID_STATE);
 		return NULL;
 	}
+
+	/* Replicate the state transition, if any, or refresh. */
+	if (__predict_false(state != 0)) {
+		npf_sync_conn(npc->npc_ctx, NPF_SYNC_STATE, con);
+	} else {
+		npf_sync_refresh(npc->npc_ctx, con);
+	}
 #if 0
 	/*
 	 * TODO -- determine when this might be wanted/used.
@@ -392,6 +435,22 @@ npf_conn_inspect(npf_cache_t *npc, const unsigned di, int *error)
 	return con;
 }
 
+/*
+ * npf_conn_admit: account for a new connection, enforcing the limit.
+ */
+static bool
+npf_conn_admit(npf_t *npf)
+{
+	const npf_conn_params_t *params = npf->params[NPF_PARAMS_CONN];
+	const unsigned max = params->conn_max;
+
+	if (atomic_inc_uint_nv(&npf->conn_count) > max && max) {
+		atomic_dec_uint(&npf->conn_count);
+		return false;
+	}
+	return true;
+}
+
 /*
  * npf_conn_establish: create a new connection, insert into the global list.
  *
@@ -416,9 +475,20 @@ npf_conn_establish(npf_cache_t *npc, const unsigned di, bool global)
 		return NULL;
 	}
 
+	/*
+	 * Enforce the limit.  Let the G/C worker run: it will expire the
+	 * connections early under such pressure.
+	 */
+	if (__predict_false(!npf_conn_admit(npf))) {
+		npf_stats_inc(npf, NPF_STAT_CONN_LIMIT);
+		npf_worker_signal(npf);
+		return NULL;
+	}
+
 	/* Allocate and initialize the new connection. */
 	con = pool_cache_get(npf->conn_cache[idx], PR_NOWAIT);
 	if (__predict_false(!con)) {
+		atomic_dec_uint(&npf->conn_count);
 		npf_worker_signal(npf);
 		return NULL;
 	}
@@ -430,6 +500,9 @@ npf_conn_establish(npf_cache_t *npc, const unsigned di, bool global)
 	atomic_store_relaxed(&con->c_refcnt, 0);
 	con->c_rproc = NULL;
 	con->c_nat = NULL;
+	con->c_srcent = NULL;
+	con->c_syncid = 0;
+	con->c_syncgen = 0;
 
 	con->c_proto = npc->npc_proto;
 	CTASSERT(sizeof(con->c_proto) >= sizeof(npc->npc_proto));
@@ -488,11 +561,13 @@ err:
 	 * here since there might be references acquired already.
 	 */
 	if (error) {
-		atomic_or_uint(&con->c_flags, CONN_REMOVED | CONN_EXPIRE);
+		atomic_or_uint(&con->c_flags,
+		    CONN_REMOVED | CONN_EXPIRE | CONN_NOLOG);
 		atomic_dec_uint(&con->c_refcnt);
 		npf_stats_inc(npf, NPF_STAT_RACE_CONN);
 	} else {
 		NPF_PRINTF(("NPF: establish conn %p\n", con));
+		npf_evlog_conn(npf, NPF_EVENT_CONN_CREATE, con);
 	}
 
 	/* Finally, insert into the connection list. */
@@ -509,6 +584,17 @@ npf_conn_destroy(npf_t *npf, npf_conn_t *con)
 
 	KASSERT(atomic_load_relaxed(&con->c_refcnt) == 0);
 
+	if ((atomic_load_relaxed(&con->c_flags) & CONN_NOLOG) == 0) {
+		npf_evlog_conn(npf, NPF_EVENT_CONN_EXPIRE, con);
+	}
+	if ((atomic_load_relaxed(&con->c_flags) &
+	    (CONN_ACTIVE | CONN_NOLOG | CONN_SYNCED)) == CONN_ACTIVE) {
+		/*
+		 * Note: the connections created from the records are
+		 * expired by their origin, therefore not recorded.
+		 */
+		npf_sync_conn(npf, NPF_SYNC_EXPIRE, con);
+	}
 	if (con->c_nat) {
 		/* Release any NAT structures. */
 		npf_nat_destroy(con, con->c_nat);
@@ -517,6 +603,10 @@ npf_conn_destroy(npf_t *npf, npf_conn_t *con)
 		/* Release the rule procedure. */
 		npf_rproc_release(con->c_rproc);
 	}
+	if (con->c_srcent) {
+		/* Release the source tracking entry. */
+		npf_srctrack_exit(npf, con->c_srcent);
+	}
 
 	/* Destroy the state. */
 	npf_state_destroy(&con->c_state);
@@ -524,6 +614,7 @@ npf_conn_destroy(npf_t *npf, npf_conn_t *con)
 
 	/* Free the structure, increase the counter. */
 	pool_cache_put(npf->conn_cache[idx], con);
+	atomic_dec_uint(&npf->conn_count);
 	npf_stats_inc(npf, NPF_STAT_CONN_DESTROY);
 	NPF_PRINTF(("NPF: conn %p destroyed\n", con));
 }
@@ -602,6 +693,14 @@ npf_conn_setnat(const npf_cache_t *npc, npf_conn_t *con,
 	/* Associate the NAT entry and release the lock. */
 	con->c_nat = nt;
 	mutex_exit(&con->c_lock);
+
+	/*
+	 * Replicate the association with an active connection; for the
+	 * new ones, it is a part of the creation record.
+	 */
+	if (flags & CONN_ACTIVE) {
+		npf_sync_conn(npf, NPF_SYNC_NAT, con);
+	}
 	return 0;
 }
 
@@ -658,6 +757,20 @@ npf_conn_setpass(npf_conn_t *con, const npf_match_info_t *mi, npf_rproc_t *rp)
 	}
 }
 
+/*
+ * npf_conn_setsrc: associate the source tracking entry with the new
+ * connection.  The caller transfers its accounting of the connection,
+ * which will be released on npf_conn_destroy().
+ */
+void
+npf_conn_setsrc(npf_conn_t *con, npf_srcent_t *ent)
+{
+	KASSERT((atomic_load_relaxed(&con->c_flags) & CONN_ACTIVE) == 0);
+	KASSERT(atomic_load_relaxed(&con->c_refcnt) > 0);
+	KASSERT(con->c_srcent == NULL);
+	con->c_srcent = ent;
+}
+
 /*
  * npf_conn_release: release a reference, which might allow G/C thread
  * to destroy this connection.
@@ -684,21 +797,75 @@ npf_conn_getnat(const npf_conn_t *con)
 	return con->c_nat;
 }
 
+/*
+ * npf_conn_getproto: return the protocol of the connection.
+ */
+unsigned
+npf_conn_getproto(const npf_conn_t *con)
+{
+	return con->c_proto;
+}
+
+/*
+ * npf_conn_adaptive_etime: scale down the expiration time linearly once
+ * the number of connections exceeds the "conn.adaptive.start" threshold,
+ * reaching zero at the "conn.adaptive.end" threshold.  The thresholds
+ * are given as a percentage of "conn.max".
+ */
+static int
+npf_conn_adaptive_etime(const npf_t *npf, unsigned count, int etime)
+{
+	const npf_conn_params_t *params = npf->params[NPF_PARAMS_CONN];
+	const uint64_t max = params->conn_max;
+	const uint64_t start = max * params->adaptive_start / 100;
+	const uint64_t end = max * params->adaptive_end / 100;
+
+	if (max == 0 || count <= start) {
+		return etime;
+	}
+	if (count >= end) {
+		return 0;
+	}
+	return (int)(etime * (end - count) / (end - start));
+}
+
 /*
  * npf_conn_expired: criterion to check if connection is expired.
  */
 bool
 npf_conn_expired(npf_t *npf, const npf_conn_t *con, uint64_t tsnow)
 {
+	const npf_conn_params_t *params = npf->params[NPF_PARAMS_CONN];
 	const unsigned flags = atomic_load_relaxed(&con->c_flags);
-	const int etime = npf_state_etime(npf, &con->c_state, con->c_proto);
-	int elapsed;
+	const unsigned count = atomic_load_relaxed(&npf->conn_count);
+	const unsigned max = params->conn_max;
+	int etime, elapsed;
 
 	if (__predict_false(flags & CONN_EXPIRE)) {
 		/* Explicitly marked to be expired. */
 		return true;
 	}
 
+	/*
+	 * If the limit is reached, then drop the embryonic connections
+	 * first: they are the likely product of a flood.
+	 */
+	if (__predict_false(max && count >= max) &&
+	    npf_state_embryonic_p(&con->c_state, con->c_proto)) {
+		npf_stats_inc(npf, NPF_STAT_CONN_EARLYDROP);
+		return true;
+	}
+	etime = npf_state_etime(npf, &con->c_state, con->c_proto);
+	if (flags & CONN_SYNCED) {
+		/*
+		 * The activity of the replicated connection is refreshed
+		 * by the records, which lag by up to the refresh interval.
+		 * Allow one of them to be lost.
+		 */
+		etime += 2 * atomic_load_relaxed(&npf->sync_refresh);
+	}
+	etime = npf_conn_adaptive_etime(npf, count, etime);
+
 	/*
 	 * Note: another thread may update 'atime' and it might
 	 * become greater than 'now'.
@@ -741,8 +908,37 @@ npf_conn_worker(npf_t *npf)
 {
 	npf_conndb_t *conn_db = atomic_load_consume(&npf->conn_db);
 	npf_conndb_gc(npf, conn_db, false, true);
+	npf_srctrack_worker(npf);
 }
 
+/*
+ * npf_conn_iter_init: start the iteration over the active connection
+ * database; if the connection tracking is off, then it is empty.
+ */
+void
+npf_conn_iter_init(npf_t *npf, npf_conndb_iter_t *it)
+{
+	mutex_enter(&npf->conn_lock);
+	if (atomic_load_relaxed(&npf->conn_tracking) == CONN_TRACKING_ON) {
+		npf_conndb_t *conn_db = atomic_load_relaxed(&npf->conn_db);
+		npf_conndb_iter_init(npf, conn_db, it);
+	} else {
+		it->ci_cd = NULL;
+		it->ci_next = NULL;
+	}
+	mutex_exit(&npf->conn_lock);
+}
+
+void
+npf_conn_iter_fini(npf_t *npf, npf_conndb_iter_t *it)
+{
+	mutex_enter(&npf->conn_lock);
+	npf_conndb_iter_fini(npf, it);
+	mutex_exit(&npf->conn_lock);
+}
+
+#define	CONN_EXPORT_BATCH	256
+
 /*
  * npf_conndb_export: construct a list of connections prepared for saving.
  * Note: this is expected to be an expensive operation.
@@ -750,38 +946,592 @@ npf_conn_worker(npf_t *npf)
 int
 npf_conndb_export(npf_t *npf, nvlist_t *nvl)
 {
-	npf_conn_t *head, *con;
-	npf_conndb_t *conn_db;
+	npf_conndb_iter_t it;
+	npf_conn_t *con;
 
 	/*
 	 * Note: acquire conn_lock to prevent from the database
-	 * destruction and G/C thread.
+	 * destruction and G/C thread.  The iterator preserves the
+	 * position, therefore hold the lock only for a batch.
 	 */
-	mutex_enter(&npf->conn_lock);
-	if (atomic_load_relaxed(&npf->conn_tracking) != CONN_TRACKING_ON) {
+	npf_conn_iter_init(npf, &it);
+	do {
+		unsigned n = CONN_EXPORT_BATCH;
+
+		mutex_enter(&npf->conn_lock);
+		while (n-- && (con = npf_conndb_iter_next(npf, &it)) != NULL) {
+			nvlist_t *con_nvl;
+
+			con_nvl = nvlist_create(0);
+			if (npf_conn_export(npf, con, con_nvl) == 0) {
+				nvlist_append_nvlist_array(nvl, "conn-list",
+				    con_nvl);
+			}
+			nvlist_destroy(con_nvl);
+		}
+		con = it.ci_next;
 		mutex_exit(&npf->conn_lock);
-		return 0;
+	} while (con);
+	npf_conn_iter_fini(npf, &it);
+	return 0;
+}
+
+/*
+ * Connection listing.
+ *
+ *	The listing is returned in batches.  The position is preserved
+ *	across the requests in a cursor, i.e. the database iterator kept
+ *	in the kernel and identified by the ID.  The cursors abandoned by
+ *	the consumers are reclaimed after a timeout.
+ */
+
+#define	CONN_LIST_BATCH		256
+#define	CONN_LIST_MAX		1024
+#define	CONN_CURSOR_MAX		16
+#define	CONN_CURSOR_TIMEOUT	60	// seconds
+
+struct npf_conncursor {
+	uint64_t		cc_id;
+	time_t			cc_atime;
+	npf_conndb_iter_t	cc_iter;
+	LIST_ENTRY(npf_conncursor) cc_entry;
+};
+
+typedef struct npf_conncursor npf_conncursor_t;
+
+typedef struct {
+	unsigned		alen;	// zero if any
+	int			proto;	// -1 if any
+	npf_addr_t		addr;
+	npf_netmask_t		mask;	// NPF_NO_NETMASK if any address
+	in_port_t		port;	// network byte-order; zero if any
+	unsigned		ifid;	// zero if any
+	bool			nat;
+} npf_connlist_filter_t;
+
+/*
+ * npf_conncursor_get: create a new cursor, if the ID is zero, or take
+ * the existing one, i.e. it is unavailable to the other requests until
+ * put back.  Also, reclaim the abandoned cursors.
+ *
+ * => Returns NULL if there is no such cursor or too many of them.
+ */
+static npf_conncursor_t *
+npf_conncursor_get(npf_t *npf, uint64_t id)
+{
+	npf_conncursor_t *cc, *next, *ncc = NULL;
+	struct timespec tsnow;
+
+	if (id == 0) {
+		ncc = kmem_zalloc(sizeof(npf_conncursor_t), KM_SLEEP);
 	}
-	conn_db = atomic_load_relaxed(&npf->conn_db);
-	head = npf_conndb_getlist(conn_db);
-	con = head;
-	while (con) {
-		nvlist_t *con_nvl;
+	getnanouptime(&tsnow);
 
-		con_nvl = nvlist_create(0);
-		if (npf_conn_export(npf, con, con_nvl) == 0) {
-			nvlist_append_nvlist_array(nvl, "conn-list", con_nvl);
+	mutex_enter(&npf->conn_lock);
+	cc = LIST_FIRST(&npf->conn_cursors);
+	while (cc) {
+		next = LIST_NEXT(cc, cc_entry);
+		if (id && cc->cc_id == id) {
+			LIST_REMOVE(cc, cc_entry);
+			break;
+		}
+		if (tsnow.tv_sec - cc->cc_atime > CONN_CURSOR_TIMEOUT) {
+			LIST_REMOVE(cc, cc_entry);
+			npf_conndb_iter_fini(npf, &cc->cc_iter);
+			kmem_free(cc, sizeof(npf_conncursor_t));
+			npf->conn_ncursors--;
 		}
-		nvlist_destroy(con_nvl);
+		cc = next;
+	}
+	if (ncc && npf->conn_ncursors < CONN_CURSOR_MAX) {
+		npf_conndb_t *conn_db = atomic_load_relaxed(&npf->conn_db);
 
-		if ((con = npf_conndb_getnext(conn_db, con)) == head) {
-			break;
+		/*
+		 * Note: if the connection tracking is off, then the
+		 * iterator is left detached, i.e. the listing is empty.
+		 */
+		cc = ncc;
+		cc->cc_id = ++npf->conn_cursor_id;
+		if (atomic_load_relaxed(&npf->conn_tracking) ==
+		    CONN_TRACKING_ON) {
+			npf_conndb_iter_init(npf, conn_db, &cc->cc_iter);
 		}
+		npf->conn_ncursors++;
+		ncc = NULL;
 	}
 	mutex_exit(&npf->conn_lock);
+
+	if (ncc) {
+		kmem_free(ncc, sizeof(npf_conncursor_t));
+	}
+	return cc;
+}
+
+/*
+ * npf_conncursor_put: put back the cursor, taken by npf_conncursor_get(),
+ * or destroy it, if the listing is over.  Returns the ID or zero.
+ */
+static uint64_t
+npf_conncursor_put(npf_t *npf, npf_conncursor_t *cc, bool done)
+{
+	struct timespec tsnow;
+	uint64_t id = 0;
+
+	getnanouptime(&tsnow);
+
+	mutex_enter(&npf->conn_lock);
+	if (done) {
+		npf_conndb_iter_fini(npf, &cc->cc_iter);
+		npf->conn_ncursors--;
+	} else {
+		cc->cc_atime = tsnow.tv_sec;
+		LIST_INSERT_HEAD(&npf->conn_cursors, cc, cc_entry);
+		id = cc->cc_id;
+	}
+	mutex_exit(&npf->conn_lock);
+
+	if (done) {
+		kmem_free(cc, sizeof(npf_conncursor_t));
+	}
+	return id;
+}
+
+static void
+npf_conncursor_flush(npf_t *npf)
+{
+	npf_conncursor_t *cc;
+
+	mutex_enter(&npf->conn_lock);
+	while ((cc = LIST_FIRST(&npf->conn_cursors)) != NULL) {
+		LIST_REMOVE(cc, cc_entry);
+		npf_conndb_iter_fini(npf, &cc->cc_iter);
+		kmem_free(cc, sizeof(npf_conncursor_t));
+	}
+	npf->conn_ncursors = 0;
+	mutex_exit(&npf->conn_lock);
+}
+
+/*
+ * npf_connlist_filter_import: construct the filter of the listing.
+ *
+ * => Returns ENOENT if no connection can match, e.g. the interface
+ *    name is not known.
+ */
+static int
+npf_connlist_filter_import(npf_t *npf, const nvlist_t *req,
+    npf_connlist_filter_t *f)
+{
+	const nvlist_t *fnv;
+	const char *ifname;
+	const void *addr;
+	size_t alen;
+
+	memset(f, 0, sizeof(npf_connlist_filter_t));
+	f->proto = -1;
+	f->mask = NPF_NO_NETMASK;
+
+	if ((fnv = dnvlist_get_nvlist(req, "filter", NULL)) == NULL) {
+		return 0;
+	}
+	f->alen = dnvlist_get_number(fnv, "alen", 0);
+	if (nvlist_exists_number(fnv, "proto")) {
+		f->proto = nvlist_get_number(fnv, "proto") & 0xff;
+	}
+	if ((addr = dnvlist_get_binary(fnv, "addr", &alen, NULL, 0)) != NULL) {
+		if (alen != sizeof(struct in_addr) &&
+		    alen != sizeof(struct in6_addr)) {
+			return EINVAL;
+		}
+		if (f->alen && f->alen != alen) {
+			return EINVAL;
+		}
+		memcpy(&f->addr, addr, alen);
+		f->alen = alen;
+		f->mask = dnvlist_get_number(fnv, "mask", NPF_MAX_NETMASK);
+		if (f->mask > (alen << 3)) {
+			f->mask = alen << 3;
+		}
+	}
+	f->port = htons(dnvlist_get_number(fnv, "port", 0));
+	f->nat = dnvlist_get_bool(fnv, "nat", false);
+
+	ifname = dnvlist_get_string(fnv, "ifname", NULL);
+	if (ifname && (f->ifid = npf_ifmap_lookupname(npf, ifname)) == 0) {
+		return ENOENT;
+	}
+	return 0;
+}
+
+/*
+ * npf_connlist_filter_match: match the connection against the filter,
+ * using the forwards key, i.e. the original addresses and ports.
+ */
+static bool
+npf_connlist_filter_match(const npf_connlist_filter_t *f, npf_conn_t *con)
+{
+	npf_connrec_key_t rk;
+
+	if (f->alen && con->c_alen != f->alen) {
+		return false;
+	}
+	if (f->proto != -1 && con->c_proto != (unsigned)f->proto) {
+		return false;
+	}
+	if (f->ifid && con->c_ifid != f->ifid) {
+		return false;
+	}
+	if (f->nat && con->c_nat == NULL) {
+		return false;
+	}
+	if (f->port == 0 && f->mask == NPF_NO_NETMASK) {
+		return true;
+	}
+	(void)npf_connkey_getrec(npf_conn_getforwkey(con), &rk);
+	if (f->port && rk.ck_sport != f->port && rk.ck_dport != f->port) {
+		return false;
+	}
+	if (f->mask != NPF_NO_NETMASK &&
+	    npf_addr_cmp(&rk.ck_saddr, f->mask, &f->addr, f->mask, f->alen) &&
+	    npf_addr_cmp(&rk.ck_daddr, f->mask, &f->addr, f->mask, f->alen)) {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * npf_conndb_list: return the next batch of the connections matching
+ * the filter, resuming from the cursor, if one is given.  The returned
+ * cursor is zero at the end of the listing.
+ *
+ * => The connections created after the start of the listing are not
+ *    listed; the connection database is locked only for a batch.
+ */
+int
+npf_conndb_list(npf_t *npf, const nvlist_t *req, nvlist_t *resp)
+{
+	npf_connlist_filter_t f;
+	npf_conncursor_t *cc;
+	npf_conn_t *con;
+	uint64_t id, count;
+	unsigned n = 0;
+	int error;
+
+	id = dnvlist_get_number(req, "cursor", 0);
+	count = dnvlist_get_number(req, "count", CONN_LIST_BATCH);
+	count = MAX(MIN(count, CONN_LIST_MAX), 1);
+
+	error = npf_connlist_filter_import(npf, req, &f);
+	if (error == ENOENT) {
+		/* Nothing to list. */
+		nvlist_add_number(resp, "cursor", 0);
+		return 0;
+	}
+	if (error) {
+		return error;
+	}
+	if ((cc = npf_conncursor_get(npf, id)) == NULL) {
+		return id ? ESTALE : EBUSY;
+	}
+
+	do {
+		unsigned scan = CONN_EXPORT_BATCH;
+
+		mutex_enter(&npf->conn_lock);
+		while (scan-- && n < count &&
+		    (con = npf_conndb_iter_next(npf, &cc->cc_iter)) != NULL) {
+			nvlist_t *con_nvl;
+
+			if (!npf_connlist_filter_match(&f, con)) {
+				continue;
+			}
+			con_nvl = nvlist_create(0);
+			if (npf_conn_export(npf, con, con_nvl) == 0) {
+				nvlist_append_nvlist_array(resp, "conn-list",
+				    con_nvl);
+				n++;
+			}
+			nvlist_destroy(con_nvl);
+		}
+		con = cc->cc_iter.ci_next;
+		mutex_exit(&npf->conn_lock);
+	} while (con && n < count);
+
+	id = npf_conncursor_put(npf, cc, con == NULL);
+	nvlist_add_number(resp, "cursor", id);
 	return 0;
 }
 
+/*
+ * npf_conn_getrec: construct the connection record, except the interface
+ * names.  The interface IDs are returned in the given array, indexed by
+ * NPF_CONNREC_IF_*, and can be converted using npf_connrec_setifnames().
+ *
+ * => If 'gen' is not NULL, then advance the replication generation and
+ *    return it; it is consistent with the captured state.
+ * => Takes no locks other than the connection lock.
+ */
+void
+npf_conn_getrec(npf_conn_t *con, npf_connrec_t *rec, unsigned *ifids,
+    uint32_t *gen)
+{
+	npf_connkey_t *fw, *bk;
+	unsigned alen;
+	npf_nat_t *nt;
+
+	memset(rec, 0, sizeof(npf_connrec_t));
+	rec->cr_flags = atomic_load_relaxed(&con->c_flags);
+	rec->cr_proto = con->c_proto;
+	ifids[NPF_CONNREC_IF] = con->c_ifid;
+
+	fw = npf_conn_getforwkey(con);
+	alen = NPF_CONNKEY_ALEN(fw);
+	KASSERT(alen == con->c_alen);
+	bk = npf_conn_getbackkey(con, alen);
+	rec->cr_alen = alen;
+
+	CTASSERT(sizeof(npf_state_t) <= NPF_CONNREC_STATELEN);
+	mutex_enter(&con->c_lock);
+	ifids[NPF_CONNREC_IF_FORW] =
+	    npf_connkey_getrec(fw, &rec->cr_key[NPF_FLOW_FORW]);
+	ifids[NPF_CONNREC_IF_BACK] =
+	    npf_connkey_getrec(bk, &rec->cr_key[NPF_FLOW_BACK]);
+	memcpy(rec->cr_state, &con->c_state, sizeof(npf_state_t));
+	nt = con->c_nat;
+	if (gen) {
+		*gen = ++con->c_syncgen;
+	}
+	mutex_exit(&con->c_lock);
+
+	/* Note: the NAT entry is destroyed only with the connection. */
+	ifids[NPF_CONNREC_IF_NAT] = nt ? npf_nat_getrec(nt, rec) : 0;
+}
+
+/*
+ * npf_connrec_setifnames: set the interface names of the record, given
+ * the interface IDs returned by npf_conn_getrec().
+ */
+void
+npf_connrec_setifnames(npf_t *npf, npf_connrec_t *rec, const unsigned *ifids)
+{
+	char * const names[NPF_CONNREC_NIFS] = {
+		[NPF_CONNREC_IF] = rec->cr_ifname,
+		[NPF_CONNREC_IF_FORW] = rec->cr_key[NPF_FLOW_FORW].ck_ifname,
+		[NPF_CONNREC_IF_BACK] = rec->cr_key[NPF_FLOW_BACK].ck_ifname,
+		[NPF_CONNREC_IF_NAT] = rec->cr_nat_ifname,
+	};
+
+	for (unsigned i = 0; i < NPF_CONNREC_NIFS; i++) {
+		if (ifids[i]) {
+			npf_ifmap_copyname(npf, ifids[i], names[i], IFNAMSIZ);
+		}
+	}
+}
+
+/*
+ * npf_conndb_snapshot: fill the buffer with up to the given number of
+ * connection records, continuing the iteration.  Unlike the export,
+ * the conn_lock is held only while filling the buffer.
+ *
+ * => Returns the number of records; less than requested at the end.
+ */
+size_t
+npf_conndb_snapshot(npf_t *npf, npf_conndb_iter_t *it,
+    npf_connrec_t *buf, size_t count)
+{
+	npf_conn_t *con;
+	size_t n = 0;
+
+	mutex_enter(&npf->conn_lock);
+	while (n < count && (con = npf_conndb_iter_next(npf, it)) != NULL) {
+		const unsigned flags = atomic_load_relaxed(&con->c_flags);
+		unsigned ifids[NPF_CONNREC_NIFS];
+
+		if ((flags & (CONN_ACTIVE|CONN_EXPIRE)) != CONN_ACTIVE) {
+			continue;
+		}
+		npf_conn_getrec(con, &buf[n], ifids, NULL);
+		npf_connrec_setifnames(npf, &buf[n], ifids);
+		n++;
+	}
+	mutex_exit(&npf->conn_lock);
+	return n;
+}
+
+/*
+ * npf_conn_setrec: construct the connection from the snapshot record
+ * and insert it into the active connection database.  The replication
+ * ID and generation are zero, unless the record is replicated.  The
+ * expiration of such connection is not replicated back.
+ *
+ * => Must be called with the config lock held.
+ */
+int
+npf_conn_setrec(npf_t *npf, const npf_connrec_t *rec, uint64_t id,
+    uint32_t gen)
+{
+	const unsigned alen = rec->cr_alen;
+	npf_connkey_t *fw, *bk;
+	npf_conndb_t *conn_db;
+	npf_state_t nst;
+	npf_conn_t *con;
+	int error = 0;
+
+	KASSERT(npf_config_locked_p(npf));
+
+	if (atomic_load_relaxed(&npf->conn_tracking) != CONN_TRACKING_ON) {
+		return ENXIO;
+	}
+	if (alen != sizeof(struct in_addr) &&
+	    alen != sizeof(struct in6_addr)) {
+		return EINVAL;
+	}
+	memcpy(&nst, rec->cr_state, sizeof(npf_state_t));
+	if (!npf_state_valid_p(&nst, rec->cr_proto)) {
+		return EINVAL;
+	}
+	if (!npf_conn_admit(npf)) {
+		npf_stats_inc(npf, NPF_STAT_CONN_LIMIT);
+		return ENOSPC;
+	}
+
+	/* Allocate a connection and initialize it (clear first). */
+	con = pool_cache_get(npf->conn_cache[NPF_CONNCACHE(alen)], PR_WAITOK);
+	memset(con, 0, sizeof(npf_conn_t));
+	mutex_init(&con->c_lock, MUTEX_DEFAULT, IPL_SOFTNET);
+	npf_stats_inc(npf, NPF_STAT_CONN_CREATE);
+
+	con->c_proto = rec->cr_proto;
+	con->c_alen = alen;
+	con->c_syncid = id;
+	con->c_syncgen = gen;
+	atomic_store_relaxed(&con->c_flags,
+	    (rec->cr_flags & (PFIL_ALL | CONN_PASS)) | CONN_SYNCED);
+	con->c_state = nst;
+	conn_update_atime(con);
+	con->c_synctime = con->c_atime;
+
+	if (rec->cr_ifname[0] != '\0') {
+		char ifname[IFNAMSIZ];
+
+		strlcpy(ifname, rec->cr_ifname, sizeof(ifname));
+		if ((con->c_ifid = npf_ifmap_register(npf, ifname)) == 0) {
+			goto err;
+		}
+	}
+	fw = npf_conn_getforwkey(con);
+	if (!npf_connkey_setrec(npf, &rec->cr_key[NPF_FLOW_FORW],
+	    alen, con->c_proto, fw)) {
+		goto err;
+	}
+	bk = npf_conn_getbackkey(con, alen);
+	if (!npf_connkey_setrec(npf, &rec->cr_key[NPF_FLOW_BACK],
+	    alen, con->c_proto, bk)) {
+		goto err;
+	}
+
+	/* Reconstruct NAT association, if any. */
+	if (rec->cr_nat &&
+	    (con->c_nat = npf_nat_setrec(npf, rec, con)) == NULL) {
+		goto err;
+	}
+
+	/*
+	 * Insert both keys and activate the connection.  On duplicate,
+	 * let the G/C thread destroy it, as there might be references
+	 * acquired already (see npf_conn_establish()).
+	 */
+	mutex_enter(&con->c_lock);
+	atomic_or_uint(&con->c_flags, CONN_ACTIVE);
+	conn_db = atomic_load_consume(&npf->conn_db);
+	if (!npf_conndb_insert(conn_db, fw, con, NPF_FLOW_FORW)) {
+		error = EISCONN;
+	} else if (!npf_conndb_insert(conn_db, bk, con, NPF_FLOW_BACK)) {
+		npf_conn_t *ret __diagused;
+		ret = npf_conndb_remove(conn_db, fw);
+		KASSERT(ret == con);
+		error = EISCONN;
+	}
+	if (error) {
+		atomic_or_uint(&con->c_flags,
+		    CONN_REMOVED | CONN_EXPIRE | CONN_NOLOG);
+	}
+	npf_conndb_enqueue(conn_db, con);
+	mutex_exit(&con->c_lock);
+	return error;
+err:
+	atomic_or_uint(&con->c_flags, CONN_NOLOG);
+	npf_conn_destroy(npf, con);
+	return EINVAL;
+}
+
+/*
+ * npf_conn_update: update the protocol state and the replication
+ * generation of the connection from the record and refresh its last
+ * activity time.
+ *
+ * => Returns false if the state in the record is not valid.
+ */
+bool
+npf_conn_update(npf_conn_t *con, const npf_connrec_t *rec, uint32_t gen)
+{
+	npf_state_t nst;
+
+	memcpy(&nst, rec->cr_state, sizeof(npf_state_t));
+	if (!npf_state_valid_p(&nst, con->c_proto)) {
+		return false;
+	}
+	mutex_enter(&con->c_lock);
+	con->c_state = nst;
+	con->c_syncgen = gen;
+	mutex_exit(&con->c_lock);
+	conn_update_atime(con);
+	return true;
+}
+
+/*
+ * npf_conn_evict: remove the connection, which is replaced or expired
+ * by the replication.  It is neither logged nor replicated.  The NAT
+ * port is returned now, as the replacement would take the same port.
+ *
+ * => Must be called with the config lock held.
+ */
+void
+npf_conn_evict(npf_t *npf, npf_conn_t *con)
+{
+	npf_nat_t *nt;
+
+	KASSERT(npf_config_locked_p(npf));
+	atomic_or_uint(&con->c_flags, CONN_NOLOG);
+	npf_conn_remove(atomic_load_relaxed(&npf->conn_db), con);
+
+	mutex_enter(&con->c_lock);
+	nt = con->c_nat;
+	mutex_exit(&con->c_lock);
+	if (nt) {
+		npf_nat_evict(nt);
+	}
+}
+
+/*
+ * npf_conndb_restore: restore the connections from the snapshot records
+ * into the active connection database.  The NAT policies are looked up
+ * in the active configuration, which must be loaded first.
+ *
+ * => Returns the number of restored connections.
+ */
+size_t
+npf_conndb_restore(npf_t *npf, const npf_connrec_t *buf, size_t count)
+{
+	size_t n = 0;
+
+	npf_config_enter(npf);
+	for (size_t i = 0; i < count; i++) {
+		n += npf_conn_setrec(npf, &buf[i], 0, 0) == 0;
+	}
+	npf_config_exit(npf);
+	return n;
+}
+
 /*
  * npf_conn_export: serialize a single connection.
  */
@@ -850,6 +1600,7 @@ npf_conn_import(npf_t *npf, npf_conndb_t *cd, const nvlist_t *cdict,
 
 	/* Allocate a connection and initialize it (clear first). */
 	con = pool_cache_get(npf->conn_cache[idx], PR_WAITOK);
+	atomic_inc_uint(&npf->conn_count);
 	memset(con, 0, sizeof(npf_conn_t));
 	mutex_init(&con->c_lock, MUTEX_DEFAULT, IPL_SOFTNET);
 	npf_stats_inc(npf, NPF_STAT_CONN_CREATE);
@@ -909,6 +1660,7 @@ npf_conn_import(npf_t *npf, npf_conndb_t *cd, const nvlist_t *cdict,
 	npf_conndb_enqueue(cd, con);
 	return 0;
 err:
+	atomic_or_uint(&con->c_flags, CONN_NOLOG);
 	npf_conn_destroy(npf, con);
 	return EINVAL;
 }
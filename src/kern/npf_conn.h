@@ -35,6 +35,15 @@ struct npf_conn {
 	unsigned		c_retfl;
 	uint64_t		c_rid;
 
+	/*
+	 * Replication: the connection ID, the generation of its last
+	 * record and the last activity time, as of the last record (see
+	 * npf_sync.c).  The generation is protected by c_lock.
+	 */
+	uint64_t		c_syncid;
+	uint32_t		c_syncgen;
+	uint32_t		c_synctime;
+
 	/*
 	 * Entry in the connection database/list.  The entry is
 	 * protected by npf_t::conn_lock.
@@ -44,9 +53,13 @@ struct npf_conn {
 		LIST_ENTRY(npf_conn)	c_entry;
 	};
 
-	/* Associated rule procedure or NAT (if any). */
+	/*
+	 * Associated rule procedure, NAT and the source tracking entry
+	 * (if any).
+	 */
 	npf_rproc_t *		c_rproc;
 	npf_nat_t *		c_nat;
+	npf_srcent_t *		c_srcent;
 
 	/*
 	 * The Reference count and the last activity time (used to
@@ -70,6 +83,9 @@ struct npf_conn {
 typedef struct {
 	int	connkey_interface;
 	int	connkey_direction;
+	int	conn_max;
+	int	adaptive_start;
+	int	adaptive_end;
 } npf_conn_params_t;
 
 #endif
@@ -104,8 +120,33 @@ void		npf_connkey_getkey(const npf_connkey_t *, unsigned *,
 		    unsigned *, npf_addr_t *, uint16_t *);
 unsigned	npf_connkey_import(npf_t *, const nvlist_t *, npf_connkey_t *);
 nvlist_t *	npf_connkey_export(npf_t *, const npf_connkey_t *);
+unsigned	npf_connkey_getrec(const npf_connkey_t *, npf_connrec_key_t *);
+unsigned	npf_connkey_setrec(npf_t *, const npf_connrec_key_t *,
+		    unsigned, unsigned, npf_connkey_t *);
 void		npf_connkey_print(const npf_connkey_t *);
 
+/*
+ * Connection database iterator.  The position is preserved when the
+ * conn_lock is released: the G/C moves the iterators past the removed
+ * connections.
+ */
+typedef struct npf_conndb_iter {
+	npf_conndb_t *			ci_cd;
+	npf_conn_t *			ci_next;
+	LIST_ENTRY(npf_conndb_iter)	ci_entry;
+} npf_conndb_iter_t;
+
+/*
+ * Interfaces of the connection record (see npf_conn_getrec()).
+ */
+enum {
+	NPF_CONNREC_IF = 0,
+	NPF_CONNREC_IF_FORW,
+	NPF_CONNREC_IF_BACK,
+	NPF_CONNREC_IF_NAT,
+	NPF_CONNREC_NIFS
+};
+
 /*
  * Connection tracking interface.
  */
@@ -124,12 +165,24 @@ bool		npf_conn_pass(const npf_conn_t *, npf_match_info_t *,
 		    npf_rproc_t **);
 void		npf_conn_setpass(npf_conn_t *, const npf_match_info_t *,
 		    npf_rproc_t *);
+void		npf_conn_setsrc(npf_conn_t *, npf_srcent_t *);
 int		npf_conn_setnat(const npf_cache_t *, npf_conn_t *,
 		    npf_nat_t *, unsigned);
 npf_nat_t *	npf_conn_getnat(const npf_conn_t *);
+unsigned	npf_conn_getproto(const npf_conn_t *);
 bool		npf_conn_expired(npf_t *, const npf_conn_t *, uint64_t);
 void		npf_conn_remove(npf_conndb_t *, npf_conn_t *);
 void		npf_conn_worker(npf_t *);
+void		npf_conn_iter_init(npf_t *, npf_conndb_iter_t *);
+void		npf_conn_iter_fini(npf_t *, npf_conndb_iter_t *);
+void		npf_conn_getrec(npf_conn_t *, npf_connrec_t *, unsigned *,
+		    uint32_t *);
+void		npf_connrec_setifnames(npf_t *, npf_connrec_t *,
+		    const unsigned *);
+int		npf_conn_setrec(npf_t *, const npf_connrec_t *, uint64_t,
+		    uint32_t);
+bool		npf_conn_update(npf_conn_t *, const npf_connrec_t *, uint32_t);
+void		npf_conn_evict(npf_t *, npf_conn_t *);
 int		npf_conn_import(npf_t *, npf_conndb_t *, const nvlist_t *,
 		    npf_ruleset_t *);
 int		npf_conn_find(npf_t *, const nvlist_t *, nvlist_t *);
@@ -152,7 +205,15 @@ npf_conn_t *	npf_conndb_remove(npf_conndb_t *, npf_connkey_t *);
 void		npf_conndb_enqueue(npf_conndb_t *, npf_conn_t *);
 npf_conn_t *	npf_conndb_getlist(npf_conndb_t *);
 npf_conn_t *	npf_conndb_getnext(npf_conndb_t *, npf_conn_t *);
+void		npf_conndb_iter_init(npf_t *, npf_conndb_t *,
+		    npf_conndb_iter_t *);
+npf_conn_t *	npf_conndb_iter_next(npf_t *, npf_conndb_iter_t *);
+void		npf_conndb_iter_fini(npf_t *, npf_conndb_iter_t *);
 int		npf_conndb_export(npf_t *, nvlist_t *);
+int		npf_conndb_list(npf_t *, const nvlist_t *, nvlist_t *);
+size_t		npf_conndb_snapshot(npf_t *, npf_conndb_iter_t *,
+		    npf_connrec_t *, size_t);
+size_t		npf_conndb_restore(npf_t *, const npf_connrec_t *, size_t);
 void		npf_conndb_gc(npf_t *, npf_conndb_t *, bool, bool);
 
 #endif	/* _NPF_CONN_H_ */
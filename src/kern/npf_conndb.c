@@ -60,6 +60,9 @@ struct npf_conndb {
 
 	/* The last inspected connection (for circular iteration). */
 	npf_conn_t *		cd_marker;
+
+	/* The active iterators (see npf_conndb_iter_init()). */
+	LIST_HEAD(, npf_conndb_iter) cd_iters;
 };
 
 typedef struct {
@@ -121,6 +124,7 @@ npf_conndb_create(void)
 
 	LIST_INIT(&cd->cd_list);
 	LIST_INIT(&cd->cd_gclist);
+	LIST_INIT(&cd->cd_iters);
 	return cd;
 }
 
@@ -131,6 +135,7 @@ npf_conndb_destroy(npf_conndb_t *cd)
 	KASSERT(cd->cd_marker == NULL);
 	KASSERT(LIST_EMPTY(&cd->cd_list));
 	KASSERT(LIST_EMPTY(&cd->cd_gclist));
+	KASSERT(LIST_EMPTY(&cd->cd_iters));
 
 	thmap_destroy(cd->cd_map);
 	kmem_free(cd, sizeof(npf_conndb_t));
@@ -274,6 +279,70 @@ npf_conndb_getnext(npf_conndb_t *cd, npf_conn_t *con)
 	return con;
 }
 
+/*
+ * npf_conndb_iter_init: start the iteration over all connections; the
+ * new connections, enqueued after this point, are not visited.
+ *
+ * => Must be called with the conn_lock held; the lock may be dropped
+ *    in-between the npf_conndb_iter_next() calls.
+ * => The iteration must be finished with npf_conndb_iter_fini().
+ */
+void
+npf_conndb_iter_init(npf_t *npf, npf_conndb_t *cd, npf_conndb_iter_t *it)
+{
+	KASSERT(mutex_owned(&npf->conn_lock));
+
+	it->ci_cd = cd;
+	it->ci_next = npf_conndb_getlist(cd);
+	LIST_INSERT_HEAD(&cd->cd_iters, it, ci_entry);
+}
+
+/*
+ * npf_conndb_iter_next: return the next connection or NULL at the end.
+ *
+ * => Must be called with the conn_lock held.
+ * => The connection is valid only until the conn_lock is released.
+ */
+npf_conn_t *
+npf_conndb_iter_next(npf_t *npf, npf_conndb_iter_t *it)
+{
+	npf_conn_t *con;
+
+	KASSERT(mutex_owned(&npf->conn_lock));
+
+	if ((con = it->ci_next) != NULL) {
+		it->ci_next = LIST_NEXT(con, c_entry);
+	}
+	return con;
+}
+
+void
+npf_conndb_iter_fini(npf_t *npf, npf_conndb_iter_t *it)
+{
+	KASSERT(mutex_owned(&npf->conn_lock));
+
+	if (it->ci_cd) {
+		LIST_REMOVE(it, ci_entry);
+		it->ci_cd = NULL;
+	}
+}
+
+/*
+ * npf_conndb_iter_unlink: move the iterators past the connection, which
+ * is about to be removed from the list.
+ */
+static void
+npf_conndb_iter_unlink(npf_conndb_t *cd, npf_conn_t *con)
+{
+	npf_conndb_iter_t *it;
+
+	LIST_FOREACH(it, &cd->cd_iters, ci_entry) {
+		if (it->ci_next == con) {
+			it->ci_next = LIST_NEXT(con, c_entry);
+		}
+	}
+}
+
 /*
  * npf_conndb_gc_incr: incremental G/C of the expired connections.
  */
@@ -310,6 +379,7 @@ npf_conndb_gc_incr(npf_t *npf, npf_conndb_t *cd, const time_t now)
 		 */
 		if (npf_conn_expired(npf, con, now)) {
 			/* Yes: move to the G/C list. */
+			npf_conndb_iter_unlink(cd, con);
 			LIST_REMOVE(con, c_entry);
 			LIST_INSERT_HEAD(&cd->cd_gclist, con, c_entry);
 			npf_conn_remove(cd, con);
@@ -378,6 +448,8 @@ npf_conndb_gc(npf_t *npf, npf_conndb_t *cd, bool flush, bool sync)
 	mutex_enter(&npf->conn_lock);
 	npf_conndb_update(cd);
 	if (flush) {
+		npf_conndb_iter_t *it;
+
 		/* Just unlink and move all connections to the G/C list. */
 		while ((con = LIST_FIRST(&cd->cd_list)) != NULL) {
 			LIST_REMOVE(con, c_entry);
@@ -385,6 +457,13 @@ npf_conndb_gc(npf_t *npf, npf_conndb_t *cd, bool flush, bool sync)
 			npf_conn_remove(cd, con);
 		}
 		cd->cd_marker = NULL;
+
+		/* The iterations are over. */
+		while ((it = LIST_FIRST(&cd->cd_iters)) != NULL) {
+			LIST_REMOVE(it, ci_entry);
+			it->ci_cd = NULL;
+			it->ci_next = NULL;
+		}
 	} else {
 		/* Incremental G/C of the expired connections. */
 		gc_conns = npf_conndb_gc_incr(npf, cd, tsnow.tv_sec);
@@ -431,4 +510,7 @@ npf_conndb_gc(npf_t *npf, npf_conndb_t *cd, bool flush, bool sync)
 		LIST_REMOVE(con, c_entry);
 		npf_conn_destroy(npf, con);
 	}
+
+	/* Return the released ports into the port map in bulk. */
+	npf_portmap_sync(npf->portmap);
 }
@@ -103,7 +103,7 @@ npf_connkey_getkey(const npf_connkey_t *key, unsigned *alen, unsigned *proto,
 	 */
 
 	*alen = (k[0] >> 28) << 2;
-	*proto = (k[0] >> 16) & 0xff;
+	*proto = (k[0] >> 20) & 0xff;
 	id[NPF_SRC] = k[1] >> 16;
 	id[NPF_DST] = k[1] & 0xffff;
 
@@ -145,7 +145,7 @@ npf_connkey_getckey(const npf_connkey_t *key, unsigned *ifid, unsigned *di)
 {
 	const uint32_t * const k = key->ck_key;
 
-	*ifid = k[0] & ((1U << 20) - 1);
+	*ifid = k[0] & ((1U << 18) - 1);
 	*di = (k[0] >> 18) & PFIL_ALL;
 }
 
@@ -353,6 +353,62 @@ npf_connkey_import(npf_t *npf, const nvlist_t *key_nv, npf_connkey_t *key)
 	return ret;
 }
 
+/*
+ * npf_connkey_getrec: store the key in the connection snapshot record.
+ *
+ * => Returns the interface ID, if any; the caller sets the name.
+ */
+unsigned
+npf_connkey_getrec(const npf_connkey_t *key, npf_connrec_key_t *rk)
+{
+	unsigned alen, proto, ifid, di;
+	npf_addr_t ips[2];
+	uint16_t ids[2];
+
+	npf_connkey_getkey(key, &alen, &proto, ips, ids);
+	rk->ck_sport = ids[NPF_SRC];
+	rk->ck_dport = ids[NPF_DST];
+	memcpy(&rk->ck_saddr, &ips[NPF_SRC], alen);
+	memcpy(&rk->ck_daddr, &ips[NPF_DST], alen);
+
+	npf_connkey_getckey(key, &ifid, &di);
+	rk->ck_di = di;
+	return ifid;
+}
+
+/*
+ * npf_connkey_setrec: construct the key from the connection snapshot
+ * record.
+ *
+ * => Returns the key length in bytes or zero on failure.
+ */
+unsigned
+npf_connkey_setrec(npf_t *npf, const npf_connrec_key_t *rk, unsigned alen,
+    unsigned proto, npf_connkey_t *key)
+{
+	const npf_addr_t *ips[2] = { &rk->ck_saddr, &rk->ck_daddr };
+	const uint16_t ids[2] = { rk->ck_sport, rk->ck_dport };
+	unsigned ret, ifid = 0;
+
+	if (alen == 0 || alen > sizeof(npf_addr_t) || proto >= IPPROTO_MAX) {
+		return 0;
+	}
+	ret = npf_connkey_setkey(key, alen, proto, ips, ids, NPF_FLOW_FORW);
+	if (ret == 0) {
+		return 0;
+	}
+	if (rk->ck_ifname[0] != '\0') {
+		char ifname[IFNAMSIZ];
+
+		strlcpy(ifname, rk->ck_ifname, sizeof(ifname));
+		if ((ifid = npf_ifmap_register(npf, ifname)) == 0) {
+			return 0;
+		}
+	}
+	npf_connkey_setckey(key, ifid, rk->ck_di & PFIL_ALL);
+	return ret;
+}
+
 #if defined(DDB) || defined(_NPF_TESTING)
 
 void
@@ -113,6 +113,31 @@ npf_mk_table_entries(npf_table_t *t, const nvlist_t *req, nvlist_t *resp)
 	return error;
 }
 
+/*
+ * npf_mk_table_file: create a const table which references the database
+ * file, instead of carrying the data itself.
+ */
+static int __noinline
+npf_mk_table_file(const char *name, unsigned tid, int type,
+    const char *path, nvlist_t *resp, npf_table_t **tblp)
+{
+	if (type != NPF_TABLE_CONST || path[0] != '/') {
+		NPF_ERR_DEBUG(resp);
+		return EINVAL;
+	}
+#ifdef _NPF_STANDALONE
+	if ((*tblp = npf_table_create_file(name, tid, path)) == NULL) {
+		nvlist_add_stringf(resp, "error-msg",
+		    "table `%s': could not map the file `%s'", name, path);
+		return EINVAL;
+	}
+	return 0;
+#else
+	NPF_ERR_DEBUG(resp);
+	return ENOTSUP;
+#endif
+}
+
 /*
  * npf_mk_table: create a table from provided nvlist.
  */
@@ -121,7 +146,7 @@ npf_mk_table(npf_t *npf, const nvlist_t *req, nvlist_t *resp,
     npf_tableset_t *tblset, npf_table_t **tblp, bool replacing)
 {
 	npf_table_t *t;
-	const char *name;
+	const char *name, *path;
 	const void *blob;
 	uint64_t tid;
 	size_t size;
@@ -145,19 +170,25 @@ npf_mk_table(npf_t *npf, const nvlist_t *req, nvlist_t *resp,
 		goto out;
 	}
 
-	/* Get the entries or binary data. */
-	blob = dnvlist_get_binary(req, "data", &size, NULL, 0);
-	if (type == NPF_TABLE_CONST && (blob == NULL || size == 0)) {
-		NPF_ERR_DEBUG(resp);
-		error = EINVAL;
-		goto out;
-	}
-
-	t = npf_table_create(name, (unsigned)tid, type, blob, size);
-	if (t == NULL) {
-		NPF_ERR_DEBUG(resp);
-		error = ENOMEM;
-		goto out;
+	/* Get the entries, binary data or the path to the data file. */
+	if ((path = dnvlist_get_string(req, "data-path", NULL)) != NULL) {
+		error = npf_mk_table_file(name, tid, type, path, resp, &t);
+		if (error) {
+			goto out;
+		}
+	} else {
+		blob = dnvlist_get_binary(req, "data", &size, NULL, 0);
+		if (type == NPF_TABLE_CONST && (blob == NULL || size == 0)) {
+			NPF_ERR_DEBUG(resp);
+			error = EINVAL;
+			goto out;
+		}
+		t = npf_table_create(name, (unsigned)tid, type, blob, size);
+		if (t == NULL) {
+			NPF_ERR_DEBUG(resp);
+			error = ENOMEM;
+			goto out;
+		}
 	}
 
 	if ((error = npf_mk_table_entries(t, req, resp)) != 0) {
@@ -636,9 +667,70 @@ out:
 	return error;
 }
 
+/*
+ * npf_mk_table_update: apply the passed table entries to the active
+ * table in place, i.e. only the difference.  The table name, ID and
+ * type must match the active table.
+ */
+static int __noinline
+npf_mk_table_update(npf_t *npf, const nvlist_t *req, nvlist_t *resp,
+    npf_tableset_t *tblset)
+{
+	const nvlist_t * const *entries = NULL;
+	npf_ioctl_ent_t *uents = NULL;
+	const char *name;
+	npf_table_t *t;
+	size_t nitems = 0;
+	uint64_t tid;
+	int type, error = 0;
+
+	name = dnvlist_get_string(req, "name", NULL);
+	tid = dnvlist_get_number(req, "id", UINT64_MAX);
+	type = dnvlist_get_number(req, "type", UINT64_MAX);
+	if (!name || (t = npf_tableset_getbyname(tblset, name)) == NULL ||
+	    npf_table_getid(t) != tid || npf_table_gettype(t) != type) {
+		NPF_ERR_DEBUG(resp);
+		return EINVAL;
+	}
+
+	if (nvlist_exists_nvlist_array(req, "entries")) {
+		entries = nvlist_get_nvlist_array(req, "entries", &nitems);
+	}
+	if (nitems) {
+		uents = kmem_alloc(nitems * sizeof(npf_ioctl_ent_t), KM_SLEEP);
+	}
+	for (unsigned i = 0; i < nitems; i++) {
+		const nvlist_t *entry = entries[i];
+		npf_ioctl_ent_t *uent = &uents[i];
+		const npf_addr_t *addr;
+		size_t alen;
+
+		addr = dnvlist_get_binary(entry, "addr", &alen, NULL, 0);
+		if (addr == NULL || alen == 0 || alen > sizeof(npf_addr_t)) {
+			NPF_ERR_DEBUG(resp);
+			error = EINVAL;
+			goto out;
+		}
+		memcpy(&uent->addr, addr, alen);
+		uent->alen = alen;
+		uent->mask = dnvlist_get_number(entry, "mask", NPF_NO_NETMASK);
+	}
+
+	error = npf_table_update(t, uents, nitems);
+	npf_table_gc(npf, t);
+	if (error) {
+		NPF_ERR_DEBUG(resp);
+	}
+out:
+	if (uents) {
+		kmem_free(uents, nitems * sizeof(npf_ioctl_ent_t));
+	}
+	return error;
+}
+
 /*
  * npfctl_table_replace: atomically replace a table's contents with
- * the passed table data.
+ * the passed table data.  If requested, update the table incrementally.
  */
 static int __noinline
 npfctl_table_replace(npf_t *npf, const nvlist_t *req, nvlist_t *resp)
@@ -648,6 +740,10 @@ npfctl_table_replace(npf_t *npf, const nvlist_t *req, nvlist_t *resp)
 	int error = 0;
 
 	nc = npf_config_enter(npf);
+	if (dnvlist_get_bool(req, "incremental", false)) {
+		error = npf_mk_table_update(npf, req, resp, nc->tableset);
+		goto err;
+	}
 	error = npf_mk_table(npf, req, resp, nc->tableset, &tbl, true);
 	if (error) {
 		goto err;
@@ -845,6 +941,9 @@ npfctl_run_op(npf_t *npf, unsigned op, const nvlist_t *req, nvlist_t *resp)
 	case IOC_NPF_CONN_LOOKUP:
 		error = npf_conn_find(npf, req, resp);
 		break;
+	case IOC_NPF_CONN_LIST:
+		error = npf_conndb_list(npf, req, resp);
+		break;
 	case IOC_NPF_TABLE_REPLACE:
 		error = npfctl_table_replace(npf, req, resp);
 		break;
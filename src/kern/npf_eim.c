@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * NPF endpoint-independent mapping (EIM) for NAT.
+ *
+ * Overview
+ *
+ *	By default, each NAT connection gets its own translation port,
+ *	i.e. the mapping is "address and port dependent".  With the
+ *	endpoint-independent mapping (RFC 4787, section 4.1), the same
+ *	translation address and port are reused for all connections from
+ *	the same original address and port (and the protocol), regardless
+ *	of the destination.  Therefore, a subscriber consumes one port
+ *	per socket rather than per connection.
+ *
+ *	The mapping entries are reference counted by the NAT entries of
+ *	the connections.  The translation port is allocated for the first
+ *	connection and released together with the last one.
+ *
+ * Concurrency
+ *
+ *	The mappings are kept in a hash table with a lock per bucket.
+ *	The bucket lock protects the entries and their reference counts.
+ */
+
+#ifdef _KERNEL
+#include <sys/cdefs.h>
+__KERNEL_RCSID(0, "$NetBSD$");
+
+#include <sys/param.h>
+#include <sys/types.h>
+
+#include <sys/kmem.h>
+#include <sys/mutex.h>
+#include <sys/systm.h>
+#endif
+
+#include "npf_impl.h"
+
+#define	EIM_HASH_BUCKETS	1024
+#define	EIM_HASH_MASK		(EIM_HASH_BUCKETS - 1)
+
+struct npf_eim_ent {
+	LIST_ENTRY(npf_eim_ent)	entry;
+	unsigned		refcnt;
+	uint16_t		alen;
+	uint16_t		proto;
+	in_port_t		oport;
+	in_port_t		tport;
+	npf_addr_t		oaddr;
+	npf_addr_t		taddr;
+};
+
+typedef struct {
+	kmutex_t		lock;
+	LIST_HEAD(, npf_eim_ent) list;
+} eim_bucket_t;
+
+struct npf_eim {
+	eim_bucket_t		buckets[EIM_HASH_BUCKETS];
+};
+
+npf_eim_t *
+npf_eim_create(void)
+{
+	npf_eim_t *eim;
+
+	eim = kmem_zalloc(sizeof(npf_eim_t), KM_SLEEP);
+	for (unsigned i = 0; i < EIM_HASH_BUCKETS; i++) {
+		eim_bucket_t *b = &eim->buckets[i];
+		mutex_init(&b->lock, MUTEX_DEFAULT, IPL_SOFTNET);
+		LIST_INIT(&b->list);
+	}
+	return eim;
+}
+
+/*
+ * npf_eim_destroy: destroy the mapping table.
+ *
+ * => The caller ensures there are no mappings, i.e. all the NAT
+ *    entries which referenced them are destroyed.
+ */
+void
+npf_eim_destroy(npf_eim_t *eim)
+{
+	for (unsigned i = 0; i < EIM_HASH_BUCKETS; i++) {
+		eim_bucket_t *b = &eim->buckets[i];
+		KASSERT(LIST_EMPTY(&b->list));
+		mutex_destroy(&b->lock);
+	}
+	kmem_free(eim, sizeof(npf_eim_t));
+}
+
+static eim_bucket_t *
+eim_getbucket(npf_eim_t *eim, unsigned alen, const npf_addr_t *oaddr,
+    in_port_t oport, unsigned proto)
+{
+	const uint32_t seed = 0x9e3779b9 ^ ((proto << 16) | oport);
+	const uint32_t hash = murmurhash2(oaddr, alen, seed);
+	return &eim->buckets[hash & EIM_HASH_MASK];
+}
+
+static npf_eim_ent_t *
+eim_lookup(eim_bucket_t *b, unsigned alen, const npf_addr_t *oaddr,
+    in_port_t oport, unsigned proto)
+{
+	npf_eim_ent_t *ent;
+
+	KASSERT(mutex_owned(&b->lock));
+	LIST_FOREACH(ent, &b->list, entry) {
+		if (ent->oport == oport && ent->proto == proto &&
+		    ent->alen == alen &&
+		    memcmp(&ent->oaddr, oaddr, alen) == 0) {
+			return ent;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * npf_eim_lookup: find the mapping of the original address and port
+ * and, if found, acquire a reference and return the translation address
+ * and port (in network byte-order).
+ */
+npf_eim_ent_t *
+npf_eim_lookup(npf_eim_t *eim, unsigned alen, const npf_addr_t *oaddr,
+    in_port_t oport, unsigned proto, npf_addr_t *taddr, in_port_t *tport)
+{
+	eim_bucket_t *b = eim_getbucket(eim, alen, oaddr, oport, proto);
+	npf_eim_ent_t *ent;
+
+	mutex_enter(&b->lock);
+	if ((ent = eim_lookup(b, alen, oaddr, oport, proto)) != NULL) {
+		ent->refcnt++;
+		memcpy(taddr, &ent->taddr, alen);
+		*tport = ent->tport;
+	}
+	mutex_exit(&b->lock);
+	return ent;
+}
+
+/*
+ * npf_eim_insert: create the mapping with the given translation address
+ * and port, holding the first reference.
+ *
+ * => If the mapping was created concurrently, then acquire a reference
+ *    on it and return its translation address and port instead; the
+ *    caller is responsible for releasing the port it has taken.
+ * => Returns NULL on allocation failure.
+ */
+npf_eim_ent_t *
+npf_eim_insert(npf_eim_t *eim, unsigned alen, const npf_addr_t *oaddr,
+    in_port_t oport, unsigned proto, npf_addr_t *taddr, in_port_t *tport)
+{
+	eim_bucket_t *b = eim_getbucket(eim, alen, oaddr, oport, proto);
+	npf_eim_ent_t *ent;
+
+	mutex_enter(&b->lock);
+	if ((ent = eim_lookup(b, alen, oaddr, oport, proto)) != NULL) {
+		ent->refcnt++;
+		memcpy(taddr, &ent->taddr, alen);
+		*tport = ent->tport;
+		goto out;
+	}
+	ent = kmem_intr_zalloc(sizeof(npf_eim_ent_t), KM_NOSLEEP);
+	if (ent == NULL) {
+		goto out;
+	}
+	ent->refcnt = 1;
+	ent->alen = alen;
+	ent->proto = proto;
+	ent->oport = oport;
+	ent->tport = *tport;
+	memcpy(&ent->oaddr, oaddr, alen);
+	memcpy(&ent->taddr, taddr, alen);
+	LIST_INSERT_HEAD(&b->list, ent, entry);
+out:
+	mutex_exit(&b->lock);
+	return ent;
+}
+
+/*
+ * npf_eim_put: release the reference on the mapping.
+ *
+ * => Returns true if it was the last reference and the mapping was
+ *    destroyed, i.e. the caller should release the translation port.
+ */
+bool
+npf_eim_put(npf_eim_t *eim, npf_eim_ent_t *ent)
+{
+	eim_bucket_t *b = eim_getbucket(eim, ent->alen, &ent->oaddr,
+	    ent->oport, ent->proto);
+	bool last;
+
+	mutex_enter(&b->lock);
+	KASSERT(ent->refcnt > 0);
+	last = --ent->refcnt == 0;
+	if (last) {
+		LIST_REMOVE(ent, entry);
+	}
+	mutex_exit(&b->lock);
+
+	if (last) {
+		kmem_intr_free(ent, sizeof(npf_eim_ent_t));
+	}
+	return last;
+}
+
+#if defined(DDB) || defined(_NPF_TESTING)
+
+unsigned
+npf_eim_getrefs(npf_eim_t *eim, unsigned alen, const npf_addr_t *oaddr,
+    in_port_t oport, unsigned proto)
+{
+	eim_bucket_t *b = eim_getbucket(eim, alen, oaddr, oport, proto);
+	npf_eim_ent_t *ent;
+	unsigned refcnt;
+
+	mutex_enter(&b->lock);
+	ent = eim_lookup(b, alen, oaddr, oport, proto);
+	refcnt = ent ? ent->refcnt : 0;
+	mutex_exit(&b->lock);
+	return refcnt;
+}
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * NPF event log: connection and NAT entry records.
+ *
+ * Overview
+ *
+ *	The creation and destruction of the connections and NAT entries
+ *	are recorded as fixed-size binary records (npf_event_t), e.g. to
+ *	meet the logging requirements for the carrier-grade NAT.  The
+ *	records are consumed in batches using npf_evlog_drain().
+ *
+ *	With the port block allocation (PBA), the assignment and release
+ *	of the blocks are recorded instead of the NAT entries; with the
+ *	deterministic NAT, the mapping is derived from the policy, so the
+ *	NAT entries are not recorded at all.
+ *
+ *	The records are kept in the per-CPU log rings (see npf_logring.c),
+ *	therefore the packet path never blocks.  If the ring is full, then
+ *	the record is dropped and accounted in the statistics.
+ */
+
+#ifdef _KERNEL
+#include <sys/cdefs.h>
+__KERNEL_RCSID(0, "$NetBSD$");
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/systm.h>
+#endif
+
+#include "npf_impl.h"
+#include "npf_conn.h"
+
+#define	EVLOG_NEVENTS		4096
+
+void
+npf_evlog_init(npf_t *npf)
+{
+	npf->evlog = npf_logring_create(EVLOG_NEVENTS, sizeof(npf_event_t));
+}
+
+void
+npf_evlog_fini(npf_t *npf)
+{
+	if (npf->evlog) {
+		npf_logring_destroy(npf->evlog);
+		npf->evlog = NULL;
+	}
+}
+
+/*
+ * npf_evlog_put: stamp the record and put it into the local ring.
+ */
+static void
+npf_evlog_put(npf_t *npf, npf_logring_t *lr, npf_event_t *ev)
+{
+	struct timespec ts;
+
+	getnanotime(&ts);
+	ev->ev_sec = ts.tv_sec;
+	ev->ev_nsec = ts.tv_nsec;
+
+	if (!npf_logring_put(lr, ev, sizeof(npf_event_t))) {
+		npf_stats_inc(npf, NPF_STAT_EVLOG_DROP);
+	}
+}
+
+static bool
+npf_evlog_setkey(npf_event_t *ev, npf_conn_t *con)
+{
+	const npf_connkey_t *key = npf_conn_getforwkey(con);
+	unsigned alen, proto;
+	npf_addr_t ips[2];
+	uint16_t ids[2];
+
+	if (NPF_CONNKEY_ALEN(key) == 0) {
+		/* The keys are not set, e.g. the import has failed. */
+		return false;
+	}
+	npf_connkey_getkey(key, &alen, &proto, ips, ids);
+	ev->ev_alen = alen;
+	ev->ev_proto = proto;
+	ev->ev_sport = ids[NPF_SRC];
+	ev->ev_dport = ids[NPF_DST];
+	memcpy(&ev->ev_saddr, &ips[NPF_SRC], alen);
+	memcpy(&ev->ev_daddr, &ips[NPF_DST], alen);
+	return true;
+}
+
+/*
+ * npf_evlog_conn: record the connection event.
+ */
+void
+npf_evlog_conn(npf_t *npf, unsigned type, npf_conn_t *con)
+{
+	npf_logring_t *lr = npf->evlog;
+	npf_event_t ev;
+
+	if (__predict_true(lr == NULL)) {
+		return;
+	}
+	memset(&ev, 0, sizeof(npf_event_t));
+	ev.ev_type = type;
+	if (npf_evlog_setkey(&ev, con)) {
+		npf_evlog_put(npf, lr, &ev);
+	}
+}
+
+/*
+ * npf_evlog_nat: record the NAT entry event, given its connection,
+ * the NAT type and the translation address and port.
+ */
+void
+npf_evlog_nat(npf_t *npf, unsigned type, npf_conn_t *con, unsigned ntype,
+    const npf_addr_t *taddr, in_port_t tport)
+{
+	npf_logring_t *lr = npf->evlog;
+	npf_event_t ev;
+
+	if (__predict_true(lr == NULL)) {
+		return;
+	}
+	memset(&ev, 0, sizeof(npf_event_t));
+	ev.ev_type = type;
+	ev.ev_nat = ntype;
+	if (npf_evlog_setkey(&ev, con)) {
+		memcpy(&ev.ev_taddr, taddr, ev.ev_alen);
+		ev.ev_tport = tport;
+		npf_evlog_put(npf, lr, &ev);
+	}
+}
+
+/*
+ * npf_evlog_block: record the port block event, given the NAT type, the
+ * original and translation addresses, the first port and the number of
+ * ports in the block.
+ */
+void
+npf_evlog_block(npf_t *npf, unsigned type, unsigned ntype, unsigned alen,
+    const npf_addr_t *oaddr, const npf_addr_t *taddr, in_port_t port,
+    unsigned nports)
+{
+	npf_logring_t *lr = npf->evlog;
+	npf_event_t ev;
+
+	if (__predict_true(lr == NULL)) {
+		return;
+	}
+	memset(&ev, 0, sizeof(npf_event_t));
+	ev.ev_type = type;
+	ev.ev_nat = ntype;
+	ev.ev_alen = alen;
+	memcpy(&ev.ev_saddr, oaddr, alen);
+	memcpy(&ev.ev_taddr, taddr, alen);
+	ev.ev_tport = port;
+	ev.ev_nports = nports;
+	npf_evlog_put(npf, lr, &ev);
+}
+
+/*
+ * npf_evlog_drain: move up to the given number of records from the
+ * rings into the buffer; returns the number of records.
+ */
+size_t
+npf_evlog_drain(npf_t *npf, npf_event_t *buf, size_t count)
+{
+	npf_logring_t *lr = npf->evlog;
+
+	if (lr == NULL) {
+		return 0;
+	}
+	return npf_logring_drain(lr, buf, sizeof(npf_event_t), count);
+}
@@ -38,6 +38,7 @@ static void *		npf_ext_log_id;
 
 typedef struct {
 	unsigned int	if_idx;
+	npf_logcap_t	cap;
 } npf_ext_log_t;
 
 static int
@@ -47,6 +48,7 @@ npf_log_ctor(npf_rproc_t *rp, const nvlist_t *params)
 
 	meta = kmem_zalloc(sizeof(npf_ext_log_t), KM_SLEEP);
 	meta->if_idx = dnvlist_get_number(params, "log-interface", 0);
+	npf_logcap_init(&meta->cap, params);
 	npf_rproc_assign(rp, meta);
 	return 0;
 }
@@ -61,11 +63,16 @@ static bool
 npf_log(npf_cache_t *npc, void *meta, const npf_match_info_t *mi, int *decision)
 {
 	struct mbuf *m = nbuf_head_mbuf(npc->npc_nbuf);
-	const npf_ext_log_t *log = meta;
+	npf_ext_log_t *log = meta;
 	struct psref psref;
 	ifnet_t *ifp;
 	struct npfloghdr hdr;
 
+	/* Sampling and the rate cap, if configured. */
+	if (!npf_logcap_pass(npc, &log->cap)) {
+		return true;
+	}
+
 	memset(&hdr, 0, sizeof(hdr));
 	/* Set the address family. */
 	if (npf_iscached(npc, NPC_IP4)) {
@@ -81,8 +88,12 @@ npf_log(npf_cache_t *npc, void *meta, const npf_match_info_t *mi, int *decision)
 	    0 /* pass */ : 1 /* block */;
 	hdr.reason = 0;	/* match */
 
+	/*
+	 * Note: do not take the interface map lock for every logged
+	 * packet; the lock-free copy is sufficient for logging.
+	 */
 	struct nbuf *nb = npc->npc_nbuf;
-	npf_ifmap_copyname(npc->npc_ctx, nb ? nb->nb_ifid : 0,
+	npf_ifmap_copylogname(npc->npc_ctx, nb ? nb->nb_ifid : 0,
 	    hdr.ifname, sizeof(hdr.ifname));
 
 	hdr.rulenr = htonl((uint32_t)mi->mi_rid);
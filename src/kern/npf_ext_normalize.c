@@ -81,7 +81,7 @@ npf_normalize_dtor(npf_rproc_t *rp, void *params)
  * clear "don't fragment" and/or enforce minimum TTL).
  */
 static inline void
-npf_normalize_ip4(npf_cache_t *npc, npf_normalize_t *np)
+npf_normalize_ip4(npf_cache_t *npc, npf_normalize_t *np, unsigned offload)
 {
 	struct ip *ip = npc->npc_ip.v4;
 	uint16_t cksum = ip->ip_sum;
@@ -114,8 +114,10 @@ npf_normalize_ip4(npf_cache_t *npc, npf_normalize_t *np)
 		ip->ip_ttl = minttl;
 	}
 
-	/* Update IPv4 checksum. */
-	ip->ip_sum = cksum;
+	/* Update IPv4 checksum, unless it is computed on transmit. */
+	if ((offload & NPF_CKSUM_IPV4) == 0) {
+		ip->ip_sum = cksum;
+	}
 }
 
 /*
@@ -128,6 +130,7 @@ npf_normalize(npf_cache_t *npc, void *params, const npf_match_info_t *mi,
 	npf_normalize_t *np = params;
 	uint16_t cksum, mss, maxmss = np->n_maxmss;
 	uint16_t old[2], new[2];
+	unsigned offload, rwr = 0;
 	struct tcphdr *th;
 	int wscale;
 	bool mid;
@@ -136,10 +139,12 @@ npf_normalize(npf_cache_t *npc, void *params, const npf_match_info_t *mi,
 	if (*decision == NPF_DECISION_BLOCK) {
 		return true;
 	}
+	offload = npf_cksum_offload(npc);
 
 	/* Normalize IPv4.  Nothing to do for IPv6. */
 	if (npf_iscached(npc, NPC_IP4) && (np->n_random_id || np->n_minttl)) {
-		npf_normalize_ip4(npc, np);
+		npf_normalize_ip4(npc, np, offload);
+		rwr |= NPF_CKSUM_IPV4;
 	}
 	th = npc->npc_l4.tcp;
 
@@ -150,15 +155,15 @@ npf_normalize(npf_cache_t *npc, void *params, const npf_match_info_t *mi,
 	if (maxmss == 0 || !npf_iscached(npc, NPC_TCP) ||
 	    (th->th_flags & TH_SYN) == 0) {
 		/* Not required; done. */
-		return true;
+		goto out;
 	}
 	mss = 0;
 	if (!npf_fetch_tcpopts(npc, &mss, &wscale)) {
-		return true;
+		goto out;
 	}
 	if (ntohs(mss) <= maxmss) {
 		/* Nothing else to do. */
-		return true;
+		goto out;
 	}
 	maxmss = htons(maxmss);
 
@@ -169,7 +174,11 @@ npf_normalize(npf_cache_t *npc, void *params, const npf_match_info_t *mi,
 	 *
 	 * WARNING: must re-fetch the TCP header after the modification.
 	 */
-	if (npf_set_mss(npc, maxmss, old, new, &mid) &&
+	if (!npf_set_mss(npc, maxmss, old, new, &mid)) {
+		goto out;
+	}
+	rwr |= NPF_CKSUM_TCP;
+	if ((offload & NPF_CKSUM_TCP) == 0 &&
 	    !nbuf_cksum_barrier(npc->npc_nbuf, mi->mi_di)) {
 		th = npc->npc_l4.tcp;
 		if (mid) {
@@ -181,7 +190,11 @@ npf_normalize(npf_cache_t *npc, void *params, const npf_match_info_t *mi,
 		}
 		th->th_sum = cksum;
 	}
-
+out:
+	/* The rewritten checksums which are computed on transmit. */
+	if ((offload &= rwr) != 0) {
+		nbuf_cksum_offload_set(npc->npc_ctx, npc->npc_nbuf, offload);
+	}
 	return true;
 }
 
@@ -0,0 +1,384 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * NPF packet logging extension, which does not depend on the npflog
+ * interface and bpf(4), i.e. can be used with the standalone NPF.
+ *
+ * The first 'snaplen' bytes of the packet are copied, together with
+ * the rule ID, the decision and the interface, into the per-CPU log
+ * rings of the NPF instance (see npf_logring.c).  The records are
+ * consumed in batches using npf_ext_pktlog_drain() or written out in
+ * the pcap format, with the pflog (npflog) header, by
+ * npf_ext_pktlog_pcap_write().
+ *
+ * Note: the interface ID is resolved to the name on drain, rather
+ * than on every logged packet.
+ */
+
+#ifdef _KERNEL
+#include <sys/cdefs.h>
+__KERNEL_RCSID(0, "$NetBSD$");
+
+#include <sys/types.h>
+#include <sys/module.h>
+#include <sys/kmem.h>
+#endif
+
+#include "npf.h"
+#include "npf_impl.h"
+
+#if defined(_NPF_STANDALONE)
+#include <unistd.h>
+#endif
+
+NPF_EXT_MODULE(npf_ext_pktlog, "");
+
+#define	NPFEXT_PKTLOG_VER	1
+
+#define	PKTLOG_NRECS		1024
+#define	PKTLOG_SNAPLEN		128
+
+static void *		npf_ext_pktlog_id;
+
+typedef struct {
+	unsigned	snaplen;
+	npf_logcap_t	cap;
+} npf_ext_pktlog_t;
+
+static int
+npf_pktlog_ctor(npf_rproc_t *rp, const nvlist_t *params)
+{
+	npf_ext_pktlog_t *meta;
+	uint64_t snaplen;
+
+	snaplen = dnvlist_get_number(params, "snaplen", PKTLOG_SNAPLEN);
+	if (snaplen == 0 || snaplen > NPF_PKTLOG_SNAPLEN) {
+		snaplen = NPF_PKTLOG_SNAPLEN;
+	}
+	meta = kmem_zalloc(sizeof(npf_ext_pktlog_t), KM_SLEEP);
+	meta->snaplen = snaplen;
+	npf_logcap_init(&meta->cap, params);
+	npf_rproc_assign(rp, meta);
+	return 0;
+}
+
+static void
+npf_pktlog_dtor(npf_rproc_t *rp, void *meta)
+{
+	kmem_free(meta, sizeof(npf_ext_pktlog_t));
+}
+
+static bool
+npf_pktlog(npf_cache_t *npc, void *meta, const npf_match_info_t *mi,
+    int *decision)
+{
+	npf_ext_pktlog_t *pl = meta;
+	const nbuf_t *nbuf = npc->npc_nbuf;
+	npf_t *npf = npc->npc_ctx;
+	npf_pktlog_t rec;
+	struct timespec ts;
+
+	/* Sampling and the rate cap, if configured. */
+	if (!npf_logcap_pass(npc, &pl->cap)) {
+		return true;
+	}
+
+	memset(&rec, 0, offsetof(npf_pktlog_t, pl_data));
+	getnanotime(&ts);
+	rec.pl_sec = ts.tv_sec;
+	rec.pl_nsec = ts.tv_nsec;
+	rec.pl_rid = mi->mi_rid;
+
+	if (npf_iscached(npc, NPC_IP4)) {
+		rec.pl_af = AF_INET;
+	} else if (npf_iscached(npc, NPC_IP6)) {
+		rec.pl_af = AF_INET6;
+	} else {
+		rec.pl_af = AF_UNSPEC;
+	}
+	rec.pl_action = *decision == NPF_DECISION_PASS ?
+	    0 /* pass */ : 1 /* block */;
+	rec.pl_dir = mi->mi_di;
+	rec.pl_ifid = nbuf->nb_ifid;
+
+	rec.pl_len = nbuf_datalen(nbuf);
+	rec.pl_caplen = nbuf_copydata(nbuf, rec.pl_data, pl->snaplen);
+
+	if (!npf_logring_put(npf->pktlog, &rec,
+	    offsetof(npf_pktlog_t, pl_data[rec.pl_caplen]))) {
+		npf_stats_inc(npf, NPF_STAT_PKTLOG_DROP);
+	}
+	return true;
+}
+
+/*
+ * npf_ext_pktlog_drain: move up to the given number of the packet log
+ * records into the buffer; returns the number of records.
+ */
+__dso_public size_t
+npf_ext_pktlog_drain(npf_t *npf, npf_pktlog_t *buf, size_t count)
+{
+	size_t n;
+
+	if (npf->pktlog == NULL) {
+		return 0;
+	}
+	n = npf_logring_drain(npf->pktlog, buf,
+	    sizeof(npf_pktlog_t), count);
+	for (size_t i = 0; i < n; i++) {
+		npf_ifmap_copyname(npf, buf[i].pl_ifid,
+		    buf[i].pl_ifname, sizeof(buf[i].pl_ifname));
+	}
+	return n;
+}
+
+#if defined(_NPF_STANDALONE)
+
+/*
+ * The pcap file format with the pflog link-layer header, which is
+ * also used by the npflog interface (see if_npflog.h).
+ */
+
+#define	PCAP_MAGIC		0xa1b2c3d4
+#define	PCAP_LINKTYPE_PFLOG	117
+
+/* The address family values expected by the pflog decoders. */
+#define	PFLOG_AF_INET		2
+#define	PFLOG_AF_INET6		24
+
+struct pcap_filehdr {
+	uint32_t	magic;
+	uint16_t	version_major;
+	uint16_t	version_minor;
+	int32_t		thiszone;
+	uint32_t	sigfigs;
+	uint32_t	snaplen;
+	uint32_t	linktype;
+};
+
+struct pcap_pkthdr {
+	uint32_t	ts_sec;
+	uint32_t	ts_usec;
+	uint32_t	caplen;
+	uint32_t	len;
+};
+
+struct pcap_pfloghdr {
+	uint8_t		length;
+	uint8_t		af;
+	uint8_t		action;
+	uint8_t		reason;
+	char		ifname[16];
+	char		ruleset[16];
+	uint32_t	rulenr;
+	uint32_t	subrulenr;
+	uint32_t	uid;
+	uint32_t	pid;
+	uint32_t	rule_uid;
+	uint32_t	rule_pid;
+	uint8_t		dir;
+	uint8_t		pad[3];
+};
+
+#define	PKTLOG_BATCH		32
+#define	PCAP_RECLEN_MAX		(sizeof(struct pcap_pkthdr) + \
+				    sizeof(struct pcap_pfloghdr) + \
+				    NPF_PKTLOG_SNAPLEN)
+
+static int
+pktlog_write(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	size_t off = 0;
+
+	while (off < len) {
+		ssize_t ret = write(fd, p + off, len - off);
+		if (ret == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		off += ret;
+	}
+	return 0;
+}
+
+/*
+ * npf_ext_pktlog_pcap_header: write the pcap file header.
+ *
+ * => Returns 0 on success or -1 on error.
+ */
+__dso_public int
+npf_ext_pktlog_pcap_header(int fd)
+{
+	struct pcap_filehdr hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = PCAP_MAGIC;
+	hdr.version_major = 2;
+	hdr.version_minor = 4;
+	hdr.snaplen = sizeof(struct pcap_pfloghdr) + NPF_PKTLOG_SNAPLEN;
+	hdr.linktype = PCAP_LINKTYPE_PFLOG;
+	return pktlog_write(fd, &hdr, sizeof(hdr));
+}
+
+static void
+pktlog_pcap_hdrs(const npf_pktlog_t *rec, struct pcap_pkthdr *ph,
+    struct pcap_pfloghdr *lh)
+{
+	ph->ts_sec = rec->pl_sec;
+	ph->ts_usec = rec->pl_nsec / 1000;
+	ph->caplen = sizeof(struct pcap_pfloghdr) + rec->pl_caplen;
+	ph->len = sizeof(struct pcap_pfloghdr) + rec->pl_len;
+
+	memset(lh, 0, sizeof(struct pcap_pfloghdr));
+	lh->length = offsetof(struct pcap_pfloghdr, pad);
+	switch (rec->pl_af) {
+	case AF_INET:
+		lh->af = PFLOG_AF_INET;
+		break;
+	case AF_INET6:
+		lh->af = PFLOG_AF_INET6;
+		break;
+	}
+	lh->action = rec->pl_action;
+	lh->reason = 0; /* match */
+	strlcpy(lh->ifname, rec->pl_ifname, sizeof(lh->ifname));
+	strlcpy(lh->ruleset, "rules", sizeof(lh->ruleset));
+	lh->rulenr = htonl((uint32_t)rec->pl_rid);
+	lh->subrulenr = htonl((uint32_t)(rec->pl_rid >> 32));
+	lh->uid = lh->rule_uid = UINT32_MAX;
+	lh->pid = lh->rule_pid = UINT32_MAX;
+
+	switch (rec->pl_dir) {
+	case PFIL_IN:
+		lh->dir = 1;
+		break;
+	case PFIL_OUT:
+		lh->dir = 2;
+		break;
+	default:
+		lh->dir = 0;
+		break;
+	}
+}
+
+/*
+ * npf_ext_pktlog_pcap_write: drain the packet log and write the records
+ * as the pcap packet records; the file header must be already written
+ * using npf_ext_pktlog_pcap_header().
+ *
+ * => Returns the number of records written or -1 on error.
+ */
+__dso_public int
+npf_ext_pktlog_pcap_write(npf_t *npf, int fd)
+{
+	const size_t recslen = sizeof(npf_pktlog_t) * PKTLOG_BATCH;
+	const size_t buflen = PKTLOG_BATCH * PCAP_RECLEN_MAX;
+	npf_pktlog_t *recs;
+	size_t n, total = 0;
+	uint8_t *buf;
+	int ret = -1;
+
+	recs = kmem_alloc(recslen, KM_SLEEP);
+	buf = kmem_alloc(buflen, KM_SLEEP);
+
+	while ((n = npf_ext_pktlog_drain(npf, recs, PKTLOG_BATCH)) != 0) {
+		size_t len = 0;
+
+		/* Serialise the batch and write it out at once. */
+		for (size_t i = 0; i < n; i++) {
+			const npf_pktlog_t *rec = &recs[i];
+			struct pcap_pfloghdr lh;
+			struct pcap_pkthdr ph;
+
+			pktlog_pcap_hdrs(rec, &ph, &lh);
+			memcpy(&buf[len], &ph, sizeof(ph));
+			len += sizeof(ph);
+			memcpy(&buf[len], &lh, sizeof(lh));
+			len += sizeof(lh);
+			memcpy(&buf[len], rec->pl_data, rec->pl_caplen);
+			len += rec->pl_caplen;
+		}
+		if (pktlog_write(fd, buf, len) == -1) {
+			goto out;
+		}
+		total += n;
+		if (n < PKTLOG_BATCH) {
+			break;
+		}
+	}
+	ret = total;
+out:
+	kmem_free(buf, buflen);
+	kmem_free(recs, recslen);
+	return ret;
+}
+
+#endif
+
+__dso_public int
+npf_ext_pktlog_init(npf_t *npf)
+{
+	static const npf_ext_ops_t npf_pktlog_ops = {
+		.version	= NPFEXT_PKTLOG_VER,
+		.ctx		= NULL,
+		.ctor		= npf_pktlog_ctor,
+		.dtor		= npf_pktlog_dtor,
+		.proc		= npf_pktlog
+	};
+	npf_logring_t *pktlog;
+	void *id;
+
+	/*
+	 * Note: if already registered, then the ring and the ID in use
+	 * must be retained; they are assigned only on success.
+	 */
+	pktlog = npf_logring_create(PKTLOG_NRECS, sizeof(npf_pktlog_t));
+	if ((id = npf_ext_register(npf, "pktlog", &npf_pktlog_ops)) == NULL) {
+		npf_logring_destroy(pktlog);
+		return EEXIST;
+	}
+	npf->pktlog = pktlog;
+	npf_ext_pktlog_id = id;
+	return 0;
+}
+
+__dso_public int
+npf_ext_pktlog_fini(npf_t *npf)
+{
+	int error;
+
+	if ((error = npf_ext_unregister(npf, npf_ext_pktlog_id)) != 0) {
+		return error;
+	}
+	npf_logring_destroy(npf->pktlog);
+	npf->pktlog = NULL;
+	return 0;
+}
+
+#ifdef _KERNEL
+static int
+npf_ext_pktlog_modcmd(modcmd_t cmd, void *arg)
+{
+	npf_t *npf = npf_getkernctx();
+
+	switch (cmd) {
+	case MODULE_CMD_INIT:
+		return npf_ext_pktlog_init(npf);
+	case MODULE_CMD_FINI:
+		return npf_ext_pktlog_fini(npf);
+	case MODULE_CMD_AUTOUNLOAD:
+		return npf_autounload_p() ? 0 : EBUSY;
+	default:
+		return ENOTTY;
+	}
+	return 0;
+}
+#endif
@@ -15,6 +15,38 @@
  * Reference:
  *
  *	S. Vegesna, 2001, IP Quality of Service; Cisco Press; pages 36-37.
+ *
+ * Concurrency
+ *
+ *	The token bucket is protected by the lock, but the CPUs do not
+ *	take it for every packet.  Instead, each CPU borrows a batch of
+ *	tokens (at most the tokens of a millisecond) from the committed
+ *	bucket and consumes them locally.  The leftover tokens are returned
+ *	to the bucket when the batch is no longer sufficient, therefore the
+ *	tokens are never lost or created; however, the tokens borrowed by
+ *	the idle CPUs may be unavailable for the others.
+ *
+ *	When the packet is dropped because the actual debt is too large,
+ *	it remains too large until the next refill.  Therefore, the CPU
+ *	remembers the debt and drops such packets without taking the lock
+ *	for the rest of the time unit.
+ *
+ * Keyed buckets
+ *
+ *	Optionally, there is a separate bucket per source address,
+ *	destination address or flow (the 5-tuple), e.g. to limit each
+ *	source to the given rate using a single rule.  The buckets are
+ *	kept in a fixed-size set-associative table, therefore the memory
+ *	use is bounded by the configured number of buckets.  A key which
+ *	is not in the table takes the least recently used bucket of its
+ *	set.  The bucket which was idle long enough to refill is virtually
+ *	the same as a new one, therefore no separate expiration is needed;
+ *	only the buckets of the active keys are lost if the table is too
+ *	small.
+ *	Each set has its own lock.
+ *
+ *	The rate can also be given in packets rather than bits: in such
+ *	case, a token is a thousandth of a packet.
  */
 
 #ifdef _KERNEL
@@ -25,6 +57,8 @@ __KERNEL_RCSID(0, "$NetBSD$");
 #include <sys/module.h>
 #include <sys/kmem.h>
 #include <sys/mutex.h>
+#include <sys/percpu.h>
+#include <sys/cprng.h>
 #endif
 
 #include "npf.h"
@@ -62,37 +96,141 @@ typedef struct {
 	uint64_t	ebs;
 } car_state_t;
 
+/*
+ * Per-CPU state: the borrowed tokens and, if the last packet was
+ * certainly red, the remaining room of the extended burst and the time
+ * until which it is valid.
+ */
+typedef struct {
+	uint64_t	credit;
+	uint64_t	red_until;
+	uint64_t	red_room;
+} car_cache_t;
+
+/*
+ * The key of a bucket: the addresses, the ports and the protocol,
+ * depending on the key type.  Zero length means the slot is free.
+ */
+typedef struct {
+	uint32_t	addr[2][4];
+	uint16_t	port[2];
+	uint8_t		proto;
+	uint8_t		alen;
+	uint8_t		pad[2];
+} car_key_t;
+
+#define	CAR_KEY_NONE	0
+#define	CAR_KEY_SRC	1
+#define	CAR_KEY_DST	2
+#define	CAR_KEY_FLOW	3
+
+#define	CAR_SET_WAYS	4
+#define	CAR_BUCKETS_DEF	4096
+#define	CAR_BUCKETS_MAX	(1U << 20)
+
 typedef struct {
+	car_key_t	key;
 	car_state_t	car;
+} car_slot_t;
+
+typedef struct {
 	kmutex_t	lock;
+	car_slot_t	slots[CAR_SET_WAYS];
+} car_set_t;
+
+typedef struct {
+	car_state_t	car;
+	kmutex_t	lock;
+	uint64_t	batch;
+	percpu_t *	cache_percpu;
+
+	/* Packet cost in tokens, if the rate is in packets. */
+	unsigned	pkt_cost;
+
+	/* Keyed buckets. */
+	unsigned	key_type;
+	uint32_t	key_seed;
+	unsigned	nsets;
+	car_set_t *	sets;
 } npf_ext_ratelimit_t;
 
 #define	MSEC_IN_SEC	(1000)
 
+/* The batch of tokens borrowed by a CPU, as a fraction of the CBS. */
+#define	CAR_BATCH_SHIFT	4
+
+static int
+npf_ext_ratelimit_keytype(const nvlist_t *params)
+{
+	const char *key = dnvlist_get_string(params, "key", NULL);
+
+	if (key == NULL) {
+		return CAR_KEY_NONE;
+	}
+	if (strcmp(key, "src") == 0) {
+		return CAR_KEY_SRC;
+	}
+	if (strcmp(key, "dst") == 0) {
+		return CAR_KEY_DST;
+	}
+	if (strcmp(key, "flow") == 0) {
+		return CAR_KEY_FLOW;
+	}
+	return -1;
+}
+
+static void
+npf_ext_ratelimit_keyinit(npf_ext_ratelimit_t *rl, uint64_t nbuckets)
+{
+	nbuckets = MIN(MAX(nbuckets, CAR_SET_WAYS), CAR_BUCKETS_MAX);
+
+	rl->nsets = 1;
+	while (rl->nsets * CAR_SET_WAYS < nbuckets) {
+		rl->nsets <<= 1;
+	}
+	rl->sets = kmem_zalloc(sizeof(car_set_t) * rl->nsets, KM_SLEEP);
+	for (unsigned i = 0; i < rl->nsets; i++) {
+		mutex_init(&rl->sets[i].lock, MUTEX_DEFAULT, IPL_SOFTNET);
+	}
+	rl->key_seed = cprng_fast32();
+}
+
 static int
 npf_ext_ratelimit_ctor(npf_rproc_t *rproc, const nvlist_t *params)
 {
 	npf_ext_ratelimit_t *rl;
+	uint64_t rate, unit = 1;
 	car_state_t *car;
-	uint64_t bitrate;
+	int key_type;
+
+	if ((key_type = npf_ext_ratelimit_keytype(params)) == -1) {
+		return EINVAL;
+	}
 
 	rl = kmem_zalloc(sizeof(npf_ext_ratelimit_t), KM_SLEEP);
 	mutex_init(&rl->lock, MUTEX_DEFAULT, IPL_SOFTNET);
 	car = &rl->car;
 
 	/*
-	 * Get the bit rate (CIR).
+	 * Get the bit rate (CIR) in bytes or, if the packet rate is
+	 * given, in the thousandths of a packet.
 	 *
 	 * It is normalized to the number of tokens in a millisecond.
 	 * Note: millisecond-level resolution is sufficient to handle
 	 * kilobits.  Rate limiting at less than a kilobit has little
 	 * practical use and is not supported.
 	 */
-	bitrate = dnvlist_get_number(params, "bitrate", 0);
-	car->cir_tok = (bitrate >> 3) / MSEC_IN_SEC;
+	if ((rate = dnvlist_get_number(params, "packet-rate", 0)) != 0) {
+		rl->pkt_cost = MSEC_IN_SEC;
+		unit = MSEC_IN_SEC;
+		rate *= unit;
+	} else {
+		rate = dnvlist_get_number(params, "bitrate", 0) >> 3;
+	}
+	car->cir_tok = rate / MSEC_IN_SEC;
 
-	car->cbs = dnvlist_get_number(params, "normal-burst", 0);
-	car->ebs = dnvlist_get_number(params, "extended-burst", 0);
+	car->cbs = dnvlist_get_number(params, "normal-burst", 0) * unit;
+	car->ebs = dnvlist_get_number(params, "extended-burst", 0) * unit;
 
 	/*
 	 * Industry-standard defaults:
@@ -100,16 +238,29 @@ npf_ext_ratelimit_ctor(npf_rproc_t *rproc, const nvlist_t *params)
 	 * normal burst (CBS) = bit-rate * (1-byte / 8-bits) * 1.5 second
 	 * extended burst (EBS) = 2 * normal burst
 	 *
-	 * Note: buckets are in bytes, hence the division by 8.
+	 * Note: buckets are in bytes (or fractions of a packet), hence
+	 * the rate was divided by 8.
 	 */
 
 	if (!car->cbs) {
-		car->cbs = (bitrate >> 3) + (bitrate >> 4);
+		car->cbs = rate + (rate >> 1);
 	}
 	if (!car->ebs) {
 		car->ebs = car->cbs * 2;
 	}
 
+	/*
+	 * The batch is limited by the tokens of a time unit, so that
+	 * the tokens held by the CPUs are a small part of the burst.
+	 */
+	rl->batch = MIN(car->cir_tok, car->cbs >> CAR_BATCH_SHIFT);
+	rl->cache_percpu = percpu_alloc(sizeof(car_cache_t));
+
+	if ((rl->key_type = key_type) != CAR_KEY_NONE) {
+		npf_ext_ratelimit_keyinit(rl, dnvlist_get_number(params,
+		    "buckets", CAR_BUCKETS_DEF));
+	}
+
 	npf_rproc_assign(rproc, rl);
 	return 0;
 }
@@ -119,6 +270,13 @@ npf_ext_ratelimit_dtor(npf_rproc_t *rproc, void *meta)
 {
 	npf_ext_ratelimit_t *rl = meta;
 
+	if (rl->sets) {
+		for (unsigned i = 0; i < rl->nsets; i++) {
+			mutex_destroy(&rl->sets[i].lock);
+		}
+		kmem_free(rl->sets, sizeof(car_set_t) * rl->nsets);
+	}
+	percpu_free(rl->cache_percpu, sizeof(car_cache_t));
 	mutex_destroy(&rl->lock);
 	kmem_free(rl, sizeof(npf_ext_ratelimit_t));
 }
@@ -205,6 +363,146 @@ car_ratelimit(car_state_t *car, const uint64_t tsnow, const size_t nbytes)
 	return true; // yellow
 }
 
+/*
+ * car_ratelimit_cached: run the CAR algorithm using the tokens borrowed
+ * by the current CPU, if possible; otherwise, take the lock.
+ */
+static bool
+car_ratelimit_cached(npf_ext_ratelimit_t *rl, const uint64_t tsnow,
+    const size_t nbytes)
+{
+	car_state_t *car = &rl->car;
+	car_cache_t *cc;
+	bool ok;
+
+	int s = splsoftnet();
+	cc = percpu_getref(rl->cache_percpu);
+	if (__predict_true(cc->credit >= nbytes)) {
+		/* Green, using the borrowed tokens. */
+		cc->credit -= nbytes;
+		ok = true;
+		goto out;
+	}
+	if (tsnow < cc->red_until && nbytes > cc->red_room) {
+		/* Certainly red: the debt cannot decrease until refill. */
+		ok = false;
+		goto out;
+	}
+
+	mutex_enter(&rl->lock);
+
+	/* Return the leftover tokens. */
+	car->tc += cc->credit;
+	cc->credit = 0;
+
+	ok = car_ratelimit(car, tsnow, nbytes);
+	if (ok && car->tc > 0) {
+		/* Borrow the next batch. */
+		cc->credit = MIN((uint64_t)car->tc, rl->batch);
+		car->tc -= cc->credit;
+	}
+	if (!ok && (int64_t)nbytes - car->tc > (int64_t)car->ebs) {
+		cc->red_until = tsnow + 1;
+		cc->red_room = car->ebs + car->tc;
+	}
+	mutex_exit(&rl->lock);
+out:
+	percpu_putref(rl->cache_percpu);
+	splx(s);
+	return ok;
+}
+
+/*
+ * car_getkey: get the bucket key of the packet.
+ *
+ * => Returns false if the packet has no such key, e.g. not IP.
+ */
+static bool
+car_getkey(const npf_ext_ratelimit_t *rl, const npf_cache_t *npc,
+    car_key_t *key)
+{
+	const unsigned alen = npc->npc_alen;
+
+	if (!npf_iscached(npc, NPC_IP46)) {
+		return false;
+	}
+	memset(key, 0, sizeof(car_key_t));
+	key->alen = alen;
+
+	switch (rl->key_type) {
+	case CAR_KEY_SRC:
+		memcpy(key->addr[0], npc->npc_ips[NPF_SRC], alen);
+		break;
+	case CAR_KEY_DST:
+		memcpy(key->addr[0], npc->npc_ips[NPF_DST], alen);
+		break;
+	case CAR_KEY_FLOW:
+		memcpy(key->addr[0], npc->npc_ips[NPF_SRC], alen);
+		memcpy(key->addr[1], npc->npc_ips[NPF_DST], alen);
+		key->proto = npc->npc_proto;
+		if (npf_iscached(npc, NPC_TCP)) {
+			const struct tcphdr *th = npc->npc_l4.tcp;
+			key->port[0] = th->th_sport;
+			key->port[1] = th->th_dport;
+		} else if (npf_iscached(npc, NPC_UDP)) {
+			const struct udphdr *uh = npc->npc_l4.udp;
+			key->port[0] = uh->uh_sport;
+			key->port[1] = uh->uh_dport;
+		}
+		break;
+	default:
+		KASSERT(false);
+	}
+	return true;
+}
+
+/*
+ * car_ratelimit_keyed: run the CAR algorithm using the bucket of the
+ * packet key, taking the least recently used one of the set, if there
+ * is no bucket for the key.
+ */
+static bool
+car_ratelimit_keyed(npf_ext_ratelimit_t *rl, const npf_cache_t *npc,
+    const uint64_t tsnow, const size_t nbytes)
+{
+	car_slot_t *slot = NULL;
+	car_set_t *set;
+	car_key_t key;
+	uint32_t hash;
+	bool ok;
+
+	if (!car_getkey(rl, npc, &key)) {
+		return car_ratelimit_cached(rl, tsnow, nbytes);
+	}
+	hash = murmurhash2(&key, sizeof(car_key_t), rl->key_seed);
+	set = &rl->sets[hash & (rl->nsets - 1)];
+
+	mutex_enter(&set->lock);
+	for (unsigned i = 0; i < CAR_SET_WAYS; i++) {
+		car_slot_t *s = &set->slots[i];
+
+		if (memcmp(&s->key, &key, sizeof(car_key_t)) == 0) {
+			slot = s;
+			break;
+		}
+		if (!slot || s->key.alen == 0 ||
+		    (slot->key.alen && s->car.tslast < slot->car.tslast)) {
+			slot = s;
+		}
+	}
+	if (memcmp(&slot->key, &key, sizeof(car_key_t)) != 0) {
+		/* New bucket: full, since the last refill was long ago. */
+		memcpy(&slot->key, &key, sizeof(car_key_t));
+		memcpy(&slot->car, &rl->car, sizeof(car_state_t));
+		slot->car.tc = 0;
+		slot->car.compounded = 0;
+		slot->car.tslast = 0;
+	}
+	ok = car_ratelimit(&slot->car, tsnow, nbytes);
+	mutex_exit(&set->lock);
+	return ok;
+}
+
 static bool
 npf_ext_ratelimit(npf_cache_t *npc, void *meta, const npf_match_info_t *mi,
     int *decision)
@@ -218,18 +516,18 @@ npf_ext_ratelimit(npf_cache_t *npc, void *meta, const npf_match_info_t *mi,
 	if (*decision == NPF_DECISION_BLOCK) {
 		return true;
 	}
-	pktlen = nbuf_datalen(npc->npc_nbuf);
+	pktlen = rl->pkt_cost ? rl->pkt_cost : nbuf_datalen(npc->npc_nbuf);
 
 	/* Get the current time and convert to milliseconds. */
 	getnanouptime(&ts);
 	ts_msec = (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
 
 	/* Run the rate-limiting algorithm. */
-	mutex_enter(&rl->lock);
-	if (!car_ratelimit(&rl->car, ts_msec, pktlen)) {
+	if (rl->key_type != CAR_KEY_NONE ?
+	    !car_ratelimit_keyed(rl, npc, ts_msec, pktlen) :
+	    !car_ratelimit_cached(rl, ts_msec, pktlen)) {
 		*decision = NPF_DECISION_BLOCK;
 	}
-	mutex_exit(&rl->lock);
 	return true;
 }
 
@@ -52,7 +52,7 @@ __KERNEL_RCSID(0, "$NetBSD$");
 #define	m_clear_flag(m,f)	(m)->m_flags &= ~(f)
 #endif
 
-#ifndef INET6
+#if !defined(INET6) && !defined(_NPF_STANDALONE)
 #define ip6_reass_packet(x, y)	ENOTSUP
 #endif
 
@@ -126,9 +126,11 @@ npfk_packet_handler(npf_t *npf, struct mbuf **mp, ifnet_t *ifp, int di)
 	npf_conn_t *con;
 	npf_rule_t *rl;
 	npf_rproc_t *rp;
+	npf_srcent_t *src;
 	int error, decision, flags;
 	npf_match_info_t mi;
-	bool mff;
+	uint32_t cookie;
+	bool mff, synproxy, created;
 
 	KASSERT(ifp != NULL);
 
@@ -150,6 +152,7 @@ npfk_packet_handler(npf_t *npf, struct mbuf **mp, ifnet_t *ifp, int di)
 	error = 0;
 	rp = NULL;
 	con = NULL;
+	created = false;
 
 	/* Cache everything. */
 	flags = npf_cache_all(&npc);
@@ -181,6 +184,15 @@ npfk_packet_handler(npf_t *npf, struct mbuf **mp, ifnet_t *ifp, int di)
 	/* Inspect the list of connections (if found, acquires a reference). */
 	con = npf_conn_inspect(&npc, di, &error);
 
+	/*
+	 * SYN proxy: the responder's SYN-ACK completed the handshake and
+	 * was converted, so acknowledge it on behalf of the initiator.
+	 */
+	if (__predict_false(npc.npc_info & NPC_SYNPROXY)) {
+		KASSERT(con != NULL);
+		(void)npf_synproxy_synack(&npc, con);
+	}
+
 	/* If "passing" connection found - skip the ruleset inspection. */
 	if (con && npf_conn_pass(con, &mi, &rp)) {
 		npf_stats_inc(npf, NPF_STAT_PASS_CONN);
@@ -197,6 +209,14 @@ npfk_packet_handler(npf_t *npf, struct mbuf **mp, ifnet_t *ifp, int di)
 	int slock = npf_config_read_enter(npf);
 	npf_ruleset_t *rlset = npf_config_ruleset(npf);
 
+	/*
+	 * SYN proxy: if the packet is the initiator's ACK for a valid SYN
+	 * cookie, then it is replaced with the SYN for the responder.
+	 * Only check the cookies if the ruleset has any SYN proxy rules.
+	 */
+	synproxy = __predict_false(npf_ruleset_synproxy_p(rlset)) && !con &&
+	    npf_synproxy_ack(&npc, &cookie);
+
 	rl = npf_ruleset_inspect(&npc, rlset, di, NPF_LAYER_3);
 	if (__predict_false(rl == NULL)) {
 		const bool pass = npf_default_pass(npf);
@@ -225,6 +245,29 @@ npfk_packet_handler(npf_t *npf, struct mbuf **mp, ifnet_t *ifp, int di)
 		npf_stats_inc(npf, NPF_STAT_BLOCK_RULESET);
 		goto block;
 	}
+
+	/*
+	 * SYN proxy: answer the SYN with a cookie and drop it.  The SYN
+	 * reconstructed from the ACK can only be passed by such rule.
+	 */
+	if (__predict_false(mi.mi_retfl & NPF_RULE_SYNPROXY)) {
+		if (!synproxy && !con && npf_synproxy_syn(&npc)) {
+			goto out;
+		}
+	} else if (__predict_false(synproxy)) {
+		npf_stats_inc(npf, NPF_STAT_BLOCK_RULESET);
+		goto block;
+	}
+
+	/*
+	 * Per-source limits: account the new connection against its
+	 * source or block it, if the limits are exceeded.
+	 */
+	src = NULL;
+	if (__predict_false(NPF_SRCLIMIT_P(&mi.mi_srclimit)) && !con &&
+	    npf_srctrack_enter(&npc, &mi, &src) != 0) {
+		goto block;
+	}
 	npf_stats_inc(npf, NPF_STAT_PASS_RULESET);
 
 	/*
@@ -234,15 +277,30 @@ npfk_packet_handler(npf_t *npf, struct mbuf **mp, ifnet_t *ifp, int di)
 	if ((mi.mi_retfl & NPF_RULE_STATEFUL) != 0 && !con) {
 		con = npf_conn_establish(&npc, di,
 		    (mi.mi_retfl & NPF_RULE_GSTATEFUL) == 0);
+		if (con && synproxy) {
+			npf_synproxy_establish(con, cookie);
+		}
 		if (con) {
 			/*
 			 * Note: the reference on the rule procedure is
 			 * transferred to the connection.  It will be
-			 * released on connection destruction.
+			 * released on connection destruction.  So is
+			 * the accounting of the source.
 			 */
 			npf_conn_setpass(con, &mi, rp);
+			if (src) {
+				npf_conn_setsrc(con, src);
+				npf_srctrack_charge(src);
+			}
+			created = true;
+		} else if (src) {
+			npf_srctrack_exit(npf, src);
 		}
 	}
+	if (__predict_false(synproxy) && con == NULL) {
+		/* E.g. a duplicate ACK: the connection already exists. */
+		goto block;
+	}
 
 pass:
 	decision = NPF_DECISION_PASS;
@@ -253,6 +311,14 @@ pass:
 	 */
 	error = npf_do_nat(&npc, con, di);
 
+	/*
+	 * Replicate the new connection, including the NAT association.
+	 * Note: if NAT failed, then the connection is not activated.
+	 */
+	if (created && error == 0) {
+		npf_sync_conn(npf, NPF_SYNC_CREATE, con);
+	}
+
 block:
 	/*
 	 * Execute the rule procedure, if any is associated.
@@ -312,3 +378,17 @@ out:
 
 	return error;
 }
+
+#if defined(_NPF_STANDALONE)
+/*
+ * npfk_packet_fragment: fragment the packet to be transmitted, e.g. the
+ * datagram reassembled by NPF, so that each fragment fits the MTU.  In
+ * the kernel, this is done by the IP layer.
+ */
+__dso_public int
+npfk_packet_fragment(npf_t *npf, struct mbuf **mp, unsigned mtu,
+    struct mbuf **frags, unsigned *nfrags)
+{
+	return npf_reass_fragment(npf, mp, mtu, frags, nfrags);
+}
+#endif
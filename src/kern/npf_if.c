@@ -91,6 +91,21 @@ npf_ifmap_lookup(npf_t *npf, const char *ifname)
 	return NPF_IFMAP_NOID;
 }
 
+/*
+ * npf_ifmap_lookupname: return the ID of the registered interface name
+ * or zero if the name is not registered.
+ */
+unsigned
+npf_ifmap_lookupname(npf_t *npf, const char *ifname)
+{
+	unsigned id;
+
+	mutex_enter(&npf->ifmap_lock);
+	id = npf_ifmap_lookup(npf, ifname);
+	mutex_exit(&npf->ifmap_lock);
+	return id;
+}
+
 /*
  * npf_ifmap_register: register an interface name; return an assigned
  * NPF network ID on success (non-zero).
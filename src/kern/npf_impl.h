@@ -51,12 +51,26 @@ struct npf_ruleset;
 struct npf_rule;
 struct npf_rprocset;
 struct npf_portmap;
+struct npf_pba;
+struct npf_eim;
+struct npf_eim_ent;
+struct npf_srctrack;
+struct npf_srcent;
+struct npf_sync;
+struct npf_logring;
 struct npf_nat;
 struct npf_conn;
 
 typedef struct npf_ruleset	npf_ruleset_t;
 typedef struct npf_rule		npf_rule_t;
 typedef struct npf_portmap	npf_portmap_t;
+typedef struct npf_pba		npf_pba_t;
+typedef struct npf_eim		npf_eim_t;
+typedef struct npf_eim_ent	npf_eim_ent_t;
+typedef struct npf_srctrack	npf_srctrack_t;
+typedef struct npf_srcent	npf_srcent_t;
+typedef struct npf_sync		npf_sync_t;
+typedef struct npf_logring	npf_logring_t;
 typedef struct npf_nat		npf_nat_t;
 typedef struct npf_rprocset	npf_rprocset_t;
 typedef struct npf_alg		npf_alg_t;
@@ -73,6 +87,7 @@ typedef struct npf_conndb	npf_conndb_t;
 typedef struct npf_table	npf_table_t;
 typedef struct npf_tableset	npf_tableset_t;
 typedef struct npf_algset	npf_algset_t;
+typedef struct npf_reass	npf_reass_t;
 
 #ifdef __NetBSD__
 typedef void			ebr_t;
@@ -92,10 +107,27 @@ typedef struct {
 
 typedef void (*npf_workfunc_t)(npf_t *);
 
+/*
+ * Per-source limits of a stateful rule: the number of connections and
+ * the rate of new connections (per the given seconds).  Zero means no
+ * limit.  Optionally, the sources exceeding them are inserted into the
+ * "overload" table.
+ */
+typedef struct {
+	unsigned	sl_maxconn;
+	unsigned	sl_rate;
+	unsigned	sl_rate_secs;
+	unsigned	sl_tid;
+} npf_srclimit_t;
+
+#define	NPF_SRCLIMIT_NOTABLE	((unsigned)-1)
+#define	NPF_SRCLIMIT_P(sl)	((sl)->sl_maxconn != 0 || (sl)->sl_rate != 0)
+
 typedef struct {
 	uint64_t	mi_rid;
 	unsigned	mi_retfl;
 	unsigned	mi_di;
+	npf_srclimit_t	mi_srclimit;
 } npf_match_info_t;
 
 /*
@@ -125,20 +157,41 @@ typedef struct {
 	int		nst_wscale;
 } npf_tcpstate_t;
 
+#define	NPF_STATE_SYNPROXY	0x01
+
 typedef struct {
 	unsigned 	nst_state;
+	unsigned	nst_flags;
 	npf_tcpstate_t	nst_tcpst[2];
+
+	/*
+	 * SYN proxy: the difference of the ISN given to the initiator
+	 * and the ISN of the responder.  Note: the former, until the
+	 * responder replies.
+	 */
+	uint32_t	nst_seqdiff;
 } npf_state_t;
 
 /*
  * ALG FUNCTIONS.
  */
 
+#define	NPFA_MAX_PROTOS		4
+
 typedef struct {
 	bool		(*match)(npf_cache_t *, npf_nat_t *, int);
 	bool		(*translate)(npf_cache_t *, npf_nat_t *, npf_flow_t);
 	npf_conn_t *	(*inspect)(npf_cache_t *, int);
 	void		(*destroy)(npf_t *, npf_nat_t *, npf_conn_t *);
+
+	/*
+	 * Optional filter for the inspect and translate functions: the
+	 * L4 protocols (zero-terminated, if fewer) and the TCP/UDP port
+	 * in host byte order (either source or destination).  If no
+	 * protocols are specified, then the functions see all packets.
+	 */
+	uint8_t		protos[NPFA_MAX_PROTOS];
+	in_port_t	port;
 } npfa_funcs_t;
 
 /*
@@ -205,6 +258,16 @@ struct npf {
 	int			ip6_reassembly;
 	int			ip6_drop_options;
 
+	/* IPv4/IPv6 reassembly state (standalone only). */
+	npf_reass_t *		reass;
+
+	/* Rate limit of the ICMP errors (standalone only). */
+	percpu_t *		icmp_rate;
+	int			icmp_error_rate;
+
+	/* SYN cookie secret. */
+	uint32_t		synproxy_key[4];
+
 	/*
 	 * Connection tracking state: disabled (off) or enabled (on).
 	 * Connection tracking database, connection cache and the lock.
@@ -215,6 +278,17 @@ struct npf {
 	npf_conndb_t *		conn_db;
 	pool_cache_t		conn_cache[2];
 
+	/* The number of connections (see the "conn.max" parameter). */
+	unsigned		conn_count;
+
+	/* The cursors of the connection listing (see npf_conndb_list()). */
+	LIST_HEAD(, npf_conncursor) conn_cursors;
+	unsigned		conn_ncursors;
+	uint64_t		conn_cursor_id;
+
+	/* Per-source tracking for the limits of the stateful rules. */
+	npf_srctrack_t *	srctrack;
+
 	/* NAT and ALGs. */
 	npf_portmap_t *		portmap;
 	npf_algset_t *		algset;
@@ -230,6 +304,17 @@ struct npf {
 	LIST_HEAD(, npf_ext)	ext_list;
 	kmutex_t		ext_lock;
 
+	/* Event log of the connections and NAT entries (optional). */
+	npf_logring_t *		evlog;
+
+	/* Packet log of the "pktlog" extension (optional). */
+	npf_logring_t *		pktlog;
+
+	/* Connection state replication (optional). */
+	npf_sync_t *		sync;
+	int			sync_state_rate;
+	int			sync_refresh;
+
 	/* Associated worker information. */
 	unsigned		worker_flags;
 	LIST_ENTRY(npf)		worker_entry;
@@ -307,6 +392,7 @@ int		npf_params_export(const npf_t *, nvlist_t *);
 void		npf_ifmap_init(npf_t *, const npf_ifops_t *);
 void		npf_ifmap_fini(npf_t *);
 u_int		npf_ifmap_register(npf_t *, const char *);
+u_int		npf_ifmap_lookupname(npf_t *, const char *);
 void		npf_ifmap_flush(npf_t *);
 u_int		npf_ifmap_getid(npf_t *, const ifnet_t *);
 void		npf_ifmap_copylogname(npf_t *, unsigned, char *, size_t);
@@ -322,10 +408,11 @@ void		npf_recache(npf_cache_t *);
 
 bool		npf_rwrip(const npf_cache_t *, u_int, const npf_addr_t *);
 bool		npf_rwrport(const npf_cache_t *, u_int, const in_port_t);
+unsigned	npf_cksum_offload(const npf_cache_t *);
 bool		npf_rwrcksum(const npf_cache_t *, u_int,
-		    const npf_addr_t *, const in_port_t);
+		    const npf_addr_t *, const in_port_t, unsigned);
 int		npf_napt_rwr(const npf_cache_t *, u_int, const npf_addr_t *,
-		    const in_addr_t);
+		    const in_addr_t, unsigned);
 int		npf_npt66_rwr(const npf_cache_t *, u_int, const npf_addr_t *,
 		    npf_netmask_t, uint16_t);
 
@@ -348,6 +435,9 @@ bool		npf_fetch_tcpopts(npf_cache_t *, uint16_t *, int *);
 bool		npf_set_mss(npf_cache_t *, uint16_t, uint16_t *, uint16_t *,
 		    bool *);
 bool		npf_return_block(npf_cache_t *, const int);
+struct mbuf *	npf_tcp_mkpkt(const npf_cache_t *, bool, tcp_seq, tcp_seq,
+		    unsigned, uint16_t, uint16_t);
+int		npf_tcp_sendpkt(const npf_cache_t *, struct mbuf *);
 
 /* BPF interface. */
 void		npf_bpf_sysinit(void);
@@ -371,14 +461,19 @@ void		npf_tableset_reload(npf_t *, npf_tableset_t *, npf_tableset_t *);
 int		npf_tableset_export(npf_t *, const npf_tableset_t *, nvlist_t *);
 
 npf_table_t *	npf_table_create(const char *, u_int, int, const void *, size_t);
+#ifdef _NPF_STANDALONE
+npf_table_t *	npf_table_create_file(const char *, u_int, const char *);
+#endif
 void		npf_table_destroy(npf_table_t *);
 
 u_int		npf_table_getid(npf_table_t *);
+int		npf_table_gettype(npf_table_t *);
 int		npf_table_check(npf_tableset_t *, const char *, uint64_t, uint64_t, bool);
 int		npf_table_insert(npf_table_t *, const int,
 		    const npf_addr_t *, const npf_netmask_t);
 int		npf_table_remove(npf_table_t *, const int,
 		    const npf_addr_t *, const npf_netmask_t);
+int		npf_table_update(npf_table_t *, const npf_ioctl_ent_t *, unsigned);
 int		npf_table_lookup(npf_table_t *, const int, const npf_addr_t *);
 npf_addr_t *	npf_table_getsome(npf_table_t *, const int, unsigned);
 int		npf_table_list(npf_table_t *, void *, size_t);
@@ -391,6 +486,7 @@ void		npf_ruleset_destroy(npf_ruleset_t *);
 void		npf_ruleset_insert(npf_ruleset_t *, npf_rule_t *);
 void		npf_ruleset_reload(npf_t *, npf_ruleset_t *,
 		    npf_ruleset_t *, bool);
+bool		npf_ruleset_synproxy_p(const npf_ruleset_t *);
 npf_natpolicy_t *npf_ruleset_findnat(npf_ruleset_t *, uint64_t);
 void		npf_ruleset_freealg(npf_ruleset_t *, npf_alg_t *);
 int		npf_ruleset_export(npf_t *, const npf_ruleset_t *,
@@ -444,12 +540,16 @@ void		npf_state_sysfini(npf_t *);
 bool		npf_state_init(npf_cache_t *, npf_state_t *);
 bool		npf_state_inspect(npf_cache_t *, npf_state_t *, npf_flow_t);
 int		npf_state_etime(npf_t *, const npf_state_t *, const int);
+bool		npf_state_embryonic_p(const npf_state_t *, const int);
+bool		npf_state_valid_p(const npf_state_t *, const int);
 void		npf_state_destroy(npf_state_t *);
 
 void		npf_state_tcp_sysinit(npf_t *);
 void		npf_state_tcp_sysfini(npf_t *);
 bool		npf_state_tcp(npf_cache_t *, npf_state_t *, npf_flow_t);
 int		npf_state_tcp_timeout(npf_t *, const npf_state_t *);
+bool		npf_state_tcp_embryonic_p(const npf_state_t *);
+bool		npf_state_tcp_valid_p(const npf_state_t *);
 
 /* Portmap. */
 void		npf_portmap_init(npf_t *);
@@ -461,7 +561,99 @@ void		npf_portmap_destroy(npf_portmap_t *);
 in_port_t	npf_portmap_get(npf_portmap_t *, int, const npf_addr_t *);
 bool		npf_portmap_take(npf_portmap_t *, int, const npf_addr_t *, in_port_t);
 void		npf_portmap_put(npf_portmap_t *, int, const npf_addr_t *, in_port_t);
+in_port_t	npf_portmap_getblock(npf_portmap_t *, int, const npf_addr_t *,
+		    unsigned);
+bool		npf_portmap_takeblock(npf_portmap_t *, int, const npf_addr_t *,
+		    in_port_t, unsigned);
+void		npf_portmap_putblock(npf_portmap_t *, int, const npf_addr_t *,
+		    in_port_t, unsigned);
 void		npf_portmap_flush(npf_portmap_t *);
+void		npf_portmap_sync(npf_portmap_t *);
+
+/* Port block allocation. */
+npf_pba_t *	npf_pba_create(npf_t *, npf_portmap_t *, unsigned, unsigned,
+		    unsigned);
+void		npf_pba_destroy(npf_pba_t *);
+in_port_t	npf_pba_get(npf_pba_t *, unsigned, const npf_addr_t *,
+		    npf_addr_t *);
+bool		npf_pba_take(npf_pba_t *, unsigned, const npf_addr_t *,
+		    const npf_addr_t *, in_port_t);
+void		npf_pba_put(npf_pba_t *, unsigned, const npf_addr_t *, in_port_t);
+
+/* Endpoint-independent mapping. */
+npf_eim_t *	npf_eim_create(void);
+void		npf_eim_destroy(npf_eim_t *);
+npf_eim_ent_t *	npf_eim_lookup(npf_eim_t *, unsigned, const npf_addr_t *,
+		    in_port_t, unsigned, npf_addr_t *, in_port_t *);
+npf_eim_ent_t *	npf_eim_insert(npf_eim_t *, unsigned, const npf_addr_t *,
+		    in_port_t, unsigned, npf_addr_t *, in_port_t *);
+bool		npf_eim_put(npf_eim_t *, npf_eim_ent_t *);
+
+/* Log rings. */
+npf_logring_t *	npf_logring_create(unsigned, size_t);
+void		npf_logring_destroy(npf_logring_t *);
+bool		npf_logring_put(npf_logring_t *, const void *, size_t);
+size_t		npf_logring_drain(npf_logring_t *, void *, size_t, size_t);
+
+/* Log sampling and rate capping. */
+typedef struct {
+	unsigned		sample;
+	unsigned		rate;
+	volatile uint64_t	state;
+} npf_logcap_t;
+
+void		npf_logcap_init(npf_logcap_t *, const nvlist_t *);
+bool		npf_logcap_pass(npf_cache_t *, npf_logcap_t *);
+
+/* Event log. */
+void		npf_evlog_init(npf_t *);
+void		npf_evlog_fini(npf_t *);
+void		npf_evlog_conn(npf_t *, unsigned, npf_conn_t *);
+void		npf_evlog_nat(npf_t *, unsigned, npf_conn_t *, unsigned,
+		    const npf_addr_t *, in_port_t);
+void		npf_evlog_block(npf_t *, unsigned, unsigned, unsigned,
+		    const npf_addr_t *, const npf_addr_t *, in_port_t,
+		    unsigned);
+size_t		npf_evlog_drain(npf_t *, npf_event_t *, size_t);
+
+/* Connection state replication. */
+void		npf_sync_init(npf_t *);
+void		npf_sync_fini(npf_t *);
+void		npf_sync_conn(npf_t *, unsigned, npf_conn_t *);
+void		npf_sync_refresh(npf_t *, npf_conn_t *);
+size_t		npf_sync_drain(npf_t *, npf_syncrec_t *, size_t);
+size_t		npf_sync_apply(npf_t *, const npf_syncrec_t *, size_t);
+
+/* SYN proxy. */
+void		npf_synproxy_init(npf_t *);
+bool		npf_synproxy_syn(npf_cache_t *);
+bool		npf_synproxy_ack(npf_cache_t *, uint32_t *);
+void		npf_synproxy_establish(npf_conn_t *, uint32_t);
+int		npf_synproxy_synack(npf_cache_t *, npf_conn_t *);
+
+/* Source tracking. */
+void		npf_srctrack_init(npf_t *);
+void		npf_srctrack_fini(npf_t *);
+int		npf_srctrack_enter(npf_cache_t *, const npf_match_info_t *,
+		    npf_srcent_t **);
+void		npf_srctrack_charge(npf_srcent_t *);
+void		npf_srctrack_exit(npf_t *, npf_srcent_t *);
+void		npf_srctrack_gc(npf_t *, bool);
+void		npf_srctrack_worker(npf_t *);
+
+#ifdef _NPF_STANDALONE
+/* IPv4/IPv6 reassembly. */
+void		npf_reass_init(npf_t *);
+void		npf_reass_fini(npf_t *);
+int		npf_reass_packet(npf_t *, struct mbuf **, unsigned);
+int		npf_reass_fragment(npf_t *, struct mbuf **, unsigned,
+		    struct mbuf **, unsigned *);
+
+/* Packet construction. */
+void		npf_sendpkt_init(npf_t *);
+void		npf_sendpkt_fini(npf_t *);
+uint16_t	npf_cksum_buf(uint32_t, const void *, size_t);
+#endif
 
 /* NAT. */
 void		npf_nat_sysinit(void);
@@ -477,6 +669,7 @@ void		npf_nat_freealg(npf_natpolicy_t *, npf_alg_t *);
 int		npf_do_nat(npf_cache_t *, npf_conn_t *, const unsigned);
 npf_nat_t *	npf_nat_share_policy(npf_cache_t *, npf_conn_t *, npf_nat_t *);
 void		npf_nat_destroy(npf_conn_t *, npf_nat_t *);
+void		npf_nat_evict(npf_nat_t *);
 void		npf_nat_getorig(npf_nat_t *, npf_addr_t **, in_port_t *);
 void		npf_nat_gettrans(npf_nat_t *, npf_addr_t **, in_port_t *);
 void		npf_nat_setalg(npf_nat_t *, npf_alg_t *, uintptr_t);
@@ -486,6 +679,8 @@ uintptr_t	npf_nat_getalgarg(const npf_nat_t *);
 void		npf_nat_export(npf_t *, const npf_nat_t *, nvlist_t *);
 npf_nat_t *	npf_nat_import(npf_t *, const nvlist_t *, npf_ruleset_t *,
 		    npf_conn_t *);
+unsigned	npf_nat_getrec(const npf_nat_t *, npf_connrec_t *);
+npf_nat_t *	npf_nat_setrec(npf_t *, const npf_connrec_t *, npf_conn_t *);
 
 /* ALG interface. */
 void		npf_alg_sysinit(void);
@@ -515,6 +710,11 @@ bool		npf_ebr_incrit_p(ebr_t *);
 const char *	npf_addr_dump(const npf_addr_t *, int);
 void		npf_state_dump(const npf_state_t *);
 void		npf_nat_dump(const npf_nat_t *);
+unsigned	npf_pba_getblocks(npf_pba_t *, unsigned, const npf_addr_t *);
+unsigned	npf_eim_getrefs(npf_eim_t *, unsigned, const npf_addr_t *,
+		    in_port_t, unsigned);
+unsigned	npf_srctrack_getconns(npf_t *, uint64_t, unsigned,
+		    const npf_addr_t *);
 void		npf_ruleset_dump(npf_t *, const char *);
 void		npf_state_setsampler(void (*)(npf_state_t *, bool));
 
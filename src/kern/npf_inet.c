@@ -703,12 +703,49 @@ npf_rwrport(const npf_cache_t *npc, u_int which, const in_port_t port)
 	return true;
 }
 
+/*
+ * npf_cksum_offload: return the checksums of the packet (NPF_CKSUM_*
+ * flags) which will be computed on transmit, therefore the software
+ * fixups of them can be skipped.
+ */
+unsigned
+npf_cksum_offload(const npf_cache_t *npc)
+{
+	unsigned cksum = 0, offload;
+
+	offload = nbuf_cksum_offload(npc->npc_ctx, npc->npc_nbuf);
+	if (offload == 0) {
+		return 0;
+	}
+	if (npf_iscached(npc, NPC_IP4)) {
+		cksum |= NPF_CKSUM_IPV4;
+	}
+
+	/*
+	 * The TCP/UDP checksum covers the whole datagram, therefore it
+	 * cannot be computed for a fragment.  Also, the zero UDP checksum
+	 * means no checksum and it must stay such.
+	 */
+	if (npf_iscached(npc, NPC_IPFRAG)) {
+		return offload & cksum;
+	}
+	if (npf_iscached(npc, NPC_TCP)) {
+		cksum |= NPF_CKSUM_TCP;
+	}
+	if (npf_iscached(npc, NPC_UDP) && npc->npc_l4.udp->uh_sum) {
+		cksum |= NPF_CKSUM_UDP;
+	}
+	return offload & cksum;
+}
+
 /*
  * npf_rwrcksum: rewrite IPv4 and/or TCP/UDP checksum.
+ *
+ * => Skips the checksums which are offloaded (NPF_CKSUM_* flags).
  */
 bool
 npf_rwrcksum(const npf_cache_t *npc, u_int which,
-    const npf_addr_t *addr, const in_port_t port)
+    const npf_addr_t *addr, const in_port_t port, unsigned offload)
 {
 	const npf_addr_t *oaddr = npc->npc_ips[which];
 	const int proto = npc->npc_proto;
@@ -726,7 +763,9 @@ npf_rwrcksum(const npf_cache_t *npc, u_int which,
 		uint16_t ipsum = ip->ip_sum;
 
 		/* Recalculate IPv4 checksum and rewrite. */
-		ip->ip_sum = npf_addr_cksum(ipsum, alen, oaddr, addr);
+		if ((offload & NPF_CKSUM_IPV4) == 0) {
+			ip->ip_sum = npf_addr_cksum(ipsum, alen, oaddr, addr);
+		}
 	} else {
 		/* No checksum for IPv6. */
 		KASSERT(npf_iscached(npc, NPC_IP6));
@@ -741,6 +780,9 @@ npf_rwrcksum(const npf_cache_t *npc, u_int which,
 	switch (proto) {
 	case IPPROTO_TCP:
 		KASSERT(npf_iscached(npc, NPC_TCP));
+		if (offload & NPF_CKSUM_TCP) {
+			return true;
+		}
 		th = npc->npc_l4.tcp;
 		ocksum = &th->th_sum;
 		oport = (which == NPF_SRC) ? th->th_sport : th->th_dport;
@@ -749,7 +791,7 @@ npf_rwrcksum(const npf_cache_t *npc, u_int which,
 		KASSERT(npf_iscached(npc, NPC_UDP));
 		uh = npc->npc_l4.udp;
 		ocksum = &uh->uh_sum;
-		if (*ocksum == 0) {
+		if (*ocksum == 0 || (offload & NPF_CKSUM_UDP) != 0) {
 			/* No need to update. */
 			return true;
 		}
@@ -775,10 +817,13 @@ npf_rwrcksum(const npf_cache_t *npc, u_int which,
 
 /*
  * npf_napt_rwr: perform address and/or port translation.
+ *
+ * => The checksums given by the offload flags (see npf_cksum_offload())
+ *    are not updated, but requested to be computed on transmit.
  */
 int
 npf_napt_rwr(const npf_cache_t *npc, u_int which,
-    const npf_addr_t *addr, const in_addr_t port)
+    const npf_addr_t *addr, const in_addr_t port, unsigned offload)
 {
 	const unsigned proto = npc->npc_proto;
 
@@ -787,15 +832,16 @@ npf_napt_rwr(const npf_cache_t *npc, u_int which,
 	 * current (old) address/port for the calculations.  Then perform
 	 * the address translation i.e. rewrite source or destination.
 	 */
-	if (!npf_rwrcksum(npc, which, addr, port)) {
+	if (!npf_rwrcksum(npc, which, addr, port, offload)) {
 		return EINVAL;
 	}
 	if (!npf_rwrip(npc, which, addr)) {
 		return EINVAL;
 	}
+
 	if (port == 0) {
-		/* Done. */
-		return 0;
+		/* No port translation. */
+		goto out;
 	}
 
 	switch (proto) {
@@ -814,6 +860,11 @@ npf_napt_rwr(const npf_cache_t *npc, u_int which,
 	default:
 		return ENOTSUP;
 	}
+out:
+	/* Finally, the checksums to compute on transmit. */
+	if (offload) {
+		nbuf_cksum_offload_set(npc->npc_ctx, npc->npc_nbuf, offload);
+	}
 	return 0;
 }
 
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * NPF log sampling and rate capping, used by the logging extensions.
+ *
+ * Overview
+ *
+ *	Logging every packet of a busy rule (e.g. blocking an attack)
+ *	can overwhelm the logging pipeline.  Therefore, the records can
+ *	be limited in two ways:
+ *
+ *	- Sampling: only 1-in-N flows are logged.  The decision is made
+ *	  using the flow hash, i.e. it is deterministic: either all or
+ *	  none of the packets of a flow are logged.  The hash is symmetric,
+ *	  so both directions of a flow get the same decision.
+ *
+ *	- Rate cap: at most R records per second are logged, using the
+ *	  token bucket with the burst of R records.
+ *
+ *	The suppressed records are accounted in the statistics.
+ *
+ * Concurrency
+ *
+ *	The token bucket state (the last refill time and the number of
+ *	tokens) is packed into a single 64-bit word, which is updated
+ *	using CAS.  Note: the refill time is advanced only by the time
+ *	worth of the added tokens, so that the fractions are not lost,
+ *	unless the bucket is full.
+ */
+
+#ifdef _KERNEL
+#include <sys/cdefs.h>
+__KERNEL_RCSID(0, "$NetBSD$");
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/atomic.h>
+#include <sys/systm.h>
+#endif
+
+#include "npf_impl.h"
+
+#define	LOGCAP_TOKEN_BITS	24
+#define	LOGCAP_TOKEN_MASK	((UINT64_C(1) << LOGCAP_TOKEN_BITS) - 1)
+#define	LOGCAP_RATE_MAX		LOGCAP_TOKEN_MASK
+
+#define	LOGCAP_STATE(ts, tok)	(((ts) << LOGCAP_TOKEN_BITS) | (tok))
+#define	LOGCAP_TIME(st)		((st) >> LOGCAP_TOKEN_BITS)
+#define	LOGCAP_TOKENS(st)	((st) & LOGCAP_TOKEN_MASK)
+
+/*
+ * npf_logcap_init: set up the sampling and the rate cap, given the
+ * "sample" (1-in-N flows) and "limit" (records per second) parameters.
+ */
+void
+npf_logcap_init(npf_logcap_t *lc, const nvlist_t *params)
+{
+	uint64_t rate;
+
+	memset(lc, 0, sizeof(npf_logcap_t));
+	lc->sample = dnvlist_get_number(params, "sample", 0);
+	rate = dnvlist_get_number(params, "limit", 0);
+	lc->rate = MIN(rate, LOGCAP_RATE_MAX);
+
+	/* Start with the full bucket. */
+	lc->state = LOGCAP_STATE(UINT64_C(0), (uint64_t)lc->rate);
+}
+
+static uint32_t
+npf_logcap_flowhash(const npf_cache_t *npc)
+{
+	const unsigned alen = npc->npc_alen;
+	uint32_t hash, ports = 0;
+
+	if (!npf_iscached(npc, NPC_IP46)) {
+		return 0;
+	}
+	if (npf_iscached(npc, NPC_TCP)) {
+		const struct tcphdr *th = npc->npc_l4.tcp;
+		ports = th->th_sport ^ th->th_dport;
+	} else if (npf_iscached(npc, NPC_UDP)) {
+		const struct udphdr *uh = npc->npc_l4.udp;
+		ports = uh->uh_sport ^ uh->uh_dport;
+	}
+	hash = murmurhash2(npc->npc_ips[NPF_SRC], alen, npc->npc_proto) ^
+	    murmurhash2(npc->npc_ips[NPF_DST], alen, npc->npc_proto) ^ ports;
+	return murmurhash2(&hash, sizeof(hash), 0x9e3779b9);
+}
+
+static bool
+npf_logcap_take(npf_logcap_t *lc)
+{
+	const uint64_t rate = lc->rate;
+	uint64_t old, new, now, last, tokens;
+	struct timespec ts;
+
+	getnanouptime(&ts);
+	now = (uint64_t)ts.tv_sec * 1000 + (ts.tv_nsec / 1000000);
+	now = now & (UINT64_MAX >> LOGCAP_TOKEN_BITS);
+
+	do {
+		old = atomic_load_relaxed(&lc->state);
+		last = LOGCAP_TIME(old);
+		tokens = LOGCAP_TOKENS(old);
+
+		/* Refill the bucket, up to the burst, i.e. the rate. */
+		if (now > last) {
+			const uint64_t elapsed = MIN(now - last, 1000);
+			const uint64_t refill = (elapsed * rate) / 1000;
+
+			if (tokens + refill >= rate) {
+				tokens = rate;
+				last = now;
+			} else if (refill) {
+				tokens += refill;
+				last += (refill * 1000) / rate;
+			}
+		}
+		if (tokens == 0) {
+			return false;
+		}
+		new = LOGCAP_STATE(last, tokens - 1);
+	} while (atomic_cas_64(&lc->state, old, new) != old);
+
+	return true;
+}
+
+/*
+ * npf_logcap_pass: determine whether the packet should be logged,
+ * accounting the suppressed records.
+ */
+bool
+npf_logcap_pass(npf_cache_t *npc, npf_logcap_t *lc)
+{
+	if (lc->sample > 1 && npf_logcap_flowhash(npc) % lc->sample) {
+		npf_stats_inc(npc->npc_ctx, NPF_STAT_LOG_UNSAMPLED);
+		return false;
+	}
+	if (lc->rate && !npf_logcap_take(lc)) {
+		npf_stats_inc(npc->npc_ctx, NPF_STAT_LOG_CAPPED);
+		return false;
+	}
+	return true;
+}
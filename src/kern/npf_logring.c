@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * NPF log rings: per-CPU buffers of the fixed-size log records.
+ *
+ * Overview
+ *
+ *	The log records (e.g. of the event log or the packet logging
+ *	extension) are produced by the packet path and consumed in
+ *	batches using npf_logring_drain().
+ *
+ * Concurrency
+ *
+ *	Each CPU (a thread, in the standalone case) has its own ring
+ *	buffer with a single producer and a single consumer; therefore,
+ *	the producer does not take any locks.  If the ring is full, then
+ *	the record is dropped and the caller is notified.  The rings are
+ *	created on demand and never freed until the log is destroyed.
+ *	The consumers are serialised using the lock, which also protects
+ *	the list of rings.
+ */
+
+#ifdef _KERNEL
+#include <sys/cdefs.h>
+__KERNEL_RCSID(0, "$NetBSD$");
+
+#include <sys/param.h>
+#include <sys/types.h>
+
+#include <sys/kmem.h>
+#include <sys/mutex.h>
+#include <sys/percpu.h>
+#include <sys/systm.h>
+#endif
+
+#include "npf_impl.h"
+
+typedef struct npf_ring {
+	/* Producer index: written only by the owner. */
+	unsigned		head;
+	uint8_t			pad[COHERENCY_UNIT - sizeof(unsigned)];
+
+	/* Consumer index and the entry on the list of rings. */
+	unsigned		tail;
+	TAILQ_ENTRY(npf_ring)	entry;
+	uint8_t			recs[];
+} npf_ring_t;
+
+struct npf_logring {
+	percpu_t *		percpu;
+	unsigned		nrecs;
+	size_t			recsize;
+	kmutex_t		lock;
+	TAILQ_HEAD(, npf_ring)	rings;
+};
+
+#define	RING_SIZE(lr)	(offsetof(npf_ring_t, recs[0]) + \
+			    (lr)->nrecs * (lr)->recsize)
+#define	RING_REC(lr, r, i) \
+    (&(r)->recs[((i) & ((lr)->nrecs - 1)) * (lr)->recsize])
+
+/*
+ * npf_logring_create: create the log, with the given number of records
+ * (must be a power of two) of the given size in the ring of each CPU.
+ */
+npf_logring_t *
+npf_logring_create(unsigned nrecs, size_t recsize)
+{
+	npf_logring_t *lr;
+
+	KASSERT(nrecs && (nrecs & (nrecs - 1)) == 0);
+
+	lr = kmem_zalloc(sizeof(npf_logring_t), KM_SLEEP);
+	lr->percpu = percpu_alloc(sizeof(npf_ring_t *));
+	lr->nrecs = nrecs;
+	lr->recsize = roundup2(recsize, sizeof(uint64_t));
+	mutex_init(&lr->lock, MUTEX_DEFAULT, IPL_SOFTNET);
+	TAILQ_INIT(&lr->rings);
+	return lr;
+}
+
+/*
+ * npf_logring_destroy: destroy the log, discarding the records.
+ *
+ * => The caller ensures there are no producers.
+ */
+void
+npf_logring_destroy(npf_logring_t *lr)
+{
+	npf_ring_t *r;
+
+	while ((r = TAILQ_FIRST(&lr->rings)) != NULL) {
+		TAILQ_REMOVE(&lr->rings, r, entry);
+		kmem_intr_free(r, RING_SIZE(lr));
+	}
+	percpu_free(lr->percpu, sizeof(npf_ring_t *));
+	mutex_destroy(&lr->lock);
+	kmem_free(lr, sizeof(npf_logring_t));
+}
+
+static npf_ring_t *
+npf_logring_getring(npf_logring_t *lr, npf_ring_t **rp)
+{
+	npf_ring_t *r;
+
+	if (__predict_true((r = *rp) != NULL)) {
+		return r;
+	}
+	if ((r = kmem_intr_zalloc(RING_SIZE(lr), KM_NOSLEEP)) == NULL) {
+		return NULL;
+	}
+	mutex_enter(&lr->lock);
+	TAILQ_INSERT_TAIL(&lr->rings, r, entry);
+	mutex_exit(&lr->lock);
+	*rp = r;
+	return r;
+}
+
+/*
+ * npf_logring_put: copy the record (or its first 'len' bytes) into
+ * the ring of the current CPU.
+ *
+ * => Returns false if the ring is full and the record was dropped.
+ */
+bool
+npf_logring_put(npf_logring_t *lr, const void *rec, size_t len)
+{
+	npf_ring_t **rp, *r;
+	bool ok = false;
+	unsigned head;
+
+	KASSERT(len <= lr->recsize);
+
+	int s = splsoftnet();
+	rp = percpu_getref(lr->percpu);
+	if (__predict_false((r = npf_logring_getring(lr, rp)) == NULL)) {
+		goto out;
+	}
+	head = r->head;
+	if (__predict_false(head - atomic_load_acquire(&r->tail) >=
+	    lr->nrecs)) {
+		/* The ring is full. */
+		goto out;
+	}
+	memcpy(RING_REC(lr, r, head), rec, len);
+	atomic_store_release(&r->head, head + 1);
+	ok = true;
+out:
+	percpu_putref(lr->percpu);
+	splx(s);
+	return ok;
+}
+
+/*
+ * npf_logring_drain: move up to the given number of records from the
+ * rings into the buffer (an array of the records).
+ *
+ * => Returns the number of records.
+ * => The records of each ring are in order, but the rings are not
+ *    ordered with respect to each other.
+ */
+size_t
+npf_logring_drain(npf_logring_t *lr, void *buf, size_t recsize, size_t count)
+{
+	uint8_t *rec = buf;
+	npf_ring_t *r;
+	size_t n = 0;
+
+	KASSERT(recsize <= lr->recsize);
+
+	mutex_enter(&lr->lock);
+	TAILQ_FOREACH(r, &lr->rings, entry) {
+		const unsigned head = atomic_load_acquire(&r->head);
+		unsigned tail = r->tail;
+
+		while (tail != head && n < count) {
+			memcpy(rec, RING_REC(lr, r, tail), recsize);
+			rec += recsize;
+			tail++;
+			n++;
+		}
+		atomic_store_release(&r->tail, tail);
+		if (n == count) {
+			break;
+		}
+	}
+
+	/*
+	 * If the buffer is full, then start with this ring next time,
+	 * so that the rings are drained fairly.
+	 */
+	while (r && TAILQ_FIRST(&lr->rings) != r) {
+		npf_ring_t *first = TAILQ_FIRST(&lr->rings);
+		TAILQ_REMOVE(&lr->rings, first, entry);
+		TAILQ_INSERT_TAIL(&lr->rings, first, entry);
+	}
+	mutex_exit(&lr->lock);
+	return n;
+}
@@ -101,6 +101,27 @@ nbuf_head_mbuf(nbuf_t *nbuf)
 	return nbuf->nb_mbuf0;
 }
 
+/*
+ * nbuf_copydata: copy up to the given number of bytes from the start
+ * of the packet into the buffer; returns the number of bytes copied.
+ */
+size_t
+nbuf_copydata(const nbuf_t *nbuf, void *buf, size_t len)
+{
+	struct mbuf *m = nbuf->nb_mbuf0;
+	uint8_t *d = buf;
+	size_t n = 0;
+
+	while (m && n < len) {
+		const size_t mlen = MIN(m_buflen(m), len - n);
+
+		memcpy(d + n, mtod(m, void *), mlen);
+		n += mlen;
+		m = m_next_ptr(m);
+	}
+	return n;
+}
+
 bool
 nbuf_flag_p(const nbuf_t *nbuf, int flag)
 {
@@ -280,6 +301,46 @@ nbuf_cksum_barrier(nbuf_t *nbuf, int di)
 	return false;
 }
 
+/*
+ * nbuf_cksum_offload: return the checksums of the packet (NPF_CKSUM_*
+ * flags), which will be computed on transmit, if the backend supports
+ * the checksum offload.
+ */
+unsigned
+nbuf_cksum_offload(npf_t *npf, const nbuf_t *nbuf)
+{
+#ifdef _KERNEL
+	(void)npf; (void)nbuf;
+	return 0;
+#else
+	const npf_mbufops_t *mops = nbuf->nb_mops;
+
+	if (!mops->get_cksum_offload || !mops->set_cksum_offload) {
+		return 0;
+	}
+	return mops->get_cksum_offload(npf, nbuf->nb_mbuf0);
+#endif
+}
+
+/*
+ * nbuf_cksum_offload_set: request the given checksums to be computed
+ * on transmit, instead of updating them.
+ *
+ * => Must be called after the headers are rewritten.
+ */
+void
+nbuf_cksum_offload_set(npf_t *npf, nbuf_t *nbuf, unsigned flags)
+{
+	KASSERT(flags != 0);
+#ifdef _KERNEL
+	(void)npf; (void)nbuf;
+	KASSERT(false);
+#else
+	KASSERT(nbuf->nb_mops->set_cksum_offload != NULL);
+	nbuf->nb_mops->set_cksum_offload(npf, nbuf->nb_mbuf0, flags);
+#endif
+}
+
 /*
  * npf_mbuf_add_tag: associate a tag with the network buffer.
  *
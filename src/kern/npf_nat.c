@@ -41,6 +41,31 @@
  *	from the port map.  Each NAT entry is associated with the policy,
  *	which contains translation IP address.  Allocated port is returned
  *	to the port map and NAT entry is destroyed when connection expires.
+ *
+ *	If port block allocation (PBA) is set, then the ports are taken
+ *	from the blocks assigned per original address.  See npf_pba.c
+ *	source file for the details.
+ *
+ *	If the endpoint-independent mapping (EIM) is set, then the
+ *	connections from the same original address and port share the
+ *	translation address and port, regardless of the destination.
+ *	See npf_eim.c source file for the details.
+ *
+ * Deterministic NAT
+ *
+ *	The deterministic NAT (RFC 7422) maps the original network onto
+ *	the translation network arithmetically: each translation address
+ *	serves n_det_nsubs subscribers, each having a fixed range of
+ *	n_det_ports ports.  Given the host part of the original address
+ *	as the subscriber index i:
+ *
+ *		taddr = taddr-net + i / nsubs
+ *		port-range = min-port + (i % nsubs) * ports, of ports
+ *
+ *	Therefore, the mapping can be reconstructed from the policy and
+ *	need not be logged per connection.  The ports in use are tracked
+ *	in a bitmap per translation address (allocated on demand), i.e.
+ *	the port map is not used.
  */
 
 #ifdef _KERNEL
@@ -52,6 +77,7 @@ __KERNEL_RCSID(0, "$NetBSD$");
 
 #include <sys/atomic.h>
 #include <sys/condvar.h>
+#include <sys/cprng.h>
 #include <sys/kmem.h>
 #include <sys/mutex.h>
 #include <sys/pool.h>
@@ -61,15 +87,36 @@ __KERNEL_RCSID(0, "$NetBSD$");
 #include "npf_impl.h"
 #include "npf_conn.h"
 
+/*
+ * NAT entries of the policy are kept in the lists, sharded to avoid the
+ * lock contention when the connections are created and destroyed on many
+ * CPUs.  The list is selected by the NAT entry address.  Each list is
+ * padded to the cache line.
+ */
+#define	NPF_NAT_NLISTS_SHIFT	5
+#define	NPF_NAT_NLISTS		(1U << NPF_NAT_NLISTS_SHIFT)
+
+typedef struct {
+	kmutex_t		lock;
+	LIST_HEAD(, npf_nat)	list;
+} npf_natlist_t;
+
+typedef union {
+	npf_natlist_t		nl;
+	uint8_t			pad[COHERENCY_UNIT];
+} npf_natlist_pad_t;
+
 /*
  * NAT policy structure.
  */
 struct npf_natpolicy {
 	npf_t *			n_npfctx;
-	kmutex_t		n_lock;
-	LIST_HEAD(, npf_nat)	n_nat_list;
+	npf_natlist_pad_t	n_nat_lists[NPF_NAT_NLISTS];
 	unsigned		n_refcnt;
 	uint64_t		n_id;
+	npf_pba_t *		n_pba;
+	npf_eim_t *		n_eim;
+	uint64_t **		n_det_bitmaps;
 
 	/*
 	 * Translation type, flags, address or table and the port.
@@ -86,6 +133,16 @@ struct npf_natpolicy {
 	npf_netmask_t		n_tmask;
 	in_port_t		n_tport;
 	unsigned		n_tid;
+	unsigned		n_pba_size;
+	unsigned		n_pba_max;
+
+	/* Deterministic NAT: the original network and the port range. */
+	npf_addr_t		n_det_oaddr;
+	npf_netmask_t		n_det_omask;
+	unsigned		n_det_minport;
+	unsigned		n_det_maxport;
+	unsigned		n_det_ports;
+	unsigned		n_det_nsubs;
 
 	unsigned		n_algo;
 	union {
@@ -102,6 +159,18 @@ struct npf_natpolicy {
 #define	NPF_NP_CMP_START	offsetof(npf_natpolicy_t, n_type)
 #define	NPF_NP_CMP_SIZE		(sizeof(npf_natpolicy_t) - NPF_NP_CMP_START)
 
+/*
+ * Deterministic NAT limits: the original network of up to 2^24 and
+ * the translation network of up to 2^16 addresses.
+ */
+#define	NPF_DET_MAX_OBITS	24
+#define	NPF_DET_MAX_TBITS	16
+
+#define	NPF_DET_HOSTBITS(m)	((m) == NPF_NO_NETMASK ? 0 : 32 - (m))
+#define	NPF_DET_NADDRS(np)	(1U << NPF_DET_HOSTBITS((np)->n_tmask))
+#define	NPF_DET_BMSIZE(np)	\
+    ((((np)->n_det_nsubs * (np)->n_det_ports + 63) >> 6) * sizeof(uint64_t))
+
 /*
  * NAT entry for a connection.
  */
@@ -122,6 +191,12 @@ struct npf_nat {
 	in_port_t		nt_oport;
 	in_port_t		nt_tport;
 
+	/* Endpoint-independent mapping (if any) sharing the port. */
+	npf_eim_ent_t *		nt_eim;
+
+	/* The port was returned early (see npf_nat_evict()). */
+	bool			nt_portfree;
+
 	/* ALG (if any) associated with this NAT entry. */
 	npf_alg_t *		nt_alg;
 	uintptr_t		nt_alg_arg;
@@ -151,6 +226,99 @@ npf_nat_sysfini(void)
 	pool_cache_destroy(nat_cache);
 }
 
+/*
+ * npf_nat_det_init: validate and set up the deterministic NAT policy.
+ */
+static int
+npf_nat_det_init(npf_natpolicy_t *np, const nvlist_t *nat)
+{
+	const unsigned tbits = NPF_DET_HOSTBITS(np->n_tmask);
+	unsigned obits, range;
+	const void *addr;
+	size_t len;
+
+	/*
+	 * Outbound NAPT from an IPv4 network onto a translation network.
+	 */
+	if (np->n_type != NPF_NATOUT || np->n_alen != sizeof(struct in_addr) ||
+	    (np->n_flags & (NPF_NAT_USETABLE | NPF_NAT_PBA)) != 0 ||
+	    (np->n_flags & NPF_NAT_PORTMAP) == 0) {
+		return EINVAL;
+	}
+	addr = dnvlist_get_binary(nat, "det-addr", &len, NULL, 0);
+	if (!addr || len != np->n_alen) {
+		return EINVAL;
+	}
+	np->n_det_omask = dnvlist_get_number(nat, "det-mask", NPF_NO_NETMASK);
+	if (npf_netmask_check(np->n_alen, np->n_det_omask)) {
+		return EINVAL;
+	}
+	npf_addr_mask(addr, np->n_det_omask, np->n_alen, &np->n_det_oaddr);
+
+	obits = NPF_DET_HOSTBITS(np->n_det_omask);
+	if (obits > NPF_DET_MAX_OBITS || tbits > NPF_DET_MAX_TBITS) {
+		return EINVAL;
+	}
+
+	/*
+	 * Port range and the number of ports per subscriber.  By default,
+	 * the range is evenly divided among the subscribers.
+	 */
+	np->n_det_minport = dnvlist_get_number(nat,
+	    "det-min-port", NPF_NAT_DET_MINPORT);
+	np->n_det_maxport = dnvlist_get_number(nat,
+	    "det-max-port", NPF_NAT_DET_MAXPORT);
+	if (np->n_det_minport == 0 || np->n_det_maxport > 65535 ||
+	    np->n_det_minport > np->n_det_maxport) {
+		return EINVAL;
+	}
+	range = np->n_det_maxport - np->n_det_minport + 1;
+	np->n_det_nsubs = ((1U << obits) + (1U << tbits) - 1) >> tbits;
+	np->n_det_ports = dnvlist_get_number(nat, "det-ports",
+	    range / np->n_det_nsubs);
+	if (np->n_det_ports == 0 ||
+	    np->n_det_ports > range / np->n_det_nsubs) {
+		return EINVAL;
+	}
+
+	np->n_det_bitmaps = kmem_zalloc(NPF_DET_NADDRS(np) *
+	    sizeof(uint64_t *), KM_SLEEP);
+	return 0;
+}
+
+static void
+npf_nat_det_fini(npf_natpolicy_t *np)
+{
+	const unsigned naddrs = NPF_DET_NADDRS(np);
+
+	for (unsigned i = 0; i < naddrs; i++) {
+		uint64_t *bm = np->n_det_bitmaps[i];
+
+		if (bm) {
+			kmem_intr_free(bm, NPF_DET_BMSIZE(np));
+		}
+	}
+	kmem_free(np->n_det_bitmaps, naddrs * sizeof(uint64_t *));
+}
+
+static void
+npf_natpolicy_fini(npf_natpolicy_t *np)
+{
+	for (unsigned i = 0; i < NPF_NAT_NLISTS; i++) {
+		npf_natlist_t *nl = &np->n_nat_lists[i].nl;
+		KASSERT(LIST_EMPTY(&nl->list));
+		mutex_destroy(&nl->lock);
+	}
+	kmem_free(np, sizeof(npf_natpolicy_t));
+}
+
+static inline npf_natlist_t *
+npf_nat_getlist(npf_natpolicy_t *np, const npf_nat_t *nt)
+{
+	const uint32_t h = (uint32_t)((uintptr_t)nt >> 4) * 0x9e3779b1U;
+	return &np->n_nat_lists[h >> (32 - NPF_NAT_NLISTS_SHIFT)].nl;
+}
+
 /*
  * npf_natpolicy_create: create a new NAT policy.
  */
@@ -165,6 +333,12 @@ npf_natpolicy_create(npf_t *npf, const nvlist_t *nat, npf_ruleset_t *rset)
 	atomic_store_relaxed(&np->n_refcnt, 1);
 	np->n_npfctx = npf;
 
+	for (unsigned i = 0; i < NPF_NAT_NLISTS; i++) {
+		npf_natlist_t *nl = &np->n_nat_lists[i].nl;
+		mutex_init(&nl->lock, MUTEX_DEFAULT, IPL_SOFTNET);
+		LIST_INIT(&nl->list);
+	}
+
 	/* The translation type, flags and policy ID. */
 	np->n_type = dnvlist_get_number(nat, "type", 0);
 	np->n_flags = dnvlist_get_number(nat, "flags", 0) & ~NPF_NAT_PRIVMASK;
@@ -174,8 +348,6 @@ npf_natpolicy_create(npf_t *npf, const nvlist_t *nat, npf_ruleset_t *rset)
 	if (((np->n_type == NPF_NATIN) ^ (np->n_type == NPF_NATOUT)) == 0) {
 		goto err;
 	}
-	mutex_init(&np->n_lock, MUTEX_DEFAULT, IPL_SOFTNET);
-	LIST_INIT(&np->n_nat_list);
 
 	/*
 	 * Translation IP, mask and port (if applicable).  If using the
@@ -213,6 +385,11 @@ npf_natpolicy_create(npf_t *npf, const nvlist_t *nat, npf_ruleset_t *rset)
 		break;
 	case NPF_ALGO_NETMAP:
 		break;
+	case NPF_ALGO_DETERMINISTIC:
+		if (npf_nat_det_init(np, nat)) {
+			goto err;
+		}
+		break;
 	case NPF_ALGO_IPHASH:
 	case NPF_ALGO_RR:
 	default:
@@ -221,10 +398,49 @@ npf_natpolicy_create(npf_t *npf, const nvlist_t *nat, npf_ruleset_t *rset)
 		}
 		break;
 	}
+
+	/*
+	 * Port block allocation (PBA).
+	 */
+	if (np->n_flags & NPF_NAT_PBA) {
+		const unsigned pba_size = dnvlist_get_number(nat,
+		    "nat-pba-size", 0);
+
+		if ((np->n_flags & NPF_NAT_PORTMAP) == 0 ||
+		    pba_size < NPF_NAT_PBA_MINSIZE ||
+		    pba_size > NPF_NAT_PBA_MAXSIZE ||
+		    (pba_size & (pba_size - 1)) != 0) {
+			goto err;
+		}
+		np->n_pba_size = pba_size;
+		np->n_pba_max = dnvlist_get_number(nat, "nat-pba-max",
+		    NPF_NAT_PBA_MAXBLOCKS);
+		if (np->n_pba_max == 0) {
+			goto err;
+		}
+		np->n_pba = npf_pba_create(npf, npf->portmap, np->n_type,
+		    np->n_pba_size, np->n_pba_max);
+	}
+
+	/*
+	 * Endpoint-independent mapping (EIM).
+	 */
+	if (np->n_flags & NPF_NAT_EIM) {
+		if (np->n_type != NPF_NATOUT ||
+		    (np->n_flags & NPF_NAT_PORTMAP) == 0) {
+			if (np->n_pba) {
+				npf_pba_destroy(np->n_pba);
+			}
+			if (np->n_det_bitmaps) {
+				npf_nat_det_fini(np);
+			}
+			goto err;
+		}
+		np->n_eim = npf_eim_create();
+	}
 	return np;
 err:
-	mutex_destroy(&np->n_lock);
-	kmem_free(np, sizeof(npf_natpolicy_t));
+	npf_natpolicy_fini(np);
 	return NULL;
 }
 
@@ -248,6 +464,19 @@ npf_natpolicy_export(const npf_natpolicy_t *np, nvlist_t *nat)
 	case NPF_ALGO_NPT66:
 		nvlist_add_number(nat, "npt66-adj", np->n_npt66_adj);
 		break;
+	case NPF_ALGO_DETERMINISTIC:
+		nvlist_add_binary(nat, "det-addr",
+		    &np->n_det_oaddr, np->n_alen);
+		nvlist_add_number(nat, "det-mask", np->n_det_omask);
+		nvlist_add_number(nat, "det-min-port", np->n_det_minport);
+		nvlist_add_number(nat, "det-max-port", np->n_det_maxport);
+		nvlist_add_number(nat, "det-ports", np->n_det_ports);
+		nvlist_add_number(nat, "det-nsubs", np->n_det_nsubs);
+		break;
+	}
+	if (np->n_flags & NPF_NAT_PBA) {
+		nvlist_add_number(nat, "nat-pba-size", np->n_pba_size);
+		nvlist_add_number(nat, "nat-pba-max", np->n_pba_max);
 	}
 	return 0;
 }
@@ -260,9 +489,16 @@ npf_natpolicy_release(npf_natpolicy_t *np)
 	if (atomic_dec_uint_nv(&np->n_refcnt) != 0) {
 		return;
 	}
-	KASSERT(LIST_EMPTY(&np->n_nat_list));
-	mutex_destroy(&np->n_lock);
-	kmem_free(np, sizeof(npf_natpolicy_t));
+	if (np->n_pba) {
+		npf_pba_destroy(np->n_pba);
+	}
+	if (np->n_eim) {
+		npf_eim_destroy(np->n_eim);
+	}
+	if (np->n_det_bitmaps) {
+		npf_nat_det_fini(np);
+	}
+	npf_natpolicy_fini(np);
 }
 
 /*
@@ -279,15 +515,18 @@ npf_natpolicy_destroy(npf_natpolicy_t *np)
 	 * then expire them and kick the worker.
 	 */
 	if (atomic_load_relaxed(&np->n_refcnt) > 1) {
-		npf_nat_t *nt;
-
-		mutex_enter(&np->n_lock);
-		LIST_FOREACH(nt, &np->n_nat_list, nt_entry) {
-			npf_conn_t *con = nt->nt_conn;
-			KASSERT(con != NULL);
-			npf_conn_expire(con);
+		for (unsigned i = 0; i < NPF_NAT_NLISTS; i++) {
+			npf_natlist_t *nl = &np->n_nat_lists[i].nl;
+			npf_nat_t *nt;
+
+			mutex_enter(&nl->lock);
+			LIST_FOREACH(nt, &nl->list, nt_entry) {
+				npf_conn_t *con = nt->nt_conn;
+				KASSERT(con != NULL);
+				npf_conn_expire(con);
+			}
+			mutex_exit(&nl->lock);
 		}
-		mutex_exit(&np->n_lock);
 		npf_worker_signal(np->n_npfctx);
 	}
 	KASSERT(atomic_load_relaxed(&np->n_refcnt) >= 1);
@@ -304,16 +543,20 @@ npf_natpolicy_destroy(npf_natpolicy_t *np)
 void
 npf_nat_freealg(npf_natpolicy_t *np, npf_alg_t *alg)
 {
-	npf_nat_t *nt;
+	for (unsigned i = 0; i < NPF_NAT_NLISTS; i++) {
+		npf_natlist_t *nl = &np->n_nat_lists[i].nl;
+		npf_nat_t *nt;
 
-	mutex_enter(&np->n_lock);
-	LIST_FOREACH(nt, &np->n_nat_list, nt_entry) {
-		if (nt->nt_alg == alg) {
-			npf_alg_destroy(np->n_npfctx, alg, nt, nt->nt_conn);
-			nt->nt_alg = NULL;
+		mutex_enter(&nl->lock);
+		LIST_FOREACH(nt, &nl->list, nt_entry) {
+			if (nt->nt_alg == alg) {
+				npf_alg_destroy(np->n_npfctx, alg,
+				    nt, nt->nt_conn);
+				nt->nt_alg = NULL;
+			}
 		}
+		mutex_exit(&nl->lock);
 	}
-	mutex_exit(&np->n_lock);
 }
 
 /*
@@ -420,6 +663,250 @@ npf_nat_algo_netmap(const npf_cache_t *npc, const npf_natpolicy_t *np,
 	npf_addr_bitor(orig_addr, np->n_tmask, npc->npc_alen, addr);
 }
 
+/*
+ * npf_nat_algo_det: compute the translation address for the original
+ * address using the deterministic NAT mapping.
+ *
+ * => Returns the subscriber index or -1 if not in the original network.
+ */
+static int
+npf_nat_algo_det(const npf_natpolicy_t *np, const npf_addr_t *oaddr,
+    npf_addr_t *taddr)
+{
+	const uint32_t ohmask = (1U << NPF_DET_HOSTBITS(np->n_det_omask)) - 1;
+	const uint32_t thmask = (1U << NPF_DET_HOSTBITS(np->n_tmask)) - 1;
+	const uint32_t o = ntohl(oaddr->word32[0]);
+	uint32_t idx, tnet;
+
+	if ((o & ~ohmask) != ntohl(np->n_det_oaddr.word32[0])) {
+		return -1;
+	}
+	idx = o & ohmask;
+	tnet = ntohl(np->n_taddr.word32[0]) & ~thmask;
+	taddr->word32[0] = htonl(tnet + idx / np->n_det_nsubs);
+	return idx;
+}
+
+/*
+ * npf_nat_det_bitmap: get the port bitmap of the translation address,
+ * given its index within the translation network.
+ */
+static uint64_t *
+npf_nat_det_bitmap(npf_natpolicy_t *np, unsigned aidx)
+{
+	uint64_t *bm, *obm;
+
+	KASSERT(aidx < NPF_DET_NADDRS(np));
+	bm = atomic_load_consume(&np->n_det_bitmaps[aidx]);
+	if (__predict_true(bm)) {
+		return bm;
+	}
+	bm = kmem_intr_zalloc(NPF_DET_BMSIZE(np), KM_NOSLEEP);
+	if (bm == NULL) {
+		return NULL;
+	}
+	obm = atomic_cas_ptr(&np->n_det_bitmaps[aidx], NULL, bm);
+	if (obm) {
+		/* Race: use the existing bitmap. */
+		kmem_intr_free(bm, NPF_DET_BMSIZE(np));
+		bm = obm;
+	}
+	return bm;
+}
+
+static bool
+npf_nat_det_setbit(uint64_t *bm, unsigned bit)
+{
+	volatile uint64_t *wp = &bm[bit >> 6];
+	const uint64_t b = UINT64_C(1) << (bit & 63);
+	uint64_t oval;
+
+	do {
+		oval = *wp;
+		if (oval & b) {
+			return false;
+		}
+	} while (atomic_cas_64(wp, oval, oval | b) != oval);
+	return true;
+}
+
+static void
+npf_nat_det_clrbit(uint64_t *bm, unsigned bit)
+{
+	volatile uint64_t *wp = &bm[bit >> 6];
+	const uint64_t b = UINT64_C(1) << (bit & 63);
+	uint64_t oval;
+
+	do {
+		oval = *wp;
+		KASSERT(oval & b);
+	} while (atomic_cas_64(wp, oval, oval & ~b) != oval);
+}
+
+/*
+ * npf_nat_det_getport: allocate a port in the subscriber's range.
+ *
+ * => Returns the port value in network byte-order; zero on failure.
+ */
+static in_port_t
+npf_nat_det_getport(npf_natpolicy_t *np, unsigned idx)
+{
+	const unsigned nports = np->n_det_ports;
+	const unsigned base = (idx % np->n_det_nsubs) * nports;
+	unsigned start;
+	uint64_t *bm;
+
+	bm = npf_nat_det_bitmap(np, idx / np->n_det_nsubs);
+	if (__predict_false(bm == NULL)) {
+		return 0;
+	}
+
+	/* Randomly select a port in the range and linearly probe. */
+	start = cprng_fast32() % nports;
+	for (unsigned n = 0; n < nports; n++) {
+		const unsigned bit = base + (start + n) % nports;
+
+		if (npf_nat_det_setbit(bm, bit)) {
+			return htons(np->n_det_minport + bit);
+		}
+	}
+	return 0;
+}
+
+/*
+ * npf_nat_det_takeport: allocate a specific port, verifying that it
+ * is in the subscriber's range.
+ */
+static bool
+npf_nat_det_takeport(npf_natpolicy_t *np, const npf_addr_t *oaddr,
+    const npf_addr_t *taddr, in_port_t port)
+{
+	const unsigned nports = np->n_det_ports;
+	const unsigned bit = ntohs(port) - np->n_det_minport;
+	npf_addr_t addr;
+	uint64_t *bm;
+	int idx;
+
+	idx = npf_nat_algo_det(np, oaddr, &addr);
+	if (idx < 0 || addr.word32[0] != taddr->word32[0] ||
+	    ntohs(port) < np->n_det_minport ||
+	    bit / nports != idx % np->n_det_nsubs) {
+		return false;
+	}
+	bm = npf_nat_det_bitmap(np, idx / np->n_det_nsubs);
+	return bm && npf_nat_det_setbit(bm, bit);
+}
+
+/*
+ * npf_nat_det_putport: release the port of the translation address.
+ */
+static void
+npf_nat_det_putport(npf_natpolicy_t *np, const npf_addr_t *taddr,
+    in_port_t port)
+{
+	const uint32_t thmask = (1U << NPF_DET_HOSTBITS(np->n_tmask)) - 1;
+	const unsigned aidx = ntohl(taddr->word32[0]) & thmask;
+	uint64_t *bm = atomic_load_consume(&np->n_det_bitmaps[aidx]);
+
+	KASSERT(bm != NULL);
+	npf_nat_det_clrbit(bm, ntohs(port) - np->n_det_minport);
+}
+
+/*
+ * npf_nat_getport: allocate a port for translation.
+ *
+ * => PBA may also change the translation address to the one bound to
+ *    the original address.
+ */
+static in_port_t
+npf_nat_getport(npf_natpolicy_t *np, npf_nat_t *nt, int det_idx)
+{
+	if (np->n_pba) {
+		return npf_pba_get(np->n_pba, nt->nt_alen,
+		    &nt->nt_oaddr, &nt->nt_taddr);
+	}
+	if (det_idx >= 0) {
+		return npf_nat_det_getport(np, det_idx);
+	}
+	if (np->n_flags & NPF_NAT_PORTMAP) {
+		npf_portmap_t *pm = np->n_npfctx->portmap;
+		return npf_portmap_get(pm, nt->nt_alen, &nt->nt_taddr);
+	}
+	return np->n_tport;
+}
+
+/*
+ * npf_nat_evlog_p: whether the NAT entry should be recorded in the event
+ * log.  The port taken from a PBA block is covered by the block record;
+ * the deterministic mapping can be derived from the policy.
+ */
+static inline bool
+npf_nat_evlog_p(const npf_natpolicy_t *np, const npf_nat_t *nt)
+{
+	if (np->n_det_bitmaps) {
+		return false;
+	}
+	return np->n_pba == NULL || nt->nt_tport == 0;
+}
+
+/*
+ * npf_nat_takeport: take a specific port, e.g. of the loaded connection.
+ */
+static bool
+npf_nat_takeport(npf_natpolicy_t *np, const npf_nat_t *nt)
+{
+	if (np->n_pba) {
+		return npf_pba_take(np->n_pba, nt->nt_alen,
+		    &nt->nt_oaddr, &nt->nt_taddr, nt->nt_tport);
+	}
+	if (np->n_det_bitmaps) {
+		return npf_nat_det_takeport(np, &nt->nt_oaddr,
+		    &nt->nt_taddr, nt->nt_tport);
+	}
+	if (np->n_flags & NPF_NAT_PORTMAP) {
+		npf_portmap_t *pm = np->n_npfctx->portmap;
+		return npf_portmap_take(pm, nt->nt_alen,
+		    &nt->nt_taddr, nt->nt_tport);
+	}
+	return true;
+}
+
+/*
+ * npf_nat_putport: return the port to the port block or the port map.
+ */
+static void
+npf_nat_putport(npf_natpolicy_t *np, unsigned alen, const npf_addr_t *oaddr,
+    const npf_addr_t *taddr, in_port_t port)
+{
+	if (np->n_pba) {
+		npf_pba_put(np->n_pba, alen, oaddr, port);
+	} else if (np->n_det_bitmaps) {
+		npf_nat_det_putport(np, taddr, port);
+	} else if (np->n_flags & NPF_NAT_PORTMAP) {
+		npf_portmap_put(np->n_npfctx->portmap, alen, taddr, port);
+	}
+}
+
+/*
+ * npf_nat_eim_insert: create the endpoint-independent mapping for the
+ * NAT entry with the allocated port or, if lost the race, switch to the
+ * existing mapping.
+ */
+static void
+npf_nat_eim_insert(npf_natpolicy_t *np, npf_nat_t *nt, unsigned proto)
+{
+	const in_port_t tport = nt->nt_tport;
+	npf_addr_t taddr;
+
+	memcpy(&taddr, &nt->nt_taddr, sizeof(npf_addr_t));
+	nt->nt_eim = npf_eim_insert(np->n_eim, nt->nt_alen, &nt->nt_oaddr,
+	    nt->nt_oport, proto, &nt->nt_taddr, &nt->nt_tport);
+	if (nt->nt_tport != tport ||
+	    memcmp(&nt->nt_taddr, &taddr, nt->nt_alen) != 0) {
+		npf_nat_putport(np, nt->nt_alen, &nt->nt_oaddr, &taddr, tport);
+	}
+}
+
 static inline npf_addr_t *
 npf_nat_getaddr(npf_cache_t *npc, npf_natpolicy_t *np, const unsigned alen)
 {
@@ -456,8 +943,10 @@ npf_nat_create(npf_cache_t *npc, npf_natpolicy_t *np, npf_conn_t *con)
 	const unsigned alen = npc->npc_alen;
 	const nbuf_t *nbuf = npc->npc_nbuf;
 	npf_t *npf = npc->npc_ctx;
+	npf_natlist_t *nl;
 	npf_addr_t *taddr;
 	npf_nat_t *nt;
+	int det_idx = -1;
 
 	KASSERT(npf_iscached(npc, NPC_IP46));
 	KASSERT(npf_iscached(npc, NPC_LAYER4));
@@ -470,6 +959,8 @@ npf_nat_create(npf_cache_t *npc, npf_natpolicy_t *np, npf_conn_t *con)
 	npf_stats_inc(npf, NPF_STAT_NAT_CREATE);
 	nt->nt_natpolicy = np;
 	nt->nt_conn = con;
+	nt->nt_eim = NULL;
+	nt->nt_portfree = false;
 	nt->nt_alg = NULL;
 
 	/*
@@ -500,6 +991,15 @@ npf_nat_create(npf_cache_t *npc, npf_natpolicy_t *np, npf_conn_t *con)
 		const unsigned which = npf_nat_which(np->n_type, NPF_FLOW_FORW);
 		npf_nat_algo_netmap(npc, np, which, &nt->nt_taddr);
 		taddr = &nt->nt_taddr;
+	} else if (np->n_algo == NPF_ALGO_DETERMINISTIC) {
+		/* Outbound only: the source is the original address. */
+		det_idx = npf_nat_algo_det(np,
+		    npc->npc_ips[NPF_SRC], &nt->nt_taddr);
+		if (__predict_false(det_idx < 0)) {
+			pool_cache_put(nat_cache, nt);
+			return NULL;
+		}
+		taddr = &nt->nt_taddr;
 	} else {
 		/* Static IP address. */
 		taddr = &np->n_taddr;
@@ -538,18 +1038,34 @@ npf_nat_create(npf_cache_t *npc, npf_natpolicy_t *np, npf_conn_t *con)
 		    uh->uh_sport : uh->uh_dport;
 	}
 
+	/*
+	 * With the endpoint-independent mapping, reuse the translation
+	 * address and port of the original address and port, if mapped.
+	 */
+	if (np->n_eim) {
+		nt->nt_eim = npf_eim_lookup(np->n_eim, alen, &nt->nt_oaddr,
+		    nt->nt_oport, proto, &nt->nt_taddr, &nt->nt_tport);
+		if (nt->nt_eim) {
+			goto out;
+		}
+	}
+
 	/* Get a new port for translation. */
-	if ((np->n_flags & NPF_NAT_PORTMAP) != 0) {
-		npf_portmap_t *pm = np->n_npfctx->portmap;
-		nt->nt_tport = npf_portmap_get(pm, alen, taddr);
-	} else {
-		nt->nt_tport = np->n_tport;
+	nt->nt_tport = npf_nat_getport(np, nt, det_idx);
+	if (np->n_eim && nt->nt_tport) {
+		npf_nat_eim_insert(np, nt, proto);
 	}
 out:
-	mutex_enter(&np->n_lock);
-	LIST_INSERT_HEAD(&np->n_nat_list, nt, nt_entry);
+	nl = npf_nat_getlist(np, nt);
+	mutex_enter(&nl->lock);
+	LIST_INSERT_HEAD(&nl->list, nt, nt_entry);
 	/* Note: we also consume the reference on policy. */
-	mutex_exit(&np->n_lock);
+	mutex_exit(&nl->lock);
+
+	if (npf_nat_evlog_p(np, nt)) {
+		npf_evlog_nat(npf, NPF_EVENT_NAT_CREATE, con, np->n_type,
+		    &nt->nt_taddr, nt->nt_tport);
+	}
 	return nt;
 }
 
@@ -587,7 +1103,7 @@ npf_dnat_translate(npf_cache_t *npc, npf_nat_t *nt, npf_flow_t flow)
 	KASSERT(!nbuf_flag_p(npc->npc_nbuf, NBUF_DATAREF_RESET));
 
 	/* Finally, perform the translation. */
-	return npf_napt_rwr(npc, which, addr, port);
+	return npf_napt_rwr(npc, which, addr, port, npf_cksum_offload(npc));
 }
 
 /*
@@ -614,7 +1130,8 @@ npf_snat_translate(npf_cache_t *npc, const npf_natpolicy_t *np, npf_flow_t flow)
 		taddr = &np->n_taddr;
 		break;
 	}
-	return npf_napt_rwr(npc, which, taddr, np->n_tport);
+	return npf_napt_rwr(npc, which, taddr, np->n_tport,
+	    npf_cksum_offload(npc));
 }
 
 /*
@@ -787,6 +1304,9 @@ out:
 		if (error) {
 			/* It was created for NAT - just expire. */
 			npf_conn_expire(ncon);
+		} else {
+			/* Replicate the connection (see npfk_packet_handler). */
+			npf_sync_conn(npc->npc_ctx, NPF_SYNC_CREATE, ncon);
 		}
 		npf_conn_release(ncon);
 	}
@@ -835,6 +1355,42 @@ npf_nat_getalgarg(const npf_nat_t *nt)
 	return nt->nt_alg_arg;
 }
 
+/*
+ * npf_nat_freeport: return taken port to the port block or the portmap,
+ * unless it is still shared via the endpoint-independent mapping.
+ */
+static void
+npf_nat_freeport(npf_natpolicy_t *np, npf_nat_t *nt)
+{
+	bool shared;
+
+	if (nt->nt_portfree) {
+		return;
+	}
+	shared = nt->nt_eim && !npf_eim_put(np->n_eim, nt->nt_eim);
+	if (!shared && nt->nt_tport) {
+		npf_nat_putport(np, nt->nt_alen, &nt->nt_oaddr,
+		    &nt->nt_taddr, nt->nt_tport);
+	}
+	nt->nt_portfree = true;
+}
+
+/*
+ * npf_nat_evict: return the port of the NAT entry of the connection,
+ * which is replaced by the replication, so that the replacement could
+ * take it.  The translation itself is kept for the packets in flight.
+ *
+ * => Must be called with the config lock held.
+ */
+void
+npf_nat_evict(npf_nat_t *nt)
+{
+	npf_natpolicy_t *np = nt->nt_natpolicy;
+
+	KASSERT(npf_config_locked_p(np->n_npfctx));
+	npf_nat_freeport(np, nt);
+}
+
 /*
  * npf_nat_destroy: destroy NAT structure (performed on connection expiration).
  */
@@ -843,6 +1399,7 @@ npf_nat_destroy(npf_conn_t *con, npf_nat_t *nt)
 {
 	npf_natpolicy_t *np = nt->nt_natpolicy;
 	npf_t *npf = np->n_npfctx;
+	npf_natlist_t *nl;
 	npf_alg_t *alg;
 
 	/* Execute the ALG destroy callback, if any. */
@@ -850,21 +1407,21 @@ npf_nat_destroy(npf_conn_t *con, npf_nat_t *nt)
 		npf_alg_destroy(npf, alg, nt, con);
 		nt->nt_alg = NULL;
 	}
-
-	/* Return taken port to the portmap. */
-	if ((np->n_flags & NPF_NAT_PORTMAP) != 0 && nt->nt_tport) {
-		npf_portmap_t *pm = npf->portmap;
-		npf_portmap_put(pm, nt->nt_alen, &nt->nt_taddr, nt->nt_tport);
-	}
+	npf_nat_freeport(np, nt);
 	npf_stats_inc(np->n_npfctx, NPF_STAT_NAT_DESTROY);
+	if (npf_nat_evlog_p(np, nt)) {
+		npf_evlog_nat(npf, NPF_EVENT_NAT_DESTROY, con, np->n_type,
+		    &nt->nt_taddr, nt->nt_tport);
+	}
 
 	/*
 	 * Remove the connection from the list and drop the reference on
 	 * the NAT policy.  Note: this might trigger its destruction.
 	 */
-	mutex_enter(&np->n_lock);
+	nl = npf_nat_getlist(np, nt);
+	mutex_enter(&nl->lock);
 	LIST_REMOVE(nt, nt_entry);
-	mutex_exit(&np->n_lock);
+	mutex_exit(&nl->lock);
 	npf_natpolicy_release(np);
 
 	pool_cache_put(nat_cache, nt);
@@ -898,6 +1455,67 @@ npf_nat_export(npf_t *npf, const npf_nat_t *nt, nvlist_t *con_nv)
 	nvlist_move_nvlist(con_nv, "nat", nat_nv);
 }
 
+/*
+ * npf_nat_import_bind: take the translation port of the imported NAT
+ * entry, associate the entry with the policy and the connection.
+ *
+ * => If 'active' is true, then the policy is globally visible.
+ * => Returns true on success and false on failure.
+ */
+static bool
+npf_nat_import_bind(npf_t *npf, npf_natpolicy_t *np, npf_nat_t *nt,
+    npf_conn_t *con, bool active)
+{
+	const unsigned alen = nt->nt_alen;
+	npf_natlist_t *nl;
+
+	/*
+	 * Take a specific port from the port block or port-map, unless
+	 * already taken by the endpoint-independent mapping.
+	 */
+	if (np->n_eim && nt->nt_tport) {
+		npf_addr_t taddr_eim;
+		in_port_t tport_eim;
+
+		nt->nt_eim = npf_eim_lookup(np->n_eim, alen,
+		    &nt->nt_oaddr, nt->nt_oport, npf_conn_getproto(con),
+		    &taddr_eim, &tport_eim);
+		if (nt->nt_eim && (tport_eim != nt->nt_tport ||
+		    memcmp(&taddr_eim, &nt->nt_taddr, alen) != 0)) {
+			npf_eim_put(np->n_eim, nt->nt_eim);
+			return false;
+		}
+	}
+	if (nt->nt_eim == NULL && nt->nt_tport) {
+		if (!npf_nat_takeport(np, nt)) {
+			return false;
+		}
+		if (np->n_eim) {
+			npf_nat_eim_insert(np, nt, npf_conn_getproto(con));
+		}
+	}
+	npf_stats_inc(npf, NPF_STAT_NAT_CREATE);
+
+	/*
+	 * Associate, take a reference and insert.  Unlocked/non-atomic
+	 * if the policy is not yet globally visible.
+	 */
+	nt->nt_natpolicy = np;
+	nt->nt_conn = con;
+	nl = npf_nat_getlist(np, nt);
+	if (active) {
+		atomic_inc_uint(&np->n_refcnt);
+		mutex_enter(&nl->lock);
+		LIST_INSERT_HEAD(&nl->list, nt, nt_entry);
+		mutex_exit(&nl->lock);
+	} else {
+		atomic_store_relaxed(&np->n_refcnt,
+		    atomic_load_relaxed(&np->n_refcnt) + 1);
+		LIST_INSERT_HEAD(&nl->list, nt, nt_entry);
+	}
+	return true;
+}
+
 /*
  * npf_nat_import: find the NAT policy and unserialize the NAT entry.
  */
@@ -928,6 +1546,7 @@ npf_nat_import(npf_t *npf, const nvlist_t *nat,
 	if (alen == 0 || alen > sizeof(npf_addr_t)) {
 		goto err;
 	}
+	nt->nt_alen = alen;
 
 	taddr = dnvlist_get_binary(nat, "taddr", &len, NULL, 0);
 	if (!taddr || len != alen) {
@@ -944,26 +1563,73 @@ npf_nat_import(npf_t *npf, const nvlist_t *nat,
 	nt->nt_oport = dnvlist_get_number(nat, "oport", 0);
 	nt->nt_tport = dnvlist_get_number(nat, "tport", 0);
 
-	/* Take a specific port from port-map. */
-	if ((np->n_flags & NPF_NAT_PORTMAP) != 0 && nt->nt_tport) {
-		npf_portmap_t *pm = npf->portmap;
+	if (!npf_nat_import_bind(npf, np, nt, con, false)) {
+		goto err;
+	}
+	return nt;
+err:
+	pool_cache_put(nat_cache, nt);
+	return NULL;
+}
+
+/*
+ * npf_nat_getrec: store the NAT entry in the connection snapshot record.
+ *
+ * => Returns the interface ID, if any; the caller sets the name.
+ */
+unsigned
+npf_nat_getrec(const npf_nat_t *nt, npf_connrec_t *rec)
+{
+	const unsigned alen = nt->nt_alen;
+
+	rec->cr_nat = 1;
+	rec->cr_nat_id = nt->nt_natpolicy->n_id;
+	memcpy(&rec->cr_nat_oaddr, &nt->nt_oaddr, alen);
+	rec->cr_nat_oport = nt->nt_oport;
+	memcpy(&rec->cr_nat_taddr, &nt->nt_taddr, alen);
+	rec->cr_nat_tport = nt->nt_tport;
+	return nt->nt_ifid;
+}
+
+/*
+ * npf_nat_setrec: find the NAT policy of the active configuration and
+ * construct the NAT entry from the connection snapshot record.
+ *
+ * => Must be called with the config lock held.
+ */
+npf_nat_t *
+npf_nat_setrec(npf_t *npf, const npf_connrec_t *rec, npf_conn_t *con)
+{
+	npf_natpolicy_t *np;
+	npf_nat_t *nt;
+
+	KASSERT(npf_config_locked_p(npf));
+
+	np = npf_ruleset_findnat(npf_config_natset(npf), rec->cr_nat_id);
+	if (np == NULL || rec->cr_alen == 0 ||
+	    rec->cr_alen > sizeof(npf_addr_t)) {
+		return NULL;
+	}
+	nt = pool_cache_get(nat_cache, PR_WAITOK);
+	memset(nt, 0, sizeof(npf_nat_t));
+
+	if (rec->cr_nat_ifname[0] != '\0') {
+		char ifname[IFNAMSIZ];
 
-		if (!npf_portmap_take(pm, nt->nt_alen,
-		    &nt->nt_taddr, nt->nt_tport)) {
+		strlcpy(ifname, rec->cr_nat_ifname, sizeof(ifname));
+		if ((nt->nt_ifid = npf_ifmap_register(npf, ifname)) == 0) {
 			goto err;
 		}
 	}
-	npf_stats_inc(npf, NPF_STAT_NAT_CREATE);
+	nt->nt_alen = rec->cr_alen;
+	memcpy(&nt->nt_oaddr, &rec->cr_nat_oaddr, sizeof(npf_addr_t));
+	memcpy(&nt->nt_taddr, &rec->cr_nat_taddr, sizeof(npf_addr_t));
+	nt->nt_oport = rec->cr_nat_oport;
+	nt->nt_tport = rec->cr_nat_tport;
 
-	/*
-	 * Associate, take a reference and insert.  Unlocked/non-atomic
-	 * since the policy is not yet globally visible.
-	 */
-	nt->nt_natpolicy = np;
-	nt->nt_conn = con;
-	atomic_store_relaxed(&np->n_refcnt,
-	    atomic_load_relaxed(&np->n_refcnt) + 1);
-	LIST_INSERT_HEAD(&np->n_nat_list, nt, nt_entry);
+	if (!npf_nat_import_bind(npf, np, nt, con, true)) {
+		goto err;
+	}
 	return nt;
 err:
 	pool_cache_put(nat_cache, nt);
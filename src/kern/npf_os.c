@@ -261,6 +261,7 @@ npf_dev_ioctl(dev_t dev, u_long cmd, void *data, int flag, lwp_t *l)
 	case IOC_NPF_RULE:
 	case IOC_NPF_CONN_LOOKUP:
 	case IOC_NPF_TABLE_REPLACE:
+	case IOC_NPF_CONN_LIST:
 		 /* nvlist_ref_t argument, handled below */
 		 break;
 	default:
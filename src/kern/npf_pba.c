@@ -0,0 +1,423 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * NPF port block allocation (PBA) for NAT.
+ *
+ * Overview
+ *
+ *	Instead of allocating each translation port from the port map,
+ *	every subscriber (i.e. the original address) is assigned a block
+ *	of contiguous ports on the translation address.  The ports are
+ *	then allocated locally, within the block.  More blocks are added
+ *	on demand, up to the limit, and all blocks of the subscriber are
+ *	released once its last connection is gone.  Therefore, only the
+ *	block assignments need to be logged to reconstruct the mapping:
+ *	they are recorded in the event log (see npf_evlog.c).
+ *
+ *	The subscriber is bound to the translation address selected for
+ *	its first connection, i.e. the address pooling is "paired".
+ *
+ * Concurrency
+ *
+ *	The subscribers are kept in a hash table with a lock per bucket.
+ *	The bucket lock protects the subscriber entries and their blocks.
+ */
+
+#ifdef _KERNEL
+#include <sys/cdefs.h>
+__KERNEL_RCSID(0, "$NetBSD$");
+
+#include <sys/param.h>
+#include <sys/types.h>
+
+#include <sys/kmem.h>
+#include <sys/mutex.h>
+#include <sys/systm.h>
+#endif
+
+#include "npf_impl.h"
+
+#define	PBA_HASH_BUCKETS	512
+#define	PBA_HASH_MASK		(PBA_HASH_BUCKETS - 1)
+
+typedef struct pba_block {
+	LIST_ENTRY(pba_block)	entry;
+	unsigned		base;
+	unsigned		used;
+	unsigned		hint;
+	uint64_t		bits[];
+} pba_block_t;
+
+typedef struct pba_sub {
+	LIST_ENTRY(pba_sub)	entry;
+	LIST_HEAD(, pba_block)	blocks;
+	unsigned		nblocks;
+	unsigned		refcnt;
+	unsigned		alen;
+	npf_addr_t		oaddr;
+	npf_addr_t		taddr;
+} pba_sub_t;
+
+typedef struct {
+	kmutex_t		lock;
+	LIST_HEAD(, pba_sub)	list;
+} pba_bucket_t;
+
+struct npf_pba {
+	npf_t *			npf;
+	npf_portmap_t *		portmap;
+	unsigned		ntype;
+	unsigned		block_size;
+	unsigned		max_blocks;
+	pba_bucket_t		buckets[PBA_HASH_BUCKETS];
+};
+
+#define	PBA_BLOCK_WORDS(n)	(((n) + 63) >> 6)
+#define	PBA_BLOCK_SIZE(n)	\
+    offsetof(pba_block_t, bits[PBA_BLOCK_WORDS(n)])
+
+/*
+ * npf_pba_create: create the PBA structures of the NAT policy of the
+ * given type, with the blocks taken from the port map.
+ */
+npf_pba_t *
+npf_pba_create(npf_t *npf, npf_portmap_t *pm, unsigned ntype,
+    unsigned block_size, unsigned max_blocks)
+{
+	npf_pba_t *pba;
+
+	KASSERT(block_size >= NPF_NAT_PBA_MINSIZE);
+	KASSERT(block_size <= NPF_NAT_PBA_MAXSIZE);
+	KASSERT((block_size & (block_size - 1)) == 0);
+	KASSERT(max_blocks > 0);
+
+	pba = kmem_zalloc(sizeof(npf_pba_t), KM_SLEEP);
+	pba->npf = npf;
+	pba->portmap = pm;
+	pba->ntype = ntype;
+	pba->block_size = block_size;
+	pba->max_blocks = max_blocks;
+
+	for (unsigned i = 0; i < PBA_HASH_BUCKETS; i++) {
+		pba_bucket_t *b = &pba->buckets[i];
+		mutex_init(&b->lock, MUTEX_DEFAULT, IPL_SOFTNET);
+		LIST_INIT(&b->list);
+	}
+	return pba;
+}
+
+/*
+ * npf_pba_destroy: destroy the PBA structures.
+ *
+ * => The caller ensures there are no subscribers, i.e. all the NAT
+ *    entries which used PBA are destroyed.
+ */
+void
+npf_pba_destroy(npf_pba_t *pba)
+{
+	for (unsigned i = 0; i < PBA_HASH_BUCKETS; i++) {
+		pba_bucket_t *b = &pba->buckets[i];
+		KASSERT(LIST_EMPTY(&b->list));
+		mutex_destroy(&b->lock);
+	}
+	kmem_free(pba, sizeof(npf_pba_t));
+}
+
+static pba_bucket_t *
+pba_getbucket(npf_pba_t *pba, unsigned alen, const npf_addr_t *addr)
+{
+	const uint32_t hash = murmurhash2(addr, alen, 0x9e3779b9);
+	return &pba->buckets[hash & PBA_HASH_MASK];
+}
+
+static pba_sub_t *
+pba_lookup(pba_bucket_t *b, unsigned alen, const npf_addr_t *oaddr)
+{
+	pba_sub_t *sub;
+
+	KASSERT(mutex_owned(&b->lock));
+	LIST_FOREACH(sub, &b->list, entry) {
+		if (sub->alen == alen &&
+		    memcmp(&sub->oaddr, oaddr, alen) == 0) {
+			return sub;
+		}
+	}
+	return NULL;
+}
+
+static pba_sub_t *
+pba_sub_create(pba_bucket_t *b, unsigned alen,
+    const npf_addr_t *oaddr, const npf_addr_t *taddr)
+{
+	pba_sub_t *sub;
+
+	sub = kmem_intr_zalloc(sizeof(pba_sub_t), KM_NOSLEEP);
+	if (sub == NULL) {
+		return NULL;
+	}
+	LIST_INIT(&sub->blocks);
+	sub->alen = alen;
+	memcpy(&sub->oaddr, oaddr, alen);
+	memcpy(&sub->taddr, taddr, alen);
+	LIST_INSERT_HEAD(&b->list, sub, entry);
+	return sub;
+}
+
+/*
+ * pba_sub_release: release all blocks of the subscriber and destroy it.
+ */
+static void
+pba_sub_release(npf_pba_t *pba, pba_sub_t *sub)
+{
+	const unsigned nports = pba->block_size;
+	pba_block_t *blk;
+
+	KASSERT(sub->refcnt == 0);
+
+	while ((blk = LIST_FIRST(&sub->blocks)) != NULL) {
+		LIST_REMOVE(blk, entry);
+		npf_portmap_putblock(pba->portmap, sub->alen, &sub->taddr,
+		    htons(blk->base), nports);
+		npf_evlog_block(pba->npf, NPF_EVENT_NAT_BLOCK_RELEASE,
+		    pba->ntype, sub->alen, &sub->oaddr, &sub->taddr,
+		    htons(blk->base), nports);
+		kmem_intr_free(blk, PBA_BLOCK_SIZE(nports));
+	}
+	LIST_REMOVE(sub, entry);
+	kmem_intr_free(sub, sizeof(pba_sub_t));
+}
+
+/*
+ * pba_block_add: add the block of ports, starting at the given base
+ * (in network byte-order) or, if zero, at any available base.
+ */
+static pba_block_t *
+pba_block_add(npf_pba_t *pba, pba_sub_t *sub, in_port_t base)
+{
+	const unsigned nports = pba->block_size;
+	npf_portmap_t *pm = pba->portmap;
+	pba_block_t *blk;
+
+	if (sub->nblocks == pba->max_blocks) {
+		return NULL;
+	}
+	blk = kmem_intr_zalloc(PBA_BLOCK_SIZE(nports), KM_NOSLEEP);
+	if (blk == NULL) {
+		return NULL;
+	}
+	if (base) {
+		if (!npf_portmap_takeblock(pm, sub->alen,
+		    &sub->taddr, base, nports)) {
+			base = 0;
+		}
+	} else {
+		base = npf_portmap_getblock(pm, sub->alen,
+		    &sub->taddr, nports);
+	}
+	if (base == 0) {
+		kmem_intr_free(blk, PBA_BLOCK_SIZE(nports));
+		return NULL;
+	}
+	blk->base = ntohs(base);
+	LIST_INSERT_HEAD(&sub->blocks, blk, entry);
+	sub->nblocks++;
+
+	npf_evlog_block(pba->npf, NPF_EVENT_NAT_BLOCK_ASSIGN, pba->ntype,
+	    sub->alen, &sub->oaddr, &sub->taddr, base, nports);
+	return blk;
+}
+
+/*
+ * pba_block_alloc: allocate the next free port in the block.
+ */
+static unsigned
+pba_block_alloc(pba_block_t *blk, unsigned nports)
+{
+	unsigned i = blk->hint;
+
+	KASSERT(blk->used < nports);
+
+	for (;;) {
+		const uint64_t word = blk->bits[i >> 6];
+		const uint64_t bit = UINT64_C(1) << (i & 63);
+
+		if ((i & 63) == 0 && word == UINT64_MAX) {
+			/* Skip the full word. */
+			i = (i + 64) & (nports - 1);
+			continue;
+		}
+		if ((word & bit) == 0) {
+			blk->bits[i >> 6] = word | bit;
+			break;
+		}
+		i = (i + 1) & (nports - 1);
+	}
+	blk->hint = (i + 1) & (nports - 1);
+	blk->used++;
+	return blk->base + i;
+}
+
+/*
+ * npf_pba_get: allocate a port for the subscriber, identified by the
+ * original address.
+ *
+ * => On entry, the translation address is the one to use if this is
+ *    the first connection of the subscriber.  It is set to the bound
+ *    translation address on return.
+ * => Returns the port value in network byte-order; zero on failure.
+ */
+in_port_t
+npf_pba_get(npf_pba_t *pba, unsigned alen,
+    const npf_addr_t *oaddr, npf_addr_t *taddr)
+{
+	pba_bucket_t *b = pba_getbucket(pba, alen, oaddr);
+	pba_block_t *blk;
+	unsigned port = 0;
+	pba_sub_t *sub;
+
+	mutex_enter(&b->lock);
+	if ((sub = pba_lookup(b, alen, oaddr)) == NULL) {
+		sub = pba_sub_create(b, alen, oaddr, taddr);
+		if (sub == NULL) {
+			goto out;
+		}
+	}
+	memcpy(taddr, &sub->taddr, alen);
+
+	/* Allocate from the existing blocks or assign a new block. */
+	LIST_FOREACH(blk, &sub->blocks, entry) {
+		if (blk->used < pba->block_size) {
+			break;
+		}
+	}
+	if (blk == NULL && (blk = pba_block_add(pba, sub, 0)) == NULL) {
+		if (sub->refcnt == 0) {
+			pba_sub_release(pba, sub);
+		}
+		goto out;
+	}
+	port = pba_block_alloc(blk, pba->block_size);
+	sub->refcnt++;
+out:
+	mutex_exit(&b->lock);
+	return htons(port);
+}
+
+/*
+ * npf_pba_take: allocate a specific port for the subscriber, e.g. when
+ * loading the saved connections.
+ */
+bool
+npf_pba_take(npf_pba_t *pba, unsigned alen, const npf_addr_t *oaddr,
+    const npf_addr_t *taddr, in_port_t port)
+{
+	pba_bucket_t *b = pba_getbucket(pba, alen, oaddr);
+	const unsigned nports = pba->block_size;
+	const unsigned hport = ntohs(port);
+	const unsigned base = hport & ~(nports - 1);
+	unsigned i = hport & (nports - 1);
+	pba_block_t *blk;
+	pba_sub_t *sub;
+	bool ok = false;
+
+	mutex_enter(&b->lock);
+	if ((sub = pba_lookup(b, alen, oaddr)) == NULL) {
+		sub = pba_sub_create(b, alen, oaddr, taddr);
+		if (sub == NULL) {
+			goto out;
+		}
+	} else if (memcmp(&sub->taddr, taddr, alen) != 0) {
+		/* Must be the same translation address. */
+		goto out;
+	}
+	LIST_FOREACH(blk, &sub->blocks, entry) {
+		if (blk->base == base) {
+			break;
+		}
+	}
+	if (blk == NULL) {
+		blk = pba_block_add(pba, sub, htons(base));
+		if (blk == NULL) {
+			goto release;
+		}
+	}
+	if (blk->bits[i >> 6] & (UINT64_C(1) << (i & 63))) {
+		/* Already in use. */
+		goto release;
+	}
+	blk->bits[i >> 6] |= UINT64_C(1) << (i & 63);
+	blk->used++;
+	sub->refcnt++;
+	ok = true;
+release:
+	if (sub->refcnt == 0) {
+		pba_sub_release(pba, sub);
+	}
+out:
+	mutex_exit(&b->lock);
+	return ok;
+}
+
+/*
+ * npf_pba_put: release the port of the subscriber.  Once the last port
+ * is released, all the blocks of the subscriber are released.
+ */
+void
+npf_pba_put(npf_pba_t *pba, unsigned alen,
+    const npf_addr_t *oaddr, in_port_t port)
+{
+	pba_bucket_t *b = pba_getbucket(pba, alen, oaddr);
+	const unsigned nports = pba->block_size;
+	const unsigned hport = ntohs(port);
+	const unsigned i = hport & (nports - 1);
+	pba_block_t *blk;
+	pba_sub_t *sub;
+
+	mutex_enter(&b->lock);
+	sub = pba_lookup(b, alen, oaddr);
+	KASSERT(sub != NULL);
+	KASSERT(sub->refcnt > 0);
+
+	LIST_FOREACH(blk, &sub->blocks, entry) {
+		if (blk->base == (hport & ~(nports - 1))) {
+			KASSERT(blk->used > 0);
+			KASSERT(blk->bits[i >> 6] & (UINT64_C(1) << (i & 63)));
+			blk->bits[i >> 6] &= ~(UINT64_C(1) << (i & 63));
+			blk->used--;
+			break;
+		}
+	}
+	KASSERT(blk != NULL);
+
+	if (--sub->refcnt == 0) {
+		pba_sub_release(pba, sub);
+	}
+	mutex_exit(&b->lock);
+}
+
+#if defined(DDB) || defined(_NPF_TESTING)
+
+/*
+ * npf_pba_getblocks: return the number of blocks held by the subscriber.
+ */
+unsigned
+npf_pba_getblocks(npf_pba_t *pba, unsigned alen, const npf_addr_t *oaddr)
+{
+	pba_bucket_t *b = pba_getbucket(pba, alen, oaddr);
+	unsigned nblocks = 0;
+	pba_sub_t *sub;
+
+	mutex_enter(&b->lock);
+	if ((sub = pba_lookup(b, alen, oaddr)) != NULL) {
+		nblocks = sub->nblocks;
+	}
+	mutex_exit(&b->lock);
+	return nblocks;
+}
+
+#endif
@@ -12,6 +12,20 @@
  *	translation.  Port maps are per IP addresses, therefore multiple
  *	NAT policies operating on the same IP address will share the
  *	same port map.
+ *
+ *	To reduce the contention on the bitmap words, each CPU keeps a
+ *	small cache of the port chunks, i.e. the 64-port ranges matching
+ *	the level 1 bitmap words.  The free ports of a chunk are reserved
+ *	in the bitmap with a single CAS and handed out locally; the released
+ *	ports are put back into the chunk of the local cache and returned to
+ *	the bitmap in bulk, when the chunk is evicted or the cache is synced.
+ *	The ports in the cache are set in the bitmap, i.e. they appear as
+ *	used to the other CPUs; npf_portmap_take() reclaims them.  Each
+ *	cache has a lock, which is normally taken only by its CPU, but
+ *	serialises the reclaim with it.
+ *
+ *	The ports may also be allocated in aligned blocks, which are then
+ *	managed by the caller, e.g. the port block allocation (PBA) NAT.
  */
 
 #ifdef _KERNEL
@@ -26,6 +40,7 @@ __KERNEL_RCSID(0, "$NetBSD$");
 #include <sys/kmem.h>
 #include <sys/mutex.h>
 #include <sys/cprng.h>
+#include <sys/percpu.h>
 #include <sys/thmap.h>
 #endif
 
@@ -79,10 +94,32 @@ typedef struct bitmap {
 #define	NPF_PORTMAP_MINPORT	1024
 #define	NPF_PORTMAP_MAXPORT	65535
 
+/*
+ * Per-CPU port cache: a few chunks, each with a mask of the free ports,
+ * which are reserved in the bitmap word at the given base.  The cache
+ * is allocated on the first use and is on the list of the port map.
+ */
+#define	PORTMAP_CACHE_CHUNKS	4
+
+typedef struct {
+	bitmap_t *		bm;
+	unsigned		base;
+	uint64_t		free;
+} portmap_chunk_t;
+
+typedef struct portmap_cache {
+	kmutex_t		lock;
+	portmap_chunk_t		chunks[PORTMAP_CACHE_CHUNKS];
+	unsigned		next_evict;
+	LIST_ENTRY(portmap_cache) entry;
+} portmap_cache_t;
+
 struct npf_portmap {
 	thmap_t	*		addr_map;
 	LIST_HEAD(, bitmap)	bitmap_list;
+	LIST_HEAD(, portmap_cache) cache_list;
 	kmutex_t		list_lock;
+	percpu_t *		cache_percpu;
 	int			min_port;
 	int			max_port;
 };
@@ -125,6 +162,7 @@ npf_portmap_create(int min_port, int max_port)
 	pm = kmem_zalloc(sizeof(npf_portmap_t), KM_SLEEP);
 	mutex_init(&pm->list_lock, MUTEX_DEFAULT, IPL_SOFTNET);
 	pm->addr_map = thmap_create(0, NULL, THMAP_NOCOPY);
+	pm->cache_percpu = percpu_alloc(sizeof(portmap_cache_t *));
 	pm->min_port = min_port;
 	pm->max_port = max_port;
 	return pm;
@@ -133,9 +171,17 @@ npf_portmap_create(int min_port, int max_port)
 void
 npf_portmap_destroy(npf_portmap_t *pm)
 {
+	portmap_cache_t *pc;
+
 	npf_portmap_flush(pm);
 	KASSERT(LIST_EMPTY(&pm->bitmap_list));
 
+	while ((pc = LIST_FIRST(&pm->cache_list)) != NULL) {
+		LIST_REMOVE(pc, entry);
+		mutex_destroy(&pc->lock);
+		kmem_intr_free(pc, sizeof(portmap_cache_t));
+	}
+	percpu_free(pm->cache_percpu, sizeof(portmap_cache_t *));
 	thmap_destroy(pm->addr_map);
 	mutex_destroy(&pm->list_lock);
 	kmem_free(pm, sizeof(npf_portmap_t));
@@ -251,6 +297,50 @@ bitmap_isset(const bitmap_t *bm, unsigned bit)
 }
 #endif
 
+/*
+ * bitmap_l1_expand: convert the packed level 0 word into the level 1
+ * bitmap, copying over the current values.
+ *
+ * => Returns false on no memory; otherwise, the caller should re-read
+ *    the level 0 word, since it might have been changed.
+ */
+static bool
+bitmap_l1_expand(bitmap_t *bm, unsigned i, uint64_t bval)
+{
+	unsigned n, bitvals[5];
+	bitmap_l1_t *bm1;
+	uint64_t bm1p;
+
+	KASSERT((bval & PORTMAP_L1_TAG) == 0);
+
+	bm1 = kmem_intr_zalloc(sizeof(bitmap_l1_t), KM_NOSLEEP);
+	if (bm1 == NULL) {
+		return false;
+	}
+	n = bitmap_word_unpack(bval, bitvals);
+	while (n--) {
+		const unsigned v = bitvals[n];
+		const unsigned off = v >> PORTMAP_L1_SHIFT;
+
+		KASSERT(v <= PORTMAP_L0_MASK);
+		KASSERT(off < (sizeof(uint64_t) * CHAR_BIT));
+		bm1->bits1[off] |= UINT64_C(1) << (v & PORTMAP_L1_MASK);
+	}
+
+	/*
+	 * Attempt to set the L1 structure.  Note: there is no
+	 * ABA problem since the we compare the actual values.
+	 * Note: CAS serves as a memory barrier.
+	 */
+	bm1p = (uintptr_t)bm1;
+	KASSERT((bm1p & PORTMAP_L1_TAG) == 0);
+	bm1p |= PORTMAP_L1_TAG;
+	if (atomic_cas_64(&bm->bits0[i], bval, bm1p) != bval) {
+		kmem_intr_free(bm1, sizeof(bitmap_l1_t));
+	}
+	return true;
+}
+
 static bool
 bitmap_set(bitmap_t *bm, unsigned bit)
 {
@@ -264,9 +354,6 @@ again:
 	bval = atomic_load_relaxed(&bm->bits0[i]);
 
 	if ((bval & PORTMAP_L1_TAG) == 0) {
-		unsigned n = 0, bitvals[5];
-		uint64_t bm1p;
-
 		if (bitmap_word_isset(bval, chunk_bit)) {
 			return false;
 		}
@@ -282,37 +369,11 @@ again:
 			return true;
 		}
 
-		/*
-		 * Full: allocate L1 block and copy over the current
-		 * values into the level.
-		 */
-		bm1 = kmem_intr_zalloc(sizeof(bitmap_l1_t), KM_NOSLEEP);
-		if (bm1 == NULL) {
+		/* Full: expand into the level 1 bitmap. */
+		if (!bitmap_l1_expand(bm, i, bval)) {
 			return false; // error
 		}
-		n = bitmap_word_unpack(bval, bitvals);
-		while (n--) {
-			const unsigned v = bitvals[n];
-			const unsigned off = v >> PORTMAP_L1_SHIFT;
-
-			KASSERT(v <= PORTMAP_L0_MASK);
-			KASSERT(off < (sizeof(uint64_t) * CHAR_BIT));
-			bm1->bits1[off] |= UINT64_C(1) << (v & PORTMAP_L1_MASK);
-		}
-
-		/*
-		 * Attempt to set the L1 structure.  Note: there is no
-		 * ABA problem since the we compare the actual values.
-		 * Note: CAS serves as a memory barrier.
-		 */
-		bm1p = (uintptr_t)bm1;
-		KASSERT((bm1p & PORTMAP_L1_TAG) == 0);
-		bm1p |= PORTMAP_L1_TAG;
-		if (atomic_cas_64(&bm->bits0[i], bval, bm1p) != bval) {
-			kmem_intr_free(bm1, sizeof(bitmap_l1_t));
-			goto again;
-		}
-		bval = bm1p;
+		goto again;
 	}
 
 	bm1 = PORTMAP_L1_GET(bval);
@@ -371,6 +432,72 @@ again:
 	return true;
 }
 
+/*
+ * bitmap_chunk_take: reserve the free bits of the chunk (the level 1
+ * word at the given base), which are in the mask, with a single CAS.
+ *
+ * => Returns the mask of the reserved bits; zero if none.
+ */
+static uint64_t
+bitmap_chunk_take(bitmap_t *bm, unsigned base, uint64_t mask)
+{
+	const unsigned i = base >> PORTMAP_L0_SHIFT;
+	volatile uint64_t *w;
+	uint64_t bval, oval;
+	bitmap_l1_t *bm1;
+
+	KASSERT(base < PORTMAP_MAX_BITS);
+	KASSERT((base & PORTMAP_L1_MASK) == 0);
+
+	/* The chunk is represented only in the level 1 bitmap. */
+	while (((bval = atomic_load_relaxed(&bm->bits0[i])) &
+	    PORTMAP_L1_TAG) == 0) {
+		if (!bitmap_l1_expand(bm, i, bval)) {
+			return 0; // no memory
+		}
+	}
+	bm1 = PORTMAP_L1_GET(bval);
+	w = &bm1->bits1[(base & PORTMAP_L0_MASK) >> PORTMAP_L1_SHIFT];
+	do {
+		oval = atomic_load_relaxed(w);
+		if ((mask & ~oval) == 0) {
+			return 0;
+		}
+	} while (atomic_cas_64(w, oval, oval | mask) != oval);
+	return mask & ~oval;
+}
+
+/*
+ * bitmap_chunk_put: release the bits of the chunk, which are in the mask.
+ */
+static void
+bitmap_chunk_put(bitmap_t *bm, unsigned base, uint64_t mask)
+{
+	const unsigned i = base >> PORTMAP_L0_SHIFT;
+	volatile uint64_t *w;
+	uint64_t bval, oval;
+	bitmap_l1_t *bm1;
+
+	KASSERT(base < PORTMAP_MAX_BITS);
+	KASSERT((base & PORTMAP_L1_MASK) == 0);
+
+	bval = atomic_load_relaxed(&bm->bits0[i]);
+	if ((bval & PORTMAP_L1_TAG) == 0) {
+		/* Packed: there are only a few values. */
+		while (mask) {
+			bitmap_clr(bm, base + ffs64(mask) - 1);
+			mask &= mask - 1;
+		}
+		return;
+	}
+	bm1 = PORTMAP_L1_GET(bval);
+	w = &bm1->bits1[(base & PORTMAP_L0_MASK) >> PORTMAP_L1_SHIFT];
+	do {
+		oval = atomic_load_relaxed(w);
+		KASSERT((oval & mask) == mask);
+	} while (atomic_cas_64(w, oval, oval & ~mask) != oval);
+}
+
 /////////////////////////////////////////////////////////////////////////
 
 static bitmap_t *
@@ -415,6 +542,198 @@ npf_portmap_autoget(npf_portmap_t *pm, unsigned alen, const npf_addr_t *addr)
 	return bm;
 }
 
+/////////////////////////////////////////////////////////////////////////
+
+static inline bool
+portmap_port_valid(npf_portmap_t *pm, unsigned port)
+{
+	const unsigned min_port = atomic_load_relaxed(&pm->min_port);
+	const unsigned max_port = atomic_load_relaxed(&pm->max_port);
+	return port >= min_port && port <= max_port;
+}
+
+/*
+ * portmap_chunk_mask: return the mask of the chunk ports in the range.
+ */
+static inline uint64_t
+portmap_chunk_mask(unsigned base, unsigned min_port, unsigned max_port)
+{
+	const unsigned lo = MAX(min_port, base) - base;
+	const unsigned hi = MIN(max_port, base + PORTMAP_L1_MASK) - base;
+
+	KASSERT(lo <= hi && hi <= PORTMAP_L1_MASK);
+	return (UINT64_MAX >> (PORTMAP_L1_MASK - hi)) & (UINT64_MAX << lo);
+}
+
+/*
+ * portmap_chunk_release: return the free ports of the chunk into the
+ * bitmap, in bulk, and invalidate the cache entry.
+ */
+static void
+portmap_chunk_release(portmap_chunk_t *ch)
+{
+	if (ch->free) {
+		bitmap_chunk_put(ch->bm, ch->base, ch->free);
+	}
+	memset(ch, 0, sizeof(portmap_chunk_t));
+}
+
+/*
+ * portmap_chunk_pop: take a randomly selected free port of the chunk.
+ */
+static unsigned
+portmap_chunk_pop(portmap_chunk_t *ch)
+{
+	const unsigned r = cprng_fast32() & PORTMAP_L1_MASK;
+	const uint64_t rfree = (ch->free >> r) |
+	    (ch->free << ((64 - r) & PORTMAP_L1_MASK));
+	unsigned bit;
+
+	KASSERT(ch->free != 0);
+	bit = (r + ffs64(rfree) - 1) & PORTMAP_L1_MASK;
+	ch->free &= ~(UINT64_C(1) << bit);
+	return ch->base + bit;
+}
+
+/*
+ * portmap_cache_lookup: find the cache entry of the given chunk or,
+ * if the base is PORTMAP_MAX_BITS, any entry with free ports.
+ */
+static portmap_chunk_t *
+portmap_cache_lookup(portmap_cache_t *pc, bitmap_t *bm, unsigned base)
+{
+	for (unsigned i = 0; i < PORTMAP_CACHE_CHUNKS; i++) {
+		portmap_chunk_t *ch = &pc->chunks[i];
+
+		if (ch->bm != bm) {
+			continue;
+		}
+		if (base == PORTMAP_MAX_BITS ?
+		    ch->free != 0 : ch->base == base) {
+			return ch;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * portmap_cache_alloc: return the cache entry of the chunk; if none,
+ * take an unused entry or evict one, returning its free ports into
+ * the bitmap.  Therefore, there is at most one entry per chunk.
+ */
+static portmap_chunk_t *
+portmap_cache_alloc(portmap_cache_t *pc, bitmap_t *bm, unsigned base)
+{
+	portmap_chunk_t *ch;
+
+	if ((ch = portmap_cache_lookup(pc, bm, base)) != NULL) {
+		return ch;
+	}
+	for (unsigned i = 0; i < PORTMAP_CACHE_CHUNKS; i++) {
+		if (pc->chunks[i].free == 0) {
+			ch = &pc->chunks[i];
+			break;
+		}
+	}
+	if (ch == NULL) {
+		ch = &pc->chunks[pc->next_evict++ % PORTMAP_CACHE_CHUNKS];
+		portmap_chunk_release(ch);
+	}
+	ch->bm = bm;
+	ch->base = base;
+	ch->free = 0;
+	return ch;
+}
+
+/*
+ * portmap_cache_refill: reserve the free ports of a randomly selected
+ * chunk, probing linearly from it, and put them into the cache.
+ */
+static portmap_chunk_t *
+portmap_cache_refill(npf_portmap_t *pm, portmap_cache_t *pc, bitmap_t *bm)
+{
+	const unsigned min_port = atomic_load_relaxed(&pm->min_port);
+	const unsigned max_port = atomic_load_relaxed(&pm->max_port);
+	const unsigned first = min_port >> PORTMAP_L1_SHIFT;
+	const unsigned nchunks = (max_port >> PORTMAP_L1_SHIFT) - first + 1;
+	const unsigned target = cprng_fast32() % nchunks;
+
+	for (unsigned i = 0; i < nchunks; i++) {
+		const unsigned c = first + (target + i) % nchunks;
+		const unsigned base = c << PORTMAP_L1_SHIFT;
+		const uint64_t mask = portmap_chunk_mask(base,
+		    min_port, max_port);
+		portmap_chunk_t *ch;
+		uint64_t bits;
+
+		if ((bits = bitmap_chunk_take(bm, base, mask)) != 0) {
+			ch = portmap_cache_alloc(pc, bm, base);
+			KASSERT((ch->free & bits) == 0);
+			ch->free |= bits;
+			return ch;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * portmap_cache_enter: get the cache of the current CPU, allocating it
+ * on the first use, and lock it.
+ *
+ * => Must be called with the per-CPU reference held.
+ * => Returns NULL on no memory.
+ */
+static portmap_cache_t *
+portmap_cache_enter(npf_portmap_t *pm, portmap_cache_t **pcp)
+{
+	portmap_cache_t *pc;
+
+	if (__predict_false((pc = *pcp) == NULL)) {
+		pc = kmem_intr_zalloc(sizeof(portmap_cache_t), KM_NOSLEEP);
+		if (pc == NULL) {
+			return NULL;
+		}
+		mutex_init(&pc->lock, MUTEX_DEFAULT, IPL_SOFTNET);
+		mutex_enter(&pm->list_lock);
+		LIST_INSERT_HEAD(&pm->cache_list, pc, entry);
+		mutex_exit(&pm->list_lock);
+		*pcp = pc;
+	}
+	mutex_enter(&pc->lock);
+	return pc;
+}
+
+/*
+ * portmap_cache_reclaim: find the free port in the caches of all CPUs
+ * and, if found, remove it from there; it stays set in the bitmap.
+ */
+static bool
+portmap_cache_reclaim(npf_portmap_t *pm, bitmap_t *bm, unsigned port)
+{
+	const unsigned base = port & ~PORTMAP_L1_MASK;
+	const uint64_t b = UINT64_C(1) << (port & PORTMAP_L1_MASK);
+	portmap_cache_t *pc;
+	bool found = false;
+
+	mutex_enter(&pm->list_lock);
+	LIST_FOREACH(pc, &pm->cache_list, entry) {
+		portmap_chunk_t *ch;
+
+		mutex_enter(&pc->lock);
+		ch = portmap_cache_lookup(pc, bm, base);
+		if (ch && (ch->free & b) != 0) {
+			ch->free &= ~b;
+			found = true;
+		}
+		mutex_exit(&pc->lock);
+		if (found) {
+			break;
+		}
+	}
+	mutex_exit(&pm->list_lock);
+	return found;
+}
+
 /*
  * npf_portmap_flush: free all bitmaps and remove all addresses.
  *
@@ -424,8 +743,18 @@ npf_portmap_autoget(npf_portmap_t *pm, unsigned alen, const npf_addr_t *addr)
 void
 npf_portmap_flush(npf_portmap_t *pm)
 {
+	portmap_cache_t *pc;
 	bitmap_t *bm;
 
+	/* Invalidate the caches; all ports are released anyway. */
+	mutex_enter(&pm->list_lock);
+	LIST_FOREACH(pc, &pm->cache_list, entry) {
+		mutex_enter(&pc->lock);
+		memset(pc->chunks, 0, sizeof(pc->chunks));
+		mutex_exit(&pc->lock);
+	}
+	mutex_exit(&pm->list_lock);
+
 	while ((bm = LIST_FIRST(&pm->bitmap_list)) != NULL) {
 		for (unsigned i = 0; i < PORTMAP_L0_WORDS; i++) {
 			uintptr_t bm1 = bm->bits0[i];
@@ -444,6 +773,28 @@ npf_portmap_flush(npf_portmap_t *pm)
 	thmap_gc(pm->addr_map, thmap_stage_gc(pm->addr_map));
 }
 
+/*
+ * npf_portmap_sync: return the free ports cached by the local CPU into
+ * the bitmap, e.g. after the G/C released a batch of them.
+ */
+void
+npf_portmap_sync(npf_portmap_t *pm)
+{
+	portmap_cache_t **pcp, *pc;
+
+	int s = splsoftnet();
+	pcp = percpu_getref(pm->cache_percpu);
+	if ((pc = *pcp) != NULL) {
+		mutex_enter(&pc->lock);
+		for (unsigned i = 0; i < PORTMAP_CACHE_CHUNKS; i++) {
+			portmap_chunk_release(&pc->chunks[i]);
+		}
+		mutex_exit(&pc->lock);
+	}
+	percpu_putref(pm->cache_percpu);
+	splx(s);
+}
+
 /*
  * npf_portmap_get: allocate and return a port from the given portmap.
  *
@@ -455,8 +806,9 @@ npf_portmap_get(npf_portmap_t *pm, int alen, const npf_addr_t *addr)
 {
 	const unsigned min_port = atomic_load_relaxed(&pm->min_port);
 	const unsigned max_port = atomic_load_relaxed(&pm->max_port);
-	const unsigned port_delta = max_port - min_port + 1;
-	unsigned bit, target;
+	portmap_cache_t **pcp, *pc;
+	portmap_chunk_t *ch;
+	unsigned port = 0;
 	bitmap_t *bm;
 
 	/* Sanity check: the user might set incorrect parameters. */
@@ -470,25 +822,46 @@ npf_portmap_get(npf_portmap_t *pm, int alen, const npf_addr_t *addr)
 		return 0;
 	}
 
-	/* Randomly select a port. */
-	target = min_port + (cprng_fast32() % port_delta);
-	bit = target;
-next:
-	if (bitmap_set(bm, bit)) {
-		/* Success. */
-		return htons(bit);
+	/*
+	 * Take a port from the local cache, refilling it if empty.
+	 * Discard the ports which are out of the range, in case the
+	 * parameters have changed.
+	 */
+	int s = splsoftnet();
+	pcp = percpu_getref(pm->cache_percpu);
+	if ((pc = portmap_cache_enter(pm, pcp)) == NULL) {
+		/* No memory. */
+		goto out;
 	}
-	bit = min_port + ((bit + 1) % port_delta);
-	if (target != bit) {
-		/* Next.. */
-		goto next;
+	for (;;) {
+		ch = portmap_cache_lookup(pc, bm, PORTMAP_MAX_BITS);
+		if (ch == NULL) {
+			ch = portmap_cache_refill(pm, pc, bm);
+			if (ch == NULL) {
+				/* No space. */
+				break;
+			}
+		}
+		port = portmap_chunk_pop(ch);
+		if (__predict_true(portmap_port_valid(pm, port))) {
+			break;
+		}
+		bitmap_clr(bm, port);
+		port = 0;
 	}
-	/* No space. */
-	return 0;
+	mutex_exit(&pc->lock);
+out:
+	percpu_putref(pm->cache_percpu);
+	splx(s);
+
+	return htons(port);
 }
 
 /*
  * npf_portmap_take: allocate a specific port in the portmap.
+ *
+ * => If the port is free, but reserved in the cache of some CPU, then
+ *    reclaim it from there.
  */
 bool
 npf_portmap_take(npf_portmap_t *pm, int alen,
@@ -501,6 +874,14 @@ npf_portmap_take(npf_portmap_t *pm, int alen,
 		/* Out of memory / invalid port. */
 		return false;
 	}
+	if (bitmap_set(bm, port)) {
+		return true;
+	}
+	if (portmap_cache_reclaim(pm, bm, port)) {
+		return true;
+	}
+
+	/* The chunk might have been returned into the bitmap meanwhile. */
 	return bitmap_set(bm, port);
 }
 
@@ -508,16 +889,144 @@ npf_portmap_take(npf_portmap_t *pm, int alen,
  * npf_portmap_put: release the port, making it available in the portmap.
  *
  * => The port value should be in network byte-order.
+ * => The port is put into the chunk of the local cache; the free ports
+ *    are returned into the bitmap in bulk, once the chunk is evicted.
  */
 void
 npf_portmap_put(npf_portmap_t *pm, int alen,
     const npf_addr_t *addr, in_port_t port)
 {
+	portmap_cache_t **pcp, *pc;
+	portmap_chunk_t *ch;
+	unsigned base;
+	uint64_t b;
 	bitmap_t *bm;
 
 	bm = npf_portmap_autoget(pm, alen, addr);
-	if (bm) {
-		port = ntohs(port);
+	if (bm == NULL) {
+		return;
+	}
+	port = ntohs(port);
+	if (!portmap_port_valid(pm, port)) {
+		bitmap_clr(bm, port);
+		return;
+	}
+	base = port & ~PORTMAP_L1_MASK;
+	b = UINT64_C(1) << (port & PORTMAP_L1_MASK);
+
+	int s = splsoftnet();
+	pcp = percpu_getref(pm->cache_percpu);
+	if ((pc = portmap_cache_enter(pm, pcp)) != NULL) {
+		ch = portmap_cache_alloc(pc, bm, base);
+		KASSERT((ch->free & b) == 0);
+		ch->free |= b;
+		mutex_exit(&pc->lock);
+	} else {
+		/* No memory: return the port into the bitmap. */
 		bitmap_clr(bm, port);
 	}
+	percpu_putref(pm->cache_percpu);
+	splx(s);
+}
+
+/*
+ * npf_portmap_setblock: set all bits in the block, rolling back if
+ * any of the ports are already in use.
+ */
+static bool
+npf_portmap_setblock(bitmap_t *bm, unsigned base, unsigned nports)
+{
+	for (unsigned i = 0; i < nports; i++) {
+		if (!bitmap_set(bm, base + i)) {
+			while (i--) {
+				bitmap_clr(bm, base + i);
+			}
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * npf_portmap_getblock: allocate a block of contiguous ports, aligned
+ * to its size, from the given portmap.
+ *
+ * => The number of ports must be a power of two.
+ * => Returns the first port of the block in network byte-order.
+ * => Zero indicates a failure.
+ */
+in_port_t
+npf_portmap_getblock(npf_portmap_t *pm, int alen,
+    const npf_addr_t *addr, unsigned nports)
+{
+	const unsigned min_port = atomic_load_relaxed(&pm->min_port);
+	const unsigned max_port = atomic_load_relaxed(&pm->max_port);
+	unsigned first, nblocks, target;
+	bitmap_t *bm;
+
+	KASSERT(nports > 0 && (nports & (nports - 1)) == 0);
+
+	/* The range of the block indexes fitting the port range. */
+	first = MAX(roundup2(min_port, nports) / nports, 1);
+	if (__predict_false(min_port > max_port ||
+	    (max_port + 1) / nports <= first)) {
+		return 0;
+	}
+	nblocks = (max_port + 1) / nports - first;
+
+	bm = npf_portmap_autoget(pm, alen, addr);
+	if (__predict_false(bm == NULL)) {
+		/* No memory. */
+		return 0;
+	}
+
+	/* Randomly select a block and linearly probe from it. */
+	target = cprng_fast32() % nblocks;
+	for (unsigned i = 0; i < nblocks; i++) {
+		const unsigned base = (first + (target + i) % nblocks) * nports;
+
+		if (npf_portmap_setblock(bm, base, nports)) {
+			return htons(base);
+		}
+	}
+	return 0;
+}
+
+/*
+ * npf_portmap_takeblock: allocate a specific block of ports.
+ */
+bool
+npf_portmap_takeblock(npf_portmap_t *pm, int alen,
+    const npf_addr_t *addr, in_port_t port, unsigned nports)
+{
+	const unsigned min_port = atomic_load_relaxed(&pm->min_port);
+	const unsigned max_port = atomic_load_relaxed(&pm->max_port);
+	bitmap_t *bm = npf_portmap_autoget(pm, alen, addr);
+	const unsigned base = ntohs(port);
+
+	KASSERT(nports > 0 && (nports & (nports - 1)) == 0);
+	if (!bm || (base & (nports - 1)) != 0 || base < min_port ||
+	    base + nports - 1 > max_port) {
+		/* Out of memory / invalid block. */
+		return false;
+	}
+	return npf_portmap_setblock(bm, base, nports);
+}
+
+/*
+ * npf_portmap_putblock: release the block of ports.
+ */
+void
+npf_portmap_putblock(npf_portmap_t *pm, int alen,
+    const npf_addr_t *addr, in_port_t port, unsigned nports)
+{
+	bitmap_t *bm = npf_portmap_autoget(pm, alen, addr);
+	const unsigned base = ntohs(port);
+
+	if (bm == NULL) {
+		return;
+	}
+	for (unsigned i = 0; i < nports; i++) {
+		bitmap_clr(bm, base + i);
+	}
 }
@@ -48,6 +48,9 @@ struct npf_ruleset {
 	unsigned		rs_slots;
 	unsigned		rs_nitems;
 
+	/* Whether any (including dynamic) rule has the SYN proxy. */
+	bool			rs_synproxy;
+
 	/* Array of ordered rules. */
 	npf_rule_t *		rs_rules[];
 };
@@ -68,6 +71,9 @@ struct npf_rule {
 	npf_natpolicy_t *	r_natp;
 	npf_rproc_t *		r_rproc;
 
+	/* Per-source limits of the stateful rule (optional). */
+	npf_srclimit_t		r_srclimit;
+
 	union {
 		/*
 		 * Dynamic group: rule subset and a group list entry.
@@ -102,6 +108,7 @@ struct npf_rule {
 #define	SKIPTO_MASK		(SKIPTO_ADJ_FLAG - 1)
 
 static nvlist_t *	npf_rule_export(npf_t *, const npf_rule_t *);
+static int		npf_rule_srclimit(npf_rule_t *, const nvlist_t *);
 
 /*
  * Private attributes - must be in the NPF_RULE_PRIVMASK range.
@@ -180,6 +187,10 @@ npf_ruleset_insert(npf_ruleset_t *rlset, npf_rule_t *rl)
 	rlset->rs_nitems++;
 	rl->r_id = ++rlset->rs_idcnt;
 
+	if (rl->r_attr & NPF_RULE_SYNPROXY) {
+		rlset->rs_synproxy = true;
+	}
+
 	if (rl->r_skip_to < ++n) {
 		rl->r_skip_to = SKIPTO_ADJ_FLAG | n;
 	}
@@ -219,6 +230,14 @@ npf_ruleset_add(npf_ruleset_t *rlset, const char *rname, npf_rule_t *rl)
 	rl->r_id = ++rlset->rs_idcnt;
 	rl->r_parent = rg;
 
+	/*
+	 * Note: the SYN proxy indication is never cleared, but it only
+	 * enables the SYN cookie check on the ACK packets.
+	 */
+	if (rl->r_attr & NPF_RULE_SYNPROXY) {
+		atomic_store_relaxed(&rlset->rs_synproxy, true);
+	}
+
 	/*
 	 * Rule priority: (highest) 1, 2 ... n (lowest).
 	 * Negative priority indicates an operation and is reset to zero.
@@ -485,6 +504,10 @@ npf_ruleset_reload(npf_t *npf, npf_ruleset_t *newset,
 
 			KASSERT(rl->r_parent == active_rgroup);
 			rl->r_parent = rg;
+
+			if (rl->r_attr & NPF_RULE_SYNPROXY) {
+				newset->rs_synproxy = true;
+			}
 		}
 	}
 
@@ -542,6 +565,15 @@ npf_ruleset_reload(npf_t *npf, npf_ruleset_t *newset,
 	newset->rs_idcnt = oldset->rs_idcnt;
 }
 
+/*
+ * npf_ruleset_synproxy_p: whether the ruleset has any SYN proxy rules.
+ */
+bool
+npf_ruleset_synproxy_p(const npf_ruleset_t *rlset)
+{
+	return atomic_load_relaxed(&rlset->rs_synproxy);
+}
+
 /*
  * npf_ruleset_findnat: find a NAT policy in the ruleset by a given ID.
  */
@@ -615,6 +647,12 @@ npf_rule_alloc(npf_t *npf, const nvlist_t *rule)
 		rl->r_skip_to = dnvlist_get_number(rule, "skip-to", 0);
 	}
 
+	/* Per-source limits (optional). */
+	if (npf_rule_srclimit(rl, rule) != 0) {
+		npf_rule_free(rl);
+		return NULL;
+	}
+
 	/* Interface name; register and get the npf-if-id. */
 	if ((rname = dnvlist_get_string(rule, "ifname", NULL)) != NULL) {
 		if ((rl->r_ifid = npf_ifmap_register(npf, rname)) == 0) {
@@ -636,9 +674,36 @@ npf_rule_alloc(npf_t *npf, const nvlist_t *rule)
 	return rl;
 }
 
+/*
+ * npf_rule_srclimit: set the per-source limits of the stateful rule.
+ */
+static int
+npf_rule_srclimit(npf_rule_t *rl, const nvlist_t *rule)
+{
+	npf_srclimit_t *sl = &rl->r_srclimit;
+
+	sl->sl_maxconn = dnvlist_get_number(rule, "src-max-conn", 0);
+	sl->sl_rate = dnvlist_get_number(rule, "src-max-rate", 0);
+	sl->sl_rate_secs = dnvlist_get_number(rule, "src-rate-secs", 0);
+	sl->sl_tid = dnvlist_get_number(rule, "src-overload-table",
+	    NPF_SRCLIMIT_NOTABLE);
+
+	if (!NPF_SRCLIMIT_P(sl)) {
+		return 0;
+	}
+	if ((rl->r_attr & NPF_RULE_STATEFUL) == 0) {
+		return EINVAL;
+	}
+	if (sl->sl_rate && sl->sl_rate_secs == 0) {
+		return EINVAL;
+	}
+	return 0;
+}
+
 static nvlist_t *
 npf_rule_export(npf_t *npf, const npf_rule_t *rl)
 {
+	const npf_srclimit_t *sl = &rl->r_srclimit;
 	nvlist_t *rule = nvlist_create(0);
 	unsigned skip_to = 0;
 	npf_rproc_t *rp;
@@ -669,6 +734,15 @@ npf_rule_export(npf_t *npf, const npf_rule_t *rl)
 	if (rl->r_info) {
 		nvlist_add_binary(rule, "info", rl->r_info, rl->r_info_len);
 	}
+	if (NPF_SRCLIMIT_P(sl)) {
+		nvlist_add_number(rule, "src-max-conn", sl->sl_maxconn);
+		nvlist_add_number(rule, "src-max-rate", sl->sl_rate);
+		nvlist_add_number(rule, "src-rate-secs", sl->sl_rate_secs);
+		if (sl->sl_tid != NPF_SRCLIMIT_NOTABLE) {
+			nvlist_add_number(rule, "src-overload-table",
+			    sl->sl_tid);
+		}
+	}
 	if ((rp = npf_rule_getrproc(rl)) != NULL) {
 		const char *rname = npf_rproc_getname(rp);
 		nvlist_add_string(rule, "rproc", rname);
@@ -918,6 +992,7 @@ npf_rule_conclude(const npf_rule_t *rl, npf_match_info_t *mi)
 	/* If not passing - drop the packet. */
 	mi->mi_retfl = rl->r_attr;
 	mi->mi_rid = rl->r_id;
+	mi->mi_srclimit = rl->r_srclimit;
 	return (rl->r_attr & NPF_RULE_PASS) ? 0 : ENETUNREACH;
 }
 
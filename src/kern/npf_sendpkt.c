@@ -34,15 +34,17 @@ __KERNEL_RCSID(0, "$NetBSD$");
 #define	DEFAULT_IP_TTL		(ip_defttl)
 
 #if defined(_NPF_STANDALONE)
-#define	m_gethdr(t, f)		(npf)->mbufops->alloc((npf), 0, 0)
 #define	m_freem(m)		(npc)->npc_ctx->mbufops->free(m)
 #define	mtod(m,t)		((t)((npc)->npc_ctx->mbufops->getdata(m)))
 #endif
 
-#if !defined(INET6) || defined(_NPF_STANDALONE)
+#if !defined(INET6) && !defined(_NPF_STANDALONE)
 #define	in6_cksum(...)		0
 #define	ip6_output(...)		0
 #define	icmp6_error(m, ...)	m_freem(m)
+#endif
+
+#if !defined(INET6) || defined(_NPF_STANDALONE)
 #define	npf_ip6_setscope(n, i)	((void)(i), 0)
 #endif
 
@@ -63,53 +65,334 @@ npf_ip6_setscope(const npf_cache_t *npc, struct ip6_hdr *ip6)
 }
 #endif
 
+#if defined(_NPF_STANDALONE)
 /*
- * npf_return_tcp: return a TCP reset (RST) packet.
+ * In the standalone case, there is no IP layer: the packets are fully
+ * constructed here and passed to the output interface operation, i.e.
+ * the application is responsible for routing and transmitting them.
+ */
+
+#define	NPF_IPV6_MMTU		1280
+#define	NPF_ICMP_ERROR_RATE	100	// per second, per thread
+
+#define	in_cksum(m, len)	npf_cksum_buf(0, mtod(m, const void *), (len))
+#define	in6_cksum(m, p, off, len)	\
+    npf_in6_cksum(mtod(m, const void *), (p), (off), (len))
+#define	ip_output(m, ...)	npf_output(npc, (m))
+#define	ip6_output(m, ...)	npf_output(npc, (m))
+#define	icmp_error(m, t, c, ...)	(void)npf_icmp_error(npc, (m), (t), (c))
+#define	icmp6_error(m, t, c, ...)	(void)npf_icmp_error(npc, (m), (t), (c))
+
+/*
+ * npf_cksum_buf: compute the Internet checksum of the contiguous buffer,
+ * given the initial sum (in the host byte order).
+ */
+uint16_t
+npf_cksum_buf(uint32_t sum, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len > 1) {
+		sum += (p[0] << 8) | p[1];
+		p += 2;
+		len -= 2;
+	}
+	if (len) {
+		sum += p[0] << 8;
+	}
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return htons(~sum & 0xffff);
+}
+
+/*
+ * npf_in6_cksum: compute the checksum of the upper-layer data at the
+ * given offset, including the IPv6 pseudo-header.
+ */
+static uint16_t
+npf_in6_cksum(const void *data, uint8_t nxt, unsigned off, unsigned len)
+{
+	const struct ip6_hdr *ip6 = data;
+	const uint8_t *addrs = (const uint8_t *)&ip6->ip6_src;
+	uint32_t sum = 0;
+
+	/* The source and destination addresses are adjacent. */
+	for (unsigned i = 0; i < 2 * sizeof(struct in6_addr); i += 2) {
+		sum += (addrs[i] << 8) | addrs[i + 1];
+	}
+	sum += (len >> 16) + (len & 0xffff) + nxt;
+	return npf_cksum_buf(sum, (const uint8_t *)data + off, len);
+}
+
+/*
+ * npf_output: pass the constructed packet for transmission.
+ *
+ * => The packet is always consumed.
  */
 static int
-npf_return_tcp(npf_cache_t *npc)
+npf_output(const npf_cache_t *npc, struct mbuf *m)
+{
+	npf_t *npf = npc->npc_ctx;
+
+	if (npf->ifops->output == NULL) {
+		m_freem(m);
+		return ENOTSUP;
+	}
+	return npf->ifops->output(npf, m, npc->npc_nbuf->nb_ifp);
+}
+
+/* The token bucket of the ICMP errors. */
+typedef struct {
+	uint32_t		tokens;
+	uint64_t		time;	// milliseconds
+} npf_icmprate_t;
+
+void
+npf_sendpkt_init(npf_t *npf)
+{
+	npf_param_t param_map[] = {
+		{
+			"icmp.error_rate",
+			&npf->icmp_error_rate,
+			.default_val = NPF_ICMP_ERROR_RATE,
+			.min = 0, .max = INT_MAX
+		},
+	};
+	npf->icmp_rate = percpu_alloc(sizeof(npf_icmprate_t));
+	npf_param_register(npf, param_map, __arraycount(param_map));
+}
+
+void
+npf_sendpkt_fini(npf_t *npf)
+{
+	percpu_free(npf->icmp_rate, sizeof(npf_icmprate_t));
+}
+
+/*
+ * npf_icmp_ratelimit: take a token from the bucket of the current
+ * thread; returns true if there is none, i.e. over the limit.  The
+ * bucket is refilled at the given rate and holds one second worth.
+ */
+static bool
+npf_icmp_ratelimit(npf_t *npf)
+{
+	const unsigned rate = atomic_load_relaxed(&npf->icmp_error_rate);
+	struct timespec tsnow;
+	npf_icmprate_t *rt;
+	uint64_t now, add;
+	bool over;
+
+	if (rate == 0) {
+		return false;
+	}
+	getnanouptime(&tsnow);
+	now = (uint64_t)tsnow.tv_sec * 1000 + tsnow.tv_nsec / 1000000;
+
+	int s = splsoftnet();
+	rt = percpu_getref(npf->icmp_rate);
+	if (rt->time == 0) {
+		rt->tokens = rate;
+		rt->time = now;
+	}
+	if ((add = (now - rt->time) * rate / 1000) != 0) {
+		/* Note: the remainder is carried over. */
+		rt->tokens = MIN(rt->tokens + add, rate);
+		rt->time += add * 1000 / rate;
+	}
+	rt->tokens = MIN(rt->tokens, rate);
+	if ((over = rt->tokens == 0) == false) {
+		rt->tokens--;
+	}
+	percpu_putref(npf->icmp_rate);
+	splx(s);
+	return over;
+}
+
+/*
+ * npf_icmp_error_p: determine whether the ICMP error may be sent in
+ * response to the packet, i.e. the checks of icmp_error(9): not for the
+ * multicast or broadcast destination, not to the source which is not a
+ * unicast address and not for the non-first fragment.  Note: there are
+ * no interface addresses, so the subnet broadcast is not recognized.
+ */
+static bool
+npf_icmp_error_p(const npf_cache_t *npc)
+{
+	if (npf_iscached(npc, NPC_IP4)) {
+		const struct ip *oip = npc->npc_ip.v4;
+		const in_addr_t src = ntohl(oip->ip_src.s_addr);
+		const in_addr_t dst = ntohl(oip->ip_dst.s_addr);
+
+		if (IN_MULTICAST(dst) || dst == INADDR_BROADCAST) {
+			return false;
+		}
+		if (IN_MULTICAST(src) || IN_EXPERIMENTAL(src) ||
+		    src == INADDR_ANY) {
+			return false;
+		}
+		return (ntohs(oip->ip_off) & IP_OFFMASK) == 0;
+	} else {
+		const struct ip6_hdr *oip6 = npc->npc_ip.v6;
+
+		if (IN6_IS_ADDR_MULTICAST(&oip6->ip6_dst)) {
+			return false;
+		}
+		if (IN6_IS_ADDR_MULTICAST(&oip6->ip6_src) ||
+		    IN6_IS_ADDR_UNSPECIFIED(&oip6->ip6_src)) {
+			return false;
+		}
+
+		/*
+		 * The fragment offset is not cached: the upper layer
+		 * is not processed for any of the fragments anyway.
+		 */
+		return !npf_iscached(npc, NPC_IPFRAG);
+	}
+}
+
+/*
+ * npf_icmp_error: construct and send the ICMP or ICMPv6 error, quoting
+ * the original packet, i.e. an equivalent of icmp_error(9).  The source
+ * address is the original destination address.  The errors are subject
+ * to the checks of npf_icmp_error_p() and rate-limited per thread (the
+ * "icmp.error_rate" parameter); the suppressed ones are accounted.
+ *
+ * => The original packet is consumed.
+ */
+static int
+npf_icmp_error(const npf_cache_t *npc, struct mbuf *m0, int type, int code)
+{
+	npf_t *npf = npc->npc_ctx;
+	const npf_mbufops_t *mops = npf->mbufops;
+	const size_t pktlen = mops->getchainlen(m0);
+	size_t hlen, dlen, n;
+	struct mbuf *m, *mq;
+	uint8_t *data;
+
+	if (!npf_icmp_error_p(npc) || npf_icmp_ratelimit(npf)) {
+		npf_stats_inc(npf, NPF_STAT_ICMP_SUPPRESSED);
+		m_freem(m0);
+		return 0;
+	}
+	if (npf_iscached(npc, NPC_IP4)) {
+		const struct ip *oip = npc->npc_ip.v4;
+
+		/* The IP header and the first 8 bytes of the data. */
+		hlen = sizeof(struct ip) + ICMP_MINLEN;
+		dlen = MIN(pktlen, (size_t)(oip->ip_hl << 2) + 8);
+	} else {
+		/* As much as possible, not exceeding the minimum MTU. */
+		KASSERT(npf_iscached(npc, NPC_IP6));
+		hlen = sizeof(struct ip6_hdr) + sizeof(struct icmp6_hdr);
+		dlen = MIN(pktlen, NPF_IPV6_MMTU - hlen);
+	}
+	if ((m = mops->alloc(npf, 0, hlen + dlen)) == NULL) {
+		m_freem(m0);
+		return ENOMEM;
+	}
+	data = mtod(m, uint8_t *);
+	memset(data, 0, hlen);
+
+	/* Quote the original packet. */
+	for (mq = m0, n = 0; mq && n < dlen; mq = mops->getnext(mq)) {
+		const size_t len = MIN(mops->getlen(mq), dlen - n);
+
+		memcpy(data + hlen + n, mops->getdata(mq), len);
+		n += len;
+	}
+
+	if (npf_iscached(npc, NPC_IP4)) {
+		const struct ip *oip = npc->npc_ip.v4;
+		struct ip *ip = (struct ip *)data;
+		struct icmp *icp = (struct icmp *)(ip + 1);
+
+		icp->icmp_type = type;
+		icp->icmp_code = code;
+		icp->icmp_cksum = npf_cksum_buf(0, icp, ICMP_MINLEN + dlen);
+
+		ip->ip_v = IPVERSION;
+		ip->ip_hl = sizeof(struct ip) >> 2;
+		ip->ip_len = htons(hlen + dlen);
+		ip->ip_ttl = DEFAULT_IP_TTL;
+		ip->ip_p = IPPROTO_ICMP;
+		ip->ip_src = oip->ip_dst;
+		ip->ip_dst = oip->ip_src;
+		ip->ip_sum = npf_cksum_buf(0, ip, sizeof(struct ip));
+	} else {
+		const struct ip6_hdr *oip6 = npc->npc_ip.v6;
+		struct ip6_hdr *ip6 = (struct ip6_hdr *)data;
+		struct icmp6_hdr *icp6 = (struct icmp6_hdr *)(ip6 + 1);
+		const unsigned plen = sizeof(struct icmp6_hdr) + dlen;
+
+		ip6->ip6_vfc = IPV6_VERSION;
+		ip6->ip6_plen = htons(plen);
+		ip6->ip6_nxt = IPPROTO_ICMPV6;
+		ip6->ip6_hlim = IPV6_DEFHLIM;
+		memcpy(&ip6->ip6_src, &oip6->ip6_dst, sizeof(struct in6_addr));
+		memcpy(&ip6->ip6_dst, &oip6->ip6_src, sizeof(struct in6_addr));
+
+		icp6->icmp6_type = type;
+		icp6->icmp6_code = code;
+		icp6->icmp6_cksum = npf_in6_cksum(ip6, IPPROTO_ICMPV6,
+		    sizeof(struct ip6_hdr), plen);
+	}
+	m_freem(m0);
+	return npf_output(npc, m);
+}
+#endif
+
+/*
+ * npf_tcp_mkpkt: construct a TCP segment without the data, either in
+ * the direction of the given packet or, if reply is true, in the reverse
+ * direction.  The MSS option is added, if non-zero.
+ *
+ * => The SEQ, ACK, window and MSS values are in the host byte order.
+ */
+struct mbuf *
+npf_tcp_mkpkt(const npf_cache_t *npc, bool reply, tcp_seq seq, tcp_seq ack,
+    unsigned tcpfl, uint16_t win, uint16_t mss)
 {
 	npf_t *npf = npc->npc_ctx;
+	const unsigned src = reply ? NPF_DST : NPF_SRC;
+	const unsigned dst = reply ? NPF_SRC : NPF_DST;
+	const unsigned thlen = sizeof(struct tcphdr) +
+	    (mss ? TCPOLEN_MAXSEG : 0);
+	const struct tcphdr *oth = npc->npc_l4.tcp;
 	struct mbuf *m;
 	struct ip *ip = NULL;
 	struct ip6_hdr *ip6 = NULL;
-	struct tcphdr *oth, *th;
-	tcp_seq seq, ack;
-	int tcpdlen, len;
-	uint32_t win;
+	struct tcphdr *th;
+	int len;
 
-	/* Fetch relevant data. */
 	KASSERT(npf_iscached(npc, NPC_IP46));
-	KASSERT(npf_iscached(npc, NPC_LAYER4));
-	tcpdlen = npf_tcpsaw(npc, &seq, &ack, &win);
-	oth = npc->npc_l4.tcp;
-
-	if (oth->th_flags & TH_RST) {
-		return 0;
-	}
+	KASSERT(npf_iscached(npc, NPC_TCP));
 
 	/* Create and setup a network buffer. */
 	if (npf_iscached(npc, NPC_IP4)) {
-		len = sizeof(struct ip) + sizeof(struct tcphdr);
+		len = sizeof(struct ip) + thlen;
 	} else if (npf_iscached(npc, NPC_IP6)) {
-		len = sizeof(struct ip6_hdr) + sizeof(struct tcphdr);
+		len = sizeof(struct ip6_hdr) + thlen;
 	} else {
-		return EINVAL;
+		return NULL;
 	}
 
+#if defined(_NPF_STANDALONE)
+	m = npf->mbufops->alloc(npf, 0, len);
+	if (m == NULL) {
+		return NULL;
+	}
+#else
 	m = m_gethdr(M_DONTWAIT, MT_HEADER);
 	if (m == NULL) {
-		return ENOMEM;
+		return NULL;
 	}
-#if !defined(_NPF_STANDALONE)
 	m->m_data += max_linkhdr;
 	m->m_len = len;
 	m->m_pkthdr.len = len;
 	(void)npf;
 #endif
 	if (npf_iscached(npc, NPC_IP4)) {
-		struct ip *oip = npc->npc_ip.v4;
-
 		ip = mtod(m, struct ip *);
 		memset(ip, 0, len);
 
@@ -118,23 +401,23 @@ npf_return_tcp(npf_cache_t *npc)
 		 * Note: IP length contains TCP header length.
 		 */
 		ip->ip_p = IPPROTO_TCP;
-		ip->ip_src.s_addr = oip->ip_dst.s_addr;
-		ip->ip_dst.s_addr = oip->ip_src.s_addr;
-		ip->ip_len = htons(sizeof(struct tcphdr));
+		memcpy(&ip->ip_src, npc->npc_ips[src], sizeof(struct in_addr));
+		memcpy(&ip->ip_dst, npc->npc_ips[dst], sizeof(struct in_addr));
+		ip->ip_len = htons(thlen);
 
 		th = (struct tcphdr *)(ip + 1);
 	} else {
-		struct ip6_hdr *oip = npc->npc_ip.v6;
-
 		KASSERT(npf_iscached(npc, NPC_IP6));
 		ip6 = mtod(m, struct ip6_hdr *);
 		memset(ip6, 0, len);
 
 		ip6->ip6_nxt = IPPROTO_TCP;
 		ip6->ip6_hlim = IPV6_DEFHLIM;
-		memcpy(&ip6->ip6_src, &oip->ip6_dst, sizeof(struct in6_addr));
-		memcpy(&ip6->ip6_dst, &oip->ip6_src, sizeof(struct in6_addr));
-		ip6->ip6_plen = htons(len);
+		memcpy(&ip6->ip6_src, npc->npc_ips[src],
+		    sizeof(struct in6_addr));
+		memcpy(&ip6->ip6_dst, npc->npc_ips[dst],
+		    sizeof(struct in6_addr));
+		ip6->ip6_plen = htons(thlen);
 		ip6->ip6_vfc = IPV6_VERSION;
 
 		th = (struct tcphdr *)(ip6 + 1);
@@ -143,15 +426,22 @@ npf_return_tcp(npf_cache_t *npc)
 	/*
 	 * Construct TCP header and compute the checksum.
 	 */
-	th->th_sport = oth->th_dport;
-	th->th_dport = oth->th_sport;
-	th->th_seq = htonl(ack);
-	if (oth->th_flags & TH_SYN) {
-		tcpdlen++;
+	th->th_sport = reply ? oth->th_dport : oth->th_sport;
+	th->th_dport = reply ? oth->th_sport : oth->th_dport;
+	th->th_seq = htonl(seq);
+	th->th_ack = htonl(ack);
+	th->th_off = thlen >> 2;
+	th->th_flags = tcpfl;
+	th->th_win = htons(win);
+
+	if (mss) {
+		uint8_t *opt = (uint8_t *)(th + 1);
+
+		opt[0] = TCPOPT_MAXSEG;
+		opt[1] = TCPOLEN_MAXSEG;
+		opt[2] = mss >> 8;
+		opt[3] = mss & 0xff;
 	}
-	th->th_ack = htonl(seq + tcpdlen);
-	th->th_off = sizeof(struct tcphdr) >> 2;
-	th->th_flags = TH_ACK | TH_RST;
 
 	if (npf_iscached(npc, NPC_IP4)) {
 		th->th_sum = in_cksum(m, len);
@@ -164,28 +454,70 @@ npf_return_tcp(npf_cache_t *npc)
 		ip->ip_tos = IPTOS_LOWDELAY;
 		ip->ip_len = htons(len);
 		ip->ip_ttl = DEFAULT_IP_TTL;
+#if defined(_NPF_STANDALONE)
+		/* No IP layer to fill in the header checksum. */
+		ip->ip_sum = npf_cksum_buf(0, ip, sizeof(struct ip));
+#endif
 	} else {
-		KASSERT(npf_iscached(npc, NPC_IP6));
 		th->th_sum = in6_cksum(m, IPPROTO_TCP, sizeof(struct ip6_hdr),
-		    sizeof(struct tcphdr));
+		    thlen);
 
 		/* Handle IPv6 scopes */
 		if (npf_ip6_setscope(npc, ip6) != 0) {
-			goto bad;
+			m_freem(m);
+			return NULL;
 		}
 	}
+	return m;
+}
 
-	/* Do not inspect the generated reject packets going out. */
+/*
+ * npf_tcp_sendpkt: pass the constructed TCP segment to the IP layer.
+ *
+ * => The packet is always consumed.
+ */
+int
+npf_tcp_sendpkt(const npf_cache_t *npc, struct mbuf *m)
+{
+	/* Do not inspect the generated packets going out. */
 	(void)npf_mbuf_add_tag(npc->npc_nbuf, m, NPF_NTAG_PASS);
 
-	/* Pass to IP layer. */
 	if (npf_iscached(npc, NPC_IP4)) {
 		return ip_output(m, NULL, NULL, IP_FORWARDING, NULL, NULL);
 	}
 	return ip6_output(m, NULL, NULL, IPV6_FORWARDING, NULL, NULL, NULL);
-bad:
-	m_freem(m);
-	return EINVAL;
+}
+
+/*
+ * npf_return_tcp: return a TCP reset (RST) packet.
+ */
+static int
+npf_return_tcp(npf_cache_t *npc)
+{
+	const struct tcphdr *oth;
+	tcp_seq seq, ack;
+	int tcpdlen;
+	uint32_t win;
+	struct mbuf *m;
+
+	/* Fetch relevant data. */
+	KASSERT(npf_iscached(npc, NPC_IP46));
+	KASSERT(npf_iscached(npc, NPC_LAYER4));
+	tcpdlen = npf_tcpsaw(npc, &seq, &ack, &win);
+	oth = npc->npc_l4.tcp;
+
+	if (oth->th_flags & TH_RST) {
+		return 0;
+	}
+	if (oth->th_flags & TH_SYN) {
+		tcpdlen++;
+	}
+
+	m = npf_tcp_mkpkt(npc, true, ack, seq + tcpdlen, TH_ACK | TH_RST, 0, 0);
+	if (m == NULL) {
+		return ENOMEM;
+	}
+	return npf_tcp_sendpkt(npc, m);
 }
 
 /*
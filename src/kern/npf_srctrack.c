@@ -0,0 +1,511 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * NPF source tracking: the per-source limits of the stateful rules.
+ *
+ * Overview
+ *
+ *	A stateful rule may limit the number of concurrent connections
+ *	("max-src-conn") and the rate of new connections ("max-src-conn-
+ *	rate") per source address, so that a single host cannot fill the
+ *	connection table.  The sources are tracked per rule, i.e. keyed by
+ *	the rule ID and the source address.  The source entry is looked up
+ *	once per new connection and it is held by the connection until its
+ *	destruction, so there is no per-packet cost.
+ *
+ *	The rate is estimated as in pf(4): the counter is scaled by 1000,
+ *	it decays linearly over the period and each new connection adds
+ *	one.  The connection is charged only once it is established, so
+ *	that the blocked or failed attempts do not count.  The entry
+ *	outlives its last connection until the counter has decayed, then
+ *	it is collected by the G/C worker, incrementally.
+ *
+ *	If a limit is exceeded, then the connection is rejected and the
+ *	source may be inserted into a table ("overload"), e.g. the one used
+ *	by a blocking rule.  The table insertion may sleep, therefore it is
+ *	deferred to the G/C worker.
+ *
+ *	The number of the entries is limited (the "srctrack.max" parameter),
+ *	so that the spoofed sources cannot exhaust the memory.  If the limit
+ *	is reached, then the connections from the new sources are rejected.
+ *
+ * Concurrency
+ *
+ *	The entries are kept in a key-value map (thmap), keyed by the rule
+ *	ID and the source address, and on a list for the G/C.  The lookups
+ *	are lock-free and protected by the EBR; each entry has a lock, which
+ *	protects its counters.  The list and the G/C position are protected
+ *	by the list lock.  The G/C removes the entry from the map and flags
+ *	it under the entry lock; it destroys the entry after the EBR sync.
+ *	The queue of the pending table insertions has its own lock.
+ *
+ *	Lock order: list_lock -> npf_srcent_t::lock
+ */
+
+#ifdef _KERNEL
+#include <sys/cdefs.h>
+__KERNEL_RCSID(0, "$NetBSD$");
+
+#include <sys/param.h>
+#include <sys/types.h>
+
+#include <sys/atomic.h>
+#include <sys/kmem.h>
+#include <sys/mutex.h>
+#include <sys/systm.h>
+#include <sys/thmap.h>
+#include <sys/time.h>
+#endif
+
+#include "npf_impl.h"
+
+/* The default maximum number of the entries. */
+#define	SRC_MAX_ENTRIES		65536
+
+/* The number of entries to scan per G/C run. */
+#define	SRC_GC_ENTRIES		256
+
+/* The number of pending "overload" table insertions. */
+#define	SRC_OVERLOAD_QLEN	64
+
+#define	SRC_RATE_SCALE		1000
+
+/*
+ * The key: the rule ID followed by the source address.
+ */
+typedef struct {
+	uint64_t		rid;
+	npf_addr_t		addr;
+} src_key_t;
+
+#define	SRC_KEY_LEN(alen)	(offsetof(src_key_t, addr) + (alen))
+
+struct npf_srcent {
+	kmutex_t		lock;
+	LIST_ENTRY(npf_srcent)	entry;
+	unsigned		conns;
+	unsigned		rate_count;
+	uint32_t		rate_last;
+	unsigned		rate_secs;
+	bool			overload;
+	bool			removed;
+	uint16_t		alen;
+	src_key_t		key;
+};
+
+typedef struct {
+	unsigned		tid;
+	unsigned		alen;
+	npf_addr_t		addr;
+} src_overload_t;
+
+struct npf_srctrack {
+	thmap_t *		map;
+	unsigned		count;
+	int			max_entries;
+
+	kmutex_t		list_lock;
+	LIST_HEAD(, npf_srcent)	list;
+	npf_srcent_t *		gc_cursor;
+
+	kmutex_t		ovl_lock;
+	unsigned		ovl_count;
+	src_overload_t		ovl_queue[SRC_OVERLOAD_QLEN];
+};
+
+void
+npf_srctrack_init(npf_t *npf)
+{
+	npf_srctrack_t *st;
+
+	st = kmem_zalloc(sizeof(npf_srctrack_t), KM_SLEEP);
+	st->map = thmap_create(0, NULL, THMAP_NOCOPY);
+	mutex_init(&st->list_lock, MUTEX_DEFAULT, IPL_SOFTNET);
+	LIST_INIT(&st->list);
+	mutex_init(&st->ovl_lock, MUTEX_DEFAULT, IPL_SOFTNET);
+	npf->srctrack = st;
+
+	npf_param_t param_map[] = {
+		{
+			"srctrack.max",
+			&st->max_entries,
+			.default_val = SRC_MAX_ENTRIES,
+			.min = 0, .max = INT_MAX
+		},
+	};
+	npf_param_register(npf, param_map, __arraycount(param_map));
+}
+
+/*
+ * npf_srctrack_fini: destroy the source tracking.
+ *
+ * => The caller ensures there are no connections, i.e. no entries
+ *    are referenced.
+ */
+void
+npf_srctrack_fini(npf_t *npf)
+{
+	npf_srctrack_t *st = npf->srctrack;
+
+	npf_srctrack_gc(npf, true);
+	KASSERT(LIST_EMPTY(&st->list));
+	KASSERT(st->count == 0);
+
+	thmap_destroy(st->map);
+	mutex_destroy(&st->list_lock);
+	mutex_destroy(&st->ovl_lock);
+	kmem_free(st, sizeof(npf_srctrack_t));
+}
+
+static uint32_t
+src_getnow(void)
+{
+	struct timespec tsnow;
+
+	getnanouptime(&tsnow);
+	return tsnow.tv_sec;
+}
+
+static inline void
+src_setkey(src_key_t *key, uint64_t rid, unsigned alen, const npf_addr_t *addr)
+{
+	key->rid = rid;
+	memcpy(&key->addr, addr, alen);
+}
+
+/*
+ * src_lookup: find the entry and lock it or, if none, create one.
+ *
+ * => Returns NULL if there is no entry and 'create' is false, or if
+ *    the entry could not be created (*errorp is set then).
+ */
+static npf_srcent_t *
+src_lookup(npf_t *npf, uint64_t rid, unsigned alen, const npf_addr_t *addr,
+    uint32_t now, bool create, int *errorp)
+{
+	npf_srctrack_t *st = npf->srctrack;
+	const unsigned keylen = SRC_KEY_LEN(alen);
+	npf_srcent_t *ent, *newent;
+	src_key_t key;
+	unsigned max;
+	int s;
+
+	src_setkey(&key, rid, alen, addr);
+again:
+	s = npf_config_read_enter(npf);
+	if ((ent = thmap_get(st->map, &key, keylen)) != NULL) {
+		mutex_enter(&ent->lock);
+		if (__predict_false(ent->removed)) {
+			/* Race with the G/C: retry. */
+			mutex_exit(&ent->lock);
+			npf_config_read_exit(npf, s);
+			goto again;
+		}
+	}
+	npf_config_read_exit(npf, s);
+	if (ent || !create) {
+		return ent;
+	}
+
+	/*
+	 * Create a new entry, unless the limit is reached.
+	 */
+	max = atomic_load_relaxed(&st->max_entries);
+	if (atomic_inc_uint_nv(&st->count) > max && max) {
+		atomic_dec_uint(&st->count);
+		*errorp = ENOBUFS;
+		return NULL;
+	}
+	newent = kmem_intr_zalloc(sizeof(npf_srcent_t), KM_NOSLEEP);
+	if (newent == NULL) {
+		atomic_dec_uint(&st->count);
+		*errorp = ENOMEM;
+		return NULL;
+	}
+	mutex_init(&newent->lock, MUTEX_DEFAULT, IPL_SOFTNET);
+	newent->alen = alen;
+	newent->rate_last = now;
+	src_setkey(&newent->key, rid, alen, addr);
+
+	/*
+	 * Insert the entry.  If lost the race, then destroy ours and
+	 * use the existing one.
+	 */
+	ent = thmap_put(st->map, &newent->key, keylen, newent);
+	if (ent != newent) {
+		mutex_destroy(&newent->lock);
+		kmem_intr_free(newent, sizeof(npf_srcent_t));
+		atomic_dec_uint(&st->count);
+		goto again;
+	}
+	mutex_enter(&st->list_lock);
+	LIST_INSERT_HEAD(&st->list, ent, entry);
+	mutex_exit(&st->list_lock);
+
+	mutex_enter(&ent->lock);
+	return ent;
+}
+
+/*
+ * src_rate_decay: decay the rate counter linearly over the period.
+ */
+static void
+src_rate_decay(npf_srcent_t *ent, uint32_t now)
+{
+	const unsigned elapsed = now - ent->rate_last;
+
+	KASSERT(mutex_owned(&ent->lock));
+	KASSERT(ent->rate_secs > 0);
+
+	if (elapsed >= ent->rate_secs) {
+		ent->rate_count = 0;
+	} else {
+		ent->rate_count -= (uint64_t)ent->rate_count *
+		    elapsed / ent->rate_secs;
+	}
+	ent->rate_last = now;
+}
+
+/*
+ * src_overload: queue the insertion of the source into the table.
+ */
+static void
+src_overload(npf_t *npf, unsigned tid, unsigned alen, const npf_addr_t *addr)
+{
+	npf_srctrack_t *st = npf->srctrack;
+	src_overload_t *ovl;
+
+	mutex_enter(&st->ovl_lock);
+	if (st->ovl_count == SRC_OVERLOAD_QLEN) {
+		/* The worker is behind; the source will be hit again. */
+		mutex_exit(&st->ovl_lock);
+		return;
+	}
+	ovl = &st->ovl_queue[st->ovl_count++];
+	ovl->tid = tid;
+	ovl->alen = alen;
+	memcpy(&ovl->addr, addr, alen);
+	mutex_exit(&st->ovl_lock);
+
+	npf_stats_inc(npf, NPF_STAT_SRC_OVERLOAD);
+	npf_worker_signal(npf);
+}
+
+/*
+ * npf_srctrack_enter: account a new connection of the rule against its
+ * source address and enforce the limits of the rule.
+ *
+ * => On success, returns the source entry (if any), which the caller
+ *    should associate with the connection or release.  The rate is
+ *    charged only by npf_srctrack_charge(), once established.
+ * => Returns ENOSPC if the connection limit or EAGAIN if the rate limit
+ *    is exceeded; ENOBUFS if there are too many sources.
+ */
+int
+npf_srctrack_enter(npf_cache_t *npc, const npf_match_info_t *mi,
+    npf_srcent_t **entp)
+{
+	npf_t *npf = npc->npc_ctx;
+	const npf_srclimit_t *sl = &mi->mi_srclimit;
+	const npf_addr_t *addr = npc->npc_ips[NPF_SRC];
+	const unsigned alen = npc->npc_alen;
+	const uint32_t now = src_getnow();
+	npf_srcent_t *ent;
+	bool overload = false;
+	int error = 0;
+
+	KASSERT(npf_iscached(npc, NPC_IP46));
+
+	ent = src_lookup(npf, mi->mi_rid, alen, addr, now, true, &error);
+	if (ent == NULL) {
+		*entp = NULL;
+		if (error == ENOBUFS) {
+			npf_stats_inc(npf, NPF_STAT_BLOCK_SRC_FULL);
+			return error;
+		}
+		/* No memory: just proceed without tracking. */
+		return 0;
+	}
+	ent->rate_secs = sl->sl_rate ? sl->sl_rate_secs : 0;
+
+	if (sl->sl_rate) {
+		src_rate_decay(ent, now);
+	}
+	if (sl->sl_rate && (uint64_t)ent->rate_count + SRC_RATE_SCALE >
+	    (uint64_t)sl->sl_rate * SRC_RATE_SCALE) {
+		error = EAGAIN;
+	} else if (sl->sl_maxconn && ent->conns >= sl->sl_maxconn) {
+		error = ENOSPC;
+	}
+	if (error == 0) {
+		ent->conns++;
+	} else if (sl->sl_tid != NPF_SRCLIMIT_NOTABLE && !ent->overload) {
+		/* Insert into the table only once. */
+		ent->overload = true;
+		overload = true;
+	}
+	mutex_exit(&ent->lock);
+
+	if (error) {
+		npf_stats_inc(npf, error == EAGAIN ?
+		    NPF_STAT_BLOCK_SRC_RATE : NPF_STAT_BLOCK_SRC_CONN);
+		if (overload) {
+			src_overload(npf, sl->sl_tid, alen, addr);
+		}
+		*entp = NULL;
+		return error;
+	}
+	*entp = ent;
+	return 0;
+}
+
+/*
+ * npf_srctrack_charge: charge the established connection against the
+ * rate limit of its source.
+ */
+void
+npf_srctrack_charge(npf_srcent_t *ent)
+{
+	mutex_enter(&ent->lock);
+	KASSERT(ent->conns > 0);
+	if (ent->rate_secs) {
+		src_rate_decay(ent, src_getnow());
+		if (ent->rate_count <= UINT_MAX - SRC_RATE_SCALE) {
+			ent->rate_count += SRC_RATE_SCALE;
+		}
+	}
+	mutex_exit(&ent->lock);
+}
+
+/*
+ * npf_srctrack_exit: release the connection from its source entry.
+ *
+ * => The entry is left for the G/C, which destroys it once there are
+ *    no connections and the rate counter has decayed.
+ */
+void
+npf_srctrack_exit(npf_t *npf, npf_srcent_t *ent)
+{
+	(void)npf;
+
+	mutex_enter(&ent->lock);
+	KASSERT(ent->conns > 0);
+	ent->conns--;
+	mutex_exit(&ent->lock);
+}
+
+/*
+ * npf_srctrack_gc: destroy the entries without connections, whose rate
+ * counter has decayed.  Scans a part of the entries on each run.
+ *
+ * => If 'flush' is true, then scan all entries and destroy the ones
+ *    without connections.  The caller ensures there are no lookups.
+ */
+void
+npf_srctrack_gc(npf_t *npf, bool flush)
+{
+	npf_srctrack_t *st = npf->srctrack;
+	const uint32_t now = src_getnow();
+	LIST_HEAD(, npf_srcent) gclist;
+	unsigned n = SRC_GC_ENTRIES;
+	npf_srcent_t *ent, *next;
+	void *gcref;
+
+	LIST_INIT(&gclist);
+	mutex_enter(&st->list_lock);
+	ent = flush ? LIST_FIRST(&st->list) : st->gc_cursor;
+	while (flush || n--) {
+		if (ent == NULL && (flush ||
+		    (ent = LIST_FIRST(&st->list)) == NULL)) {
+			break;
+		}
+		next = LIST_NEXT(ent, entry);
+
+		mutex_enter(&ent->lock);
+		if (ent->conns == 0 && (flush ||
+		    now - ent->rate_last >= ent->rate_secs)) {
+			thmap_del(st->map, &ent->key, SRC_KEY_LEN(ent->alen));
+			ent->removed = true;
+			LIST_REMOVE(ent, entry);
+			LIST_INSERT_HEAD(&gclist, ent, entry);
+		}
+		mutex_exit(&ent->lock);
+		ent = next;
+	}
+	st->gc_cursor = ent;
+	mutex_exit(&st->list_lock);
+
+	/*
+	 * Ensure there are no lookups referencing the removed entries.
+	 */
+	gcref = thmap_stage_gc(st->map);
+	if (!flush && (gcref || !LIST_EMPTY(&gclist))) {
+		npf_config_enter(npf);
+		npf_config_sync(npf);
+		npf_config_exit(npf);
+	}
+	thmap_gc(st->map, gcref);
+
+	while ((ent = LIST_FIRST(&gclist)) != NULL) {
+		LIST_REMOVE(ent, entry);
+		mutex_destroy(&ent->lock);
+		kmem_intr_free(ent, sizeof(npf_srcent_t));
+		atomic_dec_uint(&st->count);
+	}
+}
+
+/*
+ * npf_srctrack_worker: insert the overloading sources into the tables
+ * and G/C the entries.
+ */
+void
+npf_srctrack_worker(npf_t *npf)
+{
+	npf_srctrack_t *st = npf->srctrack;
+	npf_config_t *nc;
+
+	if (atomic_load_relaxed(&st->ovl_count)) {
+		nc = npf_config_enter(npf);
+		mutex_enter(&st->ovl_lock);
+		while (st->ovl_count) {
+			src_overload_t ovl = st->ovl_queue[--st->ovl_count];
+			npf_table_t *t;
+
+			mutex_exit(&st->ovl_lock);
+			t = npf_tableset_getbyid(nc->tableset, ovl.tid);
+			if (t) {
+				(void)npf_table_insert(t, ovl.alen, &ovl.addr,
+				    NPF_NO_NETMASK);
+			}
+			mutex_enter(&st->ovl_lock);
+		}
+		mutex_exit(&st->ovl_lock);
+		npf_config_exit(npf);
+	}
+	npf_srctrack_gc(npf, false);
+}
+
+#if defined(DDB) || defined(_NPF_TESTING)
+
+unsigned
+npf_srctrack_getconns(npf_t *npf, uint64_t rid, unsigned alen,
+    const npf_addr_t *addr)
+{
+	npf_srcent_t *ent;
+	unsigned conns;
+
+	ent = src_lookup(npf, rid, alen, addr, 0, false, NULL);
+	if (ent == NULL) {
+		return 0;
+	}
+	conns = ent->conns;
+	mutex_exit(&ent->lock);
+	return conns;
+}
+
+#endif
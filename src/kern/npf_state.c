@@ -218,6 +218,42 @@ npf_state_etime(npf_t *npf, const npf_state_t *nst, const int proto)
 	return timeout;
 }
 
+/*
+ * npf_state_embryonic_p: return true if the connection is not yet
+ * established, i.e. there is no reply from the other side.
+ */
+bool
+npf_state_embryonic_p(const npf_state_t *nst, const int proto)
+{
+	if (proto == IPPROTO_TCP) {
+		return npf_state_tcp_embryonic_p(nst);
+	}
+	return nst->nst_state != NPF_ANY_CONN_ESTABLISHED;
+}
+
+/*
+ * npf_state_valid_p: return true if the state, e.g. constructed from
+ * the connection record, is valid for the given protocol.
+ */
+bool
+npf_state_valid_p(const npf_state_t *nst, const int proto)
+{
+	switch (proto) {
+	case IPPROTO_TCP:
+		if (nst->nst_flags & ~NPF_STATE_SYNPROXY) {
+			return false;
+		}
+		return npf_state_tcp_valid_p(nst);
+	case IPPROTO_UDP:
+	case IPPROTO_ICMP:
+	case IPPROTO_GRE:
+		return nst->nst_flags == 0 &&
+		    nst->nst_state < NPF_ANY_CONN_NSTATES;
+	default:
+		return false;
+	}
+}
+
 void
 npf_state_dump(const npf_state_t *nst)
 {
@@ -429,6 +429,103 @@ npf_tcp_inwindow(npf_cache_t *npc, npf_state_t *nst, const npf_flow_t flow)
 	return true;
 }
 
+/*
+ * npf_tcp_rwrseq: adjust the SEQ or, if ack is true, the ACK number of
+ * the TCP segment by the given delta and update the checksum.
+ */
+static void
+npf_tcp_rwrseq(npf_cache_t *npc, bool ack, uint32_t delta)
+{
+	struct tcphdr *th = npc->npc_l4.tcp;
+	tcp_seq *field = ack ? &th->th_ack : &th->th_seq;
+	const unsigned offload = npf_cksum_offload(npc) & NPF_CKSUM_TCP;
+	const uint32_t oval = *field, nval = htonl(ntohl(oval) + delta);
+
+	*field = nval;
+	if (offload) {
+		nbuf_cksum_offload_set(npc->npc_ctx, npc->npc_nbuf, offload);
+	} else {
+		th->th_sum = npf_fixup32_cksum(th->th_sum, oval, nval);
+	}
+}
+
+/*
+ * npf_tcp_synproxy: handle the handshake of the SYN proxy connection
+ * with the responder (see npf_synproxy.c for the overview).  While the
+ * handshake is in progress, the SEQ difference holds the cookie.
+ */
+static bool
+npf_tcp_synproxy(npf_cache_t *npc, npf_state_t *nst, npf_flow_t flow)
+{
+	const npf_tcpstate_t *fwd = &nst->nst_tcpst[NPF_FLOW_FORW];
+	npf_tcpstate_t *back = &nst->nst_tcpst[NPF_FLOW_BACK];
+	struct tcphdr *th = npc->npc_l4.tcp;
+	const unsigned tcpfl = th->th_flags;
+	const bool waiting = nst->nst_state == NPF_TCPS_SYN_SENT;
+	uint16_t oflags, nflags;
+	tcp_seq seq;
+
+	/* The initiator must wait for the handshake to complete. */
+	if (flow == NPF_FLOW_FORW) {
+		return false;
+	}
+	seq = ntohl(th->th_seq);
+
+	/*
+	 * The responder has refused the connection: pass the RST to the
+	 * initiator, setting the SEQ which it expects.
+	 */
+	if (waiting && (tcpfl & (TH_RST | TH_ACK)) == (TH_RST | TH_ACK)) {
+		if (ntohl(th->th_ack) != fwd->nst_end) {
+			return false;
+		}
+		npf_tcp_rwrseq(npc, false, nst->nst_seqdiff + 1 - seq);
+		nst->nst_state = NPF_TCPS_CLOSED;
+		return true;
+	}
+	if ((tcpfl & (TH_SYN | TH_ACK | TH_FIN | TH_RST)) !=
+	    (TH_SYN | TH_ACK)) {
+		return false;
+	}
+
+	/*
+	 * SYN-ACK from the responder.  If it is the first one, then the
+	 * connection is established and the SEQ difference is noted.
+	 */
+	if (waiting && ntohl(th->th_ack) != fwd->nst_end) {
+		return false;
+	}
+	if (!npf_tcp_inwindow(npc, nst, flow)) {
+		return false;
+	}
+	if (waiting) {
+		nst->nst_seqdiff -= seq;
+		nst->nst_state = NPF_TCPS_ESTABLISHED;
+
+		/* Account the ACK, which will be sent to the responder. */
+		if (SEQ_GT(back->nst_end + fwd->nst_maxwin, back->nst_maxend)) {
+			back->nst_maxend = back->nst_end + fwd->nst_maxwin;
+		}
+	}
+
+	/*
+	 * Convert the SYN-ACK into the window update for the initiator:
+	 * clear the SYN flag and translate the SEQ, advancing it past the
+	 * SYN.  Note: the flags are in the 16-bit word with the offset.
+	 */
+	th = npc->npc_l4.tcp;
+	memcpy(&oflags, (uint8_t *)&th->th_flags - 1, sizeof(uint16_t));
+	th->th_flags &= ~TH_SYN;
+	memcpy(&nflags, (uint8_t *)&th->th_flags - 1, sizeof(uint16_t));
+	if ((npf_cksum_offload(npc) & NPF_CKSUM_TCP) == 0) {
+		th->th_sum = npf_fixup16_cksum(th->th_sum, oflags, nflags);
+	}
+	npf_tcp_rwrseq(npc, false, nst->nst_seqdiff + 1);
+
+	npc->npc_info |= NPC_SYNPROXY;
+	return true;
+}
+
 /*
  * npf_state_tcp: inspect TCP segment, determine whether it belongs to
  * the connection and track its state.
@@ -442,6 +539,19 @@ npf_state_tcp(npf_cache_t *npc, npf_state_t *nst, npf_flow_t flow)
 
 	KASSERT(nst->nst_state < NPF_TCP_NSTATES);
 
+	/*
+	 * SYN proxy: handle the handshake with the responder; translate
+	 * the initiator's ACK number into the responder's space.
+	 */
+	if (__predict_false(nst->nst_flags & NPF_STATE_SYNPROXY)) {
+		if (state == NPF_TCPS_SYN_SENT || (tcpfl & TH_SYN) != 0) {
+			return npf_tcp_synproxy(npc, nst, flow);
+		}
+		if (flow == NPF_FLOW_FORW && (tcpfl & TH_ACK) != 0) {
+			npf_tcp_rwrseq(npc, true, -nst->nst_seqdiff);
+		}
+	}
+
 	/* Look for a transition to a new state. */
 	if (__predict_true((tcpfl & TH_RST) == 0)) {
 		const u_int flagcase = npf_tcpfl2case(tcpfl);
@@ -457,6 +567,11 @@ npf_state_tcp(npf_cache_t *npc, npf_state_t *nst, npf_flow_t flow)
 	if (!npf_tcp_inwindow(npc, nst, flow)) {
 		return false;
 	}
+	if (__predict_false(nst->nst_flags & NPF_STATE_SYNPROXY) &&
+	    flow == NPF_FLOW_BACK) {
+		/* SYN proxy: translate the SEQ for the initiator. */
+		npf_tcp_rwrseq(npc, false, nst->nst_seqdiff);
+	}
 	if (__predict_true(nstate == NPF_TCPS_OK)) {
 		return true;
 	}
@@ -494,6 +609,35 @@ npf_state_tcp_timeout(npf_t *npf, const npf_state_t *nst)
 	return params->timeouts[state_timeout_idx[state]];
 }
 
+/*
+ * npf_state_tcp_embryonic_p: return true if the handshake is incomplete.
+ */
+bool
+npf_state_tcp_embryonic_p(const npf_state_t *nst)
+{
+	return nst->nst_state < NPF_TCPS_ESTABLISHED;
+}
+
+/*
+ * npf_state_tcp_valid_p: return true if the state and the window scale
+ * factors are in the valid range.
+ */
+bool
+npf_state_tcp_valid_p(const npf_state_t *nst)
+{
+	if (nst->nst_state >= NPF_TCP_NSTATES) {
+		return false;
+	}
+	for (unsigned i = 0; i < 2; i++) {
+		const int wscale = nst->nst_tcpst[i].nst_wscale;
+
+		if (wscale < 0 || wscale > TCP_MAX_WINSHIFT) {
+			return false;
+		}
+	}
+	return true;
+}
+
 void
 npf_state_tcp_sysinit(npf_t *npf)
 {
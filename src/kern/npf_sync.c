@@ -0,0 +1,434 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * NPF connection state replication, e.g. to a standby in the HA pair.
+ *
+ * Overview
+ *
+ *	The changes of the connections are recorded as the delta records
+ *	(npf_syncrec_t): the creation, the TCP state transitions, the NAT
+ *	association (if made after the creation) and the expiration.  Each
+ *	record carries the complete connection record (npf_connrec_t), so
+ *	the receiver can (re)create the connection from any of them.
+ *
+ *	The receiver sees no packets of the connections, therefore the
+ *	active connections are also refreshed periodically (the refresh
+ *	record, at most once per "sync.refresh" seconds), so they do not
+ *	expire on the receiver.  The receiver extends the expiration time
+ *	of the replicated connections by the refresh interval and does
+ *	not record their expiration: it is recorded by their origin.
+ *
+ *	The records are consumed in batches using npf_sync_drain() and
+ *	passed to the standby over any transport.  The receiver applies
+ *	them using npf_sync_apply().
+ *
+ * Ordering
+ *
+ *	The records of a connection may be recorded on different CPUs,
+ *	therefore they may be drained out of order.  Each connection gets
+ *	an ID with its first record and each record has the generation,
+ *	which is advanced under the connection lock as the record is
+ *	constructed.  The IDs are seeded with the wall-clock time, so they
+ *	keep increasing across the restarts of the primary.  The receiver
+ *	keeps the ID and the generation of the last applied record in the
+ *	connection and discards the records, which are older.  It also
+ *	keeps a tombstone with the ID of the expired connection for a
+ *	short while, so the late records do not resurrect it.
+ *
+ * Concurrency
+ *
+ *	The records are kept in the per-CPU log rings (see npf_logring.c),
+ *	therefore the packet path takes no additional locks.  The interface
+ *	IDs are converted to the names on drain, since it requires the
+ *	interface map lock.  The state transitions are also rate-limited
+ *	per CPU (the "sync.state_rate" parameter).  The dropped records
+ *	are accounted in the statistics.
+ */
+
+#ifdef _KERNEL
+#include <sys/cdefs.h>
+__KERNEL_RCSID(0, "$NetBSD$");
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/kmem.h>
+#include <sys/percpu.h>
+#include <sys/systm.h>
+#include <sys/time.h>
+#endif
+
+#define __NPF_CONN_PRIVATE
+#include "npf_conn.h"
+#include "npf_impl.h"
+
+#define	SYNC_NRECS		1024
+#define	SYNC_BATCH		16
+#define	SYNC_STATE_RATE		1000	// per second, per CPU
+#define	SYNC_REFRESH		10	// seconds
+
+#define	SYNC_NTOMBS		1024
+#define	SYNC_TOMB_TIMEOUT	10	// seconds
+
+/* Tombstone of the expired connection. */
+typedef struct {
+	uint64_t		id;
+	uint32_t		time;
+	npf_connkey_t		key;
+} npf_synctomb_t;
+
+struct npf_sync {
+	npf_logring_t *		ring;
+	percpu_t *		rate;
+	uint64_t		next_id;
+	npf_synctomb_t *	tombs;
+};
+
+/* The ring entry: the record and the interface IDs of its names. */
+typedef struct {
+	unsigned		type;
+	uint32_t		gen;
+	uint64_t		id;
+	unsigned		ifids[NPF_CONNREC_NIFS];
+	npf_connrec_t		rec;
+} npf_syncent_t;
+
+typedef struct {
+	uint32_t		sec;
+	uint32_t		count;
+} npf_syncrate_t;
+
+void
+npf_sync_init(npf_t *npf)
+{
+	npf_sync_t *sync;
+	struct timespec ts;
+	npf_param_t param_map[] = {
+		{
+			"sync.state_rate",
+			&npf->sync_state_rate,
+			.default_val = SYNC_STATE_RATE,
+			.min = 0, .max = INT_MAX
+		},
+		{
+			"sync.refresh",
+			&npf->sync_refresh,
+			.default_val = SYNC_REFRESH,
+			.min = 1, .max = 3600
+		},
+	};
+
+	sync = kmem_zalloc(sizeof(npf_sync_t), KM_SLEEP);
+	sync->ring = npf_logring_create(SYNC_NRECS, sizeof(npf_syncent_t));
+	sync->rate = percpu_alloc(sizeof(npf_syncrate_t));
+	sync->tombs = kmem_zalloc(SYNC_NTOMBS * sizeof(npf_synctomb_t),
+	    KM_SLEEP);
+	getnanotime(&ts);
+	sync->next_id = (uint64_t)ts.tv_sec << 24;
+	npf->sync = sync;
+
+	npf_param_register(npf, param_map, __arraycount(param_map));
+}
+
+void
+npf_sync_fini(npf_t *npf)
+{
+	npf_sync_t *sync = npf->sync;
+
+	if (sync) {
+		npf_logring_destroy(sync->ring);
+		percpu_free(sync->rate, sizeof(npf_syncrate_t));
+		kmem_free(sync->tombs, SYNC_NTOMBS * sizeof(npf_synctomb_t));
+		kmem_free(sync, sizeof(npf_sync_t));
+		npf->sync = NULL;
+	}
+}
+
+/*
+ * npf_sync_ratelimit: account the state transition record against the
+ * limit of the current CPU; returns true if it is over the limit.
+ */
+static bool
+npf_sync_ratelimit(npf_t *npf, npf_sync_t *sync)
+{
+	const unsigned max = atomic_load_relaxed(&npf->sync_state_rate);
+	struct timespec tsnow;
+	npf_syncrate_t *rt;
+	bool over;
+
+	if (max == 0) {
+		return false;
+	}
+	getnanouptime(&tsnow);
+
+	int s = splsoftnet();
+	rt = percpu_getref(sync->rate);
+	if (rt->sec != (uint32_t)tsnow.tv_sec) {
+		rt->sec = tsnow.tv_sec;
+		rt->count = 0;
+	}
+	if ((over = rt->count >= max) == false) {
+		rt->count++;
+	}
+	percpu_putref(sync->rate);
+	splx(s);
+	return over;
+}
+
+/*
+ * npf_sync_conn: record the change of the connection.
+ */
+void
+npf_sync_conn(npf_t *npf, unsigned type, npf_conn_t *con)
+{
+	npf_sync_t *sync = npf->sync;
+	npf_syncent_t ent;
+
+	if (__predict_true(sync == NULL)) {
+		return;
+	}
+	if (type == NPF_SYNC_STATE && npf_sync_ratelimit(npf, sync)) {
+		npf_stats_inc(npf, NPF_STAT_SYNC_RATELIMIT);
+		return;
+	}
+	if (atomic_load_relaxed(&con->c_syncid) == 0) {
+		/* The first record: assign the ID, unless raced. */
+		const uint64_t id = atomic_inc_64_nv(&sync->next_id);
+		atomic_cas_64(&con->c_syncid, 0, id);
+	}
+	atomic_store_relaxed(&con->c_synctime,
+	    atomic_load_relaxed(&con->c_atime));
+	ent.type = type;
+	ent.id = atomic_load_relaxed(&con->c_syncid);
+	npf_conn_getrec(con, &ent.rec, ent.ifids, &ent.gen);
+	if (!npf_logring_put(sync->ring, &ent, sizeof(npf_syncent_t))) {
+		npf_stats_inc(npf, NPF_STAT_SYNC_DROP);
+	}
+}
+
+/*
+ * npf_sync_refresh: record the refresh of the active connection, if
+ * nothing was recorded for it during the refresh interval.  Only one
+ * CPU records it.  Note: the per-connection interval bounds the rate,
+ * therefore the records are not subject to the state transition limit.
+ */
+void
+npf_sync_refresh(npf_t *npf, npf_conn_t *con)
+{
+	uint32_t atime, stime;
+
+	if (__predict_true(npf->sync == NULL)) {
+		return;
+	}
+	atime = atomic_load_relaxed(&con->c_atime);
+	stime = atomic_load_relaxed(&con->c_synctime);
+	if ((int32_t)(atime - stime) <
+	    (int)atomic_load_relaxed(&npf->sync_refresh)) {
+		return;
+	}
+	if (atomic_cas_32(&con->c_synctime, stime, atime) != stime) {
+		/* Raced with another CPU. */
+		return;
+	}
+	npf_sync_conn(npf, NPF_SYNC_REFRESH, con);
+}
+
+/*
+ * npf_sync_drain: move up to the given number of records from the
+ * rings into the buffer; returns the number of records.
+ */
+size_t
+npf_sync_drain(npf_t *npf, npf_syncrec_t *buf, size_t count)
+{
+	npf_sync_t *sync = npf->sync;
+	npf_syncent_t ents[SYNC_BATCH];
+	size_t n = 0;
+
+	if (sync == NULL) {
+		return 0;
+	}
+	while (n < count) {
+		const size_t want = MIN(count - n, SYNC_BATCH);
+		size_t got;
+
+		got = npf_logring_drain(sync->ring, ents,
+		    sizeof(npf_syncent_t), want);
+		for (size_t i = 0; i < got; i++) {
+			npf_syncent_t *ent = &ents[i];
+			npf_syncrec_t *sr = &buf[n++];
+
+			npf_connrec_setifnames(npf, &ent->rec, ent->ifids);
+			sr->sr_type = ent->type;
+			sr->sr_gen = ent->gen;
+			sr->sr_id = ent->id;
+			memcpy(&sr->sr_conn, &ent->rec, sizeof(npf_connrec_t));
+		}
+		if (got < want) {
+			break;
+		}
+	}
+	return n;
+}
+
+static npf_synctomb_t *
+npf_sync_gettomb(npf_sync_t *sync, const npf_connkey_t *key)
+{
+	const uint32_t hash = murmurhash2(key, NPF_CONNKEY_LEN(key), 0);
+	return &sync->tombs[hash & (SYNC_NTOMBS - 1)];
+}
+
+/*
+ * npf_sync_bury: record the tombstone of the expired connection.  The
+ * table is direct-mapped: on collision, the older tombstone is lost.
+ */
+static void
+npf_sync_bury(npf_sync_t *sync, const npf_connkey_t *key, uint64_t id)
+{
+	npf_synctomb_t *tomb = npf_sync_gettomb(sync, key);
+	struct timespec tsnow;
+
+	getnanouptime(&tsnow);
+	memcpy(&tomb->key, key, NPF_CONNKEY_LEN(key));
+	tomb->time = tsnow.tv_sec;
+	tomb->id = id;
+}
+
+/*
+ * npf_sync_buried: return true if the connection with the given key
+ * and ID has expired recently, i.e. the record is late.
+ */
+static bool
+npf_sync_buried(npf_sync_t *sync, const npf_connkey_t *key, uint64_t id)
+{
+	const npf_synctomb_t *tomb = npf_sync_gettomb(sync, key);
+	struct timespec tsnow;
+
+	if (tomb->id == 0 || id > tomb->id ||
+	    memcmp(&tomb->key, key, NPF_CONNKEY_LEN(key)) != 0) {
+		return false;
+	}
+	getnanouptime(&tsnow);
+	return (uint32_t)tsnow.tv_sec - tomb->time <= SYNC_TOMB_TIMEOUT;
+}
+
+/*
+ * npf_sync_cmp: compare the record with the last applied record of the
+ * connection.  Returns -1 if the record is stale (reordered or of the
+ * older connection), 0 if it is a newer record of the same connection
+ * and 1 if it is of the newer connection.
+ */
+static int
+npf_sync_cmp(npf_conn_t *con, const npf_syncrec_t *sr)
+{
+	uint64_t id;
+	uint32_t gen;
+
+	mutex_enter(&con->c_lock);
+	id = con->c_syncid;
+	gen = con->c_syncgen;
+	mutex_exit(&con->c_lock);
+
+	if (sr->sr_id != id) {
+		return sr->sr_id < id ? -1 : 1;
+	}
+	return sr->sr_gen <= gen ? -1 : 0;
+}
+
+/*
+ * npf_sync_applyrec: apply the record to the active connection database.
+ *
+ * => Returns true if the connection was updated, created or removed.
+ */
+static bool
+npf_sync_applyrec(npf_t *npf, const npf_syncrec_t *sr)
+{
+	const npf_connrec_t *rec = &sr->sr_conn;
+	npf_sync_t *sync = npf->sync;
+	npf_connkey_t key;
+	npf_conn_t *con;
+	npf_flow_t flow;
+	int cmp;
+
+	if (!npf_connkey_setrec(npf, &rec->cr_key[NPF_FLOW_FORW],
+	    rec->cr_alen, rec->cr_proto, &key)) {
+		return false;
+	}
+	con = npf_conndb_lookup(npf, &key, &flow);
+	if (con == NULL) {
+		/* Discard the late records of the expired connection. */
+		if (npf_sync_buried(sync, &key, sr->sr_id)) {
+			return false;
+		}
+		goto create;
+	}
+	if (flow != NPF_FLOW_FORW) {
+		/* Another connection, which would be the duplicate. */
+		npf_conn_release(con);
+		return false;
+	}
+	if ((cmp = npf_sync_cmp(con, sr)) < 0) {
+		/* Discard the reordered record. */
+		npf_conn_release(con);
+		return false;
+	}
+	if (cmp == 0 && (sr->sr_type == NPF_SYNC_STATE ||
+	    sr->sr_type == NPF_SYNC_REFRESH)) {
+		/* State transition or refresh: update in place. */
+		const bool ok = npf_conn_update(con, rec, sr->sr_gen);
+		npf_conn_release(con);
+		return ok;
+	}
+
+	/*
+	 * Otherwise, the connection is replaced or removed.  Note:
+	 * do not replicate the removal back (see npf_conn_destroy).
+	 */
+	npf_conn_evict(npf, con);
+	npf_conn_release(con);
+create:
+	if (sr->sr_type == NPF_SYNC_EXPIRE) {
+		npf_sync_bury(sync, &key, sr->sr_id);
+		return true;
+	}
+	return npf_conn_setrec(npf, rec, sr->sr_id, sr->sr_gen) == 0;
+}
+
+/*
+ * npf_sync_apply: apply the records to the active connection database.
+ * The NAT policies are looked up in the active configuration, which
+ * must be loaded first.  The replication must be enabled, since the
+ * tombstones are kept in its structure.
+ *
+ * => Returns the number of applied records.
+ */
+size_t
+npf_sync_apply(npf_t *npf, const npf_syncrec_t *buf, size_t count)
+{
+	size_t n = 0;
+
+	if (npf->sync == NULL) {
+		return 0;
+	}
+	npf_config_enter(npf);
+	for (size_t i = 0; i < count; i++) {
+		const npf_syncrec_t *sr = &buf[i];
+
+		switch (sr->sr_type) {
+		case NPF_SYNC_CREATE:
+		case NPF_SYNC_STATE:
+		case NPF_SYNC_NAT:
+		case NPF_SYNC_EXPIRE:
+		case NPF_SYNC_REFRESH:
+			n += npf_sync_applyrec(npf, sr);
+			break;
+		default:
+			break;
+		}
+	}
+	npf_config_exit(npf);
+	return n;
+}
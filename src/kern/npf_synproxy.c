@@ -0,0 +1,370 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * NPF SYN proxy: protection of the TCP responders against SYN floods.
+ *
+ * Overview
+ *
+ *	The TCP handshake is first completed with the initiator on
+ *	behalf of the responder, using SYN cookies, so no state is
+ *	created for the spoofed SYNs.  Only then the connection is
+ *	established and the handshake with the responder is performed:
+ *
+ *	1. The initiator's SYN matching a "synproxy" rule is dropped and
+ *	   answered with the SYN-ACK, whose ISN is the cookie.  The window
+ *	   is zero, so the initiator does not send any data until the
+ *	   connection with the responder is established.
+ *
+ *	2. The initiator's ACK, which does not belong to any connection
+ *	   and acknowledges a valid cookie, is replaced with the SYN to
+ *	   the responder, reconstructed from the ACK and the cookie.  The
+ *	   SYN is then processed as usual, i.e. it is inspected by the
+ *	   ruleset and it establishes the connection, which is marked as
+ *	   proxied and records the cookie.
+ *
+ *	3. The responder's SYN-ACK is handled by the TCP state tracking:
+ *	   it records the difference between the cookie and the responder's
+ *	   ISN, and it converts the SYN-ACK into the window update for the
+ *	   initiator.  Also, the ACK for the SYN-ACK is sent to the
+ *	   responder on behalf of the initiator.
+ *
+ *	Afterwards, the SEQ numbers of the responder and the ACK numbers
+ *	of the initiator are translated by the difference.
+ *
+ * Cookie
+ *
+ *	The cookie encodes the time period (2 bits), the MSS (2 bits, as
+ *	an index in the table of common values) and the hash (28 bits) of
+ *	the addresses, ports, initiator's ISN, time period and MSS.  The
+ *	hash is SipHash-2-4 keyed with the secret, i.e. a keyed PRF, so
+ *	the cookie cannot be computed without it.  The cookie is valid in
+ *	the current and the previous time period.
+ *
+ *	Note: there is no space for the other options, therefore only the
+ *	MSS is negotiated; window scaling, SACK and timestamps are not.
+ *
+ *	Note: the proxied connection must be translated (NAT) on the same
+ *	interface as the SYN proxy, since the SYN and the SYN-ACK on step
+ *	3 are matched by the same connection.
+ */
+
+#ifdef _KERNEL
+#include <sys/cdefs.h>
+__KERNEL_RCSID(0, "$NetBSD$");
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/cprng.h>
+#include <sys/mbuf.h>
+#include <sys/mutex.h>
+#include <sys/systm.h>
+#include <sys/time.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#define __NPF_CONN_PRIVATE
+#include "npf_conn.h"
+#include "npf_impl.h"
+
+#if defined(_NPF_STANDALONE)
+#define	m_freem(m)		npf->mbufops->free(m)
+#endif
+
+#define	SYNCOOKIE_PERIOD	64	/* seconds */
+#define	SYNCOOKIE_TIME_SHIFT	30
+#define	SYNCOOKIE_MSS_SHIFT	28
+#define	SYNCOOKIE_HASH_MASK	((1U << SYNCOOKIE_MSS_SHIFT) - 1)
+
+/* The MSS values, which can be encoded in the cookie. */
+static const uint16_t	npf_synproxy_mss[] = { 536, 1220, 1440, 1460 };
+
+void
+npf_synproxy_init(npf_t *npf)
+{
+	for (unsigned i = 0; i < __arraycount(npf->synproxy_key); i++) {
+		npf->synproxy_key[i] = cprng_fast32();
+	}
+}
+
+#define	SIP_ROTL(x, b)	(uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define	SIP_ROUND(v0, v1, v2, v3)				\
+    do {							\
+	v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0;		\
+	v0 = SIP_ROTL(v0, 32);					\
+	v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2;		\
+	v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0;		\
+	v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2;		\
+	v2 = SIP_ROTL(v2, 32);					\
+    } while (/* CONSTCOND */ 0)
+
+/*
+ * npf_siphash: SipHash-2-4 of the data keyed with the 128-bit key, i.e.
+ * a PRF, so that the cookies cannot be forged without the secret.
+ */
+static uint64_t
+npf_siphash(const uint32_t key[4], const void *data, size_t len)
+{
+	const uint64_t k0 = key[0] | (uint64_t)key[1] << 32;
+	const uint64_t k1 = key[2] | (uint64_t)key[3] << 32;
+	uint64_t v0 = k0 ^ UINT64_C(0x736f6d6570736575);
+	uint64_t v1 = k1 ^ UINT64_C(0x646f72616e646f6d);
+	uint64_t v2 = k0 ^ UINT64_C(0x6c7967656e657261);
+	uint64_t v3 = k1 ^ UINT64_C(0x7465646279746573);
+	const uint8_t *p = data;
+	const size_t total = len;
+	uint64_t m;
+
+	/*
+	 * Process the 8-byte words, loaded as little-endian, and then
+	 * the remaining bytes together with the length.
+	 */
+	for (; len >= 8; len -= 8, p += 8) {
+		m = 0;
+		for (unsigned i = 0; i < 8; i++) {
+			m |= (uint64_t)p[i] << (8 * i);
+		}
+		v3 ^= m;
+		SIP_ROUND(v0, v1, v2, v3);
+		SIP_ROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+	m = (uint64_t)total << 56;
+	for (unsigned i = 0; i < len; i++) {
+		m |= (uint64_t)p[i] << (8 * i);
+	}
+	v3 ^= m;
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	v0 ^= m;
+
+	/* Finalization: four rounds. */
+	v2 ^= 0xff;
+	for (unsigned i = 0; i < 4; i++) {
+		SIP_ROUND(v0, v1, v2, v3);
+	}
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static unsigned
+npf_synproxy_period(void)
+{
+	struct timespec tsnow;
+
+	getnanouptime(&tsnow);
+	return tsnow.tv_sec / SYNCOOKIE_PERIOD;
+}
+
+/*
+ * npf_synproxy_cookie: compute the cookie for the initiator's ISN,
+ * given the packet from the initiator.
+ */
+static uint32_t
+npf_synproxy_cookie(const npf_cache_t *npc, tcp_seq isn, unsigned period,
+    unsigned mssidx)
+{
+	const npf_t *npf = npc->npc_ctx;
+	const struct tcphdr *th = npc->npc_l4.tcp;
+	struct {
+		npf_addr_t	addr[2];
+		in_port_t	port[2];
+		uint32_t	isn;
+		uint32_t	period;
+		uint32_t	mssidx;
+	} tuple;
+	uint32_t hash;
+
+	memset(&tuple, 0, sizeof(tuple));
+	memcpy(&tuple.addr[0], npc->npc_ips[NPF_SRC], npc->npc_alen);
+	memcpy(&tuple.addr[1], npc->npc_ips[NPF_DST], npc->npc_alen);
+	tuple.port[0] = th->th_sport;
+	tuple.port[1] = th->th_dport;
+	tuple.isn = isn;
+	tuple.period = period;
+	tuple.mssidx = mssidx;
+
+	hash = (uint32_t)npf_siphash(npf->synproxy_key, &tuple, sizeof(tuple));
+	return ((period & 3) << SYNCOOKIE_TIME_SHIFT) |
+	    (mssidx << SYNCOOKIE_MSS_SHIFT) | (hash & SYNCOOKIE_HASH_MASK);
+}
+
+/*
+ * npf_synproxy_chkcookie: validate the cookie against the current and
+ * the previous time periods; return the MSS index, if valid.
+ */
+static bool
+npf_synproxy_chkcookie(const npf_cache_t *npc, tcp_seq isn, uint32_t cookie,
+    unsigned *mssidx)
+{
+	const unsigned now = npf_synproxy_period();
+	const unsigned idx = (cookie >> SYNCOOKIE_MSS_SHIFT) & 3;
+
+	for (unsigned i = 0; i < 2; i++) {
+		const unsigned period = now - i;
+
+		if ((cookie >> SYNCOOKIE_TIME_SHIFT) != (period & 3)) {
+			continue;
+		}
+		if (npf_synproxy_cookie(npc, isn, period, idx) == cookie) {
+			*mssidx = idx;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * npf_synproxy_syn: answer the initiator's SYN with the SYN-ACK, which
+ * carries the cookie, on behalf of the responder.
+ *
+ * => Returns true if the packet is the SYN, which should be dropped.
+ */
+bool
+npf_synproxy_syn(npf_cache_t *npc)
+{
+	npf_t *npf = npc->npc_ctx;
+	const struct tcphdr *th;
+	tcp_seq seq, ack;
+	uint16_t mss = 0;
+	unsigned mssidx;
+	uint32_t cookie, win;
+	struct mbuf *m;
+	int wscale = 0;
+
+	if (!npf_iscached(npc, NPC_IP46) || !npf_iscached(npc, NPC_TCP)) {
+		return false;
+	}
+	th = npc->npc_l4.tcp;
+	if ((th->th_flags & (TH_SYN | TH_ACK | TH_RST)) != TH_SYN) {
+		return false;
+	}
+	(void)npf_tcpsaw(npc, &seq, &ack, &win);
+	(void)npf_fetch_tcpopts(npc, &mss, &wscale);
+
+	/* Encode the largest MSS, which does not exceed the initiator's. */
+	mss = ntohs(mss);
+	mssidx = __arraycount(npf_synproxy_mss) - 1;
+	while (mssidx && npf_synproxy_mss[mssidx] > mss) {
+		mssidx--;
+	}
+	cookie = npf_synproxy_cookie(npc, seq, npf_synproxy_period(), mssidx);
+
+	/*
+	 * Note: the zero window, so the initiator would not send any data
+	 * until the handshake with the responder is complete.
+	 */
+	m = npf_tcp_mkpkt(npc, true, cookie, seq + 1, TH_SYN | TH_ACK, 0,
+	    npf_synproxy_mss[mssidx]);
+	if (m) {
+		npf_stats_inc(npf, NPF_STAT_SYNPROXY_COOKIE);
+		(void)npf_tcp_sendpkt(npc, m);
+	}
+	return true;
+}
+
+/*
+ * npf_synproxy_ack: if the packet is the initiator's ACK for a valid
+ * cookie, then replace it with the SYN to the responder.
+ *
+ * => Returns true if replaced; the cookie is returned in cookiep.
+ * => On replacement, the packet is re-cached.
+ */
+bool
+npf_synproxy_ack(npf_cache_t *npc, uint32_t *cookiep)
+{
+	npf_t *npf = npc->npc_ctx;
+	nbuf_t *nbuf = npc->npc_nbuf;
+	const struct tcphdr *th;
+	tcp_seq seq, ack;
+	unsigned mssidx;
+	uint32_t win;
+	struct mbuf *m;
+
+	if (!npf_iscached(npc, NPC_IP46) || !npf_iscached(npc, NPC_TCP)) {
+		return false;
+	}
+	th = npc->npc_l4.tcp;
+	if ((th->th_flags & (TH_SYN | TH_ACK | TH_FIN | TH_RST)) != TH_ACK) {
+		return false;
+	}
+	(void)npf_tcpsaw(npc, &seq, &ack, &win);
+	if (!npf_synproxy_chkcookie(npc, seq - 1, ack - 1, &mssidx)) {
+		return false;
+	}
+
+	/*
+	 * Reconstruct the SYN: the initiator's ISN precedes the ACK and
+	 * its window is advertised by the ACK.
+	 */
+	m = npf_tcp_mkpkt(npc, false, seq - 1, 0, TH_SYN, win,
+	    npf_synproxy_mss[mssidx]);
+	if (m == NULL) {
+		return false;
+	}
+#ifdef _KERNEL
+	m_copy_rcvif(m, nbuf_head_mbuf(nbuf));
+#endif
+	m_freem(nbuf_head_mbuf(nbuf));
+
+	/* Continue with the SYN. */
+	nbuf_init(npf, nbuf, m, nbuf->nb_ifp);
+	npc->npc_info = 0;
+	(void)npf_cache_all(npc);
+	KASSERT(npf_iscached(npc, NPC_TCP));
+
+	npf_stats_inc(npf, NPF_STAT_SYNPROXY_HANDSHAKE);
+	*cookiep = ack - 1;
+	return true;
+}
+
+/*
+ * npf_synproxy_establish: mark the connection, which was established
+ * by the SYN from npf_synproxy_ack(), as proxied.
+ */
+void
+npf_synproxy_establish(npf_conn_t *con, uint32_t cookie)
+{
+	npf_state_t *nst = &con->c_state;
+
+	mutex_enter(&con->c_lock);
+	nst->nst_flags |= NPF_STATE_SYNPROXY;
+	nst->nst_seqdiff = cookie;
+	mutex_exit(&con->c_lock);
+}
+
+/*
+ * npf_synproxy_synack: acknowledge the responder's SYN-ACK on behalf
+ * of the initiator.  Note: the SYN-ACK itself has been converted into
+ * the window update for the initiator by npf_state_tcp().
+ */
+int
+npf_synproxy_synack(npf_cache_t *npc, npf_conn_t *con)
+{
+	const npf_state_t *nst = &con->c_state;
+	uint32_t win, diff;
+	tcp_seq seq, ack;
+	struct mbuf *m;
+
+	/* Note: the SEQ is already translated for the initiator. */
+	(void)npf_tcpsaw(npc, &seq, &ack, &win);
+
+	/* Advertise the initiator's window, as of its SYN. */
+	mutex_enter(&con->c_lock);
+	diff = nst->nst_seqdiff;
+	win = nst->nst_tcpst[NPF_FLOW_FORW].nst_maxwin;
+	mutex_exit(&con->c_lock);
+
+	m = npf_tcp_mkpkt(npc, true, ack, seq - diff, TH_ACK,
+	    MIN(win, TCP_MAXWIN), 0);
+	if (m == NULL) {
+		return ENOMEM;
+	}
+	return npf_tcp_sendpkt(npc, m);
+}
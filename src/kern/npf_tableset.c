@@ -40,6 +40,13 @@ __KERNEL_RCSID(0, "$NetBSD$");
 #include "lpm.h"
 #endif
 
+#ifdef _NPF_STANDALONE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include "npf_impl.h"
 
 typedef struct npf_tblent {
@@ -47,6 +54,7 @@ typedef struct npf_tblent {
 	uint16_t		te_preflen;
 	uint16_t		te_alen;
 	npf_addr_t		te_addr;
+	unsigned		te_gen;
 } npf_tblent_t;
 
 #define	NPF_ADDRLEN2IDX(alen)	((alen) >> 4)
@@ -67,15 +75,18 @@ struct npf_table {
 			void *		t_blob;
 			size_t		t_bsize;
 			struct cdbr *	t_cdb;
+			bool		t_bmapped;
 		};
 		struct {
 			npf_tblent_t **	t_elements[NPF_ADDR_SLOTS];
+			npf_tblent_t **	t_sorted[NPF_ADDR_SLOTS];
 			unsigned	t_allocated[NPF_ADDR_SLOTS];
 			unsigned	t_used[NPF_ADDR_SLOTS];
 		};
 	} /* C11 */;
 	LIST_HEAD(, npf_tblent)		t_list;
 	unsigned			t_nitems;
+	unsigned			t_gen;
 
 	/*
 	 * Table ID, type and lock.  The ID may change during the
@@ -100,6 +111,13 @@ struct npf_tableset {
 
 #define	NPF_IFADDR_STEP		4
 
+/*
+ * The IFADDR elements are stored in the insertion order, as needed
+ * by npf_table_getsome(), followed by the array of the same elements
+ * sorted by the address, which is used for the lookups.
+ */
+#define	NPF_IFADDR_ARRAYLEN(n)	(2 * (n) * sizeof(npf_tblent_t *))
+
 static pool_cache_t		tblent_cache	__read_mostly;
 
 /*
@@ -324,9 +342,10 @@ table_ifaddr_flush(npf_table_t *t)
 			KASSERT(t->t_elements[i] == NULL);
 			continue;
 		}
-		len = t->t_allocated[i] * sizeof(npf_tblent_t *);
+		len = NPF_IFADDR_ARRAYLEN(t->t_allocated[i]);
 		kmem_free(t->t_elements[i], len);
 		t->t_elements[i] = NULL;
+		t->t_sorted[i] = NULL;
 		t->t_allocated[i] = 0;
 		t->t_used[i] = 0;
 	}
@@ -337,6 +356,32 @@ table_ifaddr_flush(npf_table_t *t)
 	t->t_nitems = 0;
 }
 
+static int
+table_cdb_open(npf_table_t *t, void *blob, size_t size)
+{
+	t->t_cdb = cdbr_open_mem(blob, size, CDBR_DEFAULT, NULL, NULL);
+	if (t->t_cdb == NULL) {
+		return EINVAL;
+	}
+	t->t_blob = blob;
+	t->t_bsize = size;
+	t->t_nitems = cdbr_entries(t->t_cdb);
+	return 0;
+}
+
+static void
+table_cdb_close(npf_table_t *t)
+{
+	cdbr_close(t->t_cdb);
+#ifdef _NPF_STANDALONE
+	if (t->t_bmapped) {
+		munmap(t->t_blob, t->t_bsize);
+		return;
+	}
+#endif
+	kmem_free(t->t_blob, t->t_bsize);
+}
+
 /*
  * npf_table_create: create table with a specified ID.
  */
@@ -363,22 +408,21 @@ npf_table_create(const char *name, u_int tid, int type,
 			goto out;
 		}
 		break;
-	case NPF_TABLE_CONST:
-		t->t_blob = kmem_alloc(size, KM_SLEEP);
-		if (t->t_blob == NULL) {
+	case NPF_TABLE_CONST: {
+		void *cdb;
+
+		cdb = kmem_alloc(size, KM_SLEEP);
+		if (cdb == NULL) {
 			goto out;
 		}
-		memcpy(t->t_blob, blob, size);
-		t->t_bsize = size;
+		memcpy(cdb, blob, size);
 
-		t->t_cdb = cdbr_open_mem(t->t_blob, size,
-		    CDBR_DEFAULT, NULL, NULL);
-		if (t->t_cdb == NULL) {
-			kmem_free(t->t_blob, t->t_bsize);
+		if (table_cdb_open(t, cdb, size) != 0) {
+			kmem_free(cdb, size);
 			goto out;
 		}
-		t->t_nitems = cdbr_entries(t->t_cdb);
 		break;
+	}
 	case NPF_TABLE_IFADDR:
 		break;
 	default:
@@ -393,6 +437,62 @@ out:
 	return NULL;
 }
 
+#ifdef _NPF_STANDALONE
+/*
+ * npf_table_create_file: create a const table referencing the cdb file
+ * at the given path.  The file is mapped read-only and shared, instead
+ * of copying the database, therefore large tables are cheap to (re)load.
+ *
+ * => The file must not be modified in-place while the table exists;
+ *    it should be replaced atomically, e.g. using rename(2).
+ */
+npf_table_t *
+npf_table_create_file(const char *name, u_int tid, const char *path)
+{
+	npf_table_t *t;
+	struct stat st;
+	void *cdb;
+	size_t size;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || !st.st_size) {
+		close(fd);
+		return NULL;
+	}
+	size = st.st_size;
+	cdb = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (cdb == MAP_FAILED) {
+		return NULL;
+	}
+#ifdef MADV_HUGEPAGE
+	/*
+	 * Best effort: prefer huge pages, if the file system supports them.
+	 */
+	(void)madvise(cdb, size, MADV_HUGEPAGE);
+#endif
+
+	t = kmem_zalloc(sizeof(npf_table_t), KM_SLEEP);
+	strlcpy(t->t_name, name, NPF_TABLE_MAXNAMELEN);
+
+	if (table_cdb_open(t, cdb, size) != 0) {
+		kmem_free(t, sizeof(npf_table_t));
+		munmap(cdb, size);
+		return NULL;
+	}
+	t->t_bmapped = true;
+
+	mutex_init(&t->t_lock, MUTEX_DEFAULT, IPL_NET);
+	t->t_type = NPF_TABLE_CONST;
+	t->t_id = tid;
+	return t;
+}
+#endif
+
 /*
  * npf_table_destroy: free all table entries and table itself.
  */
@@ -412,8 +512,7 @@ npf_table_destroy(npf_table_t *t)
 		lpm_destroy(t->t_lpm);
 		break;
 	case NPF_TABLE_CONST:
-		cdbr_close(t->t_cdb);
-		kmem_free(t->t_blob, t->t_bsize);
+		table_cdb_close(t);
 		break;
 	case NPF_TABLE_IFADDR:
 		table_ifaddr_flush(t);
@@ -431,6 +530,12 @@ npf_table_getid(npf_table_t *t)
 	return t->t_id;
 }
 
+int
+npf_table_gettype(npf_table_t *t)
+{
+	return t->t_type;
+}
+
 /*
  * npf_table_check: validate the name, ID and type.
  */
@@ -466,12 +571,36 @@ npf_table_check(npf_tableset_t *ts, const char *name, uint64_t tid,
 	return 0;
 }
 
+/*
+ * table_ifaddr_search: find the position of the first element in the
+ * sorted array, which is not less than the given address.
+ */
+static inline unsigned
+table_ifaddr_search(npf_tblent_t * const *sorted, unsigned nitems,
+    const int alen, const npf_addr_t *addr)
+{
+	unsigned lo = 0, hi = nitems;
+
+	while (lo < hi) {
+		const unsigned mid = lo + ((hi - lo) >> 1);
+
+		if (memcmp(&sorted[mid]->te_addr, addr, alen) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
 static int
 table_ifaddr_insert(npf_table_t *t, const int alen, npf_tblent_t *ent)
 {
 	const unsigned aidx = NPF_ADDRLEN2IDX(alen);
 	const unsigned allocated = t->t_allocated[aidx];
 	const unsigned used = t->t_used[aidx];
+	npf_tblent_t **sorted;
+	unsigned pos;
 
 	/*
 	 * No need to check for duplicates.
@@ -482,24 +611,35 @@ table_ifaddr_insert(npf_table_t *t, const int alen, npf_tblent_t *ent)
 		size_t toalloc, newsize;
 
 		toalloc = roundup2(allocated + 1, NPF_IFADDR_STEP);
-		newsize = toalloc * sizeof(npf_tblent_t *);
+		newsize = NPF_IFADDR_ARRAYLEN(toalloc);
 
 		elements = kmem_zalloc(newsize, KM_NOSLEEP);
 		if (elements == NULL) {
 			return ENOMEM;
 		}
+		sorted = &elements[toalloc];
 		for (unsigned i = 0; i < used; i++) {
 			elements[i] = old_elements[i];
+			sorted[i] = t->t_sorted[aidx][i];
 		}
 		if (allocated) {
-			const size_t len = allocated * sizeof(npf_tblent_t *);
+			const size_t len = NPF_IFADDR_ARRAYLEN(allocated);
 			KASSERT(old_elements != NULL);
 			kmem_free(old_elements, len);
 		}
 		t->t_elements[aidx] = elements;
+		t->t_sorted[aidx] = sorted;
 		t->t_allocated[aidx] = toalloc;
 	}
 	t->t_elements[aidx][used] = ent;
+
+	/* Insert into the sorted array, keeping the order. */
+	sorted = t->t_sorted[aidx];
+	pos = table_ifaddr_search(sorted, used, alen, &ent->te_addr);
+	memmove(&sorted[pos + 1], &sorted[pos],
+	    (used - pos) * sizeof(npf_tblent_t *));
+	sorted[pos] = ent;
+
 	t->t_used[aidx]++;
 	return 0;
 }
@@ -527,6 +667,7 @@ npf_table_insert(npf_table_t *t, const int alen,
 	 * Insert the entry.  Return an error on duplicate.
 	 */
 	mutex_enter(&t->t_lock);
+	ent->te_gen = t->t_gen;
 	switch (t->t_type) {
 	case NPF_TABLE_IPSET:
 		/*
@@ -637,6 +778,219 @@ npf_table_remove(npf_table_t *t, const int alen,
 	return error;
 }
 
+/*
+ * table_ent_find: find the entry which exactly matches the given address
+ * and prefix length.  Note: the caller must hold the table lock.
+ */
+static npf_tblent_t *
+table_ent_find(npf_table_t *t, const npf_ioctl_ent_t *uent)
+{
+	const int alen = uent->alen;
+	npf_tblent_t *ent;
+
+	switch (t->t_type) {
+	case NPF_TABLE_IPSET:
+		return thmap_get(t->t_map, &uent->addr, alen);
+	case NPF_TABLE_LPM: {
+		const unsigned preflen = (uent->mask == NPF_NO_NETMASK) ?
+		    (unsigned)(alen * 8) : uent->mask;
+
+		/*
+		 * Note: a more specific prefix may shadow the entry.
+		 * In such case, the entry is considered to be missing;
+		 * it will be removed and inserted again.
+		 */
+		ent = lpm_lookup(t->t_lpm, &uent->addr, alen);
+		if (ent && ent->te_alen == alen && ent->te_preflen == preflen &&
+		    memcmp(&ent->te_addr, &uent->addr, alen) == 0) {
+			return ent;
+		}
+		return NULL;
+	}
+	default:
+		KASSERT(false);
+	}
+	return NULL;
+}
+
+/*
+ * table_update_insert: insert the pre-allocated entry, unless the exact
+ * entry is already present.  Note: the caller must hold the table lock.
+ */
+static int
+table_update_insert(npf_table_t *t, const npf_ioctl_ent_t *uent,
+    npf_tblent_t *ent)
+{
+	const int alen = uent->alen;
+
+	memcpy(&ent->te_addr, &uent->addr, alen);
+	ent->te_alen = alen;
+	ent->te_preflen = 0;
+	ent->te_gen = t->t_gen;
+
+	switch (t->t_type) {
+	case NPF_TABLE_IPSET:
+		if (thmap_put(t->t_map, &ent->te_addr, alen, ent) != ent) {
+			return EEXIST;
+		}
+		break;
+	case NPF_TABLE_LPM:
+		ent->te_preflen = (uent->mask == NPF_NO_NETMASK) ?
+		    (alen * 8) : uent->mask;
+		if (lpm_insert(t->t_lpm, &ent->te_addr, alen,
+		    ent->te_preflen, ent) != 0) {
+			return ENOMEM;
+		}
+		break;
+	default:
+		KASSERT(false);
+	}
+	LIST_INSERT_HEAD(&t->t_list, ent, te_listent);
+	t->t_nitems++;
+	return 0;
+}
+
+/*
+ * npf_table_update: bring the table contents in line with the given
+ * list of entries, in place and without changing the table ID.  Only
+ * the difference is applied: the stale entries are removed and the
+ * missing ones are inserted.  The duplicate entries are ignored.
+ *
+ * => Only the IPSET and LPM tables are supported.
+ * => The caller must hold the config lock and run npf_table_gc() after.
+ * => On failure, the table may be left partially updated.
+ */
+int
+npf_table_update(npf_table_t *t, const npf_ioctl_ent_t *uents,
+    unsigned nitems)
+{
+	LIST_HEAD(, npf_tblent) pending, gc;
+	npf_tblent_t *ent, *next;
+	unsigned gen, nmissing, npending = 0;
+	int error = 0;
+
+	if (t->t_type != NPF_TABLE_IPSET && t->t_type != NPF_TABLE_LPM) {
+		return EINVAL;
+	}
+	for (unsigned i = 0; i < nitems; i++) {
+		const npf_ioctl_ent_t *uent = &uents[i];
+
+		error = npf_netmask_check(uent->alen, uent->mask);
+		if (error) {
+			return error;
+		}
+		if (t->t_type == NPF_TABLE_IPSET &&
+		    uent->mask != NPF_NO_NETMASK) {
+			return EINVAL;
+		}
+	}
+	LIST_INIT(&pending);
+	LIST_INIT(&gc);
+
+	/*
+	 * Mark the entries which are to stay and count the missing ones.
+	 * Pre-allocate the latter, since we cannot sleep while holding
+	 * the table lock: if more are missing than pre-allocated, then
+	 * allocate and retry.  Hence the table lock is held across the
+	 * marking, the removal and the insertion, i.e. the update is not
+	 * interleaved with any other change.
+	 */
+	mutex_enter(&t->t_lock);
+	for (;;) {
+		gen = ++t->t_gen;
+		nmissing = 0;
+		for (unsigned i = 0; i < nitems; i++) {
+			if ((ent = table_ent_find(t, &uents[i])) != NULL) {
+				ent->te_gen = gen;
+			} else {
+				nmissing++;
+			}
+		}
+		if (nmissing <= npending) {
+			break;
+		}
+		mutex_exit(&t->t_lock);
+
+		while (npending < nmissing) {
+			ent = pool_cache_get(tblent_cache, PR_WAITOK);
+			LIST_INSERT_HEAD(&pending, ent, te_listent);
+			npending++;
+		}
+		mutex_enter(&t->t_lock);
+	}
+
+	/*
+	 * Remove the stale entries.  The IPSET entries are staged for
+	 * the G/C; the LPM entries can be released after the unlock,
+	 * since the LPM lookups are serialised by the table lock.
+	 */
+	for (ent = LIST_FIRST(&t->t_list); ent != NULL; ent = next) {
+		next = LIST_NEXT(ent, te_listent);
+		if (ent->te_gen == gen) {
+			continue;
+		}
+		LIST_REMOVE(ent, te_listent);
+		if (t->t_type == NPF_TABLE_IPSET) {
+			thmap_del(t->t_map, &ent->te_addr, ent->te_alen);
+			LIST_INSERT_HEAD(&t->t_gc, ent, te_listent);
+		} else {
+			lpm_remove(t->t_lpm, &ent->te_addr,
+			    ent->te_alen, ent->te_preflen);
+			LIST_INSERT_HEAD(&gc, ent, te_listent);
+		}
+		t->t_nitems--;
+	}
+
+	/*
+	 * Insert the missing entries.
+	 */
+	for (unsigned i = 0; i < nitems && !LIST_EMPTY(&pending); i++) {
+		const npf_ioctl_ent_t *uent = &uents[i];
+
+		if (table_ent_find(t, uent) != NULL) {
+			continue;
+		}
+		ent = LIST_FIRST(&pending);
+		LIST_REMOVE(ent, te_listent);
+		if ((error = table_update_insert(t, uent, ent)) != 0) {
+			LIST_INSERT_HEAD(&gc, ent, te_listent);
+			break;
+		}
+	}
+	mutex_exit(&t->t_lock);
+
+	/* Release the removed and unused entries. */
+	while ((ent = LIST_FIRST(&pending)) != NULL) {
+		LIST_REMOVE(ent, te_listent);
+		pool_cache_put(tblent_cache, ent);
+	}
+	while ((ent = LIST_FIRST(&gc)) != NULL) {
+		LIST_REMOVE(ent, te_listent);
+		pool_cache_put(tblent_cache, ent);
+	}
+	return error;
+}
+
+static inline bool
+table_ifaddr_lookup(const npf_table_t *t, const int alen,
+    const npf_addr_t *addr)
+{
+	const unsigned aidx = NPF_ADDRLEN2IDX(alen);
+	const unsigned nitems = t->t_used[aidx];
+	npf_tblent_t * const *sorted = t->t_sorted[aidx];
+	unsigned pos;
+
+	/* Binary search: the interface may have many addresses. */
+	pos = table_ifaddr_search(sorted, nitems, alen, addr);
+	if (pos < nitems) {
+		const npf_tblent_t *elm = sorted[pos];
+
+		KASSERT(elm->te_alen == alen);
+		return memcmp(&elm->te_addr, addr, alen) == 0;
+	}
+	return false;
+}
+
 /*
  * npf_table_lookup: find the table according to ID, lookup and match
  * the contents with the specified IP address.
@@ -672,22 +1026,9 @@ npf_table_lookup(npf_table_t *t, const int alen, const npf_addr_t *addr)
 			found = false;
 		}
 		break;
-	case NPF_TABLE_IFADDR: {
-		const unsigned aidx = NPF_ADDRLEN2IDX(alen);
-
-		found = false;
-		for (unsigned i = 0; i < t->t_used[aidx]; i++) {
-			const npf_tblent_t *elm = t->t_elements[aidx][i];
-
-			KASSERT(elm->te_alen == alen);
-
-			if (memcmp(&elm->te_addr, addr, alen) == 0) {
-				found = true;
-				break;
-			}
-		}
+	case NPF_TABLE_IFADDR:
+		found = table_ifaddr_lookup(t, alen, addr);
 		break;
-	}
 	default:
 		KASSERT(false);
 		found = false;
@@ -41,6 +41,142 @@ struct ifnet;
 #endif
 
 #define	NPF_NO_GC	0x01
+#define	NPF_EVLOG	0x02
+#define	NPF_SYNC	0x04
+
+/*
+ * Event log records.  The addresses and ports are in network byte-order;
+ * the addresses and ports of the record are of the original connection,
+ * i.e. as seen by the first packet.
+ *
+ * The port block records (NPF_EVENT_NAT_BLOCK_*) have only the original
+ * (subscriber) address as the source address, the translation address
+ * and the first port of the block with the number of ports in it.
+ */
+#define	NPF_EVENT_CONN_CREATE		1
+#define	NPF_EVENT_CONN_EXPIRE		2
+#define	NPF_EVENT_NAT_CREATE		3
+#define	NPF_EVENT_NAT_DESTROY		4
+#define	NPF_EVENT_NAT_BLOCK_ASSIGN	5
+#define	NPF_EVENT_NAT_BLOCK_RELEASE	6
+
+typedef struct {
+	uint32_t	ev_sec;		// wall-clock time
+	uint32_t	ev_nsec;
+	uint8_t		ev_type;	// NPF_EVENT_*
+	uint8_t		ev_proto;
+	uint8_t		ev_alen;
+	uint8_t		ev_nat;		// NPF_NATIN or NPF_NATOUT
+	in_port_t	ev_sport;
+	in_port_t	ev_dport;
+	in_port_t	ev_tport;	// translation port
+	uint16_t	ev_nports;	// port block size
+	npf_addr_t	ev_saddr;
+	npf_addr_t	ev_daddr;
+	npf_addr_t	ev_taddr;	// translation address
+} npf_event_t;
+
+/*
+ * Connection snapshot (see npfk_conn_save()): the header followed by
+ * the fixed-size records.  The addresses and ports are in network
+ * byte-order, the rest is in the host byte-order.  The protocol state
+ * is opaque, therefore the snapshot is only valid for the same version.
+ */
+#define	NPF_CONNSNAP_MAGIC	0x4e504653	// "NPFS"
+#define	NPF_CONNSNAP_VER	1
+#define	NPF_CONNREC_STATELEN	64
+
+typedef struct {
+	uint32_t	cs_magic;
+	uint16_t	cs_ver;
+	uint16_t	cs_recsize;	// sizeof(npf_connrec_t)
+} npf_connsnap_t;
+
+typedef struct {
+	in_port_t	ck_sport;
+	in_port_t	ck_dport;
+	uint32_t	ck_di;		// PFIL_IN and/or PFIL_OUT, if any
+	char		ck_ifname[IFNAMSIZ];
+	npf_addr_t	ck_saddr;
+	npf_addr_t	ck_daddr;
+} npf_connrec_key_t;
+
+typedef struct {
+	uint32_t	cr_flags;
+	uint8_t		cr_proto;
+	uint8_t		cr_alen;
+	uint8_t		cr_nat;		// non-zero if the NAT fields are set
+	uint8_t		cr_reserved;
+	char		cr_ifname[IFNAMSIZ];
+	npf_connrec_key_t cr_key[2];	// forwards and backwards
+	uint8_t		cr_state[NPF_CONNREC_STATELEN];
+
+	/* NAT: the policy, the original and translation address/port. */
+	uint64_t	cr_nat_id;
+	in_port_t	cr_nat_oport;
+	in_port_t	cr_nat_tport;
+	char		cr_nat_ifname[IFNAMSIZ];
+	npf_addr_t	cr_nat_oaddr;
+	npf_addr_t	cr_nat_taddr;
+} npf_connrec_t;
+
+/*
+ * Connection state replication records (see npfk_sync_drain()).  Each
+ * record carries the complete connection record, as of the change, and
+ * the connection ID with the generation of the record, which are used
+ * to discard the reordered records.  On the transport, the records are
+ * sent in batches, each preceded by the batch header.
+ */
+#define	NPF_SYNC_CREATE		1
+#define	NPF_SYNC_STATE		2	// TCP state transition
+#define	NPF_SYNC_NAT		3	// NAT association
+#define	NPF_SYNC_EXPIRE		4
+#define	NPF_SYNC_REFRESH	5	// periodic, while active
+
+#define	NPF_SYNC_MAGIC		0x4e504659	// "NPFY"
+
+typedef struct {
+	uint32_t	sh_magic;
+	uint16_t	sh_ver;		// NPF_CONNSNAP_VER
+	uint16_t	sh_recsize;	// sizeof(npf_syncrec_t)
+	uint32_t	sh_count;	// number of records in the batch
+	uint32_t	sh_reserved;
+} npf_synchdr_t;
+
+typedef struct {
+	uint32_t	sr_type;	// NPF_SYNC_*
+	uint32_t	sr_gen;		// generation of the record
+	uint64_t	sr_id;		// connection ID
+	npf_connrec_t	sr_conn;
+} npf_syncrec_t;
+
+/*
+ * Packet log records (the "pktlog" extension).  The packet data is
+ * captured up to the configured snapshot length.
+ */
+#define	NPF_PKTLOG_SNAPLEN	256	// maximum snapshot length
+
+typedef struct {
+	uint32_t	pl_sec;		// wall-clock time
+	uint32_t	pl_nsec;
+	uint64_t	pl_rid;		// rule ID
+	uint32_t	pl_len;		// packet length
+	uint32_t	pl_caplen;	// captured length
+	uint8_t		pl_af;
+	uint8_t		pl_action;	// 0 - pass, 1 - block
+	uint8_t		pl_dir;		// PFIL_IN or PFIL_OUT
+	uint8_t		pl_reserved;
+	unsigned	pl_ifid;
+	char		pl_ifname[IFNAMSIZ];
+	uint8_t		pl_data[NPF_PKTLOG_SNAPLEN];
+} npf_pktlog_t;
+
+/*
+ * Checksums which may be offloaded, i.e. computed on transmit.
+ */
+#define	NPF_CKSUM_IPV4	0x01	// IPv4 header checksum
+#define	NPF_CKSUM_TCP	0x02	// TCP checksum
+#define	NPF_CKSUM_UDP	0x04	// UDP checksum
 
 typedef struct {
 	const char *	(*getname)(npf_t *, struct ifnet *);
@@ -48,6 +184,7 @@ typedef struct {
 	void		(*flush)(npf_t *, void *);
 	void *		(*getmeta)(npf_t *, const struct ifnet *);
 	void		(*setmeta)(npf_t *, struct ifnet *, void *);
+	int		(*output)(npf_t *, struct mbuf *, const struct ifnet *);
 } npf_ifops_t;
 
 typedef struct {
@@ -61,6 +198,10 @@ typedef struct {
 	bool		(*ensure_writable)(struct mbuf **, size_t);
 	int		(*get_tag)(const struct mbuf *, uint32_t *);
 	int		(*set_tag)(struct mbuf *, uint32_t);
+	unsigned	(*get_cksum_offload)(npf_t *, const struct mbuf *);
+	void		(*set_cksum_offload)(npf_t *, struct mbuf *, unsigned);
+	bool		(*adj)(struct mbuf *, int);
+	bool		(*cat)(struct mbuf *, struct mbuf *);
 } npf_mbufops_t;
 
 int	npfk_sysinit(unsigned);
@@ -77,6 +218,10 @@ void	npfk_thread_register(npf_t *);
 void	npfk_thread_unregister(npf_t *);
 
 int	npfk_packet_handler(npf_t *, struct mbuf **, struct ifnet *, int);
+#ifdef _NPF_STANDALONE
+int	npfk_packet_fragment(npf_t *, struct mbuf **, unsigned,
+	    struct mbuf **, unsigned *);
+#endif
 
 void	npfk_ifmap_attach(npf_t *, struct ifnet *);
 void	npfk_ifmap_detach(npf_t *, struct ifnet *);
@@ -87,6 +232,17 @@ int	npfk_param_set(npf_t *, const char *, int);
 void	npfk_stats(npf_t *, uint64_t *);
 void	npfk_stats_clear(npf_t *);
 
+size_t	npfk_evlog_drain(npf_t *, npf_event_t *, size_t);
+int	npfk_evlog_write(npf_t *, int);
+
+int	npfk_conn_save(npf_t *, int);
+int	npfk_conn_load(npf_t *, int);
+
+size_t	npfk_sync_drain(npf_t *, npf_syncrec_t *, size_t);
+size_t	npfk_sync_apply(npf_t *, const npf_syncrec_t *, size_t);
+int	npfk_sync_write(npf_t *, int);
+int	npfk_sync_read(npf_t *, int);
+
 /*
  * Extensions.
  */
@@ -94,6 +250,12 @@ void	npfk_stats_clear(npf_t *);
 int	npf_ext_log_init(npf_t *);
 int	npf_ext_log_fini(npf_t *);
 
+int	npf_ext_pktlog_init(npf_t *);
+int	npf_ext_pktlog_fini(npf_t *);
+size_t	npf_ext_pktlog_drain(npf_t *, npf_pktlog_t *, size_t);
+int	npf_ext_pktlog_pcap_header(int);
+int	npf_ext_pktlog_pcap_write(npf_t *, int);
+
 int	npf_ext_normalize_init(npf_t *);
 int	npf_ext_normalize_fini(npf_t *);
 
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Fast pseudo-random number generator for the standalone NPF, an
+ * equivalent of cprng_fast(9): ChaCha8 keystream with the per-thread
+ * state, therefore it takes no locks.
+ *
+ * The state is seeded from the system entropy source on the first
+ * use by the thread.  The keystream is generated in batches; the first
+ * words of each batch become the next key, so the previous outputs
+ * cannot be recovered from the state (fast key erasure).
+ *
+ * Reference:
+ *
+ *	D. J. Bernstein, 2008, ChaCha, a variant of Salsa20.
+ */
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "npf_stand.h"
+
+#define	CHACHA_ROUNDS		8
+#define	CHACHA_BLOCK_WORDS	16
+#define	CHACHA_KEY_WORDS	8
+
+/* The keystream batch: a few blocks, including the next key. */
+#define	CPRNG_BATCH_WORDS	(4 * CHACHA_BLOCK_WORDS)
+
+typedef struct {
+	uint32_t	key[CHACHA_KEY_WORDS];
+	uint32_t	buf[CPRNG_BATCH_WORDS];
+	unsigned	avail;
+	bool		seeded;
+} cprng_state_t;
+
+static pthread_once_t	cprng_once = PTHREAD_ONCE_INIT;
+static tls_key_t *	cprng_tls;
+
+#define	ROTL32(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+#define	QUARTERROUND(a, b, c, d) do {				\
+	a += b; d ^= a; d = ROTL32(d, 16);				\
+	c += d; b ^= c; b = ROTL32(b, 12);				\
+	a += b; d ^= a; d = ROTL32(d, 8);				\
+	c += d; b ^= c; b = ROTL32(b, 7);				\
+} while (/* CONSTCOND */ 0)
+
+static void
+chacha_block(const uint32_t key[CHACHA_KEY_WORDS], uint32_t counter,
+    uint32_t out[CHACHA_BLOCK_WORDS])
+{
+	uint32_t in[CHACHA_BLOCK_WORDS], x[CHACHA_BLOCK_WORDS];
+
+	/* "expand 32-byte k", the key, the block counter and no nonce. */
+	in[0] = 0x61707865;
+	in[1] = 0x3320646e;
+	in[2] = 0x79622d32;
+	in[3] = 0x6b206574;
+	memcpy(&in[4], key, CHACHA_KEY_WORDS * sizeof(uint32_t));
+	in[12] = counter;
+	in[13] = in[14] = in[15] = 0;
+	memcpy(x, in, sizeof(x));
+
+	for (unsigned i = 0; i < CHACHA_ROUNDS; i += 2) {
+		QUARTERROUND(x[0], x[4], x[8], x[12]);
+		QUARTERROUND(x[1], x[5], x[9], x[13]);
+		QUARTERROUND(x[2], x[6], x[10], x[14]);
+		QUARTERROUND(x[3], x[7], x[11], x[15]);
+		QUARTERROUND(x[0], x[5], x[10], x[15]);
+		QUARTERROUND(x[1], x[6], x[11], x[12]);
+		QUARTERROUND(x[2], x[7], x[8], x[13]);
+		QUARTERROUND(x[3], x[4], x[9], x[14]);
+	}
+	for (unsigned i = 0; i < CHACHA_BLOCK_WORDS; i++) {
+		out[i] = x[i] + in[i];
+	}
+}
+
+static void
+cprng_seed(cprng_state_t *st)
+{
+	static volatile unsigned seq;
+
+	if (getentropy(st->key, sizeof(st->key)) == -1) {
+		struct timespec ts;
+
+		/* Should not happen; fall back to weaker sources. */
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		st->key[0] ^= (uint32_t)ts.tv_nsec;
+		st->key[1] ^= (uint32_t)ts.tv_sec;
+		st->key[2] ^= (uint32_t)getpid();
+		st->key[3] ^= (uint32_t)(uintptr_t)st;
+		st->key[4] ^= atomic_inc_uint_nv(&seq);
+	}
+	st->avail = 0;
+	st->seeded = true;
+}
+
+static void
+cprng_refill(cprng_state_t *st)
+{
+	const unsigned nblocks = CPRNG_BATCH_WORDS / CHACHA_BLOCK_WORDS;
+
+	for (unsigned i = 0; i < nblocks; i++) {
+		chacha_block(st->key, i, &st->buf[i * CHACHA_BLOCK_WORDS]);
+	}
+
+	/* Re-key using the beginning of the keystream; erase it. */
+	memcpy(st->key, st->buf, sizeof(st->key));
+	memset(st->buf, 0, sizeof(st->key));
+	st->avail = CPRNG_BATCH_WORDS - CHACHA_KEY_WORDS;
+}
+
+static void
+cprng_init(void)
+{
+	cprng_tls = tls_create(sizeof(cprng_state_t));
+	if (cprng_tls == NULL) {
+		abort();
+	}
+}
+
+/*
+ * npfkern_cprng_fast32: return a 32-bit pseudo-random number.
+ */
+uint32_t
+npfkern_cprng_fast32(void)
+{
+	cprng_state_t *st;
+
+	pthread_once(&cprng_once, cprng_init);
+	st = tls_get(cprng_tls);
+	if (__predict_false(!st->seeded)) {
+		cprng_seed(st);
+	}
+	if (__predict_false(st->avail == 0)) {
+		cprng_refill(st);
+	}
+	return st->buf[CPRNG_BATCH_WORDS - st->avail--];
+}
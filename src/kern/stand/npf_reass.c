@@ -0,0 +1,835 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * IPv4 and IPv6 fragment reassembly for the standalone NPF, i.e. an
+ * equivalent of the kernel ip_reass_packet() and ip6_reass_packet().
+ *
+ * Overview
+ *
+ *	The fragments are queued per datagram.  The queues are in a hash
+ *	table, keyed by the addresses, the identification and, for IPv4,
+ *	the protocol.  The table is shared by the threads, since there is
+ *	no guarantee that all fragments of a datagram arrive to the same
+ *	thread; however, each bucket has its own lock, so the contention
+ *	is unlikely.
+ *
+ *	Once the datagram is complete, the fragments are chained in place
+ *	using the adj and cat mbuf operations: the headers are stripped off
+ *	the subsequent fragments and the data is not copied.  If the mbuf
+ *	operations are not provided, then reassembly is not supported.
+ *
+ * Limits
+ *
+ *	The memory use is bounded by the total number of queued fragments
+ *	and the number of fragments per datagram.  Incomplete datagrams
+ *	expire after the timeout; they are purged by the worker, as well
+ *	as on the lookup in the bucket.
+ *
+ *	Overlapping fragments are treated as an attack (see RFC 5722):
+ *	the whole datagram is dropped.  Exact duplicates are tolerated,
+ *	i.e. just discarded.
+ *
+ * Fragmentation
+ *
+ *	The reassembled datagram may exceed the MTU of the interface it
+ *	is forwarded to, while there is no IP layer to fragment it.  The
+ *	application fragments it on output using npf_reass_fragment(),
+ *	i.e. an equivalent of the fragmentation in ip_output().
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <limits.h>
+#include <time.h>
+
+#include "../npf_impl.h"
+
+#define	REASS_HASH_BUCKETS	1024
+#define	REASS_HASH_MASK		(REASS_HASH_BUCKETS - 1)
+
+typedef struct {
+	npf_addr_t		src;
+	npf_addr_t		dst;
+	uint32_t		id;
+	uint8_t			alen;
+	uint8_t			proto;
+	uint16_t		reserved;
+} reass_key_t;
+
+typedef struct {
+	reass_key_t		key;
+	unsigned		hlen;	// headers, incl. the fragment header
+	unsigned		off;	// data offset in the datagram
+	unsigned		len;	// data length
+	bool			mf;	// more fragments
+} reass_info_t;
+
+typedef struct reass_frag {
+	struct reass_frag *	next;
+	struct mbuf *		m;
+	unsigned		hlen;
+	unsigned		off;
+	unsigned		len;
+} reass_frag_t;
+
+typedef struct reass_queue {
+	LIST_ENTRY(reass_queue)	entry;
+	reass_key_t		key;
+	uint64_t		expire;
+	reass_frag_t *		frags;	// sorted by the offset
+	unsigned		nfrags;
+	unsigned		datalen;
+	unsigned		totlen;	// zero until the last fragment
+} reass_queue_t;
+
+typedef struct {
+	kmutex_t		lock;
+	LIST_HEAD(, reass_queue) list;
+} reass_bucket_t;
+
+struct npf_reass {
+	volatile unsigned	nfrags;
+	uint32_t		seed;
+	int			timeout;
+	int			max_frags;
+	int			max_dgram_frags;
+	reass_bucket_t		buckets[REASS_HASH_BUCKETS];
+};
+
+static void	npf_reass_worker(npf_t *);
+
+void
+npf_reass_init(npf_t *npf)
+{
+	npf_reass_t *reass;
+
+	reass = kmem_zalloc(sizeof(npf_reass_t), KM_SLEEP);
+	reass->seed = cprng_fast32();
+	for (unsigned i = 0; i < REASS_HASH_BUCKETS; i++) {
+		reass_bucket_t *b = &reass->buckets[i];
+
+		mutex_init(&b->lock, MUTEX_DEFAULT, IPL_SOFTNET);
+		LIST_INIT(&b->list);
+	}
+	npf->reass = reass;
+
+	npf_param_t param_map[] = {
+		{
+			"reass.timeout",
+			&reass->timeout,
+			.default_val = 30, // s
+			.min = 1, .max = 600
+		},
+		{
+			"reass.max_frags",
+			&reass->max_frags,
+			.default_val = 8192,
+			.min = 0, .max = INT_MAX
+		},
+		{
+			"reass.max_datagram_frags",
+			&reass->max_dgram_frags,
+			.default_val = 64,
+			.min = 1, .max = 8192
+		},
+	};
+	npf_param_register(npf, param_map, __arraycount(param_map));
+	npf_worker_addfunc(npf, npf_reass_worker);
+}
+
+static uint64_t
+npf_reass_now(void)
+{
+	struct timespec tsnow;
+
+	getnanouptime(&tsnow);
+	return tsnow.tv_sec;
+}
+
+static void
+npf_reass_destroy(npf_t *npf, reass_queue_t *rq)
+{
+	npf_reass_t *reass = npf->reass;
+	reass_frag_t *rf = rq->frags;
+
+	while (rf) {
+		reass_frag_t *next = rf->next;
+
+		if (rf->m) {
+			npf->mbufops->free(rf->m);
+		}
+		kmem_intr_free(rf, sizeof(reass_frag_t));
+		atomic_dec_uint(&reass->nfrags);
+		rf = next;
+	}
+	kmem_intr_free(rq, sizeof(reass_queue_t));
+}
+
+/*
+ * npf_reass_expire: destroy the expired queues in the bucket or, if
+ * the time is not given, all queues.
+ *
+ * => Must be called with the bucket lock held.
+ */
+static void
+npf_reass_expire(npf_t *npf, reass_bucket_t *b, uint64_t now)
+{
+	reass_queue_t *rq, *next;
+
+	rq = LIST_FIRST(&b->list);
+	while (rq) {
+		next = LIST_NEXT(rq, entry);
+		if (now == 0) {
+			LIST_REMOVE(rq, entry);
+			npf_reass_destroy(npf, rq);
+		} else if (rq->expire <= now) {
+			LIST_REMOVE(rq, entry);
+			npf_reass_destroy(npf, rq);
+			npf_stats_inc(npf, NPF_STAT_REASSTIMEOUT);
+		}
+		rq = next;
+	}
+}
+
+static void
+npf_reass_worker(npf_t *npf)
+{
+	npf_reass_t *reass = npf->reass;
+	const uint64_t now = npf_reass_now();
+
+	if (atomic_load_relaxed(&reass->nfrags) == 0) {
+		return;
+	}
+	for (unsigned i = 0; i < REASS_HASH_BUCKETS; i++) {
+		reass_bucket_t *b = &reass->buckets[i];
+
+		mutex_enter(&b->lock);
+		npf_reass_expire(npf, b, now);
+		mutex_exit(&b->lock);
+	}
+}
+
+void
+npf_reass_fini(npf_t *npf)
+{
+	npf_reass_t *reass = npf->reass;
+
+	for (unsigned i = 0; i < REASS_HASH_BUCKETS; i++) {
+		reass_bucket_t *b = &reass->buckets[i];
+
+		npf_reass_expire(npf, b, 0);
+		mutex_destroy(&b->lock);
+	}
+	KASSERT(reass->nfrags == 0);
+	kmem_free(reass, sizeof(npf_reass_t));
+}
+
+/*
+ * npf_reass_parse: validate the fragment and extract its information.
+ * The fragment header is at the given offset in case of IPv6; zero
+ * indicates IPv4.
+ */
+static int
+npf_reass_parse(npf_t *npf, struct mbuf **mp, unsigned fragoff,
+    reass_info_t *fi)
+{
+	const npf_mbufops_t *mops = npf->mbufops;
+	const size_t pktlen = mops->getchainlen(*mp);
+	unsigned iplen, maxlen;
+
+	memset(&fi->key, 0, sizeof(reass_key_t));
+
+	if (fragoff == 0) {
+		const struct ip *ip;
+		unsigned ipoff;
+
+		if (!mops->ensure_contig(mp, sizeof(struct ip))) {
+			return ENOMEM;
+		}
+		ip = mops->getdata(*mp);
+		fi->hlen = ip->ip_hl << 2;
+		if (!mops->ensure_contig(mp, fi->hlen)) {
+			return ENOMEM;
+		}
+		ip = mops->getdata(*mp);
+		iplen = ntohs(ip->ip_len);
+		ipoff = ntohs(ip->ip_off);
+
+		fi->key.alen = sizeof(struct in_addr);
+		memcpy(&fi->key.src, &ip->ip_src, sizeof(struct in_addr));
+		memcpy(&fi->key.dst, &ip->ip_dst, sizeof(struct in_addr));
+		fi->key.id = ip->ip_id;
+		fi->key.proto = ip->ip_p;
+		fi->off = (ipoff & IP_OFFMASK) << 3;
+		fi->mf = (ipoff & IP_MF) != 0;
+		maxlen = IP_MAXPACKET - fi->hlen;
+	} else {
+		const struct ip6_hdr *ip6;
+		const struct ip6_frag *ip6f;
+
+		fi->hlen = fragoff + sizeof(struct ip6_frag);
+		if (!mops->ensure_contig(mp, fi->hlen)) {
+			return ENOMEM;
+		}
+		ip6 = mops->getdata(*mp);
+		ip6f = (const void *)((const uint8_t *)ip6 + fragoff);
+		iplen = sizeof(struct ip6_hdr) + ntohs(ip6->ip6_plen);
+
+		/* Note: the protocol is not a part of the key (RFC 8200). */
+		fi->key.alen = sizeof(struct in6_addr);
+		memcpy(&fi->key.src, &ip6->ip6_src, sizeof(struct in6_addr));
+		memcpy(&fi->key.dst, &ip6->ip6_dst, sizeof(struct in6_addr));
+		fi->key.id = ip6f->ip6f_ident;
+		fi->off = ntohs(ip6f->ip6f_offlg & IP6F_OFF_MASK);
+		fi->mf = (ip6f->ip6f_offlg & IP6F_MORE_FRAG) != 0;
+
+		/* The payload length, excluding the fragment header. */
+		maxlen = IP_MAXPACKET - (fragoff - sizeof(struct ip6_hdr));
+	}
+
+	/*
+	 * The data must not be empty; all fragments, except the last,
+	 * must be a multiple of 8 bytes; the datagram must fit the limit.
+	 */
+	if (iplen <= fi->hlen || iplen > pktlen) {
+		return EINVAL;
+	}
+	fi->len = iplen - fi->hlen;
+	if ((fi->mf && (fi->len & 0x7) != 0) || fi->off + fi->len > maxlen) {
+		return EINVAL;
+	}
+
+	/* Trim the link-layer padding, if any. */
+	if (pktlen > iplen && !mops->adj(*mp, -(int)(pktlen - iplen))) {
+		return EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * npf_reass_insert: insert the fragment into the queue, ordered by the
+ * offset, checking for the overlaps.
+ *
+ * => On success, the mbuf is consumed.
+ * => On failure, the queue must be destroyed.
+ */
+static int
+npf_reass_insert(npf_t *npf, reass_queue_t *rq, const reass_info_t *fi,
+    struct mbuf *m)
+{
+	npf_reass_t *reass = npf->reass;
+	reass_frag_t **prevp = &rq->frags, *prev = NULL, *next, *rf;
+	const unsigned end = fi->off + fi->len;
+
+	while ((next = *prevp) != NULL && next->off <= fi->off) {
+		prev = next;
+		prevp = &next->next;
+	}
+	if (prev && prev->off + prev->len > fi->off) {
+		if (prev->off == fi->off && prev->len == fi->len) {
+			/* Exact duplicate: just discard. */
+			npf->mbufops->free(m);
+			return 0;
+		}
+		return EINVAL;
+	}
+	if (next && end > next->off) {
+		return EINVAL;
+	}
+
+	/* The last fragment determines the total length. */
+	if (!fi->mf) {
+		if (next || (rq->totlen && rq->totlen != end)) {
+			return EINVAL;
+		}
+		rq->totlen = end;
+	} else if (rq->totlen && end >= rq->totlen) {
+		return EINVAL;
+	}
+
+	/* Check the limits. */
+	if (rq->nfrags >= (unsigned)reass->max_dgram_frags) {
+		return ENOBUFS;
+	}
+	if (atomic_inc_uint_nv(&reass->nfrags) > (unsigned)reass->max_frags) {
+		atomic_dec_uint(&reass->nfrags);
+		return ENOBUFS;
+	}
+	if ((rf = kmem_intr_zalloc(sizeof(reass_frag_t), KM_NOSLEEP)) == NULL) {
+		atomic_dec_uint(&reass->nfrags);
+		return ENOMEM;
+	}
+	rf->m = m;
+	rf->hlen = fi->hlen;
+	rf->off = fi->off;
+	rf->len = fi->len;
+	rf->next = next;
+	*prevp = rf;
+
+	rq->nfrags++;
+	rq->datalen += fi->len;
+	return 0;
+}
+
+static void
+npf_reass_fixup_ip4(npf_t *npf, struct mbuf *m, unsigned totlen)
+{
+	struct ip *ip = npf->mbufops->getdata(m);
+	const uint16_t len = htons((ip->ip_hl << 2) + totlen);
+	const uint16_t off = ip->ip_off & ~htons(IP_MF | IP_OFFMASK);
+
+	ip->ip_sum = npf_fixup16_cksum(ip->ip_sum, ip->ip_len, len);
+	ip->ip_sum = npf_fixup16_cksum(ip->ip_sum, ip->ip_off, off);
+	ip->ip_len = len;
+	ip->ip_off = off;
+}
+
+static bool
+npf_reass_fixup_ip6(npf_t *npf, struct mbuf *m, unsigned hlen,
+    unsigned totlen)
+{
+	const unsigned fragoff = hlen - sizeof(struct ip6_frag);
+	uint8_t *hdrs = npf->mbufops->getdata(m);
+	struct ip6_hdr *ip6 = (void *)hdrs;
+	const struct ip6_frag *ip6f = (const void *)(hdrs + fragoff);
+	uint8_t *nxtp = &ip6->ip6_nxt;
+	unsigned off = sizeof(struct ip6_hdr);
+
+	/* Find the "next header" field referring to the fragment header. */
+	while (off < fragoff) {
+		struct ip6_ext *ip6e = (void *)(hdrs + off);
+
+		nxtp = &ip6e->ip6e_nxt;
+		off += (ip6e->ip6e_len + 1) << 3;
+	}
+	if (off != fragoff) {
+		return false;
+	}
+	*nxtp = ip6f->ip6f_nxt;
+	ip6->ip6_plen = htons(fragoff - sizeof(struct ip6_hdr) + totlen);
+
+	/* Remove the fragment header: move the preceding headers. */
+	memmove(hdrs + sizeof(struct ip6_frag), hdrs, fragoff);
+	return npf->mbufops->adj(m, sizeof(struct ip6_frag));
+}
+
+/*
+ * npf_reass_assemble: chain the fragments of the complete datagram
+ * and fix up the header.  The queue is destroyed.
+ */
+static int
+npf_reass_assemble(npf_t *npf, reass_queue_t *rq, struct mbuf **mp)
+{
+	const npf_mbufops_t *mops = npf->mbufops;
+	reass_frag_t *rf = rq->frags;
+	const unsigned hlen = rf->hlen;
+	struct mbuf *m;
+	int error = 0;
+
+	KASSERT(rf->off == 0);
+	m = rf->m;
+	rf->m = NULL;
+
+	if (!mops->ensure_contig(&m, hlen)) {
+		error = ENOMEM;
+		goto out;
+	}
+	if (rq->key.alen == sizeof(struct in_addr)) {
+		npf_reass_fixup_ip4(npf, m, rq->totlen);
+	} else if (!npf_reass_fixup_ip6(npf, m, hlen, rq->totlen)) {
+		error = EINVAL;
+		goto out;
+	}
+
+	/* Append the data of the subsequent fragments. */
+	for (rf = rf->next; rf != NULL; rf = rf->next) {
+		if (!mops->adj(rf->m, rf->hlen) || !mops->cat(m, rf->m)) {
+			error = ENOMEM;
+			goto out;
+		}
+		rf->m = NULL;
+	}
+out:
+	npf_reass_destroy(npf, rq);
+	if (error) {
+		mops->free(m);
+		m = NULL;
+	}
+	*mp = m;
+	return error;
+}
+
+/*
+ * npf_reass_packet: queue the fragment and, once all fragments of the
+ * datagram are received, return the reassembled packet.
+ *
+ * => Returns zero and the packet, or zero and NULL if more fragments
+ *    are expected.  On error, the caller still owns the mbuf (if any).
+ * => The offset of the fragment header must be given for IPv6.
+ */
+int
+npf_reass_packet(npf_t *npf, struct mbuf **mp, unsigned fragoff)
+{
+	const npf_mbufops_t *mops = npf->mbufops;
+	npf_reass_t *reass = npf->reass;
+	reass_bucket_t *b;
+	reass_queue_t *rq;
+	reass_info_t fi;
+	uint64_t now;
+	uint32_t hash;
+	int error;
+
+	if (mops->adj == NULL || mops->cat == NULL) {
+		return ENOTSUP;
+	}
+	if ((error = npf_reass_parse(npf, mp, fragoff, &fi)) != 0) {
+		return error;
+	}
+	hash = murmurhash2(&fi.key, sizeof(reass_key_t), reass->seed);
+	b = &reass->buckets[hash & REASS_HASH_MASK];
+	now = npf_reass_now();
+
+	mutex_enter(&b->lock);
+	npf_reass_expire(npf, b, now);
+
+	LIST_FOREACH(rq, &b->list, entry) {
+		if (memcmp(&rq->key, &fi.key, sizeof(reass_key_t)) == 0)
+			break;
+	}
+	if (rq == NULL) {
+		rq = kmem_intr_zalloc(sizeof(reass_queue_t), KM_NOSLEEP);
+		if (rq == NULL) {
+			mutex_exit(&b->lock);
+			return ENOMEM;
+		}
+		memcpy(&rq->key, &fi.key, sizeof(reass_key_t));
+		rq->expire = now + reass->timeout;
+		LIST_INSERT_HEAD(&b->list, rq, entry);
+	}
+
+	if ((error = npf_reass_insert(npf, rq, &fi, *mp)) != 0) {
+		/* Invalid fragment or over the limit: drop the datagram. */
+		LIST_REMOVE(rq, entry);
+		mutex_exit(&b->lock);
+		npf_reass_destroy(npf, rq);
+		return error;
+	}
+	*mp = NULL;
+
+	if (rq->totlen == 0 || rq->datalen != rq->totlen) {
+		/* More fragments should come. */
+		mutex_exit(&b->lock);
+		return 0;
+	}
+
+	/*
+	 * All fragments are received: since there are no overlaps,
+	 * the data is contiguous.  Remove the queue and assemble.
+	 */
+	LIST_REMOVE(rq, entry);
+	mutex_exit(&b->lock);
+	return npf_reass_assemble(npf, rq, mp);
+}
+
+/*
+ * npf_reass_mkfrag: construct the fragment, given the headers and the
+ * data range of the packet.  The space for the extra header (e.g. the
+ * IPv6 fragment header) is left after the headers.
+ */
+static struct mbuf *
+npf_reass_mkfrag(npf_t *npf, struct mbuf *m, const void *hdr,
+    unsigned hlen, unsigned extra, unsigned off, unsigned len)
+{
+	const npf_mbufops_t *mops = npf->mbufops;
+	struct mbuf *frag;
+	uint8_t *data;
+
+	if ((frag = mops->alloc(npf, 0, hlen + extra + len)) == NULL) {
+		return NULL;
+	}
+	data = mops->getdata(frag);
+	memcpy(data, hdr, hlen);
+	data += hlen + extra;
+
+	/* Copy the data, skipping to the offset. */
+	while (len) {
+		unsigned mlen;
+
+		KASSERT(m != NULL);
+		mlen = mops->getlen(m);
+		if (off < mlen) {
+			const unsigned n = MIN(mlen - off, len);
+
+			memcpy(data, (const uint8_t *)mops->getdata(m) + off, n);
+			data += n;
+			len -= n;
+			off = 0;
+		} else {
+			off -= mlen;
+		}
+		m = mops->getnext(m);
+	}
+	return frag;
+}
+
+/*
+ * npf_reass_optcopy: construct the IPv4 header of the subsequent
+ * fragments: only the options with the "copied" flag are retained
+ * (see RFC 791).  Returns the header length.
+ */
+static unsigned
+npf_reass_optcopy(const struct ip *ip, struct ip *nip)
+{
+	const unsigned optlen = (ip->ip_hl << 2) - sizeof(struct ip);
+	const uint8_t *opts = (const uint8_t *)(ip + 1);
+	uint8_t *nopts = (uint8_t *)(nip + 1);
+	unsigned i = 0, n = 0;
+
+	memcpy(nip, ip, sizeof(struct ip));
+	while (i < optlen && opts[i] != IPOPT_EOL) {
+		unsigned len;
+
+		if (opts[i] == IPOPT_NOP) {
+			i++;
+			continue;
+		}
+		if (i + 1 >= optlen || (len = opts[i + 1]) < 2 ||
+		    i + len > optlen) {
+			/* Malformed: copy no more. */
+			break;
+		}
+		if (IPOPT_COPIED(opts[i])) {
+			memcpy(&nopts[n], &opts[i], len);
+			n += len;
+		}
+		i += len;
+	}
+	while (n & 0x3) {
+		nopts[n++] = IPOPT_EOL;
+	}
+	nip->ip_hl = (sizeof(struct ip) + n) >> 2;
+	return sizeof(struct ip) + n;
+}
+
+static int
+npf_reass_frag_ip4(npf_t *npf, struct mbuf **mp, unsigned mtu,
+    struct mbuf **frags, unsigned *nfrags)
+{
+	const npf_mbufops_t *mops = npf->mbufops;
+	unsigned hlen, datalen, ipoff, fhlen, off = 0, n = 0;
+	uint32_t nhdr[0xf];	// the maximum header length in words
+	const struct ip *ip;
+	const void *hdr;
+	int error;
+
+	ip = mops->getdata(*mp);
+	hlen = ip->ip_hl << 2;
+	if (hlen < sizeof(struct ip) || !mops->ensure_contig(mp, hlen)) {
+		return EINVAL;
+	}
+	ip = mops->getdata(*mp);
+	ipoff = ntohs(ip->ip_off);
+	if (ntohs(ip->ip_len) <= hlen ||
+	    ntohs(ip->ip_len) > mops->getchainlen(*mp)) {
+		return EINVAL;
+	}
+	if (ipoff & IP_DF) {
+		return EMSGSIZE;
+	}
+	datalen = ntohs(ip->ip_len) - hlen;
+
+	hdr = ip;
+	fhlen = hlen;
+	while (off < datalen) {
+		const unsigned maxlen = mtu > fhlen ? (mtu - fhlen) & ~0x7 : 0;
+		const unsigned len = MIN(datalen - off, maxlen);
+		unsigned foff = (ipoff & IP_OFFMASK) + (off >> 3);
+		struct ip *fip;
+
+		if (len == 0) {
+			error = EMSGSIZE;
+			goto err;
+		}
+		if (n == *nfrags) {
+			error = ENOBUFS;
+			goto err;
+		}
+		frags[n] = npf_reass_mkfrag(npf, *mp, hdr, fhlen, 0,
+		    hlen + off, len);
+		if (frags[n] == NULL) {
+			error = ENOMEM;
+			goto err;
+		}
+		fip = mops->getdata(frags[n++]);
+
+		/* The last fragment retains the MF flag of the packet. */
+		if (off + len < datalen || (ipoff & IP_MF) != 0) {
+			foff |= IP_MF;
+		}
+		fip->ip_len = htons(fhlen + len);
+		fip->ip_off = htons((ipoff & ~(IP_OFFMASK | IP_MF)) | foff);
+		fip->ip_sum = 0;
+		fip->ip_sum = npf_cksum_buf(0, fip, fhlen);
+
+		/* The subsequent fragments have the reduced header. */
+		if (off == 0) {
+			fhlen = npf_reass_optcopy(ip, (struct ip *)nhdr);
+			hdr = nhdr;
+		}
+		off += len;
+	}
+	*nfrags = n;
+	return 0;
+err:
+	while (n--) {
+		mops->free(frags[n]);
+	}
+	return error;
+}
+
+static int
+npf_reass_frag_ip6(npf_t *npf, struct mbuf **mp, unsigned mtu,
+    struct mbuf **frags, unsigned *nfrags)
+{
+	const npf_mbufops_t *mops = npf->mbufops;
+	unsigned hlen = sizeof(struct ip6_hdr), off = 0, n = 0;
+	unsigned nxtoff = offsetof(struct ip6_hdr, ip6_nxt);
+	unsigned datalen, maxlen;
+	const struct ip6_hdr *ip6;
+	uint32_t ident;
+	uint8_t nxt;
+	int error;
+
+	if (!mops->ensure_contig(mp, hlen)) {
+		return EINVAL;
+	}
+	ip6 = mops->getdata(*mp);
+	nxt = ip6->ip6_nxt;
+
+	/*
+	 * The unfragmentable part: the IPv6 header followed by the
+	 * hop-by-hop options and the routing headers, if any.
+	 */
+	while (nxt == IPPROTO_HOPOPTS || nxt == IPPROTO_ROUTING) {
+		const struct ip6_ext *ip6e;
+
+		if (!mops->ensure_contig(mp, hlen + sizeof(struct ip6_ext))) {
+			return EINVAL;
+		}
+		ip6e = (const void *)((const uint8_t *)mops->getdata(*mp) +
+		    hlen);
+		nxtoff = hlen;
+		nxt = ip6e->ip6e_nxt;
+		hlen += (ip6e->ip6e_len + 1) << 3;
+	}
+	if (!mops->ensure_contig(mp, hlen)) {
+		return EINVAL;
+	}
+	ip6 = mops->getdata(*mp);
+	if (sizeof(struct ip6_hdr) + ntohs(ip6->ip6_plen) <= hlen ||
+	    sizeof(struct ip6_hdr) + ntohs(ip6->ip6_plen) >
+	    mops->getchainlen(*mp)) {
+		return EINVAL;
+	}
+	datalen = sizeof(struct ip6_hdr) + ntohs(ip6->ip6_plen) - hlen;
+	maxlen = mtu > hlen + sizeof(struct ip6_frag) ?
+	    (mtu - hlen - sizeof(struct ip6_frag)) & ~0x7 : 0;
+	if (maxlen == 0) {
+		return EMSGSIZE;
+	}
+	ident = htonl(cprng_fast32());
+
+	while (off < datalen) {
+		const unsigned len = MIN(datalen - off, maxlen);
+		struct ip6_hdr *fip6;
+		struct ip6_frag *ip6f;
+		uint8_t *fhdrs;
+
+		if (n == *nfrags) {
+			error = ENOBUFS;
+			goto err;
+		}
+		frags[n] = npf_reass_mkfrag(npf, *mp, ip6, hlen,
+		    sizeof(struct ip6_frag), hlen + off, len);
+		if (frags[n] == NULL) {
+			error = ENOMEM;
+			goto err;
+		}
+		fhdrs = mops->getdata(frags[n++]);
+		fip6 = (struct ip6_hdr *)fhdrs;
+		fip6->ip6_plen = htons(hlen - sizeof(struct ip6_hdr) +
+		    sizeof(struct ip6_frag) + len);
+		fhdrs[nxtoff] = IPPROTO_FRAGMENT;
+
+		ip6f = (struct ip6_frag *)(fhdrs + hlen);
+		ip6f->ip6f_nxt = nxt;
+		ip6f->ip6f_reserved = 0;
+		ip6f->ip6f_offlg = htons(off);
+		if (off + len < datalen) {
+			ip6f->ip6f_offlg |= IP6F_MORE_FRAG;
+		}
+		ip6f->ip6f_ident = ident;
+		off += len;
+	}
+	*nfrags = n;
+	return 0;
+err:
+	while (n--) {
+		mops->free(frags[n]);
+	}
+	return error;
+}
+
+/*
+ * npf_reass_fragment: fragment the IPv4 or IPv6 packet, e.g. the
+ * reassembled datagram, so that each fragment fits the given MTU.  The
+ * data is copied, so the fragments are not chained.  The capacity of
+ * the fragment array is given on input.
+ *
+ * => On success, returns zero and the fragments; the packet is consumed.
+ *    If the packet fits the MTU, then it is returned as the only one.
+ * => On error, the caller still owns the packet.
+ */
+int
+npf_reass_fragment(npf_t *npf, struct mbuf **mp, unsigned mtu,
+    struct mbuf **frags, unsigned *nfrags)
+{
+	const npf_mbufops_t *mops = npf->mbufops;
+	const uint8_t *ver;
+	int error;
+
+	if (*nfrags == 0) {
+		return ENOBUFS;
+	}
+	if (mops->getchainlen(*mp) <= mtu) {
+		frags[0] = *mp;
+		*nfrags = 1;
+		*mp = NULL;
+		return 0;
+	}
+	if (!mops->ensure_contig(mp, sizeof(struct ip))) {
+		return EINVAL;
+	}
+	ver = mops->getdata(*mp);
+	switch (*ver >> 4) {
+	case IPVERSION:
+		error = npf_reass_frag_ip4(npf, mp, mtu, frags, nfrags);
+		break;
+	case IPV6_VERSION >> 4:
+		error = npf_reass_frag_ip6(npf, mp, mtu, frags, nfrags);
+		break;
+	default:
+		error = EINVAL;
+		break;
+	}
+	if (error == 0) {
+		mops->free(*mp);
+		*mp = NULL;
+	}
+	return error;
+}
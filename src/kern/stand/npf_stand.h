@@ -139,6 +139,7 @@ again:
 #define	atomic_inc_uint(x)	__sync_fetch_and_add((x), 1)
 #define	atomic_inc_uint_nv(x)	__sync_add_and_fetch((x), 1)
 #define	atomic_inc_ulong_nv(x)	__sync_add_and_fetch((x), 1)
+#define	atomic_inc_64_nv(x)	__sync_add_and_fetch((x), 1)
 #define	atomic_dec_uint(x)	__sync_sub_and_fetch((x), 1)
 #define	atomic_dec_uint_nv(x)	__sync_sub_and_fetch((x), 1)
 #define	atomic_or_uint(x, v)	__sync_fetch_and_or((x), (v))
@@ -253,7 +254,7 @@ strlcpy(char *dst, const char *src, size_t len)
 typedef struct percpu_tls {
 	LIST_ENTRY(percpu_tls)	entry;
 	bool			setup;
-	unsigned char		buf[];
+	uint64_t		buf[];
 } percpu_tls_t;
 
 typedef struct {
@@ -270,7 +271,7 @@ npfkern_percpu_alloc(size_t size)
 {
 	percpu_t *pc = zalloc(sizeof(percpu_t));
 	pthread_mutex_init(&pc->lock, NULL);
-	pc->key = tls_create(size);
+	pc->key = tls_create(offsetof(percpu_tls_t, buf[0]) + size);
 	return pc;
 }
 
@@ -304,7 +305,7 @@ npfkern_percpu_getref(percpu_t *pc)
 		pthread_mutex_unlock(&pc->lock);
 		t->setup = true;
 	}
-	return t->buf;
+	return (void *)t->buf;
 }
 
 static inline void
@@ -314,7 +315,7 @@ npfkern_percpu_foreach(percpu_t *pc, percpu_callback_t cb, void *arg)
 
 	pthread_mutex_lock(&pc->lock);
 	LIST_FOREACH(t, &pc->list, entry) {
-		cb(t->buf, arg, NULL);
+		cb((void *)t->buf, arg, NULL);
 	}
 	pthread_mutex_unlock(&pc->lock);
 }
@@ -331,8 +332,16 @@ npfkern_percpu_foreach(percpu_t *pc, percpu_callback_t cb, void *arg)
  * Random number generator.
  */
 
-#define	cprng_fast32()			((uint32_t)random())
-#define	ip_randomid()			((uint16_t)random())
+uint32_t	npfkern_cprng_fast32(void);
+
+#define	cprng_fast32()			npfkern_cprng_fast32()
+#define	ip_randomid()			((uint16_t)npfkern_cprng_fast32())
+
+/*
+ * Bit operations.
+ */
+
+#define	ffs64(x)			__builtin_ffsll(x)
 
 /*
  * Hashing.
@@ -346,8 +355,10 @@ uint32_t	murmurhash2(const void *, size_t, uint32_t);
 
 #if defined(__linux__)
 #define	getnanouptime(ts)	clock_gettime(CLOCK_MONOTONIC_COARSE, (ts))
+#define	getnanotime(ts)		clock_gettime(CLOCK_REALTIME_COARSE, (ts))
 #else
 #define	getnanouptime(ts)	clock_gettime(CLOCK_MONOTONIC, (ts))
+#define	getnanotime(ts)		clock_gettime(CLOCK_REALTIME, (ts))
 #endif
 #undef	mstohz
 #define	mstohz(ms)		(ms)
@@ -375,6 +386,9 @@ npfkern_kpause(const char *wmesg, bool intr, int timo, kmutex_t *mtx)
 #ifndef IPV6_DEFHLIM
 #define IPV6_DEFHLIM	64
 #endif
+#ifndef ICMP_UNREACH_ADMIN_PROHIBIT
+#define	ICMP_UNREACH_ADMIN_PROHIBIT	13
+#endif
 
 #define PFIL_ALL	(PFIL_IN|PFIL_OUT)
 #define PFIL_IFADDR	0x00000008
@@ -410,17 +424,12 @@ typedef struct ifnet ifnet_t;
 #define	IFNAMSIZ	16
 #endif
 
-static inline int
-npfkern_ip_reass_packet(void *x)
-{
-	(void)x;
-	return ENOTSUP;
-}
-
-#define	ip_reass_packet(p)		npfkern_ip_reass_packet(p)
-#define	ip_output(m, a, b, c, d, e)	ENOTSUP
-#define	icmp_error(m, t, c, a, b)
-#define	in_cksum(m, len)	0
+/*
+ * IPv4/IPv6 reassembly is performed by NPF itself, see npf_reass.c;
+ * note: the NPF instance is expected in the scope.
+ */
+#define	ip_reass_packet(mp)		npf_reass_packet(npf, (mp), 0)
+#define	ip6_reass_packet(mp, off)	npf_reass_packet(npf, (mp), (off))
 
 #define	ip6_sprintf(a)		"[IPv6]"
 #define	ip_defttl		64
@@ -9,8 +9,11 @@
 #include <sys/types.h>
 #include <stdbool.h>
 #include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include "../npf_impl.h"
+#include "../npf_conn.h"
 #include "../npfkern.h"
 
 struct npf;
@@ -43,6 +46,244 @@ npfk_socket_load(npf_t *npf, int sock)
 	return error;
 }
 
+/*
+ * write_all: write the whole buffer, retrying on partial writes.
+ */
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	size_t off = 0;
+
+	while (off < len) {
+		ssize_t ret = write(fd, p + off, len - off);
+		if (ret == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		off += ret;
+	}
+	return 0;
+}
+
+/*
+ * read_all: read up to the given length, retrying on partial reads.
+ *
+ * => Returns the number of bytes read (less on EOF) or -1 on error.
+ */
+static ssize_t
+read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	size_t off = 0;
+
+	while (off < len) {
+		ssize_t ret = read(fd, p + off, len - off);
+		if (ret == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (ret == 0) {
+			break;
+		}
+		off += ret;
+	}
+	return off;
+}
+
+#define	EVLOG_BATCH	256
+
+/*
+ * npfk_evlog_write: drain the event log and write the records, as is,
+ * into the given file descriptor.
+ *
+ * => Returns the number of records written or -1 on error.
+ */
+__dso_public int
+npfk_evlog_write(npf_t *npf, int fd)
+{
+	npf_event_t buf[EVLOG_BATCH];
+	size_t n, total = 0;
+
+	while ((n = npf_evlog_drain(npf, buf, EVLOG_BATCH)) != 0) {
+		if (write_all(fd, buf, n * sizeof(npf_event_t)) == -1) {
+			return -1;
+		}
+		total += n;
+		if (n < EVLOG_BATCH) {
+			break;
+		}
+	}
+	return total;
+}
+
+#define	CONNSNAP_BATCH	64
+
+/*
+ * npfk_conn_save: write the snapshot of the active connections into
+ * the given file descriptor.  The connections are written in batches,
+ * i.e. the connection database is not locked for the whole snapshot.
+ *
+ * => Returns the number of connections written or -1 on error.
+ */
+__dso_public int
+npfk_conn_save(npf_t *npf, int fd)
+{
+	npf_connrec_t buf[CONNSNAP_BATCH];
+	npf_connsnap_t hdr;
+	npf_conndb_iter_t it;
+	size_t n, total = 0;
+	int ret = 0;
+
+	memset(&hdr, 0, sizeof(npf_connsnap_t));
+	hdr.cs_magic = NPF_CONNSNAP_MAGIC;
+	hdr.cs_ver = NPF_CONNSNAP_VER;
+	hdr.cs_recsize = sizeof(npf_connrec_t);
+	if (write_all(fd, &hdr, sizeof(npf_connsnap_t)) == -1) {
+		return -1;
+	}
+
+	npf_conn_iter_init(npf, &it);
+	do {
+		n = npf_conndb_snapshot(npf, &it, buf, CONNSNAP_BATCH);
+		if (write_all(fd, buf, n * sizeof(npf_connrec_t)) == -1) {
+			ret = -1;
+			break;
+		}
+		total += n;
+	} while (n == CONNSNAP_BATCH);
+	npf_conn_iter_fini(npf, &it);
+
+	return ret ? ret : (int)total;
+}
+
+/*
+ * npfk_conn_load: read the connection snapshot from the given file
+ * descriptor and restore the connections into the active connection
+ * database.  The configuration must be loaded first.
+ *
+ * => Returns the number of restored connections or -1 on error.
+ * => The connections which cannot be restored (e.g. if the NAT policy
+ *    no longer exists) are skipped.
+ */
+__dso_public int
+npfk_conn_load(npf_t *npf, int fd)
+{
+	npf_connrec_t buf[CONNSNAP_BATCH];
+	npf_connsnap_t hdr;
+	size_t total = 0;
+	ssize_t len;
+
+	len = read_all(fd, &hdr, sizeof(npf_connsnap_t));
+	if (len == -1) {
+		return -1;
+	}
+	if ((size_t)len != sizeof(npf_connsnap_t) ||
+	    hdr.cs_magic != NPF_CONNSNAP_MAGIC ||
+	    hdr.cs_ver != NPF_CONNSNAP_VER ||
+	    hdr.cs_recsize != sizeof(npf_connrec_t)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	while ((len = read_all(fd, buf, sizeof(buf))) > 0) {
+		if (len % sizeof(npf_connrec_t)) {
+			/* Truncated record. */
+			errno = EINVAL;
+			return -1;
+		}
+		total += npf_conndb_restore(npf, buf,
+		    len / sizeof(npf_connrec_t));
+	}
+	return len == -1 ? -1 : (int)total;
+}
+
+#define	SYNC_BATCH	64
+
+/*
+ * npfk_sync_write: drain the connection state replication records and
+ * write them into the given file descriptor, in batches each preceded
+ * by the batch header (npf_synchdr_t).
+ *
+ * => Returns the number of records written or -1 on error.
+ */
+__dso_public int
+npfk_sync_write(npf_t *npf, int fd)
+{
+	npf_syncrec_t buf[SYNC_BATCH];
+	npf_synchdr_t hdr;
+	size_t n, total = 0;
+
+	memset(&hdr, 0, sizeof(npf_synchdr_t));
+	hdr.sh_magic = NPF_SYNC_MAGIC;
+	hdr.sh_ver = NPF_CONNSNAP_VER;
+	hdr.sh_recsize = sizeof(npf_syncrec_t);
+
+	while ((n = npf_sync_drain(npf, buf, SYNC_BATCH)) != 0) {
+		hdr.sh_count = n;
+		if (write_all(fd, &hdr, sizeof(npf_synchdr_t)) == -1 ||
+		    write_all(fd, buf, n * sizeof(npf_syncrec_t)) == -1) {
+			return -1;
+		}
+		total += n;
+		if (n < SYNC_BATCH) {
+			break;
+		}
+	}
+	return total;
+}
+
+/*
+ * npfk_sync_read: read one batch of the connection state replication
+ * records from the given file descriptor and apply them to the active
+ * connection database.  The configuration must be loaded first.
+ *
+ * => Returns the number of applied records, zero on EOF or -1 on error.
+ */
+__dso_public int
+npfk_sync_read(npf_t *npf, int fd)
+{
+	npf_syncrec_t buf[SYNC_BATCH];
+	npf_synchdr_t hdr;
+	size_t left, total = 0;
+	ssize_t len;
+
+	len = read_all(fd, &hdr, sizeof(npf_synchdr_t));
+	if (len <= 0) {
+		return len;
+	}
+	if ((size_t)len != sizeof(npf_synchdr_t) ||
+	    hdr.sh_magic != NPF_SYNC_MAGIC ||
+	    hdr.sh_ver != NPF_CONNSNAP_VER ||
+	    hdr.sh_recsize != sizeof(npf_syncrec_t)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	left = hdr.sh_count;
+	while (left) {
+		const size_t n = MIN(left, SYNC_BATCH);
+		const size_t nbytes = n * sizeof(npf_syncrec_t);
+
+		len = read_all(fd, buf, nbytes);
+		if (len == -1) {
+			return -1;
+		}
+		if ((size_t)len != nbytes) {
+			/* Truncated batch. */
+			errno = EINVAL;
+			return -1;
+		}
+		total += npf_sync_apply(npf, buf, n);
+		left -= n;
+	}
+	return total;
+}
+
 bool
 npf_active_p(void)
 {
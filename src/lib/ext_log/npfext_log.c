@@ -36,6 +36,7 @@ __RCSID("$NetBSD$");
 #include <net/if.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <assert.h>
@@ -48,12 +49,23 @@ __RCSID("$NetBSD$");
 int	npfext_log_param(nl_ext_t *, const char *, const char *);
 
 __dso_public int
-npfext_log_param(nl_ext_t *ext, const char *param, const char *val __unused)
+npfext_log_param(nl_ext_t *ext, const char *param, const char *val)
 {
 	unsigned int if_idx;
 
 	assert(param != NULL);
 
+	/* Sampling (1-in-N flows) and the rate cap (records per second). */
+	if (strcmp(param, "sample") == 0 || strcmp(param, "limit") == 0) {
+		uint64_t nval;
+
+		if (!val || (nval = strtoull(val, NULL, 10)) == 0) {
+			return EINVAL;
+		}
+		npf_ext_param_u64(ext, param, nval);
+		return 0;
+	}
+
 	if_idx = if_nametoindex(param);
 	if (if_idx == 0) {
 		int s;
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+#include <sys/cdefs.h>
+__RCSID("$NetBSD$");
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <npf.h>
+
+int	npfext_pktlog_param(nl_ext_t *, const char *, const char *);
+
+__dso_public int
+npfext_pktlog_param(nl_ext_t *ext, const char *param, const char *val)
+{
+	static const char *params[] = {
+		"snaplen", "sample", "limit"
+	};
+
+	/*
+	 * - The snapshot length, i.e. the number of bytes of the packet
+	 *   to capture; it is capped by the kernel component.
+	 * - Sampling (1-in-N flows) and the rate cap (records per second).
+	 */
+	for (unsigned i = 0; i < __arraycount(params); i++) {
+		const char *name = params[i];
+		uint64_t nval;
+
+		if (strcmp(name, param) != 0) {
+			continue;
+		}
+		if (!val || (nval = strtoull(val, NULL, 10)) == 0) {
+			return EINVAL;
+		}
+		npf_ext_param_u64(ext, name, nval);
+		return 0;
+	}
+	return EINVAL;
+}
@@ -42,9 +42,19 @@ __dso_public int
 npfext_ratelimit_param(nl_ext_t *ext, const char *param, const char *val)
 {
 	static const char *params[] = {
-		"bitrate", "normal-burst", "extended-burst"
+		"bitrate", "packet-rate", "normal-burst", "extended-burst",
+		"buckets"
 	};
 
+	if (strcmp(param, "key") == 0) {
+		if (!val || (strcmp(val, "src") && strcmp(val, "dst") &&
+		    strcmp(val, "flow"))) {
+			return EINVAL;
+		}
+		npf_ext_param_string(ext, param, val);
+		return 0;
+	}
+
 	for (unsigned i = 0; i < __arraycount(params); i++) {
 		const char *name = params[i];
 		uint64_t nval;
@@ -727,6 +727,28 @@ npf_rule_setproc(nl_rule_t *rl, const char *name)
 	return nvlist_error(rl->rule_dict);
 }
 
+int
+npf_rule_setsrclimit(nl_rule_t *rl, unsigned maxconn, unsigned rate,
+    unsigned secs)
+{
+	nvlist_t *rule_dict = rl->rule_dict;
+
+	if ((rate == 0) != (secs == 0)) {
+		return EINVAL;
+	}
+	nvlist_add_number(rule_dict, "src-max-conn", maxconn);
+	nvlist_add_number(rule_dict, "src-max-rate", rate);
+	nvlist_add_number(rule_dict, "src-rate-secs", secs);
+	return nvlist_error(rule_dict);
+}
+
+int
+npf_rule_setoverload(nl_rule_t *rl, unsigned tid)
+{
+	nvlist_add_number(rl->rule_dict, "src-overload-table", tid);
+	return nvlist_error(rl->rule_dict);
+}
+
 void *
 npf_rule_export(nl_rule_t *rl, size_t *length)
 {
@@ -835,6 +857,28 @@ npf_rule_getproc(nl_rule_t *rl)
 	return dnvlist_get_string(rl->rule_dict, "rproc", NULL);
 }
 
+bool
+npf_rule_getsrclimit(nl_rule_t *rl, unsigned *maxconn, unsigned *rate,
+    unsigned *secs)
+{
+	const nvlist_t *rule_dict = rl->rule_dict;
+
+	*maxconn = dnvlist_get_number(rule_dict, "src-max-conn", 0);
+	*rate = dnvlist_get_number(rule_dict, "src-max-rate", 0);
+	*secs = dnvlist_get_number(rule_dict, "src-rate-secs", 0);
+	return *maxconn || *rate;
+}
+
+bool
+npf_rule_getoverload(nl_rule_t *rl, unsigned *tid)
+{
+	if (!nvlist_exists_number(rl->rule_dict, "src-overload-table")) {
+		return false;
+	}
+	*tid = nvlist_get_number(rl->rule_dict, "src-overload-table");
+	return true;
+}
+
 uint64_t
 npf_rule_getid(nl_rule_t *rl)
 {
@@ -1055,6 +1099,48 @@ npf_nat_setnpt66(nl_nat_t *nt, uint16_t adj)
 	return nvlist_error(nt->rule_dict);
 }
 
+int
+npf_nat_setportblock(nl_nat_t *nt, unsigned size, unsigned maxblocks)
+{
+	nvlist_t *rule_dict = nt->rule_dict;
+	unsigned flags;
+
+	/* Port block allocation implies the port map. */
+	flags = dnvlist_get_number(rule_dict, "flags", 0);
+	if ((flags & NPF_NAT_PORTMAP) == 0) {
+		return EINVAL;
+	}
+	nvlist_free_number(rule_dict, "flags");
+	nvlist_add_number(rule_dict, "flags", flags | NPF_NAT_PBA);
+	nvlist_add_number(rule_dict, "nat-pba-size", size);
+	if (maxblocks) {
+		nvlist_add_number(rule_dict, "nat-pba-max", maxblocks);
+	}
+	return nvlist_error(rule_dict);
+}
+
+int
+npf_nat_setdetmap(nl_nat_t *nt, int af, npf_addr_t *addr,
+    npf_netmask_t mask, unsigned nports)
+{
+	nvlist_t *rule_dict = nt->rule_dict;
+	int error;
+
+	/* Deterministic NAT is from an IPv4 network. */
+	if (af != AF_INET) {
+		return EINVAL;
+	}
+	if ((error = npf_nat_setalgo(nt, NPF_ALGO_DETERMINISTIC)) != 0) {
+		return error;
+	}
+	nvlist_add_binary(rule_dict, "det-addr", addr, sizeof(struct in_addr));
+	nvlist_add_number(rule_dict, "det-mask", mask);
+	if (nports) {
+		nvlist_add_number(rule_dict, "det-ports", nports);
+	}
+	return nvlist_error(rule_dict);
+}
+
 int
 npf_nat_gettype(nl_nat_t *nt)
 {
@@ -1101,6 +1187,33 @@ npf_nat_gettable(nl_nat_t *nt)
 	return dnvlist_get_number(nt->rule_dict, "nat-table-id", 0);
 }
 
+unsigned
+npf_nat_getportblock(nl_nat_t *nt)
+{
+	return dnvlist_get_number(nt->rule_dict, "nat-pba-size", 0);
+}
+
+int
+npf_nat_getdetmap(nl_nat_t *nt, npf_addr_t *addr, npf_netmask_t *mask,
+    in_port_t *minport, unsigned *nports, unsigned *nsubs)
+{
+	const nvlist_t *rule_dict = nt->rule_dict;
+	const void *data;
+	size_t len;
+
+	data = dnvlist_get_binary(rule_dict, "det-addr", &len, NULL, 0);
+	if (!data || len != sizeof(struct in_addr)) {
+		return EINVAL;
+	}
+	memcpy(addr, data, len);
+	*mask = dnvlist_get_number(rule_dict, "det-mask", NPF_NO_NETMASK);
+	*minport = dnvlist_get_number(rule_dict, "det-min-port", 0);
+	*nports = dnvlist_get_number(rule_dict, "det-ports", 0);
+	/* Note: the layout is computed by the kernel, zero if not loaded. */
+	*nsubs = dnvlist_get_number(rule_dict, "det-nsubs", 0);
+	return 0;
+}
+
 /*
  * TABLE INTERFACE.
  */
@@ -1141,6 +1254,21 @@ npf_table_add_entry(nl_table_t *tl, int af, const npf_addr_t *addr,
 	return 0;
 }
 
+int
+npf_table_setfile(nl_table_t *tl, const char *path)
+{
+	/*
+	 * Reference the pre-built constant database file, instead of
+	 * passing its contents.  The path must be absolute.
+	 */
+	if (dnvlist_get_number(tl->table_dict, "type", 0) != NPF_TABLE_CONST ||
+	    path[0] != '/') {
+		return EINVAL;
+	}
+	nvlist_add_string(tl->table_dict, "data-path", path);
+	return nvlist_error(tl->table_dict);
+}
+
 static inline int
 _npf_table_build_const(nl_table_t *tl)
 {
@@ -1156,7 +1284,8 @@ _npf_table_build_const(nl_table_t *tl)
 		return 0;
 	}
 
-	if (!nvlist_exists_nvlist_array(tl->table_dict, "entries")) {
+	if (!nvlist_exists_nvlist_array(tl->table_dict, "entries") ||
+	    nvlist_exists_string(tl->table_dict, "data-path")) {
 		return 0;
 	}
 
@@ -1219,6 +1348,7 @@ _npf_table_build_const(nl_table_t *tl)
 		free(buf);
 		goto out;
 	}
+	memcpy(buf, cdb, len);
 	munmap(cdb, len);
 
 	/*
@@ -1276,6 +1406,15 @@ npf_table_replace(int fd, nl_table_t *tl, npf_error_t *errinfo)
 	return error;
 }
 
+int
+npf_table_replace_diff(int fd, nl_table_t *tl, npf_error_t *errinfo)
+{
+	if (!nvlist_exists_bool(tl->table_dict, "incremental")) {
+		nvlist_add_bool(tl->table_dict, "incremental", true);
+	}
+	return npf_table_replace(fd, tl, errinfo);
+}
+
 nl_table_t *
 npf_table_iterate(nl_config_t *ncf, nl_iter_t *iter)
 {
@@ -1476,29 +1615,104 @@ err:
 	return;
 }
 
-int
-npf_conn_list(int fd, npf_conn_func_t func, void *arg)
+static nvlist_t *
+npf_connfilter_export(const npf_connfilter_t *f)
 {
-	nl_config_t *ncf;
-	const nvlist_t * const *conns;
-	size_t nitems;
+	nvlist_t *fnv;
 
-	ncf = npf_config_retrieve(fd);
-	if (!ncf) {
-		return errno;
+	if ((fnv = nvlist_create(0)) == NULL) {
+		return NULL;
 	}
-	if (!nvlist_exists_nvlist_array(ncf->ncf_dict, "conn-list")) {
-		return 0;
+	switch (f->af) {
+	case AF_INET:
+		nvlist_add_number(fnv, "alen", sizeof(struct in_addr));
+		break;
+	case AF_INET6:
+		nvlist_add_number(fnv, "alen", sizeof(struct in6_addr));
+		break;
 	}
-	conns = nvlist_get_nvlist_array(ncf->ncf_dict, "conn-list", &nitems);
-	for (unsigned i = 0; i < nitems; i++) {
-		const nvlist_t *conn = conns[i];
-		npf_conn_handle(conn, func, arg);
+	if (f->proto != -1) {
+		nvlist_add_number(fnv, "proto", f->proto);
 	}
-	npf_config_destroy(ncf);
+	if (f->addr) {
+		if (!_npf_add_addr(fnv, "addr", f->af, f->addr)) {
+			nvlist_destroy(fnv);
+			return NULL;
+		}
+		if (f->mask != NPF_NO_NETMASK) {
+			nvlist_add_number(fnv, "mask", f->mask);
+		}
+	}
+	if (f->port) {
+		nvlist_add_number(fnv, "port", f->port);
+	}
+	if (f->ifname) {
+		nvlist_add_string(fnv, "ifname", f->ifname);
+	}
+	if (f->nat) {
+		nvlist_add_bool(fnv, "nat", true);
+	}
+	return fnv;
+}
+
+/*
+ * npf_conn_list_filter: list the connections matching the filter, if
+ * specified.  The connections are retrieved in batches, therefore the
+ * whole connection table is neither transferred at once nor locked.
+ */
+int
+npf_conn_list_filter(int fd, const npf_connfilter_t *f,
+    npf_conn_func_t func, void *arg)
+{
+	uint64_t cursor = 0;
+	int error;
+
+	do {
+		const nvlist_t * const *conns = NULL;
+		nvlist_t *req, *resp, *fnv;
+		size_t nitems = 0;
+
+		if ((req = nvlist_create(0)) == NULL) {
+			return ENOMEM;
+		}
+		if (f) {
+			if ((fnv = npf_connfilter_export(f)) == NULL) {
+				nvlist_destroy(req);
+				return EINVAL;
+			}
+			nvlist_move_nvlist(req, "filter", fnv);
+		}
+		nvlist_add_number(req, "cursor", cursor);
+
+		error = _npf_xfer_fd(fd, IOC_NPF_CONN_LIST, req, &resp);
+		nvlist_destroy(req);
+		if (error) {
+			return error;
+		}
+		if ((error = _npf_extract_error(resp, NULL)) != 0) {
+			nvlist_destroy(resp);
+			return error;
+		}
+		if (nvlist_exists_nvlist_array(resp, "conn-list")) {
+			conns = nvlist_get_nvlist_array(resp,
+			    "conn-list", &nitems);
+		}
+		for (size_t i = 0; i < nitems; i++) {
+			npf_conn_handle(conns[i], func, arg);
+		}
+		cursor = dnvlist_get_number(resp, "cursor", 0);
+		nvlist_destroy(resp);
+	} while (cursor);
+
 	return 0;
 }
 
+int
+npf_conn_list(int fd, npf_conn_func_t func, void *arg)
+{
+	return npf_conn_list_filter(fd, NULL, func, arg);
+}
+
 /*
  * MISC.
  */
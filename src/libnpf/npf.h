@@ -71,6 +71,21 @@ typedef int (*npfext_paramfunc_t)(nl_ext_t *, const char *, const char *);
 typedef int (*npf_conn_func_t)(unsigned, const npf_addr_t *,
     const in_port_t *, const char *, void *);
 
+/*
+ * Connection listing filter: the connections matching all the criteria
+ * are listed.  The address and port match either the source or the
+ * destination of the original connection.
+ */
+typedef struct {
+	int		af;		// AF_INET, AF_INET6 or zero if any
+	int		proto;		// -1 if any
+	const npf_addr_t *addr;		// NULL if any
+	npf_netmask_t	mask;		// NPF_NO_NETMASK for the host
+	in_port_t	port;		// host byte-order; zero if any
+	const char *	ifname;		// NULL if any
+	bool		nat;		// only the NAT connections
+} npf_connfilter_t;
+
 /*
  * API functions.
  */
@@ -109,11 +124,16 @@ int		npf_rule_setprio(nl_rule_t *, int);
 int		npf_rule_setproc(nl_rule_t *, const char *);
 int		npf_rule_setkey(nl_rule_t *, const void *, size_t);
 int		npf_rule_setinfo(nl_rule_t *, const void *, size_t);
+int		npf_rule_setsrclimit(nl_rule_t *, unsigned, unsigned, unsigned);
+int		npf_rule_setoverload(nl_rule_t *, unsigned);
 const char *	npf_rule_getname(nl_rule_t *);
 uint32_t	npf_rule_getattr(nl_rule_t *);
 const char *	npf_rule_getinterface(nl_rule_t *);
 const void *	npf_rule_getinfo(nl_rule_t *, size_t *);
 const char *	npf_rule_getproc(nl_rule_t *);
+bool		npf_rule_getsrclimit(nl_rule_t *, unsigned *, unsigned *,
+		    unsigned *);
+bool		npf_rule_getoverload(nl_rule_t *, unsigned *);
 uint64_t	npf_rule_getid(nl_rule_t *);
 const void *	npf_rule_getcode(nl_rule_t *, int *, size_t *);
 bool		npf_rule_exists_p(nl_config_t *, const char *);
@@ -134,16 +154,24 @@ int		npf_nat_settable(nl_nat_t *, unsigned);
 int		npf_nat_settablefilter(nl_nat_t *, int, npf_addr_t *, npf_netmask_t);
 int		npf_nat_setalgo(nl_nat_t *, unsigned);
 int		npf_nat_setnpt66(nl_nat_t *, uint16_t);
+int		npf_nat_setportblock(nl_nat_t *, unsigned, unsigned);
+int		npf_nat_setdetmap(nl_nat_t *, int, npf_addr_t *, npf_netmask_t,
+		    unsigned);
 int		npf_nat_gettype(nl_nat_t *);
 unsigned	npf_nat_getflags(nl_nat_t *);
 const npf_addr_t *npf_nat_getaddr(nl_nat_t *, size_t *, npf_netmask_t *);
 in_port_t	npf_nat_getport(nl_nat_t *);
 unsigned	npf_nat_gettable(nl_nat_t *);
+unsigned	npf_nat_getportblock(nl_nat_t *);
+int		npf_nat_getdetmap(nl_nat_t *, npf_addr_t *, npf_netmask_t *,
+		    in_port_t *, unsigned *, unsigned *);
 unsigned	npf_nat_getalgo(nl_nat_t *);
 int		npf_nat_insert(nl_config_t *, nl_nat_t *);
 int		npf_nat_lookup(int, int, npf_addr_t *[2], in_port_t [2], int, int);
 
 int		npf_conn_list(int, npf_conn_func_t, void *);
+int		npf_conn_list_filter(int, const npf_connfilter_t *,
+		    npf_conn_func_t, void *);
 
 nl_table_t *	npf_table_create(const char *, unsigned, int);
 const char *	npf_table_getname(nl_table_t *);
@@ -151,10 +179,12 @@ unsigned	npf_table_getid(nl_table_t *);
 int		npf_table_gettype(nl_table_t *);
 int		npf_table_add_entry(nl_table_t *, int,
 		    const npf_addr_t *, const npf_netmask_t);
+int		npf_table_setfile(nl_table_t *, const char *);
 int		npf_table_insert(nl_config_t *, nl_table_t *);
 void		npf_table_destroy(nl_table_t *);
 
 int		npf_table_replace(int, nl_table_t *, npf_error_t *);
+int		npf_table_replace_diff(int, nl_table_t *, npf_error_t *);
 
 #ifdef _NPF_PRIVATE
 
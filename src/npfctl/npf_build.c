@@ -688,6 +688,34 @@ npfctl_build_group_end(void)
 	npf_rule_insert(npf_conf, parent, group);
 }
 
+/*
+ * npfctl_build_srclimit: set the per-source limits of the stateful rule.
+ */
+static void
+npfctl_build_srclimit(nl_rule_t *rl, uint32_t attr, const src_limit_t *sl)
+{
+	unsigned tid;
+
+	if ((attr & NPF_RULE_STATEFUL) == 0) {
+		yyerror("source limits require a stateful rule");
+		return;
+	}
+	if (sl->sl_maxconn == 0 && sl->sl_rate == 0) {
+		yyerror("overload table requires a source limit");
+		return;
+	}
+	npf_rule_setsrclimit(rl, sl->sl_maxconn, sl->sl_rate, sl->sl_secs);
+
+	if (sl->sl_overload) {
+		tid = npfctl_table_getid(sl->sl_overload);
+		if (tid == (unsigned)-1) {
+			yyerror("table '%s' is not defined", sl->sl_overload);
+			return;
+		}
+		npf_rule_setoverload(rl, tid);
+	}
+}
+
 /*
  * npfctl_build_rule: create a rule, build byte-code from filter options,
  * if any, and insert into the ruleset of current group, or set the rule.
@@ -695,7 +723,7 @@ npfctl_build_group_end(void)
 void
 npfctl_build_rule(uint32_t attr, const char *ifname, sa_family_t family,
     const npfvar_t *popts, const filt_opts_t *fopts,
-    const char *pcap_filter, const char *rproc)
+    const char *pcap_filter, const char *rproc, const src_limit_t *sl)
 {
 	nl_rule_t *rl;
 
@@ -711,6 +739,9 @@ npfctl_build_rule(uint32_t attr, const char *ifname, sa_family_t family,
 	if (rproc) {
 		npf_rule_setproc(rl, rproc);
 	}
+	if (sl->sl_maxconn || sl->sl_rate || sl->sl_overload) {
+		npfctl_build_srclimit(rl, attr, sl);
+	}
 
 	if (npf_conf) {
 		nl_rule_t *cg = current_group[rule_nesting_level];
@@ -791,6 +822,16 @@ npfctl_dnat_check(const addr_port_t *ap, const unsigned algo)
 		yyerror("translation address using NETMAP must be "
 		    "a network and not a dynamic pool");
 		break;
+	case NPF_ALGO_DETERMINISTIC:
+		if (type == NPFVAR_FAM) {
+			am = npfctl_get_singlefam(ap->ap_netaddr);
+			if (am->fam_family == AF_INET) {
+				break;
+			}
+		}
+		yyerror("translation address using the deterministic NAT "
+		    "must be an IPv4 address or network");
+		break;
 	case NPF_ALGO_IPHASH:
 	case NPF_ALGO_RR:
 	case NPF_ALGO_NONE:
@@ -815,7 +856,7 @@ npfctl_dnat_check(const addr_port_t *ap, const unsigned algo)
 void
 npfctl_build_natseg(int sd, int type, unsigned mflags, const char *ifname,
     const addr_port_t *ap1, const addr_port_t *ap2, const npfvar_t *popts,
-    const filt_opts_t *fopts, unsigned algo)
+    const filt_opts_t *fopts, unsigned algo, unsigned pba)
 {
 	fam_addr_mask_t *am1 = NULL, *am2 = NULL;
 	nl_nat_t *nt1 = NULL, *nt2 = NULL;
@@ -907,6 +948,44 @@ npfctl_build_natseg(int sd, int type, unsigned mflags, const char *ifname,
 	if (mflags & NPF_NAT_PORTS) {
 		flags &= ~(NPF_NAT_PORTS | NPF_NAT_PORTMAP);
 	}
+	if (mflags & NPF_NAT_EIM) {
+		if (type != NPF_NATOUT || (flags & NPF_NAT_PORTMAP) == 0) {
+			yyerror("endpoint-independent mapping requires the "
+			    "outbound dynamic NAT with the port translation");
+		}
+		flags |= NPF_NAT_EIM;
+	}
+
+	/*
+	 * Port block allocation applies to the outbound NAT using the
+	 * port map, i.e. the traditional NAPT.  For the deterministic NAT,
+	 * the port block is the number of ports per original address.
+	 */
+	if (algo == NPF_ALGO_DETERMINISTIC) {
+		if (type != NPF_NATOUT || (flags & NPF_NAT_PORTMAP) == 0) {
+			yyerror("deterministic NAT requires the outbound "
+			    "dynamic NAT with the port translation");
+		}
+		if (npfvar_get_type(ap1->ap_netaddr, 0) != NPFVAR_FAM) {
+			yyerror("deterministic NAT requires the original "
+			    "network to be specified");
+		}
+		am1 = npfctl_get_singlefam(ap1->ap_netaddr);
+		if (am1->fam_family != AF_INET) {
+			yyerror("deterministic NAT supports only IPv4");
+		}
+	} else if (pba) {
+		if (type != NPF_NATOUT || (flags & NPF_NAT_PORTMAP) == 0) {
+			yyerror("port block allocation requires the outbound "
+			    "dynamic NAT with the port translation");
+		}
+		if (pba < NPF_NAT_PBA_MINSIZE || pba > NPF_NAT_PBA_MAXSIZE ||
+		    (pba & (pba - 1)) != 0) {
+			yyerror("port block size must be a power of two "
+			    "between %u and %u", NPF_NAT_PBA_MINSIZE,
+			    NPF_NAT_PBA_MAXSIZE);
+		}
+	}
 
 	/*
 	 * If the filter criteria is not specified explicitly, apply implicit
@@ -929,10 +1008,26 @@ npfctl_build_natseg(int sd, int type, unsigned mflags, const char *ifname,
 		memcpy(&imfopts.fo_from, ap1, sizeof(addr_port_t));
 		nt2 = npfctl_build_nat(NPF_NATOUT, ifname,
 		    ap2, popts, fopts, flags);
+		if ((flags & NPF_NAT_EIM) != 0 &&
+		    (npf_nat_getflags(nt2) & NPF_NAT_PORTMAP) == 0) {
+			yyerror("endpoint-independent mapping requires the "
+			    "port map (no port forwarding)");
+		}
+		if (algo == NPF_ALGO_DETERMINISTIC) {
+			if (npf_nat_setdetmap(nt2, am1->fam_family,
+			    &am1->fam_addr, am1->fam_mask, pba) != 0) {
+				yyerror("invalid deterministic NAT mapping");
+			}
+		} else if (pba && npf_nat_setportblock(nt2, pba, 0) != 0) {
+			yyerror("port block allocation requires the "
+			    "port map (no port forwarding)");
+		}
 	}
 
 	switch (algo) {
 	case NPF_ALGO_NONE:
+	case NPF_ALGO_DETERMINISTIC:
+		/* Note: the deterministic NAT algorithm is set above. */
 		break;
 	case NPF_ALGO_NPT66:
 		/*
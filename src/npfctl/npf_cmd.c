@@ -37,6 +37,8 @@ __RCSID("$NetBSD$");
 #include <errno.h>
 #include <err.h>
 
+#include <arpa/inet.h>
+
 #ifdef __NetBSD__
 #include <sha1.h>
 #define SHA_DIGEST_LENGTH SHA1_DIGEST_LENGTH
@@ -226,12 +228,19 @@ npfctl_table_replace(int fd, int argc, char **argv)
 	nl_table_t *t;
 	unsigned type = 0;
 	int c, tid = -1;
-	FILE *fp;
+	bool mapfile = false, incremental = false;
+	FILE *fp = NULL;
 
 	name = newname = argv[0];
 	optind = 2;
-	while ((c = getopt(argc, argv, "n:t:")) != -1) {
+	while ((c = getopt(argc, argv, "imn:t:")) != -1) {
 		switch (c) {
+		case 'i':
+			incremental = true;
+			break;
+		case 'm':
+			mapfile = true;
+			break;
 		case 't':
 			typename = optarg;
 			break;
@@ -241,7 +250,7 @@ npfctl_table_replace(int fd, int argc, char **argv)
 		default:
 			errx(EXIT_FAILURE,
 			    "Usage: %s table \"table-name\" replace "
-			    "[-n \"name\"] [-t <type>] <table-file>\n",
+			    "[-i | -m] [-n \"name\"] [-t <type>] <table-file>\n",
 			    getprogname());
 		}
 	}
@@ -251,13 +260,22 @@ npfctl_table_replace(int fd, int argc, char **argv)
 	if (typename && (type = npfctl_table_type(typename)) == 0) {
 		errx(EXIT_FAILURE, "unsupported table type '%s'", typename);
 	}
+	if (mapfile && type && type != NPF_TABLE_CONST) {
+		errx(EXIT_FAILURE, "only the const tables can be mapped");
+	}
+	if (incremental && (mapfile || strcmp(name, newname) != 0)) {
+		errx(EXIT_FAILURE, "the table cannot be renamed or mapped "
+		    "when updating in place");
+	}
 
 	if (argc != 1) {
 		usage();
 	}
 
 	path = argv[0];
-	if (strcmp(path, "-") == 0) {
+	if (mapfile) {
+		/* The database file is referenced, not read. */
+	} else if (strcmp(path, "-") == 0) {
 		path = "stdin";
 		fp = stdin;
 	} else if ((fp = fopen(path, "r")) == NULL) {
@@ -273,16 +291,38 @@ npfctl_table_replace(int fd, int argc, char **argv)
 		    "table '%s' not found in the active configuration", name);
 	}
 	tid = npf_table_getid(t);
-	if (!type) {
+	if (mapfile) {
+		type = NPF_TABLE_CONST;
+	} else if (!type) {
 		type = npf_table_gettype(t);
 	}
+	if (incremental && type != (unsigned)npf_table_gettype(t)) {
+		errx(EXIT_FAILURE, "the table type cannot be changed "
+		    "when updating in place");
+	}
 	npf_config_destroy(ncf);
 
-	if ((t = npfctl_load_table(newname, tid, type, path, fp)) == NULL) {
+	if (mapfile) {
+		char *abspath;
+
+		if ((abspath = realpath(path, NULL)) == NULL) {
+			err(EXIT_FAILURE, "realpath '%s'", path);
+		}
+		if ((t = npf_table_create(newname, tid, type)) == NULL ||
+		    npf_table_setfile(t, abspath) != 0) {
+			errx(EXIT_FAILURE, "table setup failed");
+		}
+		free(abspath);
+	} else if ((t = npfctl_load_table(newname, tid, type,
+	    path, fp)) == NULL) {
 		err(EXIT_FAILURE, "table load failed");
 	}
 
-	if (npf_table_replace(fd, t, NULL)) {
+	if (incremental) {
+		if (npf_table_replace_diff(fd, t, NULL)) {
+			err(EXIT_FAILURE, "npf_table_replace_diff(<%s>)", name);
+		}
+	} else if (npf_table_replace(fd, t, NULL)) {
 		err(EXIT_FAILURE, "npf_table_replace(<%s>)", name);
 	}
 }
@@ -404,9 +444,9 @@ again:
 
 typedef struct {
 	FILE *		fp;
-	unsigned	alen;
-	const char *	ifname;
-	bool		nat;
+	npf_connfilter_t cf;
+	int		addr_alen;
+	fam_addr_mask_t	addr;
 	bool		nowide;
 	bool		name;
 
@@ -424,21 +464,8 @@ npfctl_conn_print(unsigned alen, const npf_addr_t *a, const in_port_t *p,
 	FILE *fp = fil->fp;
 	bool nat_conn;
 
-	/*
-	 * Filter connection entries by IP version, interface and/or
-	 * applicability of NAT.
-	 */
-	if (alen != fil->alen) {
-		return 0;
-	}
-	if (fil->ifname && (!ifname || strcmp(ifname, fil->ifname) != 0)) {
-		return 0;
-	}
+	/* Note: the connections are filtered by the kernel. */
 	nat_conn = !npfctl_addr_iszero(&a[2]) || p[2] != 0;
-	if (fil->nat && !nat_conn) {
-		return 0;
-	}
-
 	fmt = fil->name ? "%A" : (fil->v4 ? "%a" : "[%a]");
 
 	addrstr = npfctl_print_addrmask(alen, fmt, &a[0], NPF_NO_NETMASK);
@@ -469,11 +496,20 @@ npfctl_conn_print(unsigned alen, const npf_addr_t *a, const in_port_t *p,
 static void
 npf_conn_list_v(int fd, unsigned alen, npf_conn_filter_t *f)
 {
-	f->alen = alen;
+	int error;
+
+	if (f->cf.addr && (unsigned)f->addr_alen != alen) {
+		/* The address of the other family. */
+		return;
+	}
 	f->v4 = alen == sizeof(struct in_addr);
+	f->cf.af = f->v4 ? AF_INET : AF_INET6;
 	f->pwidth = f->nowide ? 0 : ((f->v4 ? 15 : 40) + 1 + 5);
-	if (npf_conn_list(fd, npfctl_conn_print, f) != 0) {
-		err(EXIT_FAILURE, "npf_conn_list");
+
+	error = npf_conn_list_filter(fd, &f->cf, npfctl_conn_print, f);
+	if (error) {
+		errno = error;
+		err(EXIT_FAILURE, "npf_conn_list_filter");
 	}
 }
 
@@ -490,8 +526,9 @@ npfctl_conn_list(int fd, int argc, char **argv)
 
 	memset(&f, 0, sizeof(f));
 	f.fp = stdout;
+	f.cf.proto = -1;
 
-	while ((c = getopt(argc, argv, "46hi:nNW")) != -1) {
+	while ((c = getopt(argc, argv, "46a:hi:nNp:P:W")) != -1) {
 		switch (c) {
 		case '4':
 			alen = sizeof(struct in_addr);
@@ -502,21 +539,40 @@ npfctl_conn_list(int fd, int argc, char **argv)
 		case 'h':
 			header = false;
 			break;
+		case 'a':
+			if (!npfctl_parse_cidr(optarg, &f.addr, &f.addr_alen)) {
+				errx(EXIT_FAILURE, "invalid CIDR '%s'", optarg);
+			}
+			f.cf.addr = &f.addr.fam_addr;
+			f.cf.mask = f.addr.fam_mask;
+			break;
 		case 'i':
-			f.ifname = optarg;
+			f.cf.ifname = optarg;
 			break;
 		case 'n':
-			f.nat = true;
+			f.cf.nat = true;
 			break;
 		case 'N':
 			f.name = true;
 			break;
+		case 'p':
+			if ((f.cf.port = npfctl_portno(optarg)) == 0) {
+				errx(EXIT_FAILURE, "invalid port '%s'", optarg);
+			}
+			break;
+		case 'P':
+			if ((f.cf.proto = npfctl_protono(optarg)) == -1) {
+				errx(EXIT_FAILURE,
+				    "invalid protocol '%s'", optarg);
+			}
+			break;
 		case 'W':
 			f.nowide = true;
 			break;
 		default:
 			errx(EXIT_FAILURE,
-			    "Usage: %s list [-46hnNW] [-i <ifname>]\n",
+			    "Usage: %s list [-46hnNW] [-a <addr[/mask]>] "
+			    "[-i <ifname>] [-p <port>] [-P <proto>]\n",
 			    getprogname());
 		}
 	}
@@ -538,3 +594,166 @@ npfctl_conn_list(int fd, int argc, char **argv)
 
 	return 0;
 }
+
+////////////////////////////////////////////////////////////////////////////
+//
+// NPFCTL NAT COMMANDS
+//
+
+/*
+ * Deterministic NAT mapping (in host byte-order), see npf_nat.c source.
+ */
+typedef struct {
+	uint32_t	onet;
+	uint32_t	ohmask;
+	uint32_t	tnet;
+	uint32_t	thmask;
+	unsigned	minport;
+	unsigned	nports;
+	unsigned	nsubs;
+} npf_detmap_t;
+
+static uint32_t
+npfctl_hostmask(npf_netmask_t mask)
+{
+	return (mask == NPF_NO_NETMASK || mask >= 32) ?
+	    0 : (UINT32_C(1) << (32 - mask)) - 1;
+}
+
+static bool
+npfctl_detmap_get(nl_nat_t *nt, npf_detmap_t *dm)
+{
+	const npf_addr_t *taddr;
+	npf_netmask_t omask, tmask;
+	npf_addr_t oaddr;
+	in_port_t minport;
+	size_t alen;
+
+	if (npf_nat_getalgo(nt) != NPF_ALGO_DETERMINISTIC ||
+	    npf_nat_getdetmap(nt, &oaddr, &omask, &minport,
+	    &dm->nports, &dm->nsubs) != 0 || !dm->nports || !dm->nsubs) {
+		return false;
+	}
+	taddr = npf_nat_getaddr(nt, &alen, &tmask);
+	if (taddr == NULL || alen != sizeof(struct in_addr)) {
+		return false;
+	}
+	dm->ohmask = npfctl_hostmask(omask);
+	dm->onet = ntohl(oaddr.word32[0]) & ~dm->ohmask;
+	dm->thmask = npfctl_hostmask(tmask);
+	dm->tnet = ntohl(taddr->word32[0]) & ~dm->thmask;
+	dm->minport = minport;
+	return true;
+}
+
+static void
+npfctl_detmap_print(const npf_detmap_t *dm, uint32_t idx)
+{
+	const unsigned port = dm->minport + (idx % dm->nsubs) * dm->nports;
+	npf_addr_t oaddr, taddr;
+	char *ostr, *tstr;
+
+	memset(&oaddr, 0, sizeof(npf_addr_t));
+	memset(&taddr, 0, sizeof(npf_addr_t));
+	oaddr.word32[0] = htonl(dm->onet | idx);
+	taddr.word32[0] = htonl(dm->tnet + idx / dm->nsubs);
+
+	ostr = npfctl_print_addrmask(sizeof(struct in_addr), "%a",
+	    &oaddr, NPF_NO_NETMASK);
+	tstr = npfctl_print_addrmask(sizeof(struct in_addr), "%a",
+	    &taddr, NPF_NO_NETMASK);
+	printf("%-15s %-15s %u-%u\n", ostr, tstr, port, port + dm->nports - 1);
+	free(ostr);
+	free(tstr);
+}
+
+/*
+ * npfctl_detmap_find: print the mapping of the given address, which
+ * is either the original address or the translation address (and
+ * the port, if non-zero).
+ */
+static unsigned
+npfctl_detmap_find(const npf_detmap_t *dm, uint32_t a, unsigned port)
+{
+	uint32_t first, last, aidx;
+
+	if ((a & ~dm->ohmask) == dm->onet) {
+		npfctl_detmap_print(dm, a & dm->ohmask);
+		return 1;
+	}
+	if ((a & ~dm->thmask) != dm->tnet) {
+		return 0;
+	}
+
+	/* Reverse lookup: the subscribers of the translation address. */
+	aidx = a & dm->thmask;
+	first = aidx * dm->nsubs;
+	last = first + dm->nsubs - 1;
+	if (port) {
+		if (port < dm->minport ||
+		    port >= dm->minport + dm->nsubs * dm->nports) {
+			return 0;
+		}
+		first = last = first + (port - dm->minport) / dm->nports;
+	}
+	if (first > dm->ohmask) {
+		return 0;
+	}
+	last = MIN(last, dm->ohmask);
+	for (uint32_t idx = first; idx <= last; idx++) {
+		npfctl_detmap_print(dm, idx);
+	}
+	return last - first + 1;
+}
+
+int
+npfctl_nat_map(int fd, int argc, char **argv)
+{
+	struct in_addr addr;
+	unsigned port = 0, found = 0;
+	nl_config_t *ncf;
+	nl_nat_t *nt;
+	nl_iter_t i;
+
+	argc -= 2;
+	argv += 2;
+
+	if (argc > 2 || (argc && inet_pton(AF_INET, argv[0], &addr) != 1)) {
+		errx(EXIT_FAILURE, "Usage: %s nat-map [<address> [<port>]]",
+		    getprogname());
+	}
+	if (argc == 2) {
+		char *ep;
+
+		port = strtoul(argv[1], &ep, 10);
+		if (*ep != '\0' || port == 0 || port > UINT16_MAX) {
+			errx(EXIT_FAILURE, "invalid port '%s'", argv[1]);
+		}
+	}
+	if ((ncf = npf_config_retrieve(fd)) == NULL) {
+		err(EXIT_FAILURE, "npf_config_retrieve()");
+	}
+
+	printf("# %-13s %-15s %s\n", "orig-addr", "trans-addr", "ports");
+	for (i = NPF_ITER_BEGIN; (nt = npf_nat_iterate(ncf, &i)) != NULL;) {
+		npf_detmap_t dm;
+
+		if (!npfctl_detmap_get(nt, &dm)) {
+			continue;
+		}
+		if (argc == 0) {
+			for (uint32_t idx = 0; idx <= dm.ohmask; idx++) {
+				npfctl_detmap_print(&dm, idx);
+			}
+			found++;
+			continue;
+		}
+		found += npfctl_detmap_find(&dm, ntohl(addr.s_addr), port);
+	}
+	npf_config_destroy(ncf);
+
+	if (!found) {
+		errx(EXIT_FAILURE, "no deterministic NAT mapping found");
+	}
+	return 0;
+}
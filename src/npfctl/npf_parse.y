@@ -114,6 +114,8 @@ yyerror(const char *fmt, ...)
 %token			COLON
 %token			COMMA
 %token			DEFAULT
+%token			DETERMINISTIC
+%token			ENDPOINT_INDEP
 %token			TDYNAMIC
 %token			TSTATIC
 %token			EQ
@@ -135,6 +137,8 @@ yyerror(const char *fmt, ...)
 %token			IPSET
 %token			LPM
 %token			MAP
+%token			MAX_SRC_CONN
+%token			MAX_SRC_CONN_RATE
 %token			NO_PORTS
 %token			MINUS
 %token			NAME
@@ -143,11 +147,13 @@ yyerror(const char *fmt, ...)
 %token			ON
 %token			OFF
 %token			OUT
+%token			OVERLOAD
 %token			PAR_CLOSE
 %token			PAR_OPEN
 %token			PASS
 %token			PCAP_FILTER
 %token			PORT
+%token			PORT_BLOCK
 %token			PROCEDURE
 %token			PROTO
 %token			FAMILY
@@ -163,6 +169,7 @@ yyerror(const char *fmt, ...)
 %token			SLASH
 %token			STATEFUL
 %token			STATEFUL_ALL
+%token			SYNPROXY
 %token			TABLE
 %token			TCP
 %token			TO
@@ -188,12 +195,13 @@ yyerror(const char *fmt, ...)
 %type	<num>		port opt_final number afamily opt_family
 %type	<num>		block_or_pass rule_dir group_dir block_opts
 %type	<num>		maybe_not opt_stateful icmp_type table_type
-%type	<num>		map_sd map_algo map_flags map_type
+%type	<num>		map_sd map_algo map_flags map_pba map_type
 %type	<num>		param_val
 %type	<var>		static_ifaddrs filt_addr_element
 %type	<var>		filt_port filt_port_list port_range icmp_type_and_code
 %type	<var>		filt_addr addr_and_mask tcp_flags tcp_flags_and_mask
 %type	<var>		procs proc_call proc_param_list proc_param
+%type	<srclimit>	opt_srclimit
 %type	<var>		element list_elems list value filt_addr_list
 %type	<var>		opt_proto proto proto_elems
 %type	<addrport>	mapseg
@@ -210,6 +218,7 @@ yyerror(const char *fmt, ...)
 	filt_opts_t	filtopts;
 	opt_proto_t	optproto;
 	rule_group_t	rulegroup;
+	src_limit_t	srclimit;
 }
 
 %%
@@ -377,11 +386,24 @@ map_algo
 	| ALGO IPHASH		{ $$ = NPF_ALGO_IPHASH; }
 	| ALGO ROUNDROBIN	{ $$ = NPF_ALGO_RR; }
 	| ALGO NPT66		{ $$ = NPF_ALGO_NPT66; }
+	| ALGO DETERMINISTIC	{ $$ = NPF_ALGO_DETERMINISTIC; }
 	|			{ $$ = 0; }
 	;
 
 map_flags
 	: NO_PORTS	{ $$ = NPF_NAT_PORTS; }
+	| ENDPOINT_INDEP { $$ = NPF_NAT_EIM; }
+	|		{ $$ = 0; }
+	;
+
+map_pba
+	: PORT_BLOCK NUM
+	{
+		if ($2 == 0 || $2 > UINT16_MAX) {
+			yyerror("invalid port block size %lu", $2);
+		}
+		$$ = $2;
+	}
 	|		{ $$ = 0; }
 	;
 
@@ -400,18 +422,22 @@ mapseg
 	;
 
 map
-	: MAP ifref map_sd map_algo map_flags mapseg map_type mapseg
+	: MAP ifref map_sd map_algo map_flags map_pba mapseg map_type mapseg
 	  PASS opt_family opt_proto all_or_filt_opts
 	{
-		npfctl_build_natseg($3, $7, $5, $2, &$6, &$8, $11, &$12, $4);
+		npfctl_build_natseg($3, $8, $5, $2, &$7, &$9, $12, &$13,
+		    $4, $6);
 	}
-	| MAP ifref map_sd map_algo map_flags mapseg map_type mapseg
+	| MAP ifref map_sd map_algo map_flags map_pba mapseg map_type mapseg
 	{
-		npfctl_build_natseg($3, $7, $5, $2, &$6, &$8, NULL, NULL, $4);
+		npfctl_build_natseg($3, $8, $5, $2, &$7, &$9, NULL, NULL,
+		    $4, $6);
 	}
-	| MAP ifref map_sd map_algo map_flags proto mapseg map_type mapseg
+	| MAP ifref map_sd map_algo map_flags map_pba proto mapseg map_type
+	  mapseg
 	{
-		npfctl_build_natseg($3, $8, $5, $2, &$7, &$9, $6, NULL, $4);
+		npfctl_build_natseg($3, $9, $5, $2, &$8, &$10, $7, NULL,
+		    $4, $6);
 	}
 	| MAP RULESET group_opts
 	{
@@ -556,17 +582,17 @@ rule_group
  */
 
 rule
-	: block_or_pass opt_stateful rule_dir opt_final on_ifname
-	  opt_family opt_proto all_or_filt_opts opt_apply
+	: block_or_pass opt_stateful opt_srclimit rule_dir opt_final
+	  on_ifname opt_family opt_proto all_or_filt_opts opt_apply
 	{
-		npfctl_build_rule($1 | $2 | $3 | $4, $5,
-		    $6, $7, &$8, NULL, $9);
+		npfctl_build_rule($1 | $2 | $4 | $5, $6,
+		    $7, $8, &$9, NULL, $10, &$3);
 	}
-	| block_or_pass opt_stateful rule_dir opt_final on_ifname
-	  PCAP_FILTER STRING opt_apply
+	| block_or_pass opt_stateful opt_srclimit rule_dir opt_final
+	  on_ifname PCAP_FILTER STRING opt_apply
 	{
-		npfctl_build_rule($1 | $2 | $3 | $4, $5,
-		    AF_UNSPEC, NULL, NULL, $7, $8);
+		npfctl_build_rule($1 | $2 | $4 | $5, $6,
+		    AF_UNSPEC, NULL, NULL, $8, $9, &$3);
 	}
 	;
 
@@ -679,9 +705,46 @@ all_or_filt_opts
 opt_stateful
 	: STATEFUL	{ $$ = NPF_RULE_STATEFUL; }
 	| STATEFUL_ALL	{ $$ = NPF_RULE_STATEFUL | NPF_RULE_GSTATEFUL; }
+	| STATEFUL SYNPROXY
+	{
+		$$ = NPF_RULE_STATEFUL | NPF_RULE_SYNPROXY;
+	}
+	| STATEFUL_ALL SYNPROXY
+	{
+		$$ = NPF_RULE_STATEFUL | NPF_RULE_GSTATEFUL | NPF_RULE_SYNPROXY;
+	}
 	|		{ $$ = 0; }
 	;
 
+opt_srclimit
+	: opt_srclimit MAX_SRC_CONN NUM
+	{
+		if ($3 == 0) {
+			yyerror("invalid connection limit");
+		}
+		$$ = $1;
+		$$.sl_maxconn = $3;
+	}
+	| opt_srclimit MAX_SRC_CONN_RATE NUM SLASH NUM
+	{
+		if ($3 == 0 || $5 == 0) {
+			yyerror("invalid connection rate limit");
+		}
+		$$ = $1;
+		$$.sl_rate = $3;
+		$$.sl_secs = $5;
+	}
+	| opt_srclimit OVERLOAD TABLE_ID
+	{
+		$$ = $1;
+		$$.sl_overload = $3;
+	}
+	|
+	{
+		memset(&$$, 0, sizeof(src_limit_t));
+	}
+	;
+
 opt_apply
 	: APPLY STRING	{ $$ = $2; }
 	|		{ $$ = NULL; }
@@ -296,6 +296,7 @@ print_portrange(npf_conf_info_t *ctx __unused, const uint32_t *words)
 #define	F(name)		__CONCAT(NPF_RULE_, name)
 #define	STATEFUL_ALL	(NPF_RULE_STATEFUL | NPF_RULE_GSTATEFUL)
 #define	NAME_AT		2
+#define	SRCLIMIT_AT	10
 
 static const struct attr_keyword_mapent {
 	uint32_t	mask;
@@ -311,6 +312,7 @@ static const struct attr_keyword_mapent {
 	{ F(RETRST)|F(RETICMP),	F(RETICMP),		"return-icmp"	},
 	{ STATEFUL_ALL,		F(STATEFUL),		"stateful"	},
 	{ STATEFUL_ALL,		STATEFUL_ALL,		"stateful-all"	},
+	{ F(SYNPROXY),		F(SYNPROXY),		"synproxy"	},
 	{ F(DIMASK),		F(IN),			"in"		},
 	{ F(DIMASK),		F(OUT),			"out"		},
 	{ F(FINAL),		F(FINAL),		"final"		},
@@ -413,6 +415,30 @@ npfctl_print_id(npf_conf_info_t *ctx, nl_rule_t *rl)
 	}
 }
 
+static void
+npfctl_print_srclimit(npf_conf_info_t *ctx, nl_rule_t *rl)
+{
+	unsigned maxconn, rate, secs, tid;
+
+	if (!npf_rule_getsrclimit(rl, &maxconn, &rate, &secs)) {
+		return;
+	}
+	if (maxconn) {
+		ctx->fpos += fprintf(ctx->fp, "max-src-conn %u ", maxconn);
+	}
+	if (rate) {
+		ctx->fpos += fprintf(ctx->fp,
+		    "max-src-conn-rate %u/%u ", rate, secs);
+	}
+	if (npf_rule_getoverload(rl, &tid)) {
+		const char *tname;
+		bool ifaddr;
+
+		tname = npfctl_table_getname(ctx->conf, tid, &ifaddr);
+		ctx->fpos += fprintf(ctx->fp, "overload <%s> ", tname);
+	}
+}
+
 static void
 npfctl_print_filter_generic(npf_conf_info_t *ctx)
 {
@@ -523,6 +549,9 @@ npfctl_print_rule(npf_conf_info_t *ctx, nl_rule_t *rl, unsigned level)
 		if (i == NAME_AT && (name = npf_rule_getname(rl)) != NULL) {
 			ctx->fpos += fprintf(ctx->fp, "\"%s\" ", name);
 		}
+		if (i == SRCLIMIT_AT) {
+			npfctl_print_srclimit(ctx, rl);
+		}
 		if ((attr & ak->mask) == ak->flags) {
 			ctx->fpos += fprintf(ctx->fp, "%s ", ak->val);
 		}
@@ -563,11 +592,12 @@ npfctl_print_nat(npf_conf_info_t *ctx, nl_nat_t *nt)
 	nl_rule_t *rl = (nl_nat_t *)nt;
 	const char *ifname, *algo, *seg1, *seg2, *arrow;
 	const npf_addr_t *addr;
-	npf_netmask_t mask;
-	in_port_t port;
+	npf_addr_t daddr;
+	npf_netmask_t mask, dmask;
+	in_port_t port, dport;
 	size_t alen;
-	unsigned flags;
-	char *seg;
+	unsigned flags, dports, dnsubs;
+	char *seg, *odet, *pba;
 
 	/* Get flags and the interface. */
 	flags = npf_nat_getflags(nt);
@@ -600,6 +630,7 @@ npfctl_print_nat(npf_conf_info_t *ctx, nl_nat_t *nt)
 		free(seg), seg = p;
 	}
 	seg1 = seg2 = "any";
+	odet = NULL;
 
 	/* Get the NAT type and determine the translation segment. */
 	switch (npf_nat_gettype(nt)) {
@@ -629,22 +660,45 @@ npfctl_print_nat(npf_conf_info_t *ctx, nl_nat_t *nt)
 	case NPF_ALGO_NPT66:
 		algo = "algo npt66 ";
 		break;
+	case NPF_ALGO_DETERMINISTIC:
+		algo = "algo deterministic ";
+		break;
 	default:
 		algo = "";
 		break;
 	}
 
+	/* Port block allocation or the deterministic NAT mapping. */
+	if (npf_nat_getdetmap(nt, &daddr, &dmask, &dport,
+	    &dports, &dnsubs) == 0) {
+		odet = npfctl_print_addrmask(sizeof(struct in_addr), "%a",
+		    &daddr, dmask);
+		seg1 = odet;
+		if (dports) {
+			easprintf(&pba, "port-block %u ", dports);
+		} else {
+			pba = estrdup("");
+		}
+	} else if (flags & NPF_NAT_PBA) {
+		easprintf(&pba, "port-block %u ", npf_nat_getportblock(nt));
+	} else {
+		pba = estrdup("");
+	}
+
 	/* XXX also handle "any" */
 
 	/* Print out the NAT policy with the filter criteria. */
-	ctx->fpos += fprintf(ctx->fp, "map %s %s %s%s%s %s %s pass ",
+	ctx->fpos += fprintf(ctx->fp, "map %s %s %s%s%s%s%s %s %s pass ",
 	    ifname, (flags & NPF_NAT_STATIC) ? "static" : "dynamic",
 	    algo, (flags & NPF_NAT_PORTS) ? "" : "no-ports ",
+	    (flags & NPF_NAT_EIM) ? "endpoint-independent " : "", pba,
 	    seg1, arrow, seg2);
 	npfctl_print_filter(ctx, rl);
 	npfctl_print_id(ctx, rl);
 	ctx->fpos += fprintf(ctx->fp, "\n");
 	free(seg);
+	free(odet);
+	free(pba);
 }
 
 static void
@@ -63,6 +63,7 @@ enum {
 	NPFCTL_LOAD,
 	NPFCTL_DEBUG,
 	NPFCTL_CONN_LIST,
+	NPFCTL_NAT_MAP,
 };
 
 bool
@@ -114,14 +115,18 @@ usage(void)
 	    "\t%s table \"table-name\" { list | flush }\n",
 	    progname);
 	fprintf(stderr,
-	    "\t%s table \"table-name\" replace [-n \"name\"]"
+	    "\t%s table \"table-name\" replace [-i | -m] [-n \"name\"]"
 	    " [-t <type>] <table-file>\n",
 	    progname);
 	fprintf(stderr,
 	    "\t%s save | load\n",
 	    progname);
 	fprintf(stderr,
-	    "\t%s list [-46hNnw] [-i <ifname>]\n",
+	    "\t%s list [-46hNnw] [-a <addr[/mask]>] [-i <ifname>]"
+	    " [-p <port>] [-P <proto>]\n",
+	    progname);
+	fprintf(stderr,
+	    "\t%s nat-map [<address> [<port>]]\n",
 	    progname);
 	fprintf(stderr,
 	    "\t%s debug { -a | -b <binary-config> | -c <config> } "
@@ -146,12 +151,18 @@ npfctl_print_stats(int fd)
 		{ -1, "Packets blocked"					},
 		{ NPF_STAT_BLOCK_DEFAULT,	"default block"		},
 		{ NPF_STAT_BLOCK_RULESET,	"ruleset block"		},
+		{ NPF_STAT_BLOCK_SRC_CONN,	"source limit block"	},
+		{ NPF_STAT_BLOCK_SRC_RATE,	"source rate block"	},
+		{ NPF_STAT_BLOCK_SRC_FULL,	"source tracking full"	},
 
 		{ -1, "State and NAT entries"				},
 		{ NPF_STAT_CONN_CREATE,		"state allocations"},
 		{ NPF_STAT_CONN_DESTROY,	"state destructions"},
 		{ NPF_STAT_NAT_CREATE,		"NAT entry allocations"	},
 		{ NPF_STAT_NAT_DESTROY,		"NAT entry destructions"},
+		{ NPF_STAT_CONN_LIMIT,		"state limit hits"	},
+		{ NPF_STAT_CONN_EARLYDROP,	"state early drops"	},
+		{ NPF_STAT_SRC_OVERLOAD,	"overloading sources"	},
 
 		{ -1, "Network buffers"					},
 		{ NPF_STAT_NBUF_NONCONTIG,	"non-contiguous cases"	},
@@ -171,8 +182,24 @@ npfctl_print_stats(int fd)
 		{ NPF_STAT_FRAGMENTS,		"fragments"		},
 		{ NPF_STAT_REASSEMBLY,		"reassembled"		},
 		{ NPF_STAT_REASSFAIL,		"failed reassembly"	},
+		{ NPF_STAT_REASSTIMEOUT,	"expired reassembly"	},
+
+		{ -1, "SYN proxy"					},
+		{ NPF_STAT_SYNPROXY_COOKIE,	"SYN cookies sent"	},
+		{ NPF_STAT_SYNPROXY_HANDSHAKE,	"completed handshakes"	},
+
+		{ -1, "Logging"						},
+		{ NPF_STAT_EVLOG_DROP,		"dropped events"	},
+		{ NPF_STAT_PKTLOG_DROP,		"dropped packets"	},
+		{ NPF_STAT_LOG_UNSAMPLED,	"not sampled"		},
+		{ NPF_STAT_LOG_CAPPED,		"over the rate limit"	},
+
+		{ -1, "State replication"				},
+		{ NPF_STAT_SYNC_DROP,		"dropped records"	},
+		{ NPF_STAT_SYNC_RATELIMIT,	"over the rate limit"	},
 
 		{ -1, "Other"						},
+		{ NPF_STAT_ICMP_SUPPRESSED,	"suppressed ICMP errors"},
 		{ NPF_STAT_ERROR,		"unexpected errors"	},
 	};
 	uint64_t *st = ecalloc(1, NPF_STATS_SIZE);
@@ -525,6 +552,10 @@ npfctl(int action, int argc, char **argv)
 		ret = npfctl_conn_list(fd, argc, argv);
 		fun = "npfctl_conn_list";
 		break;
+	case NPFCTL_NAT_MAP:
+		ret = npfctl_nat_map(fd, argc, argv);
+		fun = "npfctl_nat_map";
+		break;
 	case NPFCTL_VALIDATE:
 		npfctl_config_init(false);
 		npfctl_parse_file(argc > 2 ? argv[2] : NPF_CONF_PATH);
@@ -566,6 +597,8 @@ main(int argc, char **argv)
 		{	"save",		NPFCTL_SAVE		},
 		{	"load",		NPFCTL_LOAD		},
 		{	"list",		NPFCTL_CONN_LIST	},
+		/* NAT */
+		{	"nat-map",	NPFCTL_NAT_MAP		},
 		/* Misc. */
 		{	"valid",	NPFCTL_VALIDATE		},
 		{	"debug",	NPFCTL_DEBUG		},
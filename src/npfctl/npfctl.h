@@ -92,6 +92,13 @@ typedef struct rule_group {
 	bool		rg_default;
 } rule_group_t;
 
+typedef struct src_limit {
+	unsigned long	sl_maxconn;
+	unsigned long	sl_rate;
+	unsigned long	sl_secs;
+	const char *	sl_overload;
+} src_limit_t;
+
 typedef struct proc_call {
 	const char *	pc_name;
 	npfvar_t *	pc_opts;
@@ -150,6 +157,7 @@ void		npfctl_rule(int, int, char **);
 void		npfctl_table_replace(int, int, char **);
 void		npfctl_table(int, int, char **);
 int		npfctl_conn_list(int, int, char **);
+int		npfctl_nat_map(int, int, char **);
 
 /*
  * NPF extension loading.
@@ -223,10 +231,10 @@ void		npfctl_build_group(const char *, int, const char *, bool);
 void		npfctl_build_group_end(void);
 void		npfctl_build_rule(uint32_t, const char *, sa_family_t,
 		    const npfvar_t *, const filt_opts_t *,
-		    const char *, const char *);
+		    const char *, const char *, const src_limit_t *);
 void		npfctl_build_natseg(int, int, unsigned, const char *,
 		    const addr_port_t *, const addr_port_t *,
-		    const npfvar_t *, const filt_opts_t *, unsigned);
+		    const npfvar_t *, const filt_opts_t *, unsigned, unsigned);
 void		npfctl_build_maprset(const char *, int, const char *);
 void		npfctl_build_table(const char *, u_int, const char *);
 
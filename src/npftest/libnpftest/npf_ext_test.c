@@ -14,14 +14,273 @@
 #include "npf_test.h"
 
 static bool
-npf_ratelimit_test(npf_t *npf)
+npf_ratelimit_test(npf_t *npf, bool verbose)
 {
+	const npf_match_info_t mi = { .mi_rid = 1, .mi_di = PFIL_OUT };
+	ifnet_t *ifp = npf_test_getif(IFNAME_DUMMY);
+	uint64_t passed = 0, npkts = 0;
+	nvlist_t *params;
+	npf_rproc_t *rp;
+	npf_cache_t npc;
+	struct mbuf *m;
+	size_t pktlen;
+	nbuf_t nbuf;
 	int error;
 
 	error = npf_ext_ratelimit_init(npf);
-	assert(error == 0);
-	npf_ext_ratelimit_fini(npf);
+	CHECK_TRUE(error == 0);
 
+	/* 1 MB/s, i.e. 1000 tokens in a millisecond. */
+	params = nvlist_create(0);
+	nvlist_add_string(params, "name", "ratelimit-test");
+	nvlist_add_number(params, "bitrate", 8000000);
+	nvlist_add_number(params, "normal-burst", 10000);
+	nvlist_add_number(params, "extended-burst", 20000);
+	rp = npf_rproc_create(params);
+	CHECK_TRUE(rp != NULL);
+	error = npf_ext_construct(npf, "ratelimit", rp, params);
+	CHECK_TRUE(error == 0);
+	nvlist_destroy(params);
+
+	m = mbuf_get_pkt(AF_INET, IPPROTO_UDP,
+	    LOCAL_IP1, REMOTE_IP1, 5000, 7000);
+	nbuf_init(npf, &nbuf, m, ifp);
+	memset(&npc, 0, sizeof(npf_cache_t));
+	npc.npc_ctx = npf;
+	npc.npc_nbuf = &nbuf;
+	CHECK_TRUE(npf_cache_all(&npc) & NPC_IP4);
+	pktlen = nbuf_datalen(&nbuf);
+
+	/*
+	 * Send a burst: the normal burst is green, then a part of the
+	 * extended burst is yellow and the rest is red.  The burst takes
+	 * a few milliseconds at most, so little is refilled.
+	 */
+	for (unsigned i = 0; i < 4000; i++) {
+		int decision = NPF_DECISION_PASS;
+
+		CHECK_TRUE(npf_rproc_run(&npc, rp, &mi, &decision));
+		passed += (decision == NPF_DECISION_PASS) ? pktlen : 0;
+		npkts++;
+	}
+	if (verbose) {
+		printf("ratelimit: %" PRIu64 " of %" PRIu64 " bytes passed\n",
+		    passed, npkts * pktlen);
+	}
+	CHECK_TRUE(passed >= 10000);
+	CHECK_TRUE(passed < npkts * pktlen);
+	CHECK_TRUE(passed <= 10000 + 20000 + 10 * 1000);
+	m_freem(m);
+
+	npf_rproc_release(rp);
+	error = npf_ext_ratelimit_fini(npf);
+	CHECK_TRUE(error == 0);
+	return true;
+}
+
+static unsigned
+npf_ratelimit_run(npf_rproc_t *rp, unsigned sport, unsigned npkts)
+{
+	const npf_match_info_t mi = { .mi_rid = 1, .mi_di = PFIL_OUT };
+	unsigned passed = 0;
+
+	for (unsigned i = 0; i < npkts; i++) {
+		struct mbuf *m = mbuf_get_pkt(AF_INET, IPPROTO_UDP,
+		    LOCAL_IP1, REMOTE_IP1, sport, 7000);
+		npf_cache_t *npc = get_cached_pkt(m, NULL);
+		int decision = NPF_DECISION_PASS;
+
+		npf_rproc_run(npc, rp, &mi, &decision);
+		passed += (decision == NPF_DECISION_PASS);
+		put_cached_pkt(npc);
+	}
+	return passed;
+}
+
+static bool
+npf_ratelimit_keyed_test(npf_t *npf, bool verbose)
+{
+	const unsigned nflows = 64;
+	nvlist_t *params;
+	npf_rproc_t *rp;
+	unsigned passed;
+	int error;
+
+	error = npf_ext_ratelimit_init(npf);
+	CHECK_TRUE(error == 0);
+
+	/* Invalid key type. */
+	params = nvlist_create(0);
+	nvlist_add_string(params, "name", "ratelimit-test");
+	nvlist_add_string(params, "key", "none");
+	rp = npf_rproc_create(params);
+	CHECK_TRUE(rp != NULL);
+	error = npf_ext_construct(npf, "ratelimit", rp, params);
+	CHECK_TRUE(error == EINVAL);
+	npf_rproc_release(rp);
+	nvlist_destroy(params);
+
+	/*
+	 * Each flow: 1000 packets per second with the burst of ten
+	 * packets and no extended burst (it cannot be zero, though).
+	 */
+	params = nvlist_create(0);
+	nvlist_add_string(params, "name", "ratelimit-test");
+	nvlist_add_number(params, "packet-rate", 1000);
+	nvlist_add_number(params, "normal-burst", 10);
+	nvlist_add_number(params, "extended-burst", 1);
+	nvlist_add_string(params, "key", "flow");
+	nvlist_add_number(params, "buckets", nflows * 4);
+	rp = npf_rproc_create(params);
+	CHECK_TRUE(rp != NULL);
+	error = npf_ext_construct(npf, "ratelimit", rp, params);
+	CHECK_TRUE(error == 0);
+	nvlist_destroy(params);
+
+	/*
+	 * Every flow gets its own burst.  Allow a few milliseconds of
+	 * refill, i.e. a packet per millisecond.
+	 */
+	for (unsigned i = 0; i < nflows; i++) {
+		passed = npf_ratelimit_run(rp, 1024 + i, 20);
+		if (verbose) {
+			printf("ratelimit: flow %u: %u of 20 passed\n",
+			    i, passed);
+		}
+		CHECK_TRUE(passed >= 10 && passed <= 15);
+	}
+
+	npf_rproc_release(rp);
+	error = npf_ext_ratelimit_fini(npf);
+	CHECK_TRUE(error == 0);
+	return true;
+}
+
+static bool
+npf_pktlog_test(npf_t *npf, bool verbose)
+{
+	const npf_match_info_t mi = { .mi_rid = 7, .mi_di = PFIL_OUT };
+	ifnet_t *ifp = npf_test_getif(IFNAME_DUMMY);
+	int decision = NPF_DECISION_PASS;
+	npf_pktlog_t *recs;
+	nvlist_t *params;
+	npf_rproc_t *rp;
+	npf_cache_t npc;
+	struct mbuf *m;
+	nbuf_t nbuf;
+	int error;
+
+	error = npf_ext_pktlog_init(npf);
+	CHECK_TRUE(error == 0);
+
+	/* The repeated initialization fails, retaining the ring in use. */
+	error = npf_ext_pktlog_init(npf);
+	CHECK_TRUE(error == EEXIST);
+
+	params = nvlist_create(0);
+	nvlist_add_string(params, "name", "pktlog-test");
+	nvlist_add_number(params, "snaplen", 20);
+	rp = npf_rproc_create(params);
+	CHECK_TRUE(rp != NULL);
+	error = npf_ext_construct(npf, "pktlog", rp, params);
+	CHECK_TRUE(error == 0);
+	nvlist_destroy(params);
+
+	m = mbuf_get_pkt(AF_INET, IPPROTO_UDP,
+	    LOCAL_IP1, REMOTE_IP1, 5000, 7000);
+	nbuf_init(npf, &nbuf, m, ifp);
+	memset(&npc, 0, sizeof(npf_cache_t));
+	npc.npc_ctx = npf;
+	npc.npc_nbuf = &nbuf;
+	CHECK_TRUE(npf_cache_all(&npc) & NPC_IP4);
+
+	CHECK_TRUE(npf_rproc_run(&npc, rp, &mi, &decision));
+	CHECK_TRUE(decision == NPF_DECISION_PASS);
+
+	/* Only the IPv4 header is captured. */
+	recs = kmem_zalloc(sizeof(npf_pktlog_t) * 2, KM_SLEEP);
+	CHECK_TRUE(npf_ext_pktlog_drain(npf, recs, 2) == 1);
+	if (verbose) {
+		printf("pktlog: rule %" PRIu64 ", %u/%u bytes on %s\n",
+		    recs[0].pl_rid, recs[0].pl_caplen, recs[0].pl_len,
+		    recs[0].pl_ifname);
+	}
+	CHECK_TRUE(recs[0].pl_rid == 7);
+	CHECK_TRUE(recs[0].pl_af == AF_INET);
+	CHECK_TRUE(recs[0].pl_action == 0);
+	CHECK_TRUE(recs[0].pl_dir == PFIL_OUT);
+	CHECK_TRUE(recs[0].pl_len == nbuf_datalen(&nbuf));
+	CHECK_TRUE(recs[0].pl_caplen == 20);
+	CHECK_TRUE(recs[0].pl_ifname[0] != '\0');
+	CHECK_TRUE(memcmp(recs[0].pl_data, nbuf_dataptr(&nbuf), 20) == 0);
+	CHECK_TRUE(npf_ext_pktlog_drain(npf, recs, 2) == 0);
+	kmem_free(recs, sizeof(npf_pktlog_t) * 2);
+	m_freem(m);
+
+	npf_rproc_release(rp);
+	error = npf_ext_pktlog_fini(npf);
+	CHECK_TRUE(error == 0);
+	return true;
+}
+
+static bool
+npf_logcap_test(npf_t *npf, bool verbose)
+{
+	uint64_t *stats = kmem_zalloc(NPF_STATS_SIZE, KM_SLEEP);
+	uint64_t unsampled, capped;
+	unsigned nflows = 256, logged = 0, sampled;
+	npf_logcap_t lc;
+	nvlist_t *params;
+	bool pass;
+
+	npfk_stats(npf, stats);
+	unsampled = stats[NPF_STAT_LOG_UNSAMPLED];
+	capped = stats[NPF_STAT_LOG_CAPPED];
+
+	/* Sampling: the decision is per flow, for about 1-in-4 flows. */
+	params = nvlist_create(0);
+	nvlist_add_number(params, "sample", 4);
+	npf_logcap_init(&lc, params);
+	nvlist_destroy(params);
+
+	for (unsigned i = 0; i < nflows; i++) {
+		struct mbuf *m = mbuf_get_pkt(AF_INET, IPPROTO_UDP,
+		    LOCAL_IP1, REMOTE_IP1, 1024 + i, 7000);
+		npf_cache_t *npc = get_cached_pkt(m, NULL);
+
+		pass = npf_logcap_pass(npc, &lc);
+		CHECK_TRUE(npf_logcap_pass(npc, &lc) == pass);
+		logged += pass;
+		put_cached_pkt(npc);
+	}
+	if (verbose) {
+		printf("logcap: %u of %u flows sampled\n", logged, nflows);
+	}
+	CHECK_TRUE(logged > nflows / 8 && logged < nflows / 2);
+	sampled = logged;
+
+	/* Rate cap: the burst is the rate, i.e. five records. */
+	params = nvlist_create(0);
+	nvlist_add_number(params, "limit", 5);
+	npf_logcap_init(&lc, params);
+	nvlist_destroy(params);
+
+	logged = 0;
+	for (unsigned i = 0; i < 10; i++) {
+		struct mbuf *m = mbuf_get_pkt(AF_INET, IPPROTO_UDP,
+		    LOCAL_IP1, REMOTE_IP1, 1024, 7000);
+		npf_cache_t *npc = get_cached_pkt(m, NULL);
+
+		logged += npf_logcap_pass(npc, &lc);
+		put_cached_pkt(npc);
+	}
+	CHECK_TRUE(logged == 5);
+
+	npfk_stats(npf, stats);
+	CHECK_TRUE(stats[NPF_STAT_LOG_UNSAMPLED] - unsampled ==
+	    2 * (nflows - sampled));
+	CHECK_TRUE(stats[NPF_STAT_LOG_CAPPED] - capped == 5);
+	kmem_free(stats, NPF_STATS_SIZE);
 	return true;
 }
 
@@ -31,7 +290,16 @@ npf_ext_test(bool verbose)
 	npf_t *npf = npf_getkernctx();
 	bool ok;
 
-	ok = npf_ratelimit_test(npf);
+	ok = npf_ratelimit_test(npf, verbose);
+	CHECK_TRUE(ok);
+
+	ok = npf_ratelimit_keyed_test(npf, verbose);
+	CHECK_TRUE(ok);
+
+	ok = npf_pktlog_test(npf, verbose);
+	CHECK_TRUE(ok);
+
+	ok = npf_logcap_test(npf, verbose);
 	CHECK_TRUE(ok);
 
 	(void)verbose;
@@ -45,10 +45,26 @@ get_packet(unsigned i)
 	return m;
 }
 
+/*
+ * get_host_packet: same as get_packet(), but the source address is
+ * incremented in the host byte-order, i.e. 10.0.0.1, 10.0.0.2, etc.
+ */
+static struct mbuf *
+get_host_packet(unsigned i)
+{
+	struct mbuf *m;
+	struct ip *ip;
+
+	m = mbuf_get_pkt(AF_INET, IPPROTO_UDP,
+	    "10.0.0.1", "172.16.0.1", 9000, 9000);
+	(void)mbuf_return_hdrs(m, false, &ip);
+	ip->ip_src.s_addr = htonl(ntohl(ip->ip_src.s_addr) + i);
+	return m;
+}
+
 static bool
-enqueue_connection(unsigned i, bool expire)
+enqueue_packet(struct mbuf *m, bool expire)
 {
-	struct mbuf *m = get_packet(i);
 	npf_cache_t *npc = get_cached_pkt(m, NULL);
 	npf_conn_t *con;
 
@@ -62,6 +78,12 @@ enqueue_connection(unsigned i, bool expire)
 	return true;
 }
 
+static bool
+enqueue_connection(unsigned i, bool expire)
+{
+	return enqueue_packet(get_packet(i), expire);
+}
+
 static bool
 run_conn_gc(unsigned active, unsigned expired, unsigned expected)
 {
@@ -154,6 +176,456 @@ run_gc_tests(void)
 	return true;
 }
 
+static bool
+run_limit_tests(npf_t *npf)
+{
+	npf_conndb_t *cd = npf_conndb_create();
+	npf_cache_t *npc;
+	unsigned n;
+
+	npf->conn_db = cd;
+
+	/*
+	 * Allow two more connections than there are now.
+	 */
+	npfk_param_set(npf, "conn.max", npf->conn_count + 2);
+	CHECK_TRUE(enqueue_connection(0, false));
+	CHECK_TRUE(enqueue_connection(1, false));
+
+	npc = get_cached_pkt(get_packet(2), NULL);
+	CHECK_TRUE(npf_conn_establish(npc, PFIL_IN, true) == NULL);
+	put_cached_pkt(npc);
+
+	/*
+	 * At the limit, G/C drops the embryonic (no reply seen) ones.
+	 */
+	npf_conndb_gc(npf, cd, false, false);
+	n = count_conns(cd);
+	CHECK_TRUE(n == 0);
+
+	npfk_param_set(npf, "conn.max", 0);
+	npf_conndb_gc(npf, cd, true, false);
+	npf_conndb_destroy(cd);
+	npf->conn_db = NULL;
+	return true;
+}
+
+static bool
+srclimit_enter(npf_match_info_t *mi, unsigned i, int expected, bool conn)
+{
+	npf_t *npf = npf_getkernctx();
+	struct mbuf *m;
+	npf_cache_t *npc;
+	npf_srcent_t *src;
+	npf_conn_t *con;
+	int error;
+
+	m = mbuf_get_pkt(AF_INET, IPPROTO_UDP,
+	    "10.0.0.1", "172.16.0.1", 9000 + i, 9000);
+	npc = get_cached_pkt(m, NULL);
+	error = npf_srctrack_enter(npc, mi, &src);
+	CHECK_TRUE(error == expected);
+
+	if (error == 0 && conn) {
+		con = npf_conn_establish(npc, PFIL_IN, true);
+		CHECK_TRUE(con != NULL);
+		npf_conn_setsrc(con, src);
+		npf_srctrack_charge(src);
+		npf_conn_release(con);
+	} else if (error == 0) {
+		npf_srctrack_exit(npf, src);
+	}
+	put_cached_pkt(npc);
+	return true;
+}
+
+static bool
+run_srclimit_tests(npf_t *npf)
+{
+	const unsigned alen = sizeof(struct in_addr);
+	npf_conndb_t *cd = npf_conndb_create();
+	npf_srclimit_t *sl;
+	npf_match_info_t mi;
+	npf_addr_t addr;
+
+	npf->conn_db = cd;
+	npf_inet_pton(AF_INET, "10.0.0.1", &addr);
+
+	memset(&mi, 0, sizeof(npf_match_info_t));
+	mi.mi_rid = 1;
+	sl = &mi.mi_srclimit;
+	sl->sl_tid = NPF_SRCLIMIT_NOTABLE;
+
+	/*
+	 * Allow two connections from the source.
+	 */
+	sl->sl_maxconn = 2;
+	CHECK_TRUE(srclimit_enter(&mi, 0, 0, true));
+	CHECK_TRUE(srclimit_enter(&mi, 1, 0, true));
+	CHECK_TRUE(srclimit_enter(&mi, 2, ENOSPC, true));
+	CHECK_TRUE(npf_srctrack_getconns(npf, 1, alen, &addr) == 2);
+
+	/* Other rules account separately. */
+	mi.mi_rid = 2;
+	CHECK_TRUE(srclimit_enter(&mi, 2, 0, false));
+	mi.mi_rid = 1;
+
+	/*
+	 * The destroyed connections release the source.
+	 */
+	npf_conndb_gc(npf, cd, true, false);
+	CHECK_TRUE(npf_srctrack_getconns(npf, 1, alen, &addr) == 0);
+	CHECK_TRUE(srclimit_enter(&mi, 2, 0, false));
+
+	/*
+	 * Allow two new connections per minute.  Only the established
+	 * connections are charged.
+	 */
+	sl->sl_maxconn = 0;
+	sl->sl_rate = 2;
+	sl->sl_rate_secs = 60;
+	CHECK_TRUE(srclimit_enter(&mi, 0, 0, false));
+	CHECK_TRUE(srclimit_enter(&mi, 1, 0, true));
+	CHECK_TRUE(srclimit_enter(&mi, 2, 0, true));
+	CHECK_TRUE(srclimit_enter(&mi, 3, EAGAIN, true));
+	npf_conndb_gc(npf, cd, true, false);
+
+	/*
+	 * Limit the number of sources: the rule 3 takes the last one.
+	 */
+	npf_srctrack_gc(npf, true);
+	CHECK_TRUE(npfk_param_set(npf, "srctrack.max", 2) == 0);
+	mi.mi_rid = 2;
+	CHECK_TRUE(srclimit_enter(&mi, 0, 0, false));
+	mi.mi_rid = 3;
+	CHECK_TRUE(srclimit_enter(&mi, 0, 0, false));
+	mi.mi_rid = 4;
+	CHECK_TRUE(srclimit_enter(&mi, 0, ENOBUFS, false));
+
+	/* The G/C frees the entries without connections. */
+	npf_srctrack_gc(npf, true);
+	CHECK_TRUE(srclimit_enter(&mi, 0, 0, false));
+	CHECK_TRUE(npfk_param_set(npf, "srctrack.max", 65536) == 0);
+
+	npf_srctrack_gc(npf, true);
+	npf_conndb_destroy(cd);
+	npf->conn_db = NULL;
+	return true;
+}
+
+static bool
+run_snapshot_tests(npf_t *npf)
+{
+	npf_conndb_t *cd = npf_conndb_create();
+	npf_connrec_t recs[4];
+	npf_conndb_iter_t it;
+	npf_state_t nst;
+	npf_cache_t *npc;
+	npf_conn_t *con;
+	npf_flow_t flow;
+	size_t n;
+
+	npf->conn_db = cd;
+
+	/*
+	 * The list is in the reverse order: the expired connection
+	 * is the last one.
+	 */
+	CHECK_TRUE(enqueue_connection(0, true));
+	CHECK_TRUE(enqueue_connection(1, false));
+	CHECK_TRUE(enqueue_connection(2, false));
+	CHECK_TRUE(enqueue_connection(3, false));
+
+	/*
+	 * Take the snapshot in batches, with the G/C of the next
+	 * connection in-between.  The expired one is not included.
+	 */
+	npf_conn_iter_init(npf, &it);
+	n = npf_conndb_snapshot(npf, &it, recs, 3);
+	CHECK_TRUE(n == 3);
+	npf_conndb_gc(npf, cd, false, false);
+	CHECK_TRUE(count_conns(cd) == 3);
+	CHECK_TRUE(npf_conndb_snapshot(npf, &it, &recs[n], 1) == 0);
+	npf_conn_iter_fini(npf, &it);
+
+	/*
+	 * Flush and restore.  The duplicates are not restored.
+	 */
+	npf_conndb_gc(npf, cd, true, false);
+	CHECK_TRUE(count_conns(cd) == 0);
+	CHECK_TRUE(npf_conndb_restore(npf, recs, n) == 3);
+	CHECK_TRUE(npf_conndb_restore(npf, recs, n) == 0);
+
+	npc = get_cached_pkt(get_packet(2), NULL);
+	con = npf_conn_lookup(npc, PFIL_IN, &flow);
+	CHECK_TRUE(con != NULL && flow == NPF_FLOW_FORW);
+	npf_conn_release(con);
+	put_cached_pkt(npc);
+
+	npc = get_cached_pkt(get_packet(0), NULL);
+	CHECK_TRUE(npf_conn_lookup(npc, PFIL_IN, &flow) == NULL);
+	put_cached_pkt(npc);
+
+	/*
+	 * The records with an invalid state are not restored: the state
+	 * out of range and the SYN proxy flag for UDP.
+	 */
+	npf_conndb_gc(npf, cd, true, false);
+	memcpy(&nst, recs[0].cr_state, sizeof(npf_state_t));
+	nst.nst_state = UINT_MAX;
+	memcpy(recs[0].cr_state, &nst, sizeof(npf_state_t));
+	memcpy(&nst, recs[1].cr_state, sizeof(npf_state_t));
+	nst.nst_flags |= NPF_STATE_SYNPROXY;
+	memcpy(recs[1].cr_state, &nst, sizeof(npf_state_t));
+	CHECK_TRUE(npf_conndb_restore(npf, recs, n) == 1);
+
+	npf_conndb_gc(npf, cd, true, false);
+	npf_conndb_destroy(cd);
+	npf->conn_db = NULL;
+	return true;
+}
+
+static bool
+lookup_connection(unsigned i, bool expire)
+{
+	npf_cache_t *npc = get_cached_pkt(get_packet(i), NULL);
+	npf_conn_t *con;
+	npf_flow_t flow;
+
+	con = npf_conn_lookup(npc, PFIL_IN, &flow);
+	put_cached_pkt(npc);
+	if (con == NULL) {
+		return false;
+	}
+	if (expire) {
+		npf_conn_expire(con);
+	}
+	npf_conn_release(con);
+	return flow == NPF_FLOW_FORW;
+}
+
+static bool
+run_sync_tests(npf_t *npf)
+{
+	npf_conndb_t *cd = npf_conndb_create();
+	npf_conndb_t *standby_cd = npf_conndb_create();
+	const bool own = npf->sync == NULL;
+	npf_syncrec_t recs[4], late;
+	npf_cache_t *npc;
+	npf_conn_t *con;
+	npf_flow_t flow;
+	int interval;
+
+	if (own) {
+		npf_sync_init(npf);
+	}
+	while (npf_sync_drain(npf, recs, __arraycount(recs)) != 0) {
+		continue;
+	}
+	npf->conn_db = cd;
+
+	/*
+	 * Create the connection and replicate it to the standby.
+	 */
+	npc = get_cached_pkt(get_packet(0), NULL);
+	con = npf_conn_establish(npc, PFIL_IN, true);
+	CHECK_TRUE(con != NULL);
+	npf_sync_conn(npf, NPF_SYNC_CREATE, con);
+	npf_sync_conn(npf, NPF_SYNC_STATE, con);
+	npf_conn_release(con);
+	put_cached_pkt(npc);
+
+	CHECK_TRUE(npf_sync_drain(npf, recs, __arraycount(recs)) == 2);
+	CHECK_TRUE(recs[0].sr_type == NPF_SYNC_CREATE);
+	CHECK_TRUE(recs[1].sr_type == NPF_SYNC_STATE);
+	CHECK_TRUE(recs[0].sr_id != 0 && recs[0].sr_id == recs[1].sr_id);
+	CHECK_TRUE(recs[0].sr_gen == 1 && recs[1].sr_gen == 2);
+	memcpy(&late, &recs[0], sizeof(npf_syncrec_t));
+
+	npf->conn_db = standby_cd;
+	CHECK_TRUE(npf_sync_apply(npf, &recs[0], 1) == 1);
+	CHECK_TRUE(lookup_connection(0, false));
+
+	/* The state update is applied in place. */
+	CHECK_TRUE(npf_sync_apply(npf, &recs[1], 1) == 1);
+	CHECK_TRUE(count_conns(standby_cd) == 1);
+
+	/* The reordered (older) record is discarded. */
+	CHECK_TRUE(npf_sync_apply(npf, &late, 1) == 0);
+	CHECK_TRUE(count_conns(standby_cd) == 1);
+
+	/*
+	 * The active connection is refreshed at most once per interval
+	 * (the zero interval forces it); the refresh is applied in place.
+	 */
+	npf->conn_db = cd;
+	npc = get_cached_pkt(get_packet(0), NULL);
+	con = npf_conn_lookup(npc, PFIL_IN, &flow);
+	CHECK_TRUE(con != NULL);
+	npf_sync_refresh(npf, con);
+	interval = npf->sync_refresh;
+	npf->sync_refresh = 0;
+	npf_sync_refresh(npf, con);
+	npf->sync_refresh = interval;
+	npf_conn_release(con);
+	put_cached_pkt(npc);
+
+	CHECK_TRUE(npf_sync_drain(npf, recs, __arraycount(recs)) == 1);
+	CHECK_TRUE(recs[0].sr_type == NPF_SYNC_REFRESH);
+	CHECK_TRUE(recs[0].sr_id == late.sr_id && recs[0].sr_gen == 3);
+
+	npf->conn_db = standby_cd;
+	CHECK_TRUE(npf_sync_apply(npf, recs, 1) == 1);
+	CHECK_TRUE(count_conns(standby_cd) == 1);
+
+	/*
+	 * The expiration of the replicated connection on the standby
+	 * is not recorded: otherwise, it would remove the connection
+	 * of the origin in the two-way replication.
+	 */
+	CHECK_TRUE(lookup_connection(0, true));
+	npf_conndb_gc(npf, standby_cd, false, false);
+	CHECK_TRUE(npf_sync_drain(npf, recs, __arraycount(recs)) == 0);
+	CHECK_TRUE(!lookup_connection(0, false));
+
+	/*
+	 * Expire on the master: the G/C produces the record, which
+	 * would remove the connection on the standby.
+	 */
+	npf->conn_db = cd;
+	CHECK_TRUE(lookup_connection(0, true));
+	npf_conndb_gc(npf, cd, false, false);
+	CHECK_TRUE(npf_sync_drain(npf, recs, __arraycount(recs)) == 1);
+	CHECK_TRUE(recs[0].sr_type == NPF_SYNC_EXPIRE);
+	CHECK_TRUE(recs[0].sr_id == late.sr_id && recs[0].sr_gen == 4);
+
+	npf->conn_db = standby_cd;
+	CHECK_TRUE(npf_sync_apply(npf, recs, 1) == 1);
+	CHECK_TRUE(!lookup_connection(0, false));
+
+	/* The late record does not resurrect the connection. */
+	CHECK_TRUE(npf_sync_apply(npf, &late, 1) == 0);
+	CHECK_TRUE(!lookup_connection(0, false));
+
+	/* The removal on the standby is not replicated back. */
+	npf_conndb_gc(npf, standby_cd, true, false);
+	CHECK_TRUE(npf_sync_drain(npf, recs, __arraycount(recs)) == 0);
+
+	npf_conndb_destroy(standby_cd);
+	npf_conndb_gc(npf, cd, true, false);
+	npf_conndb_destroy(cd);
+	npf->conn_db = NULL;
+
+	if (own) {
+		npf_sync_fini(npf);
+	}
+	return true;
+}
+
+/*
+ * list_connections: list a batch of the connections matching the filter
+ * and return the number of the listed connections and the cursor.
+ */
+static int
+list_connections(npf_t *npf, nvlist_t *filter, uint64_t count,
+    uint64_t *cursor, size_t *nitems)
+{
+	nvlist_t *req = nvlist_create(0);
+	nvlist_t *resp = nvlist_create(0);
+	int error;
+
+	if (filter) {
+		nvlist_add_nvlist(req, "filter", filter);
+	}
+	nvlist_add_number(req, "count", count);
+	nvlist_add_number(req, "cursor", *cursor);
+
+	*nitems = 0;
+	error = npf_conndb_list(npf, req, resp);
+	if (error == 0) {
+		if (nvlist_exists_nvlist_array(resp, "conn-list")) {
+			(void)nvlist_get_nvlist_array(resp, "conn-list",
+			    nitems);
+		}
+		*cursor = dnvlist_get_number(resp, "cursor", 0);
+	}
+	nvlist_destroy(resp);
+	nvlist_destroy(req);
+	return error;
+}
+
+static bool
+run_list_tests(npf_t *npf)
+{
+	npf_conndb_t *cd = npf_conndb_create();
+	uint64_t cursor = 0, stale;
+	nvlist_t *filter;
+	npf_addr_t addr;
+	size_t n;
+
+	npf->conn_db = cd;
+	for (unsigned i = 0; i < 4; i++) {
+		CHECK_TRUE(enqueue_packet(get_host_packet(i), false));
+	}
+
+	/*
+	 * List in batches, with the G/C in-between.
+	 */
+	CHECK_TRUE(list_connections(npf, NULL, 3, &cursor, &n) == 0);
+	CHECK_TRUE(n == 3 && cursor != 0);
+	npf_conndb_gc(npf, cd, false, false);
+	stale = cursor;
+	CHECK_TRUE(list_connections(npf, NULL, 3, &cursor, &n) == 0);
+	CHECK_TRUE(n == 1 && cursor == 0);
+
+	/* The cursor is destroyed at the end of the listing. */
+	CHECK_TRUE(list_connections(npf, NULL, 3, &stale, &n) == ESTALE);
+
+	/*
+	 * Filter by the network: 10.0.0.1 - 10.0.0.3 out of 10.0.0.1 -
+	 * 10.0.0.4.
+	 */
+	filter = nvlist_create(0);
+	npf_inet_pton(AF_INET, "10.0.0.0", &addr);
+	nvlist_add_binary(filter, "addr", &addr, sizeof(struct in_addr));
+	nvlist_add_number(filter, "mask", 30);
+	CHECK_TRUE(list_connections(npf, filter, 100, &cursor, &n) == 0);
+	CHECK_TRUE(n == 3 && cursor == 0);
+
+	/* Filter by the port and the protocol. */
+	nvlist_add_number(filter, "port", 9000);
+	nvlist_add_number(filter, "proto", IPPROTO_UDP);
+	CHECK_TRUE(list_connections(npf, filter, 100, &cursor, &n) == 0);
+	CHECK_TRUE(n == 3 && cursor == 0);
+	nvlist_destroy(filter);
+
+	filter = nvlist_create(0);
+	nvlist_add_number(filter, "proto", IPPROTO_TCP);
+	CHECK_TRUE(list_connections(npf, filter, 100, &cursor, &n) == 0);
+	CHECK_TRUE(n == 0 && cursor == 0);
+	nvlist_destroy(filter);
+
+	/* No connections through an unknown interface. */
+	filter = nvlist_create(0);
+	nvlist_add_string(filter, "ifname", "npftest_none");
+	CHECK_TRUE(list_connections(npf, filter, 100, &cursor, &n) == 0);
+	CHECK_TRUE(n == 0 && cursor == 0);
+	nvlist_destroy(filter);
+
+	/*
+	 * The flush ends the listing in progress.
+	 */
+	CHECK_TRUE(list_connections(npf, NULL, 1, &cursor, &n) == 0);
+	CHECK_TRUE(n == 1 && cursor != 0);
+	npf_conndb_gc(npf, cd, true, false);
+	CHECK_TRUE(list_connections(npf, NULL, 1, &cursor, &n) == 0);
+	CHECK_TRUE(n == 0 && cursor == 0);
+
+	npf_conndb_destroy(cd);
+	npf->conn_db = NULL;
+	return true;
+}
+
 static bool
 run_conndb_tests(npf_t *npf)
 {
@@ -165,6 +637,21 @@ run_conndb_tests(npf_t *npf)
 	npf_config_exit(npf);
 
 	ok = run_gc_tests();
+	if (ok) {
+		ok = run_limit_tests(npf);
+	}
+	if (ok) {
+		ok = run_srclimit_tests(npf);
+	}
+	if (ok) {
+		ok = run_snapshot_tests(npf);
+	}
+	if (ok) {
+		ok = run_sync_tests(npf);
+	}
+	if (ok) {
+		ok = run_list_tests(npf);
+	}
 
 	/* We *MUST* restore the valid conndb. */
 	npf->conn_db = orig_cd;
@@ -107,6 +107,91 @@ npfkern_m_ensure_contig(struct mbuf **m0, size_t len)
 	return true;
 }
 
+#if defined(_NPF_STANDALONE)
+/*
+ * Allocate a packet of the given length, e.g. for TCP RST.
+ */
+static struct mbuf *
+npfkern_m_alloc(npf_t *npf, unsigned flags, size_t len)
+{
+	struct mbuf *m;
+
+	if (len > MLEN) {
+		return NULL;
+	}
+	if ((m = npfkern_m_get(npf, flags | M_PKTHDR, MLEN)) != NULL) {
+		m->m_pkthdr.len = m->m_len = len;
+	}
+	return m;
+}
+
+/*
+ * Checksum offload: the checksums which the tests let the "hardware"
+ * compute; the requested ones are recorded in the packet header.
+ */
+unsigned npftest_cksum_offload = 0;
+
+static unsigned
+npfkern_m_get_cksum_offload(npf_t *npf __unused,
+    const struct mbuf *m __unused)
+{
+	return npftest_cksum_offload;
+}
+
+static void
+npfkern_m_set_cksum_offload(npf_t *npf __unused, struct mbuf *m,
+    unsigned flags)
+{
+	m->m_pkthdr.csum_flags |= flags;
+}
+
+/*
+ * Trimming and concatenation, used by the reassembly.
+ */
+static bool
+npfkern_m_adj(struct mbuf *m, int len)
+{
+	struct mbuf *mt = m;
+
+	if (len >= 0) {
+		if ((unsigned)len > m->m_len) {
+			return false;
+		}
+		m->m_data = (char *)m->m_data + len;
+		m->m_len -= len;
+	} else {
+		while (mt->m_next) {
+			mt = mt->m_next;
+		}
+		if ((unsigned)-len > mt->m_len) {
+			return false;
+		}
+		mt->m_len += len;
+	}
+	if (m->m_flags & M_PKTHDR) {
+		m->m_pkthdr.len -= len >= 0 ? len : -len;
+	}
+	return true;
+}
+
+static bool
+npfkern_m_cat(struct mbuf *m, struct mbuf *n)
+{
+	const unsigned len = npfkern_m_length(n);
+	struct mbuf *mt = m;
+
+	while (mt->m_next) {
+		mt = mt->m_next;
+	}
+	n->m_flags &= ~M_PKTHDR;
+	mt->m_next = n;
+
+	if (m->m_flags & M_PKTHDR) {
+		m->m_pkthdr.len += len;
+	}
+	return true;
+}
+#endif
 
 struct mbuf *
 mbuf_getwithdata(const void *data, size_t len)
@@ -332,7 +417,11 @@ put_cached_pkt(npf_cache_t *npc)
 }
 
 const npf_mbufops_t npftest_mbufops = {
+#if defined(_NPF_STANDALONE)
+	.alloc			= npfkern_m_alloc,
+#else
 	.alloc			= npfkern_m_get,
+#endif
 	.free			= npfkern_m_freem,
 	.getdata		= npfkern_m_getdata,
 	.getnext		= npfkern_m_next,
@@ -340,4 +429,10 @@ const npf_mbufops_t npftest_mbufops = {
 	.getchainlen		= npfkern_m_length,
 	.ensure_contig		= npfkern_m_ensure_contig,
 	.ensure_writable	= NULL,
+#if defined(_NPF_STANDALONE)
+	.get_cksum_offload	= npfkern_m_get_cksum_offload,
+	.set_cksum_offload	= npfkern_m_set_cksum_offload,
+	.adj			= npfkern_m_adj,
+	.cat			= npfkern_m_cat,
+#endif
 };
@@ -8,7 +8,15 @@
 #include <sys/types.h>
 #endif
 
+#ifdef _NPF_STANDALONE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
 #include "npf_impl.h"
+#include "npf_conn.h"
 #include "npf_test.h"
 
 #define	RESULT_PASS	0
@@ -215,6 +223,540 @@ checkresult(bool verbose, unsigned i, struct mbuf *m, ifnet_t *ifp, int error)
 	return true;
 }
 
+/*
+ * Deterministic NAT:
+ *	map $ext_if dynamic algo deterministic $det_net -> $det_pub
+ *
+ * There are 256 subscribers per translation address, with 252 ports each.
+ */
+#define	DET_LOCAL_IP	"100.64.1.5"
+#define	DET_PUB_IP	"198.51.100.1"
+#define	DET_MIN_PORT	(1024 + 5 * 252)
+#define	DET_MAX_PORT	(DET_MIN_PORT + 252 - 1)
+
+static bool
+handle_nat_pkt(npf_t *npf, ifnet_t *ifp, int di, const char *src,
+    in_port_t sport, const char *dst, in_port_t dport, npf_addr_t *addrs,
+    in_port_t *ports)
+{
+	struct mbuf *m;
+	npf_cache_t npc;
+	nbuf_t nbuf;
+	int error;
+
+	m = mbuf_get_pkt(AF_INET, IPPROTO_UDP, src, dst, sport, dport);
+	error = npfk_packet_handler(npf, &m, ifp, di);
+	CHECK_TRUE(error == 0);
+
+	nbuf_init(npf, &nbuf, m, ifp);
+	memset(&npc, 0, sizeof(npf_cache_t));
+	npc.npc_ctx = npf;
+	npc.npc_nbuf = &nbuf;
+	CHECK_TRUE(npf_cache_all(&npc));
+
+	memcpy(&addrs[NPF_SRC], npc.npc_ips[NPF_SRC], sizeof(struct in_addr));
+	memcpy(&addrs[NPF_DST], npc.npc_ips[NPF_DST], sizeof(struct in_addr));
+	ports[NPF_SRC] = ntohs(npc.npc_l4.udp->uh_sport);
+	ports[NPF_DST] = ntohs(npc.npc_l4.udp->uh_dport);
+	m_freem(m);
+	return true;
+}
+
+static bool
+test_nat_pkt(ifnet_t *ifp, int di, const char *src, in_port_t sport,
+    const char *dst, in_port_t dport, npf_addr_t *addrs, in_port_t *ports)
+{
+	return handle_nat_pkt(npf_getkernctx(), ifp, di, src, sport,
+	    dst, dport, addrs, ports);
+}
+
+static bool
+test_det_nat(bool verbose)
+{
+	ifnet_t *ifp = npf_test_getif(IFNAME_EXT);
+	npf_t *npf = npf_getkernctx();
+	npf_addr_t addrs[2];
+	in_port_t ports[2], tport;
+	npf_event_t ev[4];
+	char tbuf[64];
+	bool ok;
+
+	/* Outbound: the fixed translation address and the port range. */
+	npf->evlog = npf_logring_create(4, sizeof(npf_event_t));
+	ok = test_nat_pkt(ifp, PFIL_OUT, DET_LOCAL_IP, 15000,
+	    REMOTE_IP1, 7000, addrs, ports);
+	CHECK_TRUE(ok);
+
+	/* Only the connection is recorded, not the NAT entry. */
+	CHECK_TRUE(npfk_evlog_drain(npf, ev, __arraycount(ev)) == 1);
+	CHECK_TRUE(ev[0].ev_type == NPF_EVENT_CONN_CREATE);
+	npf_logring_destroy(npf->evlog);
+	npf->evlog = NULL;
+	tport = ports[NPF_SRC];
+	if (verbose) {
+		npf_inet_ntop(AF_INET, &addrs[NPF_SRC], tbuf, sizeof(tbuf));
+		printf("deterministic NAT: src %s (%d)\n", tbuf, tport);
+	}
+	CHECK_TRUE(match_addr(AF_INET, DET_PUB_IP, &addrs[NPF_SRC]));
+	CHECK_TRUE(tport >= DET_MIN_PORT && tport <= DET_MAX_PORT);
+
+	/* Inbound: the reply is translated back. */
+	npf_inet_ntop(AF_INET, &addrs[NPF_SRC], tbuf, sizeof(tbuf));
+	ok = test_nat_pkt(ifp, PFIL_IN, REMOTE_IP1, 7000,
+	    tbuf, tport, addrs, ports);
+	CHECK_TRUE(ok);
+	CHECK_TRUE(match_addr(AF_INET, DET_LOCAL_IP, &addrs[NPF_DST]));
+	CHECK_TRUE(ports[NPF_DST] == 15000);
+	return true;
+}
+
+/*
+ * Endpoint-independent mapping:
+ *	map $ext_if dynamic endpoint-independent $eim_net -> $pub_ip4
+ */
+#define	EIM_LOCAL_IP	"10.2.2.1"
+#define	EIM_PUB_IP	"192.0.2.4"
+
+static bool
+test_eim_nat(bool verbose)
+{
+	ifnet_t *ifp = npf_test_getif(IFNAME_EXT);
+	npf_addr_t addrs[2];
+	in_port_t ports[2], tport;
+	bool ok;
+
+	/* The first connection takes a port. */
+	ok = test_nat_pkt(ifp, PFIL_OUT, EIM_LOCAL_IP, 5000,
+	    REMOTE_IP1, 7000, addrs, ports);
+	CHECK_TRUE(ok);
+	CHECK_TRUE(match_addr(AF_INET, EIM_PUB_IP, &addrs[NPF_SRC]));
+	tport = ports[NPF_SRC];
+	if (verbose) {
+		printf("endpoint-independent NAT: port %d\n", tport);
+	}
+
+	/* The connections to other destinations reuse the mapping. */
+	ok = test_nat_pkt(ifp, PFIL_OUT, EIM_LOCAL_IP, 5000,
+	    REMOTE_IP2, 7000, addrs, ports);
+	CHECK_TRUE(ok);
+	CHECK_TRUE(match_addr(AF_INET, EIM_PUB_IP, &addrs[NPF_SRC]));
+	CHECK_TRUE(ports[NPF_SRC] == tport);
+
+	ok = test_nat_pkt(ifp, PFIL_OUT, EIM_LOCAL_IP, 5000,
+	    REMOTE_IP1, 7001, addrs, ports);
+	CHECK_TRUE(ok);
+	CHECK_TRUE(ports[NPF_SRC] == tport);
+
+	/* Another source port gets another mapping. */
+	ok = test_nat_pkt(ifp, PFIL_OUT, EIM_LOCAL_IP, 5001,
+	    REMOTE_IP1, 7000, addrs, ports);
+	CHECK_TRUE(ok);
+	CHECK_TRUE(ports[NPF_SRC] != tport);
+
+	/* The replies are translated back. */
+	ok = test_nat_pkt(ifp, PFIL_IN, REMOTE_IP2, 7000,
+	    EIM_PUB_IP, tport, addrs, ports);
+	CHECK_TRUE(ok);
+	CHECK_TRUE(match_addr(AF_INET, EIM_LOCAL_IP, &addrs[NPF_DST]));
+	CHECK_TRUE(ports[NPF_DST] == 5000);
+	return true;
+}
+
+/*
+ * Event log of the NAT:
+ *	map $ext_if dynamic $local_net -> $pub_ip1
+ */
+static bool
+test_evlog_nat(bool verbose)
+{
+	ifnet_t *ifp = npf_test_getif(IFNAME_EXT);
+	npf_t *npf = npf_getkernctx();
+	uint64_t *stats = kmem_zalloc(NPF_STATS_SIZE, KM_SLEEP);
+	npf_addr_t addrs[2];
+	in_port_t ports[2];
+	npf_event_t ev[8];
+	uint64_t drops;
+	size_t n;
+	bool ok;
+
+	npfk_stats(npf, stats);
+	drops = stats[NPF_STAT_EVLOG_DROP];
+
+	/*
+	 * Each connection records two events, but there is room only
+	 * for four: the events of the last connection are dropped.
+	 */
+	npf->evlog = npf_logring_create(4, sizeof(npf_event_t));
+	for (unsigned i = 0; i < 3; i++) {
+		ok = test_nat_pkt(ifp, PFIL_OUT, LOCAL_IP1, 17000 + i,
+		    REMOTE_IP1, 7000, addrs, ports);
+		CHECK_TRUE(ok);
+	}
+	n = npfk_evlog_drain(npf, ev, __arraycount(ev));
+	if (verbose) {
+		printf("event log: %zu events\n", n);
+	}
+	CHECK_TRUE(n == 4);
+
+	for (unsigned i = 0; i < n; i++) {
+		const bool nat = i & 1;
+
+		CHECK_TRUE(ev[i].ev_type == (nat ?
+		    NPF_EVENT_NAT_CREATE : NPF_EVENT_CONN_CREATE));
+		CHECK_TRUE(ev[i].ev_proto == IPPROTO_UDP);
+		CHECK_TRUE(ev[i].ev_alen == sizeof(struct in_addr));
+		CHECK_TRUE(match_addr(AF_INET, LOCAL_IP1, &ev[i].ev_saddr));
+		CHECK_TRUE(match_addr(AF_INET, REMOTE_IP1, &ev[i].ev_daddr));
+		CHECK_TRUE(ntohs(ev[i].ev_sport) == 17000 + i / 2);
+		CHECK_TRUE(ntohs(ev[i].ev_dport) == 7000);
+		if (nat) {
+			CHECK_TRUE(ev[i].ev_nat == NPF_NATOUT);
+			CHECK_TRUE(match_addr(AF_INET, PUB_IP1,
+			    &ev[i].ev_taddr));
+			CHECK_TRUE(ev[i].ev_tport != 0);
+		}
+	}
+	CHECK_TRUE(npfk_evlog_drain(npf, ev, __arraycount(ev)) == 0);
+
+	npfk_stats(npf, stats);
+	CHECK_TRUE(stats[NPF_STAT_EVLOG_DROP] - drops == 2);
+	kmem_free(stats, NPF_STATS_SIZE);
+
+	npf_logring_destroy(npf->evlog);
+	npf->evlog = NULL;
+	return true;
+}
+
+/*
+ * drain_sync: drain the replication records of the primary and check
+ * that the last one is of the given type, with the NAT association.
+ */
+static size_t
+drain_sync(npf_t *npf, npf_syncrec_t *recs, size_t count, unsigned type)
+{
+	size_t n;
+
+	n = npfk_sync_drain(npf, recs, count);
+	CHECK_TRUE(n > 0);
+	CHECK_TRUE(recs[n - 1].sr_type == type);
+	CHECK_TRUE(recs[n - 1].sr_conn.cr_nat);
+	return n;
+}
+
+/*
+ * lookup_sync: lookup the forwards key of the record on the standby and
+ * check the translation of the connection, if it is expected.
+ */
+static bool
+lookup_sync(npf_t *npf, const npf_syncrec_t *sr, const char *taddr,
+    in_port_t tport)
+{
+	const npf_connrec_t *rec = &sr->sr_conn;
+	npf_addr_t *addr = NULL;
+	npf_connkey_t key;
+	npf_conn_t *con;
+	npf_flow_t flow;
+	npf_nat_t *nt;
+	in_port_t port = 0;
+
+	CHECK_TRUE(npf_connkey_setrec(npf, &rec->cr_key[NPF_FLOW_FORW],
+	    rec->cr_alen, rec->cr_proto, &key));
+	con = npf_conndb_lookup(npf, &key, &flow);
+	if (taddr == NULL) {
+		CHECK_TRUE(con == NULL);
+		return true;
+	}
+	CHECK_TRUE(con != NULL);
+	if ((nt = npf_conn_getnat(con)) != NULL) {
+		npf_nat_gettrans(nt, &addr, &port);
+	}
+	npf_conn_release(con);
+
+	CHECK_TRUE(flow == NPF_FLOW_FORW && addr != NULL);
+	CHECK_TRUE(match_addr(AF_INET, taddr, addr));
+	CHECK_TRUE(ntohs(port) == tport);
+	return true;
+}
+
+/*
+ * Connection state replication from the primary to the standby:
+ *	map $ext_if dynamic $local_net -> $pub_ip1
+ */
+static bool
+test_sync_nat(bool verbose)
+{
+	ifnet_t *ifp = npf_test_getif(IFNAME_EXT);
+	npf_t *npf = npf_getkernctx(), *standby;
+	const bool own = npf->sync == NULL;
+	npf_syncrec_t recs[8], crec, srec;
+	npf_addr_t addrs[2];
+	in_port_t ports[2], tport;
+	npf_cache_t *npc;
+	npf_conn_t *con;
+	npf_flow_t flow;
+	bool ok;
+
+	standby = npf_test_standby_create();
+	CHECK_TRUE(standby != NULL);
+	if (own) {
+		npf_sync_init(npf);
+	}
+	while (npfk_sync_drain(npf, recs, __arraycount(recs)) != 0) {
+		continue;
+	}
+
+	/*
+	 * The outbound packet creates the connection with the NAT: it is
+	 * replicated with the creation record.
+	 */
+	ok = handle_nat_pkt(npf, ifp, PFIL_OUT, LOCAL_IP1, 15500,
+	    REMOTE_IP1, 7000, addrs, ports);
+	CHECK_TRUE(ok);
+	tport = ports[NPF_SRC];
+	CHECK_TRUE(drain_sync(npf, recs, __arraycount(recs),
+	    NPF_SYNC_CREATE) == 1);
+	memcpy(&crec, &recs[0], sizeof(npf_syncrec_t));
+	if (verbose) {
+		printf("sync: replicated connection, port %d\n", tport);
+	}
+	CHECK_TRUE(npfk_sync_apply(standby, &crec, 1) == 1);
+	CHECK_TRUE(lookup_sync(standby, &crec, PUB_IP1, tport));
+
+	/*
+	 * The reply establishes the UDP state: the transition is
+	 * replicated; the reordered creation record is discarded.
+	 */
+	ok = handle_nat_pkt(npf, ifp, PFIL_IN, REMOTE_IP1, 7000,
+	    PUB_IP1, tport, addrs, ports);
+	CHECK_TRUE(ok);
+	CHECK_TRUE(drain_sync(npf, recs, __arraycount(recs),
+	    NPF_SYNC_STATE) == 1);
+	memcpy(&srec, &recs[0], sizeof(npf_syncrec_t));
+	CHECK_TRUE(srec.sr_id == crec.sr_id && srec.sr_gen > crec.sr_gen);
+	CHECK_TRUE(npfk_sync_apply(standby, &srec, 1) == 1);
+	CHECK_TRUE(npfk_sync_apply(standby, &crec, 1) == 0);
+
+	/* The standby translates the reply back. */
+	ok = handle_nat_pkt(standby, ifp, PFIL_IN, REMOTE_IP1, 7000,
+	    PUB_IP1, tport, addrs, ports);
+	CHECK_TRUE(ok);
+	CHECK_TRUE(match_addr(AF_INET, LOCAL_IP1, &addrs[NPF_DST]));
+	CHECK_TRUE(ports[NPF_DST] == 15500);
+
+	/*
+	 * The NAT association with the active connection is replicated
+	 * with its own record.
+	 */
+	npc = get_cached_pkt(mbuf_get_pkt(AF_INET, IPPROTO_UDP,
+	    LOCAL_IP1, REMOTE_IP1, 15501, 7000), IFNAME_EXT);
+	con = npf_conn_establish(npc, PFIL_OUT, true);
+	CHECK_TRUE(con != NULL);
+	npf_conn_release(con);
+	con = npf_conn_lookup(npc, PFIL_OUT, &flow);
+	CHECK_TRUE(con != NULL);
+	CHECK_TRUE(npf_do_nat(npc, con, PFIL_OUT) == 0);
+	ok = npf_conn_getnat(con) != NULL;
+	npf_conn_release(con);
+	put_cached_pkt(npc);
+	CHECK_TRUE(ok);
+
+	CHECK_TRUE(drain_sync(npf, recs, __arraycount(recs),
+	    NPF_SYNC_NAT) == 1);
+	CHECK_TRUE(npfk_sync_apply(standby, recs, 1) == 1);
+	CHECK_TRUE(lookup_sync(standby, &recs[0], PUB_IP1,
+	    ntohs(recs[0].sr_conn.cr_nat_tport)));
+
+	/*
+	 * The newer connection with the same key replaces the existing
+	 * one and takes the same NAT port.
+	 */
+	crec.sr_id += 1000;
+	CHECK_TRUE(npfk_sync_apply(standby, &crec, 1) == 1);
+	CHECK_TRUE(lookup_sync(standby, &crec, PUB_IP1, tport));
+
+	/* The expiration removes it; the late records are discarded. */
+	crec.sr_type = NPF_SYNC_EXPIRE;
+	crec.sr_gen++;
+	CHECK_TRUE(npfk_sync_apply(standby, &crec, 1) == 1);
+	CHECK_TRUE(lookup_sync(standby, &crec, NULL, 0));
+	CHECK_TRUE(npfk_sync_apply(standby, &srec, 1) == 0);
+	CHECK_TRUE(lookup_sync(standby, &crec, NULL, 0));
+
+	if (own) {
+		npf_sync_fini(npf);
+	}
+	npf_test_standby_destroy(standby);
+	return true;
+}
+
+static unsigned	alg_ncalls;
+
+static npf_conn_t *
+test_alg_inspect(npf_cache_t *npc, int di)
+{
+	alg_ncalls++;
+	return NULL;
+}
+
+static unsigned
+test_alg_pkt(int proto, in_port_t dport)
+{
+	const unsigned ncalls = alg_ncalls;
+	struct mbuf *m;
+	npf_cache_t *npc;
+
+	m = mbuf_get_pkt(AF_INET, proto, LOCAL_IP1, REMOTE_IP1, 5000, dport);
+	npc = get_cached_pkt(m, NULL);
+	CHECK_TRUE(npf_alg_conn(npc, PFIL_OUT) == NULL);
+	put_cached_pkt(npc);
+	return alg_ncalls - ncalls;
+}
+
+/*
+ * ALG dispatch: the inspector is called only for UDP port 53.
+ */
+static bool
+test_alg_dispatch(void)
+{
+	static const npfa_funcs_t funcs = {
+		.inspect	= test_alg_inspect,
+		.protos		= { IPPROTO_UDP },
+		.port		= 53,
+	};
+	npf_t *npf = npf_getkernctx();
+	npf_alg_t *alg;
+
+	alg = npf_alg_register(npf, "test", &funcs);
+	CHECK_TRUE(alg != NULL);
+
+	CHECK_TRUE(test_alg_pkt(IPPROTO_UDP, 53) == 1);
+	CHECK_TRUE(test_alg_pkt(IPPROTO_UDP, 7000) == 0);
+	CHECK_TRUE(test_alg_pkt(IPPROTO_TCP, 53) == 0);
+
+	npf_alg_unregister(npf, alg);
+	CHECK_TRUE(test_alg_pkt(IPPROTO_UDP, 53) == 0);
+	return true;
+}
+
+#if defined(_NPF_STANDALONE)
+static bool
+test_cksum_offload_pkt(ifnet_t *ifp, in_port_t sport, uint16_t sum,
+    unsigned offload)
+{
+	npf_t *npf = npf_getkernctx();
+	struct udphdr *uh;
+	struct mbuf *m;
+	struct ip *ip;
+	uint16_t ipsum;
+	int error;
+
+	m = mbuf_get_pkt(AF_INET, IPPROTO_UDP, LOCAL_IP1, REMOTE_IP1,
+	    sport, 7000);
+	uh = mbuf_return_hdrs(m, false, &ip);
+	uh->uh_sum = sum;
+	ipsum = ip->ip_sum;
+
+	npftest_cksum_offload = NPF_CKSUM_IPV4 | NPF_CKSUM_UDP;
+	error = npfk_packet_handler(npf, &m, ifp, PFIL_OUT);
+	npftest_cksum_offload = 0;
+	CHECK_TRUE(error == 0);
+
+	/* Translated, but the checksums are left to the "hardware". */
+	uh = mbuf_return_hdrs(m, false, &ip);
+	CHECK_TRUE(ip->ip_src.s_addr == inet_addr(PUB_IP1));
+	CHECK_TRUE(ntohs(uh->uh_sport) != sport);
+	CHECK_TRUE(ip->ip_sum == ipsum);
+	CHECK_TRUE(uh->uh_sum == sum);
+	CHECK_TRUE((unsigned)m->m_pkthdr.csum_flags == offload);
+	m_freem(m);
+	return true;
+}
+
+/*
+ * Checksum offload:
+ *	map $ext_if dynamic $local_net -> $pub_ip1
+ */
+static bool
+test_cksum_offload(void)
+{
+	ifnet_t *ifp = npf_test_getif(IFNAME_EXT);
+	bool ok;
+
+	ok = test_cksum_offload_pkt(ifp, 16000, htons(0x1234),
+	    NPF_CKSUM_IPV4 | NPF_CKSUM_UDP);
+	CHECK_TRUE(ok);
+
+	/* No UDP checksum: there must still be none. */
+	ok = test_cksum_offload_pkt(ifp, 16001, 0, NPF_CKSUM_IPV4);
+	CHECK_TRUE(ok);
+	return true;
+}
+
+/*
+ * Connection snapshot: save the connections of the primary into a file
+ * and load them into the standby, which then translates the reply of
+ * the restored NAT connection:
+ *	map $ext_if dynamic $local_net -> $pub_ip1
+ */
+static bool
+test_conn_restore(bool verbose)
+{
+	ifnet_t *ifp = npf_test_getif(IFNAME_EXT);
+	npf_t *npf = npf_getkernctx(), *standby;
+	char path[] = "/tmp/npf_nat_test.XXXXXX";
+	npf_addr_t addrs[2];
+	in_port_t ports[2], tport;
+	int fd, nsaved, nloaded;
+	bool ok;
+
+	standby = npf_test_standby_create();
+	CHECK_TRUE(standby != NULL);
+
+	ok = handle_nat_pkt(npf, ifp, PFIL_OUT, LOCAL_IP1, 15600,
+	    REMOTE_IP1, 7000, addrs, ports);
+	CHECK_TRUE(ok);
+	CHECK_TRUE(match_addr(AF_INET, PUB_IP1, &addrs[NPF_SRC]));
+	tport = ports[NPF_SRC];
+
+	/*
+	 * Save and load the snapshot.  The connections are restored
+	 * only once: on the second load, all of them are duplicates.
+	 */
+	fd = mkstemp(path);
+	CHECK_TRUE(fd != -1);
+	unlink(path);
+	nsaved = npfk_conn_save(npf, fd);
+	CHECK_TRUE(nsaved > 0);
+	CHECK_TRUE(lseek(fd, 0, SEEK_SET) == 0);
+	nloaded = npfk_conn_load(standby, fd);
+	CHECK_TRUE(lseek(fd, 0, SEEK_SET) == 0);
+	CHECK_TRUE(npfk_conn_load(standby, fd) == 0);
+	close(fd);
+	if (verbose) {
+		printf("restore: saved %d, loaded %d connections\n",
+		    nsaved, nloaded);
+	}
+	CHECK_TRUE(nloaded > 0 && nloaded <= nsaved);
+
+	/* The standby translates the reply back. */
+	ok = handle_nat_pkt(standby, ifp, PFIL_IN, REMOTE_IP1, 7000,
+	    PUB_IP1, tport, addrs, ports);
+	CHECK_TRUE(ok);
+	CHECK_TRUE(match_addr(AF_INET, LOCAL_IP1, &addrs[NPF_DST]));
+	CHECK_TRUE(ports[NPF_DST] == 15600);
+
+	/* The snapshot without the header is rejected. */
+	fd = open("/dev/null", O_RDONLY);
+	CHECK_TRUE(fd != -1);
+	nloaded = npfk_conn_load(standby, fd);
+	close(fd);
+	CHECK_TRUE(nloaded == -1 && errno == EINVAL);
+
+	npf_test_standby_destroy(standby);
+	return true;
+}
+#endif
+
 bool
 npf_nat_test(bool verbose)
 {
@@ -238,5 +780,14 @@ npf_nat_test(bool verbose)
 		m_freem(m);
 		CHECK_TRUE(ret);
 	}
+	CHECK_TRUE(test_det_nat(verbose));
+	CHECK_TRUE(test_eim_nat(verbose));
+	CHECK_TRUE(test_evlog_nat(verbose));
+	CHECK_TRUE(test_alg_dispatch());
+	CHECK_TRUE(test_sync_nat(verbose));
+#if defined(_NPF_STANDALONE)
+	CHECK_TRUE(test_cksum_offload());
+	CHECK_TRUE(test_conn_restore(verbose));
+#endif
 	return true;
 }
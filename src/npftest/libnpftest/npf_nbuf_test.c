@@ -187,6 +187,288 @@ validate_mbuf_data(char *bufa, char *bufb)
 	return ok;
 }
 
+#if defined(_NPF_STANDALONE)
+
+/*
+ * Reassembly tests: the fragment data is filled with the byte offsets
+ * within the datagram, so that the reassembled data could be verified.
+ */
+
+#define	REASS_DATA_LEN		64
+
+static struct mbuf *
+mbuf_frag_ip4(unsigned off, unsigned len, bool mf, uint16_t id)
+{
+	struct mbuf *m = m_gethdr(M_WAITOK, MT_HEADER);
+	struct ip *ip = mtod(m, struct ip *);
+	uint8_t *data = (uint8_t *)(ip + 1);
+
+	memset(ip, 0, sizeof(struct ip));
+	ip->ip_v = IPVERSION;
+	ip->ip_hl = sizeof(struct ip) >> 2;
+	ip->ip_ttl = 64;
+	ip->ip_p = IPPROTO_UDP;
+	ip->ip_id = htons(id);
+	ip->ip_off = htons((off >> 3) | (mf ? IP_MF : 0));
+	ip->ip_len = htons(sizeof(struct ip) + len);
+	npf_inet_pton(AF_INET, "10.1.1.1", &ip->ip_src);
+	npf_inet_pton(AF_INET, "10.1.1.2", &ip->ip_dst);
+
+	for (unsigned i = 0; i < len; i++) {
+		data[i] = off + i;
+	}
+	m->m_pkthdr.len = m->m_len = sizeof(struct ip) + len;
+	return m;
+}
+
+static struct mbuf *
+mbuf_frag_ip6(unsigned off, unsigned len, bool mf, uint32_t id)
+{
+	struct mbuf *m = m_gethdr(M_WAITOK, MT_HEADER);
+	struct ip6_hdr *ip6 = mtod(m, struct ip6_hdr *);
+	struct ip6_frag *ip6f = (struct ip6_frag *)(ip6 + 1);
+	uint8_t *data = (uint8_t *)(ip6f + 1);
+
+	memset(ip6, 0, sizeof(struct ip6_hdr) + sizeof(struct ip6_frag));
+	ip6->ip6_vfc = IPV6_VERSION;
+	ip6->ip6_nxt = IPPROTO_FRAGMENT;
+	ip6->ip6_hlim = 64;
+	ip6->ip6_plen = htons(sizeof(struct ip6_frag) + len);
+	npf_inet_pton(AF_INET6, "2001:db8::1", &ip6->ip6_src);
+	npf_inet_pton(AF_INET6, "2001:db8::2", &ip6->ip6_dst);
+	ip6f->ip6f_nxt = IPPROTO_UDP;
+	ip6f->ip6f_offlg = htons(off) | (mf ? IP6F_MORE_FRAG : 0);
+	ip6f->ip6f_ident = htonl(id);
+
+	for (unsigned i = 0; i < len; i++) {
+		data[i] = off + i;
+	}
+	m->m_pkthdr.len = m->m_len = sizeof(struct ip6_hdr) +
+	    sizeof(struct ip6_frag) + len;
+	return m;
+}
+
+static bool
+mbuf_reass_check(struct mbuf *m, unsigned hlen, unsigned len)
+{
+	unsigned n = 0, skip = hlen;
+
+	if (npfkern_m_length(m) != hlen + len) {
+		return false;
+	}
+	for (; m != NULL; m = m->m_next) {
+		const uint8_t *d = m->m_data;
+
+		for (unsigned i = 0; i < m->m_len; i++) {
+			if (skip) {
+				skip--;
+				continue;
+			}
+			if (d[i] != (uint8_t)n++) {
+				return false;
+			}
+		}
+	}
+	return n == len;
+}
+
+static bool
+npf_reass_test(void)
+{
+	npf_t *npf = npf_getkernctx();
+	struct mbuf *m;
+	struct ip6_hdr *ip6;
+	struct ip *ip;
+	int error;
+
+	/* IPv4: out of order, with a duplicate. */
+	m = mbuf_frag_ip4(48, 16, false, 1);
+	error = npf_reass_packet(npf, &m, 0);
+	CHECK_TRUE(error == 0 && m == NULL);
+
+	m = mbuf_frag_ip4(0, 24, true, 1);
+	error = npf_reass_packet(npf, &m, 0);
+	CHECK_TRUE(error == 0 && m == NULL);
+
+	m = mbuf_frag_ip4(0, 24, true, 1);
+	error = npf_reass_packet(npf, &m, 0);
+	CHECK_TRUE(error == 0 && m == NULL);
+
+	m = mbuf_frag_ip4(24, 24, true, 1);
+	error = npf_reass_packet(npf, &m, 0);
+	CHECK_TRUE(error == 0 && m != NULL);
+
+	ip = mtod(m, struct ip *);
+	CHECK_TRUE(ntohs(ip->ip_len) == sizeof(struct ip) + REASS_DATA_LEN);
+	CHECK_TRUE(ip->ip_off == 0);
+	CHECK_TRUE(mbuf_reass_check(m, sizeof(struct ip), REASS_DATA_LEN));
+	m_freem(m);
+
+	/* IPv4: overlapping fragment drops the datagram. */
+	m = mbuf_frag_ip4(0, 24, true, 2);
+	error = npf_reass_packet(npf, &m, 0);
+	CHECK_TRUE(error == 0 && m == NULL);
+
+	m = mbuf_frag_ip4(16, 24, true, 2);
+	error = npf_reass_packet(npf, &m, 0);
+	CHECK_TRUE(error == EINVAL && m != NULL);
+	m_freem(m);
+
+	m = mbuf_frag_ip4(24, 40, false, 2);
+	error = npf_reass_packet(npf, &m, 0);
+	CHECK_TRUE(error == 0 && m == NULL);
+
+	/* IPv4: the limit of fragments per datagram. */
+	error = npfk_param_set(npf, "reass.max_datagram_frags", 2);
+	CHECK_TRUE(error == 0);
+
+	for (unsigned i = 0; i < 3; i++) {
+		m = mbuf_frag_ip4(i * 8, 8, true, 3);
+		error = npf_reass_packet(npf, &m, 0);
+		CHECK_TRUE((i < 2) ? (error == 0 && m == NULL) :
+		    (error == ENOBUFS && m != NULL));
+	}
+	m_freem(m);
+
+	error = npfk_param_set(npf, "reass.max_datagram_frags", 64);
+	CHECK_TRUE(error == 0);
+
+	/* IPv6: the fragment header is removed. */
+	m = mbuf_frag_ip6(32, 32, false, 1);
+	error = npf_reass_packet(npf, &m, sizeof(struct ip6_hdr));
+	CHECK_TRUE(error == 0 && m == NULL);
+
+	m = mbuf_frag_ip6(0, 32, true, 1);
+	error = npf_reass_packet(npf, &m, sizeof(struct ip6_hdr));
+	CHECK_TRUE(error == 0 && m != NULL);
+
+	ip6 = mtod(m, struct ip6_hdr *);
+	CHECK_TRUE(ip6->ip6_nxt == IPPROTO_UDP);
+	CHECK_TRUE(ntohs(ip6->ip6_plen) == REASS_DATA_LEN);
+	CHECK_TRUE(mbuf_reass_check(m, sizeof(struct ip6_hdr),
+	    REASS_DATA_LEN));
+	m_freem(m);
+
+	return true;
+}
+
+/*
+ * Fragmentation tests: the datagram is reassembled and then forwarded
+ * to the interface with the smaller MTU, i.e. fragmented on output.
+ * The fragments must reassemble into the same datagram.
+ */
+
+#define	FRAG_DATA_LEN		480
+#define	FRAG_MTU		256
+#define	FRAG_MAX		8
+
+static struct mbuf *
+mbuf_reass_dgram(bool ip6, uint32_t id)
+{
+	npf_t *npf = npf_getkernctx();
+	const unsigned len = FRAG_DATA_LEN / 3;
+	struct mbuf *m = NULL;
+
+	for (unsigned i = 0; i < 3; i++) {
+		const bool mf = i < 2;
+
+		m = ip6 ? mbuf_frag_ip6(i * len, len, mf, id) :
+		    mbuf_frag_ip4(i * len, len, mf, id);
+		if (npf_reass_packet(npf, &m, ip6 ?
+		    sizeof(struct ip6_hdr) : 0) != 0) {
+			m_freem(m);
+			return NULL;
+		}
+	}
+	return m;
+}
+
+static bool
+npf_frag_test(void)
+{
+	npf_t *npf = npf_getkernctx();
+	struct mbuf *m, *frags[FRAG_MAX];
+	unsigned n, off = 0;
+	int error;
+
+	/* IPv4: the datagram within the MTU is returned as is. */
+	m = mbuf_frag_ip4(0, 64, false, 10);
+	n = FRAG_MAX;
+	error = npfk_packet_fragment(npf, &m, FRAG_MTU, frags, &n);
+	CHECK_TRUE(error == 0 && m == NULL && n == 1);
+	m_freem(frags[0]);
+
+	/* IPv4: the reassembled datagram is fragmented to the MTU. */
+	m = mbuf_reass_dgram(false, 11);
+	CHECK_TRUE(m != NULL && m->m_next != NULL);
+	n = FRAG_MAX;
+	error = npfk_packet_fragment(npf, &m, FRAG_MTU, frags, &n);
+	CHECK_TRUE(error == 0 && m == NULL && n == 3);
+
+	for (unsigned i = 0; i < n; i++) {
+		const struct ip *ip = mtod(frags[i], const struct ip *);
+		const unsigned ipoff = ntohs(ip->ip_off);
+		const unsigned len = ntohs(ip->ip_len) - sizeof(struct ip);
+
+		CHECK_TRUE(ntohs(ip->ip_len) <= FRAG_MTU);
+		CHECK_TRUE(npfkern_m_length(frags[i]) == ntohs(ip->ip_len));
+		CHECK_TRUE(npf_cksum_buf(0, ip, sizeof(struct ip)) == 0);
+		CHECK_TRUE((ipoff & IP_OFFMASK) << 3 == off);
+		CHECK_TRUE(((ipoff & IP_MF) != 0) == (i < n - 1));
+		off += len;
+	}
+	CHECK_TRUE(off == FRAG_DATA_LEN);
+
+	for (unsigned i = 0; i < n; i++) {
+		m = frags[i];
+		error = npf_reass_packet(npf, &m, 0);
+		CHECK_TRUE(error == 0 && (m != NULL) == (i == n - 1));
+	}
+	CHECK_TRUE(mbuf_reass_check(m, sizeof(struct ip), FRAG_DATA_LEN));
+
+	/* IPv4: the "don't fragment" flag. */
+	mtod(m, struct ip *)->ip_off = htons(IP_DF);
+	n = FRAG_MAX;
+	error = npfk_packet_fragment(npf, &m, FRAG_MTU, frags, &n);
+	CHECK_TRUE(error == EMSGSIZE && m != NULL);
+	m_freem(m);
+
+	/* IPv6: the fragment header is inserted. */
+	m = mbuf_reass_dgram(true, 12);
+	CHECK_TRUE(m != NULL && m->m_next != NULL);
+	n = FRAG_MAX;
+	error = npfk_packet_fragment(npf, &m, FRAG_MTU, frags, &n);
+	CHECK_TRUE(error == 0 && m == NULL && n == 3);
+
+	off = 0;
+	for (unsigned i = 0; i < n; i++) {
+		const struct ip6_hdr *ip6 = mtod(frags[i], const void *);
+		const struct ip6_frag *ip6f = (const void *)(ip6 + 1);
+		const unsigned plen = ntohs(ip6->ip6_plen);
+
+		CHECK_TRUE(sizeof(struct ip6_hdr) + plen <= FRAG_MTU);
+		CHECK_TRUE(ip6->ip6_nxt == IPPROTO_FRAGMENT);
+		CHECK_TRUE(ip6f->ip6f_nxt == IPPROTO_UDP);
+		CHECK_TRUE(ntohs(ip6f->ip6f_offlg & IP6F_OFF_MASK) == off);
+		CHECK_TRUE(((ip6f->ip6f_offlg & IP6F_MORE_FRAG) != 0) ==
+		    (i < n - 1));
+		off += plen - sizeof(struct ip6_frag);
+	}
+	CHECK_TRUE(off == FRAG_DATA_LEN);
+
+	for (unsigned i = 0; i < n; i++) {
+		m = frags[i];
+		error = npf_reass_packet(npf, &m, sizeof(struct ip6_hdr));
+		CHECK_TRUE(error == 0 && (m != NULL) == (i == n - 1));
+	}
+	CHECK_TRUE(mbuf_reass_check(m, sizeof(struct ip6_hdr),
+	    FRAG_DATA_LEN));
+	m_freem(m);
+
+	return true;
+}
+#endif
+
 bool
 npf_nbuf_test(bool verbose)
 {
@@ -209,6 +491,14 @@ npf_nbuf_test(bool verbose)
 	ok = validate_mbuf_data(bufa, bufb);
 	CHECK_TRUE(ok);
 
+#if defined(_NPF_STANDALONE)
+	ok = npf_reass_test();
+	CHECK_TRUE(ok);
+
+	ok = npf_frag_test();
+	CHECK_TRUE(ok);
+#endif
+
 	(void)verbose;
 	return true;
 }
@@ -23,6 +23,7 @@ static volatile int	done;
 
 static uint64_t *	npackets;
 static bool		stateful;
+static unsigned		nworkers;
 
 __dead static void
 worker(void *arg)
@@ -88,3 +89,296 @@ npf_test_conc(bool st, unsigned nthreads)
 
 	printf("%u\t%" PRIu64 "\n", nthreads, total / NSECS);
 }
+
+/*
+ * NAT connection establishment: every packet is from a new source port,
+ * i.e. creates a connection with the NAT entry of the same policy:
+ *
+ *	map $ext_if dynamic $local_net -> $pub_ip1
+ *
+ * The port map limits the number of translations, therefore each thread
+ * establishes a fixed number of connections and the time is measured.
+ */
+#define	NAT_NCONNS	60000
+
+static npf_addr_t	nat_taddr;
+static int		nat_min_port, nat_max_port;
+
+/*
+ * nat_check_pkt: check that the source of the packet is translated to
+ * the public address and a port of the port map range, while the
+ * destination is intact.
+ */
+static bool
+nat_check_pkt(npf_t *npf, ifnet_t *ifp, struct mbuf *m)
+{
+	const struct udphdr *uh;
+	npf_addr_t daddr;
+	npf_cache_t npc;
+	nbuf_t nbuf;
+	int sport;
+
+	nbuf_init(npf, &nbuf, m, ifp);
+	memset(&npc, 0, sizeof(npf_cache_t));
+	npc.npc_ctx = npf;
+	npc.npc_nbuf = &nbuf;
+	if (!npf_cache_all(&npc) || !npf_iscached(&npc, NPC_UDP)) {
+		return false;
+	}
+	uh = npc.npc_l4.udp;
+	sport = ntohs(uh->uh_sport);
+
+	npf_inet_pton(AF_INET, REMOTE_IP1, &daddr);
+	return memcmp(npc.npc_ips[NPF_SRC], &nat_taddr,
+	    sizeof(struct in_addr)) == 0 &&
+	    memcmp(npc.npc_ips[NPF_DST], &daddr,
+	    sizeof(struct in_addr)) == 0 &&
+	    sport >= nat_min_port && sport <= nat_max_port &&
+	    ntohs(uh->uh_dport) == 80;
+}
+
+__dead static void
+nat_worker(void *arg)
+{
+	npf_t *npf = npf_getkernctx();
+	ifnet_t *ifp = npf_test_getif(IFNAME_EXT);
+	const unsigned i = (uintptr_t)arg;
+	const unsigned nconns = NAT_NCONNS / nworkers;
+	uint64_t n = 0;
+
+	while (!run)
+		/* spin-wait */;
+	for (unsigned c = 0; c < nconns; c++) {
+		const unsigned sport = 1024 + i * nconns + c;
+		struct mbuf *m;
+		int error;
+		bool ok;
+
+		m = mbuf_get_pkt(AF_INET, IPPROTO_UDP,
+		    LOCAL_IP1, REMOTE_IP1, sport, 80);
+		error = npfk_packet_handler(npf, &m, ifp, PFIL_OUT);
+		if (error == 0) {
+			/* Once passed, the packet must be translated. */
+			ok = nat_check_pkt(npf, ifp, m);
+			KASSERT(ok); (void)ok;
+			n++;
+		}
+		m_freem(m);
+	}
+	npackets[i] = n;
+	kthread_exit(0);
+}
+
+void
+npf_test_nat_conc(unsigned nthreads)
+{
+	struct timespec tstart, tend;
+	uint64_t total = 0, nsec;
+	int error;
+	lwp_t **l;
+
+	printf("THREADS\tCONNS/SEC\n");
+	nworkers = nthreads;
+	run = false;
+
+	npf_inet_pton(AF_INET, PUB_IP1, &nat_taddr);
+	error = npfk_param_get(npf_getkernctx(), "portmap.min_port",
+	    &nat_min_port);
+	KASSERT(error == 0);
+	error = npfk_param_get(npf_getkernctx(), "portmap.max_port",
+	    &nat_max_port);
+	KASSERT(error == 0);
+
+	npackets = kmem_zalloc(sizeof(uint64_t) * nthreads, KM_SLEEP);
+	l = kmem_zalloc(sizeof(lwp_t *) * nthreads, KM_SLEEP);
+
+	for (unsigned i = 0; i < nthreads; i++) {
+		error = kthread_create(PRI_NONE, KTHREAD_MUSTJOIN |
+		    KTHREAD_MPSAFE, NULL, nat_worker, (void *)(uintptr_t)i,
+		    &l[i], "npfperf");
+		KASSERT(error == 0); (void)error;
+	}
+
+	/* Start and wait until all threads establish the connections. */
+	getnanouptime(&tstart);
+	run = true;
+	for (unsigned i = 0; i < nthreads; i++) {
+		kthread_join(l[i]);
+		total += npackets[i];
+	}
+	getnanouptime(&tend);
+	kmem_free(npackets, sizeof(uint64_t) * nthreads);
+	kmem_free(l, sizeof(lwp_t *) * nthreads);
+
+	nsec = (tend.tv_sec - tstart.tv_sec) * UINT64_C(1000000000) +
+	    tend.tv_nsec - tstart.tv_nsec;
+	printf("%u\t%" PRIu64 "\n", nthreads,
+	    nsec ? (total * UINT64_C(1000000000)) / nsec : 0);
+}
+
+/*
+ * Rate limiting: all threads run the packets through the same "ratelimit"
+ * procedure.  Reports the throughput and the passed rate as a percentage
+ * of the committed rate (accuracy).
+ */
+#define	RL_BITRATE	(80 * 1000 * 1000)
+#define	RL_BURST	(100 * 1000)
+
+static npf_rproc_t *	rl_rproc;
+static uint64_t *	npassed;
+
+__dead static void
+rl_worker(void *arg)
+{
+	const npf_match_info_t mi = { .mi_rid = 1, .mi_di = PFIL_OUT };
+	npf_t *npf = npf_getkernctx();
+	ifnet_t *ifp = npf_test_getif(IFNAME_INT);
+	const unsigned i = (uintptr_t)arg;
+	uint64_t n = 0, passed = 0;
+	npf_cache_t npc;
+	struct mbuf *m;
+	size_t pktlen;
+	nbuf_t nbuf;
+
+	m = mbuf_get_pkt(AF_INET, IPPROTO_UDP,
+	    LOCAL_IP1, REMOTE_IP1, 1024 + i, 80);
+	nbuf_init(npf, &nbuf, m, ifp);
+	memset(&npc, 0, sizeof(npf_cache_t));
+	npc.npc_ctx = npf;
+	npc.npc_nbuf = &nbuf;
+	npf_cache_all(&npc);
+	pktlen = nbuf_datalen(&nbuf);
+
+	while (!run)
+		/* spin-wait */;
+	while (!done) {
+		int decision = NPF_DECISION_PASS;
+
+		npf_rproc_run(&npc, rl_rproc, &mi, &decision);
+		passed += (decision == NPF_DECISION_PASS) ? pktlen : 0;
+		n++;
+	}
+	npackets[i] = n;
+	npassed[i] = passed;
+	m_freem(m);
+	kthread_exit(0);
+}
+
+void
+npf_test_ratelimit_conc(unsigned nthreads)
+{
+	npf_t *npf = npf_getkernctx();
+	uint64_t total = 0, passed = 0;
+	nvlist_t *params;
+	int error;
+	lwp_t **l;
+
+	printf("THREADS\tPKTS\tACCURACY\n");
+	done = false;
+	run = false;
+
+	error = npf_ext_ratelimit_init(npf);
+	KASSERT(error == 0);
+
+	params = nvlist_create(0);
+	nvlist_add_string(params, "name", "ratelimit-perf");
+	nvlist_add_number(params, "bitrate", RL_BITRATE);
+	nvlist_add_number(params, "normal-burst", RL_BURST);
+	nvlist_add_number(params, "extended-burst", RL_BURST * 2);
+	rl_rproc = npf_rproc_create(params);
+	error = npf_ext_construct(npf, "ratelimit", rl_rproc, params);
+	KASSERT(error == 0); (void)error;
+	nvlist_destroy(params);
+
+	npackets = kmem_zalloc(sizeof(uint64_t) * nthreads, KM_SLEEP);
+	npassed = kmem_zalloc(sizeof(uint64_t) * nthreads, KM_SLEEP);
+	l = kmem_zalloc(sizeof(lwp_t *) * nthreads, KM_SLEEP);
+
+	for (unsigned i = 0; i < nthreads; i++) {
+		error = kthread_create(PRI_NONE, KTHREAD_MUSTJOIN |
+		    KTHREAD_MPSAFE, NULL, rl_worker, (void *)(uintptr_t)i,
+		    &l[i], "npfperf");
+		KASSERT(error == 0); (void)error;
+	}
+
+	run = true;
+	kpause("perf", false, mstohz(NSECS * 1000), NULL);
+	done = true;
+
+	for (unsigned i = 0; i < nthreads; i++) {
+		kthread_join(l[i]);
+		total += npackets[i];
+		passed += npassed[i];
+	}
+	kmem_free(npackets, sizeof(uint64_t) * nthreads);
+	kmem_free(npassed, sizeof(uint64_t) * nthreads);
+	kmem_free(l, sizeof(lwp_t *) * nthreads);
+
+	npf_rproc_release(rl_rproc);
+	npf_ext_ratelimit_fini(npf);
+
+	/* The passed bytes per second, relative to the committed rate. */
+	printf("%u\t%" PRIu64 "\t%" PRIu64 "%%\n", nthreads, total / NSECS,
+	    (passed * 100) / ((RL_BITRATE / 8) * NSECS));
+}
+
+/*
+ * PRNG: all threads generate the random numbers, as the port map and
+ * the extensions do in the packet path.
+ */
+static volatile uint32_t	cprng_sink;
+
+__dead static void
+cprng_worker(void *arg)
+{
+	const unsigned i = (uintptr_t)arg;
+	uint32_t val = 0;
+	uint64_t n = 0;
+
+	while (!run)
+		/* spin-wait */;
+	while (!done) {
+		for (unsigned c = 0; c < 1000; c++) {
+			val += cprng_fast32();
+		}
+		n += 1000;
+	}
+	cprng_sink = val;
+	npackets[i] = n;
+	kthread_exit(0);
+}
+
+void
+npf_test_cprng_conc(unsigned nthreads)
+{
+	uint64_t total = 0;
+	int error;
+	lwp_t **l;
+
+	printf("THREADS\tNUMBERS\n");
+	done = false;
+	run = false;
+
+	npackets = kmem_zalloc(sizeof(uint64_t) * nthreads, KM_SLEEP);
+	l = kmem_zalloc(sizeof(lwp_t *) * nthreads, KM_SLEEP);
+
+	for (unsigned i = 0; i < nthreads; i++) {
+		error = kthread_create(PRI_NONE, KTHREAD_MUSTJOIN |
+		    KTHREAD_MPSAFE, NULL, cprng_worker, (void *)(uintptr_t)i,
+		    &l[i], "npfperf");
+		KASSERT(error == 0); (void)error;
+	}
+
+	run = true;
+	kpause("perf", false, mstohz(NSECS * 1000), NULL);
+	done = true;
+
+	for (unsigned i = 0; i < nthreads; i++) {
+		kthread_join(l[i]);
+		total += npackets[i];
+	}
+	kmem_free(npackets, sizeof(uint64_t) * nthreads);
+	kmem_free(l, sizeof(lwp_t *) * nthreads);
+
+	printf("%u\t%" PRIu64 "\n", nthreads, total / NSECS);
+}
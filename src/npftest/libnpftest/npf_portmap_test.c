@@ -0,0 +1,286 @@
+/*
+ * NPF port map tests.
+ *
+ * Public Domain.
+ */
+
+#ifdef _KERNEL
+#include <sys/types.h>
+#endif
+
+#include "npf_impl.h"
+#include "npf_test.h"
+
+#define	PM_MIN_PORT	2048
+#define	PM_NPORTS	256
+#define	PM_MAX_PORT	(PM_MIN_PORT + PM_NPORTS - 1)
+
+static bool
+test_portmap_exhaust(npf_portmap_t *pm, const npf_addr_t *addr,
+    in_port_t *ports)
+{
+	const int alen = sizeof(struct in_addr);
+	bool seen[PM_NPORTS];
+	in_port_t port;
+
+	memset(seen, 0, sizeof(seen));
+
+	/* Allocate all ports: each must be unique and in the range. */
+	for (unsigned i = 0; i < PM_NPORTS; i++) {
+		unsigned p;
+
+		port = npf_portmap_get(pm, alen, addr);
+		CHECK_TRUE(port != 0);
+
+		p = ntohs(port);
+		CHECK_TRUE(p >= PM_MIN_PORT && p <= PM_MAX_PORT);
+		CHECK_TRUE(!seen[p - PM_MIN_PORT]);
+		seen[p - PM_MIN_PORT] = true;
+		ports[i] = port;
+	}
+
+	/* No more ports. */
+	port = npf_portmap_get(pm, alen, addr);
+	CHECK_TRUE(port == 0);
+	return true;
+}
+
+static bool
+test_portmap_basic(void)
+{
+	npf_addr_t addr_storage, *addr = &addr_storage;
+	const int alen = sizeof(struct in_addr);
+	in_port_t ports[PM_NPORTS], port;
+	npf_portmap_t *pm;
+	bool ok;
+
+	pm = npf_portmap_create(PM_MIN_PORT, PM_MAX_PORT);
+	CHECK_TRUE(pm != NULL);
+
+	memset(addr, 0, sizeof(npf_addr_t));
+	addr->word32[0] = inet_addr("10.1.1.1");
+
+	ok = test_portmap_exhaust(pm, addr, ports);
+	CHECK_TRUE(ok);
+
+	/* Already used port cannot be taken. */
+	ok = npf_portmap_take(pm, alen, addr, ports[0]);
+	CHECK_TRUE(!ok);
+
+	/* The released port is cached, but it can be taken again. */
+	npf_portmap_put(pm, alen, addr, ports[0]);
+	ok = npf_portmap_take(pm, alen, addr, ports[0]);
+	CHECK_TRUE(ok);
+	ok = npf_portmap_take(pm, alen, addr, ports[0]);
+	CHECK_TRUE(!ok);
+
+	/* ... also once returned into the bitmap. */
+	npf_portmap_put(pm, alen, addr, ports[1]);
+	npf_portmap_sync(pm);
+	ok = npf_portmap_take(pm, alen, addr, ports[1]);
+	CHECK_TRUE(ok);
+
+	/* Release all; they must be available again. */
+	for (unsigned i = 0; i < PM_NPORTS; i++) {
+		npf_portmap_put(pm, alen, addr, ports[i]);
+	}
+	ok = test_portmap_exhaust(pm, addr, ports);
+	CHECK_TRUE(ok);
+
+	/* Another address has its own port map. */
+	addr->word32[0] = inet_addr("10.1.1.2");
+	port = npf_portmap_get(pm, alen, addr);
+	CHECK_TRUE(port != 0);
+	npf_portmap_put(pm, alen, addr, port);
+
+	/* Flush releases everything. */
+	npf_portmap_flush(pm);
+	addr->word32[0] = inet_addr("10.1.1.1");
+	ok = npf_portmap_take(pm, alen, addr, ports[0]);
+	CHECK_TRUE(ok);
+
+	npf_portmap_destroy(pm);
+	return true;
+}
+
+#define	PBA_BLOCK	64
+#define	PBA_MAXBLOCKS	2
+#define	PBA_NPORTS	(PBA_BLOCK * PBA_MAXBLOCKS)
+
+static bool
+test_pba_fill(npf_pba_t *pba, const npf_addr_t *oaddr, npf_addr_t *taddr,
+    bool *seen, in_port_t *ports)
+{
+	const int alen = sizeof(struct in_addr);
+	in_port_t port;
+
+	/* Allocate all ports: one block and then one more on demand. */
+	for (unsigned i = 0; i < PBA_NPORTS; i++) {
+		unsigned p;
+
+		port = npf_pba_get(pba, alen, oaddr, taddr);
+		CHECK_TRUE(port != 0);
+
+		p = ntohs(port);
+		CHECK_TRUE(p >= PM_MIN_PORT && p <= PM_MAX_PORT);
+		CHECK_TRUE(!seen[p - PM_MIN_PORT]);
+		seen[p - PM_MIN_PORT] = true;
+		ports[i] = port;
+
+		/* Ports in the block must be contiguous. */
+		CHECK_TRUE(npf_pba_getblocks(pba, alen, oaddr) ==
+		    1 + i / PBA_BLOCK);
+		CHECK_TRUE(i % PBA_BLOCK == 0 ||
+		    (p & ~(PBA_BLOCK - 1)) == (ntohs(ports[i - 1]) &
+		    ~(PBA_BLOCK - 1)));
+	}
+
+	/* The limit of blocks is reached. */
+	port = npf_pba_get(pba, alen, oaddr, taddr);
+	CHECK_TRUE(port == 0);
+	return true;
+}
+
+static bool
+test_pba_evlog(npf_t *npf, unsigned type, const npf_addr_t *oaddr,
+    const npf_addr_t *taddr, const in_port_t *ports)
+{
+	const int alen = sizeof(struct in_addr);
+	npf_event_t ev[PBA_MAXBLOCKS + 1];
+	size_t n;
+
+	/* One record per block, in any order. */
+	n = npfk_evlog_drain(npf, ev, __arraycount(ev));
+	CHECK_TRUE(n == PBA_MAXBLOCKS);
+	for (unsigned i = 0; i < n; i++) {
+		const unsigned base = ntohs(ev[i].ev_tport);
+
+		CHECK_TRUE(ev[i].ev_type == type);
+		CHECK_TRUE(ev[i].ev_nat == NPF_NATOUT);
+		CHECK_TRUE(ev[i].ev_alen == alen);
+		CHECK_TRUE(memcmp(&ev[i].ev_saddr, oaddr, alen) == 0);
+		CHECK_TRUE(memcmp(&ev[i].ev_taddr, taddr, alen) == 0);
+		CHECK_TRUE(ev[i].ev_nports == PBA_BLOCK);
+		CHECK_TRUE(base == ntohs(ports[0]) ||
+		    base == ntohs(ports[PBA_BLOCK]));
+	}
+	return true;
+}
+
+static bool
+test_pba(void)
+{
+	npf_addr_t oaddr1, oaddr2, oaddr3, taddr1, taddr2, taddr;
+	const int alen = sizeof(struct in_addr);
+	in_port_t ports1[PM_NPORTS], ports2[PBA_NPORTS], port;
+	npf_event_t ev[PBA_MAXBLOCKS];
+	bool seen[PM_NPORTS];
+	npf_t *npf = npf_getkernctx();
+	npf_portmap_t *pm;
+	npf_pba_t *pba;
+	bool ok;
+
+	pm = npf_portmap_create(PM_MIN_PORT, PM_MAX_PORT);
+	pba = npf_pba_create(npf, pm, NPF_NATOUT, PBA_BLOCK, PBA_MAXBLOCKS);
+	npf->evlog = npf_logring_create(16, sizeof(npf_event_t));
+	memset(seen, 0, sizeof(seen));
+
+	memset(&oaddr1, 0, sizeof(npf_addr_t));
+	memset(&oaddr2, 0, sizeof(npf_addr_t));
+	memset(&oaddr3, 0, sizeof(npf_addr_t));
+	memset(&taddr1, 0, sizeof(npf_addr_t));
+	memset(&taddr2, 0, sizeof(npf_addr_t));
+	oaddr1.word32[0] = inet_addr("192.168.1.1");
+	oaddr2.word32[0] = inet_addr("192.168.1.2");
+	oaddr3.word32[0] = inet_addr("192.168.1.3");
+	taddr1.word32[0] = inet_addr("10.1.1.1");
+	taddr2.word32[0] = inet_addr("10.1.1.2");
+
+	/* Two subscribers use all four blocks of the same address. */
+	memcpy(&taddr, &taddr1, sizeof(npf_addr_t));
+	ok = test_pba_fill(pba, &oaddr1, &taddr, seen, ports1);
+	CHECK_TRUE(ok);
+	ok = test_pba_evlog(npf, NPF_EVENT_NAT_BLOCK_ASSIGN,
+	    &oaddr1, &taddr1, ports1);
+	CHECK_TRUE(ok);
+	ok = test_pba_fill(pba, &oaddr2, &taddr, seen, ports2);
+	CHECK_TRUE(ok);
+	(void)npfk_evlog_drain(npf, ev, __arraycount(ev));
+
+	/* No more blocks for the third subscriber. */
+	port = npf_pba_get(pba, alen, &oaddr3, &taddr);
+	CHECK_TRUE(port == 0);
+	CHECK_TRUE(npf_pba_getblocks(pba, alen, &oaddr3) == 0);
+
+	/* The blocks are reserved in the portmap. */
+	ok = npf_portmap_take(pm, alen, &taddr1, ports1[0]);
+	CHECK_TRUE(!ok);
+
+	/* The subscriber stays bound to its translation address. */
+	npf_pba_put(pba, alen, &oaddr1, ports1[0]);
+	memcpy(&taddr, &taddr2, sizeof(npf_addr_t));
+	port = npf_pba_get(pba, alen, &oaddr1, &taddr);
+	CHECK_TRUE(port == ports1[0]);
+	CHECK_TRUE(memcmp(&taddr, &taddr1, alen) == 0);
+
+	/* A specific port in the held block cannot be taken again. */
+	ok = npf_pba_take(pba, alen, &oaddr1, &taddr1, ports1[0]);
+	CHECK_TRUE(!ok);
+
+	/* Release the first subscriber: the blocks are freed. */
+	for (unsigned i = 0; i < PBA_NPORTS; i++) {
+		npf_pba_put(pba, alen, &oaddr1, ports1[i]);
+	}
+	CHECK_TRUE(npf_pba_getblocks(pba, alen, &oaddr1) == 0);
+	ok = test_pba_evlog(npf, NPF_EVENT_NAT_BLOCK_RELEASE,
+	    &oaddr1, &taddr1, ports1);
+	CHECK_TRUE(ok);
+
+	/* Take a specific port, as loading a saved connection would. */
+	ok = npf_pba_take(pba, alen, &oaddr3, &taddr1, ports1[0]);
+	CHECK_TRUE(ok);
+	CHECK_TRUE(npf_pba_getblocks(pba, alen, &oaddr3) == 1);
+
+	/* ... but not on another translation address. */
+	ok = npf_pba_take(pba, alen, &oaddr3, &taddr2, ports1[1]);
+	CHECK_TRUE(!ok);
+
+	/* Allocation uses the held block and the bound address. */
+	memcpy(&taddr, &taddr2, sizeof(npf_addr_t));
+	port = npf_pba_get(pba, alen, &oaddr3, &taddr);
+	CHECK_TRUE(port != 0);
+	CHECK_TRUE(memcmp(&taddr, &taddr1, alen) == 0);
+	CHECK_TRUE(npf_pba_getblocks(pba, alen, &oaddr3) == 1);
+	npf_pba_put(pba, alen, &oaddr3, port);
+	npf_pba_put(pba, alen, &oaddr3, ports1[0]);
+	CHECK_TRUE(npf_pba_getblocks(pba, alen, &oaddr3) == 0);
+
+	for (unsigned i = 0; i < PBA_NPORTS; i++) {
+		npf_pba_put(pba, alen, &oaddr2, ports2[i]);
+	}
+	npf_pba_destroy(pba);
+	npf_logring_destroy(npf->evlog);
+	npf->evlog = NULL;
+
+	/* All ports are back in the portmap. */
+	ok = test_portmap_exhaust(pm, &taddr1, ports1);
+	CHECK_TRUE(ok);
+	npf_portmap_destroy(pm);
+	return true;
+}
+
+bool
+npf_portmap_test(bool verbose)
+{
+	bool ok;
+
+	(void)verbose;
+
+	ok = test_portmap_basic();
+	CHECK_TRUE(ok);
+
+	ok = test_pba();
+	CHECK_TRUE(ok);
+
+	return true;
+}
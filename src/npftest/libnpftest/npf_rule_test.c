@@ -175,6 +175,275 @@ test_dynamic(void)
 	return true;
 }
 
+#if defined(_NPF_STANDALONE)
+static uint32_t
+cksum_add(uint32_t sum, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	for (size_t i = 0; i + 1 < len; i += 2) {
+		sum += (p[i] << 8) | p[i + 1];
+	}
+	if (len & 1) {
+		sum += p[len - 1] << 8;
+	}
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return sum;
+}
+
+/*
+ * return_icmp_suppressed: block the UDP packet with the ICMP error and
+ * determine whether the error was suppressed (and accounted as such).
+ */
+static bool
+return_icmp_suppressed(const char *src, const char *dst)
+{
+	npf_t *npf = npf_getkernctx();
+	uint64_t *stats = kmem_zalloc(NPF_STATS_SIZE, KM_SLEEP);
+	npf_cache_t *npc;
+	struct mbuf *m;
+	uint64_t count;
+	bool ret;
+
+	npfk_stats(npf, stats);
+	count = stats[NPF_STAT_ICMP_SUPPRESSED];
+
+	m = mbuf_get_pkt(AF_INET, IPPROTO_UDP, src, dst, 1234, 53);
+	npc = get_cached_pkt(m, IFNAME_INT);
+	ret = npf_return_block(npc, NPF_RULE_RETICMP);
+	kmem_free(npc->npc_nbuf, sizeof(nbuf_t));
+	kmem_free(npc, sizeof(npf_cache_t));
+
+	/* Either way, the packet is consumed. */
+	if (ret && (m = npf_test_getoutpkt()) != NULL) {
+		m_freem(m);
+		ret = false;
+	}
+	npfk_stats(npf, stats);
+	if (stats[NPF_STAT_ICMP_SUPPRESSED] != count + ret) {
+		ret = false;
+	}
+	kmem_free(stats, NPF_STATS_SIZE);
+	return ret;
+}
+
+static bool
+test_return(void)
+{
+	struct in_addr src, dst;
+	npf_cache_t *npc;
+	struct mbuf *m;
+	struct tcphdr *th;
+	struct icmp *icp;
+	struct ip *ip;
+	uint32_t sum;
+
+	npf_inet_pton(AF_INET, "10.1.1.1", &src);
+	npf_inet_pton(AF_INET, "10.1.1.2", &dst);
+
+	/*
+	 * TCP reset: the packet is not consumed.
+	 */
+	m = mbuf_get_pkt(AF_INET, IPPROTO_TCP, "10.1.1.1", "10.1.1.2",
+	    1234, 80);
+	npc = get_cached_pkt(m, IFNAME_INT);
+	CHECK_TRUE(!npf_return_block(npc, NPF_RULE_RETRST));
+	put_cached_pkt(npc);
+
+	m = npf_test_getoutpkt();
+	CHECK_TRUE(m != NULL);
+	ip = mtod(m, struct ip *);
+	th = (struct tcphdr *)(ip + 1);
+
+	CHECK_TRUE(ip->ip_p == IPPROTO_TCP);
+	CHECK_TRUE(ip->ip_src.s_addr == dst.s_addr);
+	CHECK_TRUE(ip->ip_dst.s_addr == src.s_addr);
+	CHECK_TRUE(cksum_add(0, ip, sizeof(struct ip)) == 0xffff);
+
+	CHECK_TRUE(th->th_sport == htons(80) && th->th_dport == htons(1234));
+	CHECK_TRUE(th->th_flags == (TH_ACK | TH_RST));
+	sum = cksum_add(0, &ip->ip_src, 2 * sizeof(struct in_addr));
+	sum += IPPROTO_TCP + sizeof(struct tcphdr);
+	CHECK_TRUE(cksum_add(sum, th, sizeof(struct tcphdr)) == 0xffff);
+	m_freem(m);
+
+	/*
+	 * ICMP destination unreachable: the packet is consumed.
+	 */
+	m = mbuf_get_pkt(AF_INET, IPPROTO_UDP, "10.1.1.1", "10.1.1.2",
+	    1234, 53);
+	npc = get_cached_pkt(m, IFNAME_INT);
+	CHECK_TRUE(npf_return_block(npc, NPF_RULE_RETICMP));
+	kmem_free(npc->npc_nbuf, sizeof(nbuf_t));
+	kmem_free(npc, sizeof(npf_cache_t));
+
+	m = npf_test_getoutpkt();
+	CHECK_TRUE(m != NULL);
+	ip = mtod(m, struct ip *);
+	icp = (struct icmp *)(ip + 1);
+
+	CHECK_TRUE(ip->ip_p == IPPROTO_ICMP);
+	CHECK_TRUE(ip->ip_src.s_addr == dst.s_addr);
+	CHECK_TRUE(ip->ip_dst.s_addr == src.s_addr);
+	CHECK_TRUE(cksum_add(0, ip, sizeof(struct ip)) == 0xffff);
+
+	/* The original IP header and 8 bytes of data are quoted. */
+	CHECK_TRUE(ntohs(ip->ip_len) == 2 * (sizeof(struct ip) + 8));
+	CHECK_TRUE(icp->icmp_type == ICMP_UNREACH);
+	CHECK_TRUE(icp->icmp_code == ICMP_UNREACH_ADMIN_PROHIBIT);
+	CHECK_TRUE(icp->icmp_ip.ip_dst.s_addr == dst.s_addr);
+	CHECK_TRUE(cksum_add(0, icp, 8 + sizeof(struct ip) + 8) == 0xffff);
+	m_freem(m);
+
+	/*
+	 * No ICMP error for the broadcast destination or the unspecified
+	 * source; otherwise, the errors are rate-limited.
+	 */
+	CHECK_TRUE(return_icmp_suppressed("10.1.1.1", "255.255.255.255"));
+	CHECK_TRUE(return_icmp_suppressed("0.0.0.0", "10.1.1.2"));
+
+	npfk_param_set(npf_getkernctx(), "icmp.error_rate", 1);
+	CHECK_TRUE(!return_icmp_suppressed("10.1.1.1", "10.1.1.2"));
+	CHECK_TRUE(return_icmp_suppressed("10.1.1.1", "10.1.1.2"));
+	npfk_param_set(npf_getkernctx(), "icmp.error_rate", 100);
+
+	return true;
+}
+
+static struct mbuf *
+synproxy_pkt(bool forw, unsigned tcpfl, tcp_seq seq, tcp_seq ack)
+{
+	struct mbuf *m;
+	struct tcphdr *th;
+	struct ip *ip;
+
+	if (forw) {
+		m = mbuf_get_pkt(AF_INET, IPPROTO_TCP, "10.1.1.1", "10.1.1.2",
+		    23456, 80);
+	} else {
+		m = mbuf_get_pkt(AF_INET, IPPROTO_TCP, "10.1.1.2", "10.1.1.1",
+		    80, 23456);
+	}
+	th = mbuf_return_hdrs(m, false, &ip);
+	th->th_seq = htonl(seq);
+	th->th_ack = htonl(ack);
+	th->th_flags = tcpfl;
+	th->th_win = htons(8192);
+	return m;
+}
+
+static bool
+test_synproxy(void)
+{
+	ifnet_t *ifp = npf_test_getif(IFNAME_INT);
+	npf_t *npf = npf_getkernctx();
+	nvlist_t *rule = nvlist_create(0);
+	npf_ruleset_t *rlset;
+	npf_rule_t *rl;
+	struct mbuf *m;
+	struct tcphdr *th;
+	struct ip *ip;
+	uint32_t cookie, sum;
+	uint8_t *opt;
+	uint64_t id;
+	int error;
+
+	nvlist_add_number(rule, "attr", NPF_RULE_PASS | NPF_RULE_STATEFUL |
+	    NPF_RULE_SYNPROXY | NPF_RULE_OUT | NPF_RULE_FINAL |
+	    NPF_RULE_DYNAMIC);
+	rl = npf_rule_alloc(npf, rule);
+	nvlist_destroy(rule);
+
+	npf_config_enter(npf);
+	rlset = npf_config_ruleset(npf);
+	error = npf_ruleset_add(rlset, "test-rules", rl);
+	npf_config_exit(npf);
+	CHECK_TRUE(error == 0);
+	CHECK_TRUE(npf_ruleset_synproxy_p(rlset));
+
+	/*
+	 * SYN: dropped and answered with the SYN-ACK carrying the cookie.
+	 */
+	m = synproxy_pkt(true, TH_SYN, 1000, 0);
+	error = npfk_packet_handler(npf, &m, ifp, PFIL_OUT);
+	CHECK_TRUE(error == ENETUNREACH && m == NULL);
+
+	m = npf_test_getoutpkt();
+	CHECK_TRUE(m != NULL);
+	ip = mtod(m, struct ip *);
+	th = (struct tcphdr *)(ip + 1);
+	opt = (uint8_t *)(th + 1);
+
+	CHECK_TRUE(th->th_flags == (TH_SYN | TH_ACK));
+	CHECK_TRUE(ntohl(th->th_ack) == 1001 && th->th_win == 0);
+	CHECK_TRUE(opt[0] == TCPOPT_MAXSEG && (opt[2] << 8 | opt[3]) == 536);
+	sum = cksum_add(0, &ip->ip_src, 2 * sizeof(struct in_addr));
+	sum += IPPROTO_TCP + sizeof(struct tcphdr) + TCPOLEN_MAXSEG;
+	CHECK_TRUE(cksum_add(sum, th, (th->th_off << 2)) == 0xffff);
+	cookie = ntohl(th->th_seq);
+	m_freem(m);
+
+	/*
+	 * ACK for the cookie: replaced with the SYN to the responder.
+	 */
+	m = synproxy_pkt(true, TH_ACK, 1001, cookie + 1);
+	error = npfk_packet_handler(npf, &m, ifp, PFIL_OUT);
+	CHECK_TRUE(error == 0 && m != NULL);
+	th = mbuf_return_hdrs(m, false, &ip);
+	CHECK_TRUE(th->th_flags == TH_SYN && ntohl(th->th_seq) == 1000);
+	CHECK_TRUE(th->th_win == htons(8192));
+	m_freem(m);
+
+	/*
+	 * SYN-ACK from the responder: converted into the window update
+	 * for the initiator and acknowledged on behalf of the initiator.
+	 */
+	m = synproxy_pkt(false, TH_SYN | TH_ACK, 5000, 1001);
+	error = npfk_packet_handler(npf, &m, ifp, PFIL_IN);
+	CHECK_TRUE(error == 0 && m != NULL);
+	th = mbuf_return_hdrs(m, false, &ip);
+	CHECK_TRUE(th->th_flags == TH_ACK);
+	CHECK_TRUE(ntohl(th->th_seq) == cookie + 1);
+	CHECK_TRUE(ntohl(th->th_ack) == 1001);
+	m_freem(m);
+
+	m = npf_test_getoutpkt();
+	CHECK_TRUE(m != NULL);
+	th = (struct tcphdr *)(mtod(m, struct ip *) + 1);
+	CHECK_TRUE(th->th_flags == TH_ACK && th->th_dport == htons(80));
+	CHECK_TRUE(ntohl(th->th_seq) == 1001 && ntohl(th->th_ack) == 5001);
+	m_freem(m);
+
+	/*
+	 * Data: the SEQ and ACK numbers are translated.
+	 */
+	m = synproxy_pkt(true, TH_ACK, 1001, cookie + 1);
+	error = npfk_packet_handler(npf, &m, ifp, PFIL_OUT);
+	CHECK_TRUE(error == 0 && m != NULL);
+	th = mbuf_return_hdrs(m, false, &ip);
+	CHECK_TRUE(ntohl(th->th_ack) == 5001);
+	m_freem(m);
+
+	m = synproxy_pkt(false, TH_ACK, 5001, 1001);
+	error = npfk_packet_handler(npf, &m, ifp, PFIL_IN);
+	CHECK_TRUE(error == 0 && m != NULL);
+	th = mbuf_return_hdrs(m, false, &ip);
+	CHECK_TRUE(ntohl(th->th_seq) == cookie + 1);
+	m_freem(m);
+
+	npf_config_enter(npf);
+	rlset = npf_config_ruleset(npf);
+	id = npf_rule_getid(rl);
+	error = npf_ruleset_remove(rlset, "test-rules", id);
+	npf_config_exit(npf);
+	CHECK_TRUE(error == 0);
+
+	return true;
+}
+#endif
+
 bool
 npf_rule_test(bool verbose)
 {
@@ -186,5 +455,13 @@ npf_rule_test(bool verbose)
 	ok = test_dynamic();
 	CHECK_TRUE(ok);
 
+#if defined(_NPF_STANDALONE)
+	ok = test_return();
+	CHECK_TRUE(ok);
+
+	ok = test_synproxy();
+	CHECK_TRUE(ok);
+#endif
+
 	return true;
 }
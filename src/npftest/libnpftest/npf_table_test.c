@@ -15,6 +15,11 @@
 #include <sys/endian.h>
 #endif
 
+#ifdef _NPF_STANDALONE
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
 #include "npf_impl.h"
 #include "npf_test.h"
 
@@ -396,6 +401,141 @@ test_const_table(npf_tableset_t *tblset, void *blob, size_t size)
 	return true;
 }
 
+static unsigned
+fill_uents(npf_ioctl_ent_t *uents, unsigned first, unsigned last)
+{
+	unsigned n = 0;
+
+	for (unsigned i = first; i < last; i++) {
+		npf_ioctl_ent_t *uent = &uents[n++];
+
+		memset(uent, 0, sizeof(npf_ioctl_ent_t));
+		uent->addr.word32[0] = inet_addr(ip_list[i]);
+		uent->alen = sizeof(struct in_addr);
+		uent->mask = NPF_NO_NETMASK;
+	}
+	return n;
+}
+
+static bool
+test_update(int type)
+{
+	npf_addr_t addr_storage, *addr = &addr_storage;
+	const unsigned nitems = __arraycount(ip_list);
+	const unsigned half = nitems / 2;
+	const int alen = sizeof(struct in_addr);
+	npf_ioctl_ent_t uents[__arraycount(ip_list) + 2];
+	npf_table_t *t;
+	unsigned n;
+	int error;
+
+	t = npf_table_create("update-table", 0, type, NULL, 0);
+	CHECK_TRUE(t != NULL);
+
+	/* Fill with the first half of the addresses. */
+	for (unsigned i = 0; i < half; i++) {
+		addr->word32[0] = inet_addr(ip_list[i]);
+		error = npf_table_insert(t, alen, addr, NPF_NO_NETMASK);
+		CHECK_TRUE(error == 0);
+	}
+
+	/*
+	 * Update to the second half, keeping one of the old entries.
+	 * Add a duplicate entry -- it must be ignored.
+	 */
+	n = fill_uents(uents, half - 1, nitems);
+	uents[n] = uents[n - 1];
+	error = npf_table_update(t, uents, n + 1);
+	CHECK_TRUE(error == 0);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		addr->word32[0] = inet_addr(ip_list[i]);
+		error = npf_table_lookup(t, alen, addr);
+		CHECK_TRUE((error == 0) == (i >= half - 1));
+	}
+
+	/* The same list again: no changes. */
+	error = npf_table_update(t, uents, n);
+	CHECK_TRUE(error == 0);
+	addr->word32[0] = inet_addr(ip_list[nitems - 1]);
+	error = npf_table_lookup(t, alen, addr);
+	CHECK_TRUE(error == 0);
+
+	/* Only the LPM tables accept the prefixes. */
+	addr->word32[0] = inet_addr("10.99.0.1");
+	uents[n] = uents[0];
+	uents[n].addr.word32[0] = inet_addr("10.0.0.0");
+	uents[n].mask = 8;
+	error = npf_table_update(t, uents, n + 1);
+	if (type == NPF_TABLE_LPM) {
+		CHECK_TRUE(error == 0);
+		error = npf_table_lookup(t, alen, addr);
+		CHECK_TRUE(error == 0);
+	} else {
+		CHECK_TRUE(error == EINVAL);
+		error = npf_table_lookup(t, alen, addr);
+		CHECK_TRUE(error != 0);
+	}
+
+	/* Empty list: all entries must be removed. */
+	error = npf_table_update(t, NULL, 0);
+	CHECK_TRUE(error == 0);
+	for (unsigned i = 0; i < nitems; i++) {
+		addr->word32[0] = inet_addr(ip_list[i]);
+		error = npf_table_lookup(t, alen, addr);
+		CHECK_TRUE(error != 0);
+	}
+
+	npf_table_gc(NULL, t);
+	npf_table_destroy(t);
+	return true;
+}
+
+#ifdef _NPF_STANDALONE
+static bool
+test_const_table_file(void *blob, size_t size)
+{
+	npf_addr_t addr_storage, *addr = &addr_storage;
+	const int alen = sizeof(struct in_addr);
+	char path[] = "/tmp/npf_table_test.XXXXXX";
+	npf_table_t *t;
+	int fd, error;
+	ssize_t ret;
+
+	fd = mkstemp(path);
+	CHECK_TRUE(fd != -1);
+	ret = write(fd, blob, size);
+	close(fd);
+	CHECK_TRUE(ret == (ssize_t)size);
+
+	/*
+	 * Map the database and verify the lookups.  The file may
+	 * be unlinked while it is mapped.
+	 */
+	t = npf_table_create_file(CDB_NAME, CDB_TID, path);
+	unlink(path);
+	CHECK_TRUE(t != NULL);
+
+	addr->word32[0] = inet_addr(ip_list[0]);
+	error = npf_table_lookup(t, alen, addr);
+	CHECK_TRUE(error == 0);
+
+	for (unsigned i = 1; i < __arraycount(ip_list) - 1; i++) {
+		addr->word32[0] = inet_addr(ip_list[i]);
+		error = npf_table_lookup(t, alen, addr);
+		CHECK_TRUE(error != 0);
+	}
+	npf_table_destroy(t);
+
+	/* Must fail on non-existent or invalid files. */
+	t = npf_table_create_file(CDB_NAME, CDB_TID, path);
+	CHECK_TRUE(t == NULL);
+	t = npf_table_create_file(CDB_NAME, CDB_TID, "/dev/null");
+	CHECK_TRUE(t == NULL);
+	return true;
+}
+#endif
+
 static bool
 test_ifaddr_table(npf_tableset_t *tblset)
 {
@@ -434,6 +574,51 @@ test_ifaddr_table(npf_tableset_t *tblset)
 	return true;
 }
 
+static bool
+test_ifaddr_many(void)
+{
+	npf_addr_t addr_storage, *addr = &addr_storage;
+	const int alen = sizeof(struct in_addr);
+	const unsigned nitems = 256;
+	npf_table_t *t;
+	int error;
+
+	t = npf_table_create("ifaddr-many", 0, NPF_TABLE_IFADDR, NULL, 0);
+	CHECK_TRUE(t != NULL);
+
+	/* Insert the addresses in a non-sorted order. */
+	for (unsigned i = 0; i < nitems; i++) {
+		addr->word32[0] = htonl(0x0a000000 | ((i * 37) % nitems));
+		error = npf_table_insert(t, alen, addr, NPF_NO_NETMASK);
+		CHECK_TRUE(error == 0);
+	}
+
+	for (unsigned i = 0; i < nitems; i++) {
+		npf_addr_t *elm;
+
+		/* Lookups must match... */
+		addr->word32[0] = htonl(0x0a000000 | i);
+		error = npf_table_lookup(t, alen, addr);
+		CHECK_TRUE(error == 0);
+
+		/* ... but the indexing must preserve the insertion order. */
+		elm = npf_table_getsome(t, alen, i);
+		CHECK_TRUE(elm->word32[0] ==
+		    htonl(0x0a000000 | ((i * 37) % nitems)));
+	}
+
+	addr->word32[0] = htonl(0x0a000000 | nitems);
+	error = npf_table_lookup(t, alen, addr);
+	CHECK_TRUE(error != 0);
+
+	addr->word32[0] = htonl(0x09ffffff);
+	error = npf_table_lookup(t, alen, addr);
+	CHECK_TRUE(error != 0);
+
+	npf_table_destroy(t);
+	return true;
+}
+
 static void
 test_ipset_gc(npf_tableset_t *tblset)
 {
@@ -479,12 +664,26 @@ npf_table_test(bool verbose, void *blob, size_t size)
 	ok = test_lpm_masks6(tblset);
 	CHECK_TRUE(ok);
 
+	ok = test_update(NPF_TABLE_IPSET);
+	CHECK_TRUE(ok);
+
+	ok = test_update(NPF_TABLE_LPM);
+	CHECK_TRUE(ok);
+
 	ok = test_const_table(tblset, blob, size);
 	CHECK_TRUE(ok);
 
+#ifdef _NPF_STANDALONE
+	ok = test_const_table_file(blob, size);
+	CHECK_TRUE(ok);
+#endif
+
 	ok = test_ifaddr_table(tblset);
 	CHECK_TRUE(ok);
 
+	ok = test_ifaddr_many();
+	CHECK_TRUE(ok);
+
 	/*
 	 * Remove the above IPv4 addresses -- they must have been untouched.
 	 */
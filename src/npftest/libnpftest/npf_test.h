@@ -63,6 +63,7 @@ struct mbuf {
 	void *		m_next;
 	struct {
 		int	len;
+		int	csum_flags;
 	} m_pkthdr;
 	void *		m_data;
 	unsigned char	m_data0[MLEN];
@@ -79,6 +80,8 @@ struct mbuf {
 #define	m_freem(m)		npfkern_m_freem(m)
 #define	mtod(m, t)		((t)((m)->m_data))
 
+extern unsigned			npftest_cksum_offload;
+
 #endif
 
 #define	CHECK_TRUE(x)	\
@@ -96,12 +99,20 @@ void		npf_test_init(int (*)(int, const char *, void *),
 		    long (*)(void));
 void		npf_test_fini(void);
 int		npf_test_load(const void *, size_t, bool);
+npf_t *		npf_test_standby_create(void);
+void		npf_test_standby_destroy(npf_t *);
 ifnet_t *	npf_test_addif(const char *, bool, bool);
 ifnet_t *	npf_test_getif(const char *);
+#if defined(_NPF_STANDALONE)
+struct mbuf *	npf_test_getoutpkt(void);
+#endif
 
 int		npf_test_statetrack(const void *, size_t, ifnet_t *,
 		    bool, int64_t *);
 void		npf_test_conc(bool, unsigned);
+void		npf_test_nat_conc(unsigned);
+void		npf_test_ratelimit_conc(unsigned);
+void		npf_test_cprng_conc(unsigned);
 
 struct mbuf *	mbuf_getwithdata(const void *, size_t);
 struct mbuf *	mbuf_construct_ether(int);
@@ -119,6 +130,7 @@ bool		npf_nbuf_test(bool);
 bool		npf_bpf_test(bool);
 bool		npf_table_test(bool, void *, size_t);
 bool		npf_state_test(bool);
+bool		npf_portmap_test(bool);
 
 bool		npf_rule_test(bool);
 bool		npf_nat_test(bool);
@@ -28,6 +28,10 @@ static void		npf_state_sample(npf_state_t *, bool);
 
 static void		load_npf_config_ifs(nvlist_t *, bool);
 
+/* Copy of the loaded configuration, e.g. for the standby instance. */
+static void *		npftest_config;
+static size_t		npftest_config_len;
+
 #ifndef __NetBSD__
 /*
  * Standalone NPF: we define the same struct ifnet members
@@ -48,6 +52,16 @@ static ifnet_t *	npftest_ifop_lookup(npf_t *, const char *);
 static void		npftest_ifop_flush(npf_t *, void *);
 static void *		npftest_ifop_getmeta(npf_t *, const ifnet_t *);
 static void		npftest_ifop_setmeta(npf_t *, ifnet_t *, void *);
+static void		npftest_standby_flush(npf_t *, void *);
+static void *		npftest_standby_getmeta(npf_t *, const ifnet_t *);
+static void		npftest_standby_setmeta(npf_t *, ifnet_t *, void *);
+#if defined(_NPF_STANDALONE)
+static int		npftest_ifop_output(npf_t *, struct mbuf *,
+			    const ifnet_t *);
+
+/* The last packet sent by NPF, e.g. TCP RST or ICMP error. */
+static struct mbuf *	npftest_outpkt;
+#endif
 
 const npf_ifops_t npftest_ifops = {
 	.getname	= npftest_ifop_getname,
@@ -55,6 +69,29 @@ const npf_ifops_t npftest_ifops = {
 	.flush		= npftest_ifop_flush,
 	.getmeta	= npftest_ifop_getmeta,
 	.setmeta	= npftest_ifop_setmeta,
+#if defined(_NPF_STANDALONE)
+	.output		= npftest_ifop_output,
+#endif
+};
+
+/*
+ * The standby instance shares the interfaces, but keeps its own
+ * interface metadata (see npf_test_standby_create()).
+ */
+static struct {
+	const ifnet_t *	ifp;
+	void *		meta;
+} npftest_standby_meta[16];
+
+static const npf_ifops_t npftest_standby_ifops = {
+	.getname	= npftest_ifop_getname,
+	.lookup		= npftest_ifop_lookup,
+	.flush		= npftest_standby_flush,
+	.getmeta	= npftest_standby_getmeta,
+	.setmeta	= npftest_standby_setmeta,
+#if defined(_NPF_STANDALONE)
+	.output		= npftest_ifop_output,
+#endif
 };
 
 void
@@ -84,6 +121,11 @@ npf_test_fini(void)
 	npfk_thread_unregister(npf);
 	npfk_destroy(npf);
 	npfk_sysfini();
+
+	if (npftest_config) {
+		kmem_free(npftest_config, npftest_config_len);
+		npftest_config = NULL;
+	}
 }
 
 int
@@ -101,9 +143,62 @@ npf_test_load(const void *buf, size_t len, bool verbose)
 	load_npf_config_ifs(npf_dict, verbose);
 	ret = npfk_load(npf_getkernctx(), npf_dict, &error);
 	nvlist_destroy(npf_dict);
+
+	if (ret == 0) {
+		if (npftest_config) {
+			kmem_free(npftest_config, npftest_config_len);
+		}
+		npftest_config = kmem_alloc(len, KM_SLEEP);
+		npftest_config_len = len;
+		memcpy(npftest_config, buf, len);
+	}
 	return ret;
 }
 
+/*
+ * npf_test_standby_create: create the second NPF instance, e.g. the
+ * standby of the replication, with the interfaces and the configuration
+ * of the primary one.
+ */
+npf_t *
+npf_test_standby_create(void)
+{
+	nvlist_t *npf_dict;
+	npf_error_t error;
+	ifnet_t *ifp;
+	npf_t *npf;
+
+	if (npftest_config == NULL) {
+		return NULL;
+	}
+	npf = npfk_create(NPF_SYNC, &npftest_mbufops,
+	    &npftest_standby_ifops, NULL);
+	npfk_thread_register(npf);
+
+	TAILQ_FOREACH(ifp, &npftest_ifnet_list, if_list) {
+		npfk_ifmap_attach(npf, ifp);
+		npf_ifmap_register(npf, ifp->if_xname);
+	}
+	npf_dict = nvlist_unpack(npftest_config, npftest_config_len, 0);
+	if (npf_dict == NULL || npfk_load(npf, npf_dict, &error) != 0) {
+		if (npf_dict) {
+			nvlist_destroy(npf_dict);
+		}
+		npf_test_standby_destroy(npf);
+		return NULL;
+	}
+	nvlist_destroy(npf_dict);
+	return npf;
+}
+
+void
+npf_test_standby_destroy(npf_t *npf)
+{
+	npfk_thread_unregister(npf);
+	npfk_destroy(npf);
+	memset(npftest_standby_meta, 0, sizeof(npftest_standby_meta));
+}
+
 ifnet_t *
 npf_test_addif(const char *ifname, bool reg, bool verbose)
 {
@@ -199,6 +294,62 @@ npftest_ifop_setmeta(npf_t *npf __unused, ifnet_t *ifp, void *arg)
 	ifp->if_softc = arg;
 }
 
+static void
+npftest_standby_flush(npf_t *npf __unused, void *arg)
+{
+	for (unsigned i = 0; i < __arraycount(npftest_standby_meta); i++) {
+		npftest_standby_meta[i].meta = arg;
+	}
+}
+
+static void *
+npftest_standby_getmeta(npf_t *npf __unused, const ifnet_t *ifp)
+{
+	for (unsigned i = 0; i < __arraycount(npftest_standby_meta); i++) {
+		if (npftest_standby_meta[i].ifp == ifp)
+			return npftest_standby_meta[i].meta;
+	}
+	return NULL;
+}
+
+static void
+npftest_standby_setmeta(npf_t *npf __unused, ifnet_t *ifp, void *arg)
+{
+	unsigned i;
+
+	for (i = 0; i < __arraycount(npftest_standby_meta); i++) {
+		const ifnet_t *mifp = npftest_standby_meta[i].ifp;
+
+		if (mifp == ifp || mifp == NULL)
+			break;
+	}
+	assert(i < __arraycount(npftest_standby_meta));
+	npftest_standby_meta[i].ifp = ifp;
+	npftest_standby_meta[i].meta = arg;
+}
+
+#if defined(_NPF_STANDALONE)
+static int
+npftest_ifop_output(npf_t *npf __unused, struct mbuf *m,
+    const ifnet_t *ifp __unused)
+{
+	if (npftest_outpkt) {
+		m_freem(npftest_outpkt);
+	}
+	npftest_outpkt = m;
+	return 0;
+}
+
+struct mbuf *
+npf_test_getoutpkt(void)
+{
+	struct mbuf *m = npftest_outpkt;
+
+	npftest_outpkt = NULL;
+	return m;
+}
+#endif
+
 /*
  * State sampler - this routine is called from inside of NPF state engine.
  */
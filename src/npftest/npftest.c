@@ -308,6 +308,12 @@ main(int argc, char **argv)
 			tname_matched = true;
 		}
 
+		if (!testname || strcmp("portmap", testname) == 0) {
+			ok = rumpns_npf_portmap_test(verbose);
+			fail |= result("portmap", ok);
+			tname_matched = true;
+		}
+
 		if (!testname || strcmp("gc", testname) == 0) {
 			ok = rumpns_npf_gc_test(verbose);
 			fail |= result("gc", ok);
@@ -347,6 +353,15 @@ main(int argc, char **argv)
 		if (strcmp("state", benchmark) == 0) {
 			rumpns_npf_test_conc(true, nthreads);
 		}
+		if (strcmp("nat", benchmark) == 0) {
+			rumpns_npf_test_nat_conc(nthreads);
+		}
+		if (strcmp("ratelimit", benchmark) == 0) {
+			rumpns_npf_test_ratelimit_conc(nthreads);
+		}
+		if (strcmp("cprng", benchmark) == 0) {
+			rumpns_npf_test_cprng_conc(nthreads);
+		}
 	}
 
 	rumpns_npf_test_fini();
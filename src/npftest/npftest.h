@@ -25,8 +25,12 @@
 #define	rumpns_npf_rule_test		npf_rule_test
 #define	rumpns_npf_nat_test		npf_nat_test
 #define	rumpns_npf_gc_test		npf_gc_test
+#define	rumpns_npf_portmap_test		npf_portmap_test
 #define	rumpns_npf_ext_test		npf_ext_test
 #define	rumpns_npf_test_conc		npf_test_conc
+#define	rumpns_npf_test_nat_conc	npf_test_nat_conc
+#define	rumpns_npf_test_ratelimit_conc	npf_test_ratelimit_conc
+#define	rumpns_npf_test_cprng_conc	npf_test_cprng_conc
 #define	rumpns_npf_test_statetrack	npf_test_statetrack
 #endif
 
@@ -43,11 +47,15 @@ ifnet_t *	rumpns_npf_test_getif(const char *);
 int		rumpns_npf_test_statetrack(const void *, size_t,
 		    ifnet_t *, bool, int64_t *);
 void		rumpns_npf_test_conc(bool, unsigned);
+void		rumpns_npf_test_nat_conc(unsigned);
+void		rumpns_npf_test_ratelimit_conc(unsigned);
+void		rumpns_npf_test_cprng_conc(unsigned);
 
 bool		rumpns_npf_nbuf_test(bool);
 bool		rumpns_npf_bpf_test(bool);
 bool		rumpns_npf_table_test(bool, void *, size_t);
 bool		rumpns_npf_state_test(bool);
+bool		rumpns_npf_portmap_test(bool);
 
 bool		rumpns_npf_rule_test(bool);
 bool		rumpns_npf_nat_test(bool);